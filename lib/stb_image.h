@@ -31,6 +31,7 @@
       HDR (radiance rgbE format)
       PIC (Softimage PIC)
       PNM (PPM and PGM binary only)
+      QOI
 
       Animated GIF still needs a proper API, but here's one way to do it:
           http://gist.github.com/urraka/685d9a6340b26b830d49
@@ -238,6 +239,10 @@ RECENT REVISION HISTORY:
 // (at least this is true for iOS and Android). Therefore, the NEON support is
 // toggled by a build flag: define STBI_NEON to get NEON loops.
 //
+// With GCC or Clang on x86, the JPEG decoder additionally carries AVX2
+// kernels that are used when a run-time test finds AVX2; define STBI_NO_AVX2
+// to leave them out.
+//
 // If for some reason you do not want to use any of SIMD code, or if
 // you have issues compiling it, you can disable it entirely by
 // defining STBI_NO_SIMD.
@@ -309,6 +314,7 @@ RECENT REVISION HISTORY:
 //        STBI_NO_HDR
 //        STBI_NO_PIC
 //        STBI_NO_PNM   (.ppm and .pgm)
+//        STBI_NO_QOI
 //
 //  - You can request *only* certain decoders and suppress all other ones
 //    (this will be more forward-compatible, as addition of new decoders
@@ -323,6 +329,7 @@ RECENT REVISION HISTORY:
 //        STBI_ONLY_HDR
 //        STBI_ONLY_PIC
 //        STBI_ONLY_PNM   (.ppm and .pgm)
+//        STBI_ONLY_QOI
 //
 //   - If you use STBI_NO_PNG (or _ONLY_ without PNG), and you still
 //     want the zlib decoder to be available, #define STBI_SUPPORT_ZLIB
@@ -391,6 +398,27 @@ typedef struct
 
 STBIDEF stbi_uc *stbi_load_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels);
 STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels);
+// as stbi_load_from_callbacks, but JPEGs are decoded at 1/scale of their size
+// (scale 1, 2, 4 or 8) with reduced-size IDCTs, which skips most of the IDCT,
+// upsampling and color conversion work. Output dimensions are rounded up.
+// Other formats load at full size, so check the returned dimensions.
+STBIDEF stbi_uc *stbi_load_from_callbacks_scaled(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels, int scale);
+// as stbi_load_from_callbacks_scaled, but JPEGs only decode the MCUs covering
+// region (x0, y0, x1, y1 in full size pixels, end exclusive). Blocks outside of
+// it are entropy decoded only, restart intervals outside of it are skipped
+// without decoding and decoding stops below it where possible. On return the
+// region holds the full size rectangle the image actually covers, which is
+// the whole image for other formats.
+STBIDEF stbi_uc *stbi_load_from_callbacks_region(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels, int scale, int region[4]);
+// decodes a non-interlaced PNG or a QOI without holding the image:
+// row(row_user, y, pixels) is called for every scanline from the top, with
+// desired_channels (or the file's) channels of bits (8 or 16) bits each. x, y
+// and channels_in_file are set before the first row. The pixels are only
+// valid during the call, which for PNGs is made from another thread when a
+// parallel_for is set, and are never flipped. Returns 0 for other images, or
+// on errors, after which some rows may have been delivered.
+typedef void stbi_row_callback(void *user, int y, const void *pixels);
+STBIDEF int stbi_load_rows_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels, int bits, stbi_row_callback *row, void *row_user);
 
 #ifndef STBI_NO_STDIO
 STBIDEF stbi_uc *stbi_load            (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
@@ -491,6 +519,22 @@ STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 // calling it will fail to link if your compiler doesn't
 STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip);
 
+// output 8-bit images with 3 or 4 channels in BGR(A) order instead of RGB(A),
+// the pixel order of most framebuffers. JPEGs and non-interlaced PNGs are
+// converted straight to it.
+STBIDEF void stbi_set_bgr_on_load(int flag_true_if_should_swap);
+
+// as above, but only applies to images loaded on the thread that calls the function
+STBIDEF void stbi_set_bgr_on_load_thread(int flag_true_if_should_swap);
+
+// decode baseline JPEG scans that have restart markers in parallel, and
+// unfilter large PNGs on a second task while the first one inflates: fn must
+// call task(arg, i) for every i in 0..n-1, in any order and on any threads,
+// and return once all of those calls have returned. NULL (the default)
+// decodes serially.
+typedef void stbi_parallel_for(void (*task)(void *arg, int i), void *arg, int n, void *user);
+STBIDEF void stbi_set_parallel_for(stbi_parallel_for *fn, void *user);
+
 // ZLIB client - used by PNG, available for other purposes
 
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
@@ -516,7 +560,7 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
 #if defined(STBI_ONLY_JPEG) || defined(STBI_ONLY_PNG) || defined(STBI_ONLY_BMP) \
   || defined(STBI_ONLY_TGA) || defined(STBI_ONLY_GIF) || defined(STBI_ONLY_PSD) \
   || defined(STBI_ONLY_HDR) || defined(STBI_ONLY_PIC) || defined(STBI_ONLY_PNM) \
-  || defined(STBI_ONLY_ZLIB)
+  || defined(STBI_ONLY_QOI) || defined(STBI_ONLY_ZLIB)
    #ifndef STBI_ONLY_JPEG
    #define STBI_NO_JPEG
    #endif
@@ -544,6 +588,9 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
    #ifndef STBI_ONLY_PNM
    #define STBI_NO_PNM
    #endif
+   #ifndef STBI_ONLY_QOI
+   #define STBI_NO_QOI
+   #endif
 #endif
 
 #if defined(STBI_NO_PNG) && !defined(STBI_SUPPORT_ZLIB) && !defined(STBI_NO_ZLIB)
@@ -610,12 +657,14 @@ typedef unsigned short stbi__uint16;
 typedef   signed short stbi__int16;
 typedef unsigned int   stbi__uint32;
 typedef   signed int   stbi__int32;
+typedef unsigned __int64 stbi__uint64;
 #else
 #include <stdint.h>
 typedef uint16_t stbi__uint16;
 typedef int16_t  stbi__int16;
 typedef uint32_t stbi__uint32;
 typedef int32_t  stbi__int32;
+typedef uint64_t stbi__uint64;
 #endif
 
 // should produce compiler error if size is wrong
@@ -741,6 +790,21 @@ static int stbi__sse2_available(void)
 #endif
 #endif
 
+// AVX2 kernels are compiled for their own functions only and picked at run
+// time, so the rest of the decoder still runs on any SSE2 machine
+#if defined(STBI_SSE2) && !defined(STBI_NO_AVX2) && !defined(STBI_NO_JPEG) && !defined(_MSC_VER) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define STBI_AVX2
+#include <immintrin.h>
+#define STBI__AVX2_TARGET __attribute__((target("avx2")))
+
+static int stbi__avx2_available(void)
+{
+   // also checks that the OS saves the ymm registers
+   return __builtin_cpu_supports("avx2");
+}
+#endif
+
 // ARM NEON
 #if defined(STBI_NO_SIMD) && defined(STBI_NEON)
 #undef STBI_NEON
@@ -781,6 +845,9 @@ typedef struct
 
    stbi_uc *img_buffer, *img_buffer_end;
    stbi_uc *img_buffer_original, *img_buffer_original_end;
+
+   int jpeg_scale_shift; // decode JPEGs at 1/(1<<shift) size
+   int *jpeg_region;     // decode only this part of JPEGs, reset once done
 } stbi__context;
 
 
@@ -792,6 +859,8 @@ static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
    s->io.read = NULL;
    s->read_from_callbacks = 0;
    s->callback_already_read = 0;
+   s->jpeg_scale_shift = 0;
+   s->jpeg_region = NULL;
    s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
    s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
 }
@@ -804,6 +873,8 @@ static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *
    s->buflen = sizeof(s->buffer_start);
    s->read_from_callbacks = 1;
    s->callback_already_read = 0;
+   s->jpeg_scale_shift = 0;
+   s->jpeg_region = NULL;
    s->img_buffer = s->img_buffer_original = s->buffer_start;
    stbi__refill_buffer(s);
    s->img_buffer_original_end = s->img_buffer_end;
@@ -877,9 +948,10 @@ static int      stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp);
 
 #ifndef STBI_NO_PNG
 static int      stbi__png_test(stbi__context *s);
-static void    *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri);
+static void    *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc);
 static int      stbi__png_info(stbi__context *s, int *x, int *y, int *comp);
 static int      stbi__png_is16(stbi__context *s);
+static int      stbi__png_load_rows(stbi__context *s, int *x, int *y, int *comp, int req_comp, int bits, stbi_row_callback *row, void *row_user);
 #endif
 
 #ifndef STBI_NO_BMP
@@ -926,6 +998,13 @@ static void    *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int
 static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp);
 #endif
 
+#ifndef STBI_NO_QOI
+static int      stbi__qoi_test(stbi__context *s);
+static void    *stbi__qoi_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc);
+static int      stbi__qoi_load_rows(stbi__context *s, int *x, int *y, int *comp, int req_comp, int bits, stbi_row_callback *row, void *row_user);
+static int      stbi__qoi_info(stbi__context *s, int *x, int *y, int *comp);
+#endif
+
 static
 #ifdef STBI_THREAD_LOCAL
 STBI_THREAD_LOCAL
@@ -982,7 +1061,7 @@ static int stbi__mul2sizes_valid(int a, int b)
    return a <= INT_MAX/b;
 }
 
-#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR)
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR) || !defined(STBI_NO_QOI)
 // returns 1 if "a*b + add" has no negative terms/factors and doesn't overflow
 static int stbi__mad2sizes_valid(int a, int b, int add)
 {
@@ -1006,7 +1085,7 @@ static int stbi__mad4sizes_valid(int a, int b, int c, int d, int add)
 }
 #endif
 
-#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR)
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR) || !defined(STBI_NO_QOI)
 // mallocs with size overflow checking
 static void *stbi__malloc_mad2(int a, int b, int add)
 {
@@ -1059,6 +1138,15 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp);
 
 static int stbi__vertically_flip_on_load_global = 0;
 
+static stbi_parallel_for *stbi__parallel_for_fn = NULL;
+static void *stbi__parallel_for_user = NULL;
+
+STBIDEF void stbi_set_parallel_for(stbi_parallel_for *fn, void *user)
+{
+   stbi__parallel_for_fn = fn;
+   stbi__parallel_for_user = user;
+}
+
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
 {
    stbi__vertically_flip_on_load_global = flag_true_if_should_flip;
@@ -1080,6 +1168,29 @@ STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_fli
                                          : stbi__vertically_flip_on_load_global)
 #endif // STBI_THREAD_LOCAL
 
+static int stbi__bgr_on_load_global = 0;
+
+STBIDEF void stbi_set_bgr_on_load(int flag_true_if_should_swap)
+{
+   stbi__bgr_on_load_global = flag_true_if_should_swap;
+}
+
+#ifndef STBI_THREAD_LOCAL
+#define stbi__bgr_on_load  stbi__bgr_on_load_global
+#else
+static STBI_THREAD_LOCAL int stbi__bgr_on_load_local, stbi__bgr_on_load_set;
+
+STBIDEF void stbi_set_bgr_on_load_thread(int flag_true_if_should_swap)
+{
+   stbi__bgr_on_load_local = flag_true_if_should_swap;
+   stbi__bgr_on_load_set = 1;
+}
+
+#define stbi__bgr_on_load  (stbi__bgr_on_load_set       \
+                             ? stbi__bgr_on_load_local  \
+                             : stbi__bgr_on_load_global)
+#endif // STBI_THREAD_LOCAL
+
 static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
 {
    memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
@@ -1091,7 +1202,7 @@ static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int re
    if (stbi__jpeg_test(s)) return stbi__jpeg_load(s,x,y,comp,req_comp, ri);
    #endif
    #ifndef STBI_NO_PNG
-   if (stbi__png_test(s))  return stbi__png_load(s,x,y,comp,req_comp, ri);
+   if (stbi__png_test(s))  return stbi__png_load(s,x,y,comp,req_comp, ri, bpc);
    #endif
    #ifndef STBI_NO_BMP
    if (stbi__bmp_test(s))  return stbi__bmp_load(s,x,y,comp,req_comp, ri);
@@ -1101,8 +1212,6 @@ static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int re
    #endif
    #ifndef STBI_NO_PSD
    if (stbi__psd_test(s))  return stbi__psd_load(s,x,y,comp,req_comp, ri, bpc);
-   #else
-   STBI_NOTUSED(bpc);
    #endif
    #ifndef STBI_NO_PIC
    if (stbi__pic_test(s))  return stbi__pic_load(s,x,y,comp,req_comp, ri);
@@ -1110,6 +1219,9 @@ static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int re
    #ifndef STBI_NO_PNM
    if (stbi__pnm_test(s))  return stbi__pnm_load(s,x,y,comp,req_comp, ri);
    #endif
+   #ifndef STBI_NO_QOI
+   if (stbi__qoi_test(s))  return stbi__qoi_load(s,x,y,comp,req_comp, ri, bpc);
+   #endif
 
    #ifndef STBI_NO_HDR
    if (stbi__hdr_test(s)) {
@@ -1124,6 +1236,7 @@ static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int re
       return stbi__tga_load(s,x,y,comp,req_comp, ri);
    #endif
 
+   STBI_NOTUSED(bpc);
    return stbi__errpuc("unknown image type", "Image not of any known type, or corrupt");
 }
 
@@ -1183,6 +1296,17 @@ static void stbi__vertical_flip(void *image, int w, int h, int bytes_per_pixel)
    }
 }
 
+// swaps the first and third channel of count pixels step bytes apart
+static void stbi__swap_rb(stbi_uc *p, int count, int step)
+{
+   int i;
+   for (i=0; i < count; ++i, p += step) {
+      stbi_uc t = p[0];
+      p[0] = p[2];
+      p[2] = t;
+   }
+}
+
 #ifndef STBI_NO_GIF
 static void stbi__vertical_flip_slices(void *image, int w, int h, int z, int bytes_per_pixel)
 {
@@ -1215,6 +1339,12 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
 
    // @TODO: move stbi__convert_format to here
 
+   if (stbi__bgr_on_load && ri.channel_order == STBI_ORDER_RGB) {
+      int channels = req_comp ? req_comp : *comp;
+      if (channels >= 3)
+         stbi__swap_rb((stbi_uc *) result, *x * *y, channels);
+   }
+
    if (stbi__vertically_flip_on_load) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi_uc));
@@ -1380,6 +1510,44 @@ STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *u
    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
+STBIDEF stbi_uc *stbi_load_from_callbacks_scaled(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, int scale)
+{
+   return stbi_load_from_callbacks_region(clbk, user, x, y, comp, req_comp, scale, NULL);
+}
+
+STBIDEF stbi_uc *stbi_load_from_callbacks_region(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, int scale, int region[4])
+{
+   stbi__context s;
+   stbi_uc *result;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   s.jpeg_scale_shift = scale >= 8 ? 3 : scale >= 4 ? 2 : scale >= 2 ? 1 : 0;
+   s.jpeg_region = region;
+   result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+   if (result && s.jpeg_region) {
+      // not a JPEG, so the whole image got decoded
+      region[0] = region[1] = 0;
+      region[2] = *x;
+      region[3] = *y;
+   }
+   return result;
+}
+
+STBIDEF int stbi_load_rows_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, int bits, stbi_row_callback *row, void *row_user)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   if (req_comp < 0 || req_comp > 4 || (bits != 8 && bits != 16)) return stbi__err("bad req_comp", "Internal error");
+   #ifndef STBI_NO_QOI
+   if (stbi__qoi_test(&s)) return stbi__qoi_load_rows(&s, x, y, comp, req_comp, bits, row, row_user);
+   #endif
+   #ifndef STBI_NO_PNG
+   return stbi__png_load_rows(&s, x, y, comp, req_comp, bits, row, row_user);
+   #else
+   STBI_NOTUSED(x); STBI_NOTUSED(y); STBI_NOTUSED(comp); STBI_NOTUSED(row); STBI_NOTUSED(row_user);
+   return stbi__err("unknown image type", "Image not of any known type, or corrupt");
+   #endif
+}
+
 #ifndef STBI_NO_GIF
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp)
 {
@@ -1562,7 +1730,7 @@ stbi_inline static stbi_uc stbi__get8(stbi__context *s)
    return 0;
 }
 
-#if defined(STBI_NO_JPEG) && defined(STBI_NO_HDR) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM)
+#if defined(STBI_NO_JPEG) && defined(STBI_NO_HDR) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM) && defined(STBI_NO_QOI)
 // nothing
 #else
 stbi_inline static int stbi__at_eof(stbi__context *s)
@@ -1628,7 +1796,7 @@ static int stbi__getn(stbi__context *s, stbi_uc *buffer, int n)
 }
 #endif
 
-#if defined(STBI_NO_JPEG) && defined(STBI_NO_PNG) && defined(STBI_NO_PSD) && defined(STBI_NO_PIC)
+#if defined(STBI_NO_JPEG) && defined(STBI_NO_PNG) && defined(STBI_NO_PSD) && defined(STBI_NO_PIC) && defined(STBI_NO_QOI)
 // nothing
 #else
 static int stbi__get16be(stbi__context *s)
@@ -1638,7 +1806,7 @@ static int stbi__get16be(stbi__context *s)
 }
 #endif
 
-#if defined(STBI_NO_PNG) && defined(STBI_NO_PSD) && defined(STBI_NO_PIC)
+#if defined(STBI_NO_PNG) && defined(STBI_NO_PSD) && defined(STBI_NO_PIC) && defined(STBI_NO_QOI)
 // nothing
 #else
 static stbi__uint32 stbi__get32be(stbi__context *s)
@@ -1668,7 +1836,7 @@ static stbi__uint32 stbi__get32le(stbi__context *s)
 
 #define STBI__BYTECAST(x)  ((stbi_uc) ((x) & 255))  // truncate int to byte without warnings
 
-#if defined(STBI_NO_JPEG) && defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM)
+#if defined(STBI_NO_JPEG) && defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM) && defined(STBI_NO_QOI)
 // nothing
 #else
 //////////////////////////////////////////////////////////////////////////////
@@ -1688,12 +1856,39 @@ static stbi_uc stbi__compute_y(int r, int g, int b)
 }
 #endif
 
-#if defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM)
+#if defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM) && defined(STBI_NO_QOI)
 // nothing
 #else
+// converts one row of x pixels from img_n to req_comp components
+static int stbi__convert_row(unsigned char *src, unsigned char *dest, int img_n, int req_comp, unsigned int x)
+{
+   int i;
+   #define STBI__COMBO(a,b)  ((a)*8+(b))
+   #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (STBI__COMBO(img_n, req_comp)) {
+      STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=255;                                     } break;
+      STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+      STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=255;                     } break;
+      STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
+      STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+      STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                  } break;
+      STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=255;        } break;
+      STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = 255;    } break;
+      STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
+      STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
+      default: STBI_ASSERT(0); return 0;
+   }
+   #undef STBI__CASE
+   return 1;
+}
+
 static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-   int i,j;
+   int j;
    unsigned char *good;
 
    if (req_comp == img_n) return data;
@@ -1706,29 +1901,11 @@ static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int r
    }
 
    for (j=0; j < (int) y; ++j) {
-      unsigned char *src  = data + j * x * img_n   ;
-      unsigned char *dest = good + j * x * req_comp;
-
-      #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (STBI__COMBO(img_n, req_comp)) {
-         STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=255;                                     } break;
-         STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-         STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=255;                     } break;
-         STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
-         STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-         STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                  } break;
-         STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=255;        } break;
-         STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = 255;    } break;
-         STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
-         STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
-         default: STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return stbi__errpuc("unsupported", "Unsupported format conversion");
+      if (!stbi__convert_row(data + j * x * img_n, good + j * x * req_comp, img_n, req_comp, x)) {
+         STBI_FREE(data);
+         STBI_FREE(good);
+         return stbi__errpuc("unsupported", "Unsupported format conversion");
       }
-      #undef STBI__CASE
    }
 
    STBI_FREE(data);
@@ -1748,9 +1925,35 @@ static stbi__uint16 stbi__compute_y_16(int r, int g, int b)
 #if defined(STBI_NO_PNG) && defined(STBI_NO_PSD)
 // nothing
 #else
+static int stbi__convert_row16(stbi__uint16 *src, stbi__uint16 *dest, int img_n, int req_comp, unsigned int x)
+{
+   int i;
+   #define STBI__COMBO(a,b)  ((a)*8+(b))
+   #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (STBI__COMBO(img_n, req_comp)) {
+      STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=0xffff;                                     } break;
+      STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
+      STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=0xffff;                     } break;
+      STBI__CASE(2,1) { dest[0]=src[0];                                                     } break;
+      STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
+      STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                     } break;
+      STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=0xffff;        } break;
+      STBI__CASE(3,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(3,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = 0xffff; } break;
+      STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = src[3]; } break;
+      STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                       } break;
+      default: STBI_ASSERT(0); return 0;
+   }
+   #undef STBI__CASE
+   return 1;
+}
+
 static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-   int i,j;
+   int j;
    stbi__uint16 *good;
 
    if (req_comp == img_n) return data;
@@ -1763,29 +1966,11 @@ static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int r
    }
 
    for (j=0; j < (int) y; ++j) {
-      stbi__uint16 *src  = data + j * x * img_n   ;
-      stbi__uint16 *dest = good + j * x * req_comp;
-
-      #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (STBI__COMBO(img_n, req_comp)) {
-         STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=0xffff;                                     } break;
-         STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
-         STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=0xffff;                     } break;
-         STBI__CASE(2,1) { dest[0]=src[0];                                                     } break;
-         STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
-         STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                     } break;
-         STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=0xffff;        } break;
-         STBI__CASE(3,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(3,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = 0xffff; } break;
-         STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = src[3]; } break;
-         STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                       } break;
-         default: STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return (stbi__uint16*) stbi__errpuc("unsupported", "Unsupported format conversion");
+      if (!stbi__convert_row16(data + j * x * img_n, good + j * x * req_comp, img_n, req_comp, x)) {
+         STBI_FREE(data);
+         STBI_FREE(good);
+         return (stbi__uint16*) stbi__errpuc("unsupported", "Unsupported format conversion");
       }
-      #undef STBI__CASE
    }
 
    STBI_FREE(data);
@@ -1932,10 +2117,22 @@ typedef struct
 
    int scan_n, order[4];
    int restart_interval, todo;
+   int scale_shift; // blocks are output as (8>>scale_shift)^2 pixels
+   int *region;     // requested region in pixels, NULL for the whole image
+   int roi[4];      // MCUs covering the region, end exclusive
+   int roi_done;    // decoding stopped below the region
+   int bgr;         // output red and blue swapped
+
+   // block waiting for a second one to go through idct_pair_kernel with
+   stbi_uc *idct_pending;
+   int idct_pending_stride;
+   STBI_SIMD_ALIGN(short, idct_pending_data[64]);
 
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
+   void (*idct_pair_kernel)(stbi_uc *outa, int stride_a, short data_a[64], stbi_uc *outb, int stride_b, short data_b[64]);
    void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
+   void (*YCbCr_to_BGR_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
    stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
 } stbi__jpeg;
 
@@ -2390,6 +2587,48 @@ stbi_inline static stbi_uc stbi__clamp(int x)
    t1 += p2+p4;                                \
    t0 += p1+p3;
 
+// reduced-size IDCT: evaluates the 8-point basis of the low NxN coefficients
+// at the centers of NxN output pixels, i.e. C(u)*cos((2n+1)*u*pi/(2N)) in
+// 4.12 fixed point. Output N = 8>>shift, shift 1..3.
+static const int stbi__idct_reduced4[4][4] = {
+   { 2896,  3784,  2896,  1567 },
+   { 2896,  1567, -2896, -3784 },
+   { 2896, -1567, -2896,  3784 },
+   { 2896, -3784,  2896, -1567 }
+};
+static const int stbi__idct_reduced2[2][2] = {
+   { 2896,  2896 },
+   { 2896, -2896 }
+};
+
+static void stbi__idct_reduced(stbi_uc *out, int out_stride, short data[64], int shift)
+{
+   int n = 8 >> shift, i, j, k;
+   int tmp[16];
+   const int *t = shift == 1 ? &stbi__idct_reduced4[0][0] : &stbi__idct_reduced2[0][0];
+   if (n == 1) {
+      // DC only: the block average
+      out[0] = stbi__clamp(((data[0] + 4) >> 3) + 128);
+      return;
+   }
+   // columns: tmp[y][u] = sum_v T[y][v] * F[v][u]
+   for (j=0; j < n; ++j)
+      for (k=0; k < n; ++k) {
+         int s = 0;
+         for (i=0; i < n; ++i)
+            s += t[j*n+i] * data[i*8+k];
+         tmp[j*n+k] = s;
+      }
+   // rows, then the 1/4 of the 2D transform and the 2^24 of the tables
+   for (j=0; j < n; ++j, out += out_stride)
+      for (k=0; k < n; ++k) {
+         long long s = 0;
+         for (i=0; i < n; ++i)
+            s += (long long) t[k*n+i] * tmp[j*n+i];
+         out[k] = stbi__clamp((int) ((s + (1 << 25)) >> 26) + 128);
+      }
+}
+
 static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
 {
    int i,val[64],*v=val;
@@ -2630,6 +2869,183 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 
 #endif // STBI_SSE2
 
+#ifdef STBI_AVX2
+// avx2 version of the sse2 IDCT above that transforms two blocks at once, one
+// per 128-bit lane. every operation stays within its lane, so each block
+// gets exactly the sse2 (and so the generic C) result.
+static STBI__AVX2_TARGET void stbi__idct_avx2_pair(stbi_uc *outa, int stride_a, short data_a[64], stbi_uc *outb, int stride_b, short data_b[64])
+{
+   __m256i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m256i tmp;
+
+   #define dct_const(x,y)  _mm256_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y))
+
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m256i c0##lo = _mm256_unpacklo_epi16((x),(y)); \
+      __m256i c0##hi = _mm256_unpackhi_epi16((x),(y)); \
+      __m256i out0##_l = _mm256_madd_epi16(c0##lo, c0); \
+      __m256i out0##_h = _mm256_madd_epi16(c0##hi, c0); \
+      __m256i out1##_l = _mm256_madd_epi16(c0##lo, c1); \
+      __m256i out1##_h = _mm256_madd_epi16(c0##hi, c1)
+
+   #define dct_widen(out, in) \
+      __m256i out##_l = _mm256_srai_epi32(_mm256_unpacklo_epi16(_mm256_setzero_si256(), (in)), 4); \
+      __m256i out##_h = _mm256_srai_epi32(_mm256_unpackhi_epi16(_mm256_setzero_si256(), (in)), 4)
+
+   #define dct_wadd(out, a, b) \
+      __m256i out##_l = _mm256_add_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_add_epi32(a##_h, b##_h)
+
+   #define dct_wsub(out, a, b) \
+      __m256i out##_l = _mm256_sub_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_sub_epi32(a##_h, b##_h)
+
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m256i abiased_l = _mm256_add_epi32(a##_l, bias); \
+         __m256i abiased_h = _mm256_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm256_packs_epi32(_mm256_srai_epi32(sum_l, s), _mm256_srai_epi32(sum_h, s)); \
+         out1 = _mm256_packs_epi32(_mm256_srai_epi32(dif_l, s), _mm256_srai_epi32(dif_h, s)); \
+      }
+
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi8(a, b); \
+      b = _mm256_unpackhi_epi8(tmp, b)
+
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi16(a, b); \
+      b = _mm256_unpackhi_epi16(tmp, b)
+
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m256i sum04 = _mm256_add_epi16(row0, row4); \
+         __m256i dif04 = _mm256_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m256i sum17 = _mm256_add_epi16(row1, row7); \
+         __m256i sum35 = _mm256_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   // row r of block a in the low lane, of block b in the high lane
+   #define dct_load(r) \
+      _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_load_si128((const __m128i *) (data_a + (r)*8))), \
+                              _mm_load_si128((const __m128i *) (data_b + (r)*8)), 1)
+
+   // two output rows of each block
+   #define dct_store(p) \
+      { \
+         __m128i lo = _mm256_castsi256_si128(p); \
+         __m128i hi = _mm256_extracti128_si256(p, 1); \
+         _mm_storel_epi64((__m128i *) outa, lo); outa += stride_a; \
+         _mm_storel_epi64((__m128i *) outa, _mm_shuffle_epi32(lo, 0x4e)); outa += stride_a; \
+         _mm_storel_epi64((__m128i *) outb, hi); outb += stride_b; \
+         _mm_storel_epi64((__m128i *) outb, _mm_shuffle_epi32(hi, 0x4e)); outb += stride_b; \
+      }
+
+   __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   __m256i bias_0 = _mm256_set1_epi32(512);
+   __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
+
+   row0 = dct_load(0);
+   row1 = dct_load(1);
+   row2 = dct_load(2);
+   row3 = dct_load(3);
+   row4 = dct_load(4);
+   row5 = dct_load(5);
+   row6 = dct_load(6);
+   row7 = dct_load(7);
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transposes, one per lane
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      __m256i p0 = _mm256_packus_epi16(row0, row1);
+      __m256i p1 = _mm256_packus_epi16(row2, row3);
+      __m256i p2 = _mm256_packus_epi16(row4, row5);
+      __m256i p3 = _mm256_packus_epi16(row6, row7);
+
+      // 8bit 8x8 transposes, one per lane
+      dct_interleave8(p0, p2);
+      dct_interleave8(p1, p3);
+
+      dct_interleave8(p0, p1);
+      dct_interleave8(p2, p3);
+
+      dct_interleave8(p0, p2);
+      dct_interleave8(p1, p3);
+
+      dct_store(p0);
+      dct_store(p2);
+      dct_store(p1);
+      dct_store(p3);
+   }
+
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+#undef dct_load
+#undef dct_store
+}
+
+#endif // STBI_AVX2
+
 #ifdef STBI_NEON
 
 // NEON integer IDCT. should produce bit-identical
@@ -2872,67 +3288,287 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
-static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
+static void stbi__jpeg_idct(stbi__jpeg *z, stbi_uc *out, int out_stride, short data[64])
 {
-   stbi__jpeg_reset(z);
-   if (!z->progressive) {
-      if (z->scan_n == 1) {
-         int i,j;
-         STBI_SIMD_ALIGN(short, data[64]);
-         int n = z->order[0];
-         // non-interleaved data, we just need to process one block at a time,
-         // in trivial scanline order
-         // number of blocks to do just depends on how many actual "pixels" this
-         // component has, independent of interleaved MCU blocking and such
-         int w = (z->img_comp[n].x+7) >> 3;
-         int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
-            for (i=0; i < w; ++i) {
-               int ha = z->img_comp[n].ha;
-               if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
-               // every data block is an MCU, so countdown the restart interval
-               if (--z->todo <= 0) {
-                  if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  // if it's NOT a restart, then just bail, so we get corrupt data
-                  // rather than no data
-                  if (!STBI__RESTART(z->marker)) return 1;
-                  stbi__jpeg_reset(z);
-               }
+   if (z->scale_shift)
+      stbi__idct_reduced(out, out_stride, data, z->scale_shift);
+   else if (!z->idct_pair_kernel)
+      z->idct_block_kernel(out, out_stride, data);
+   else if (z->idct_pending) {
+      z->idct_pair_kernel(z->idct_pending, z->idct_pending_stride, z->idct_pending_data, out, out_stride, data);
+      z->idct_pending = NULL;
+   } else {
+      // the caller reuses data for the next block
+      memcpy(z->idct_pending_data, data, sizeof(z->idct_pending_data));
+      z->idct_pending = out;
+      z->idct_pending_stride = out_stride;
+   }
+}
+
+// transforms a block left over by stbi__jpeg_idct
+static void stbi__jpeg_idct_flush(stbi__jpeg *z)
+{
+   if (z->idct_pending) {
+      z->idct_block_kernel(z->idct_pending, z->idct_pending_stride, z->idct_pending_data);
+      z->idct_pending = NULL;
+   }
+}
+
+// whether the restart interval starting at MCU m of a w MCUs wide scan has
+// any MCU inside roi
+static int stbi__jpeg_interval_needed(stbi__jpeg *z, int m, int w, const int roi[4])
+{
+   int end = m + z->restart_interval, j;
+   for (j = m / w; j * w < end && j < roi[3]; ++j) {
+      int i0 = j*w > m ? 0 : m - j*w;
+      int i1 = (j+1)*w < end ? w : end - j*w;
+      if (j >= roi[1] && i0 < roi[2] && i1 > roi[0]) return 1;
+   }
+   return 0;
+}
+
+// skips entropy coded bytes up to the next marker without decoding them;
+// returns whether that marker is a restart, else leaves it in z->marker
+static int stbi__jpeg_skip_interval(stbi__jpeg *z)
+{
+   while (!stbi__at_eof(z->s)) {
+      int x = stbi__get8(z->s);
+      if (x != 0xff) continue;
+      do x = stbi__get8(z->s); while (x == 0xff);
+      if (x == 0) continue; // stuffed zero
+      if (STBI__RESTART(x)) return 1;
+      z->marker = (unsigned char) x;
+      return 0;
+   }
+   return 0;
+}
+
+// ends a scan that has no MCUs of the region left: stops decoding entirely if
+// the scan carries every component, else skips to the next scan
+static int stbi__jpeg_leave_scan(stbi__jpeg *z)
+{
+   if (z->scan_n == z->s->img_n)
+      z->roi_done = 1;
+   else if (z->marker == STBI__MARKER_none || STBI__RESTART(z->marker)) {
+      z->marker = STBI__MARKER_none;
+      while (stbi__jpeg_skip_interval(z)) ;
+   }
+   return 1;
+}
+
+// decodes MCUs m0..m1-1 of a baseline scan, m0 starting a restart interval.
+// MCUs of non-interleaved scans are single blocks of their component.
+static int stbi__jpeg_decode_mcus(stbi__jpeg *z, int m0, int m1)
+{
+   if (z->scan_n == 1) {
+      int i,j;
+      STBI_SIMD_ALIGN(short, data[64]);
+      int n = z->order[0];
+      // non-interleaved data, we just need to process one block at a time,
+      // in trivial scanline order
+      // number of blocks to do just depends on how many actual "pixels" this
+      // component has, independent of interleaved MCU blocking and such
+      int w = (z->img_comp[n].x+7) >> 3;
+      int bs = 8 >> z->scale_shift;
+      int m;
+      // the region in blocks of this component
+      int roi[4];
+      roi[0] = z->roi[0] * z->img_comp[n].h;
+      roi[1] = z->roi[1] * z->img_comp[n].v;
+      roi[2] = z->roi[2] * z->img_comp[n].h;
+      roi[3] = z->roi[3] * z->img_comp[n].v;
+      for (m=m0; m < m1; ++m) {
+         i = m % w;
+         j = m / w;
+         if (j >= roi[3]) return stbi__jpeg_leave_scan(z);
+         if (z->todo == z->restart_interval && !stbi__jpeg_interval_needed(z, m, w, roi)) {
+            if (!stbi__jpeg_skip_interval(z)) return 1;
+            stbi__jpeg_reset(z);
+            m += z->restart_interval - 1;
+            continue;
+         }
+         {
+            int ha = z->img_comp[n].ha;
+            if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+            if (i >= roi[0] && i < roi[2] && j >= roi[1])
+               stbi__jpeg_idct(z, z->img_comp[n].data+z->img_comp[n].w2*j*bs+i*bs, z->img_comp[n].w2, data);
+            // every data block is an MCU, so countdown the restart interval
+            if (--z->todo <= 0) {
+               if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+               // if it's NOT a restart, then just bail, so we get corrupt data
+               // rather than no data
+               if (!STBI__RESTART(z->marker)) return 1;
+               stbi__jpeg_reset(z);
             }
          }
-         return 1;
-      } else { // interleaved
-         int i,j,k,x,y;
-         STBI_SIMD_ALIGN(short, data[64]);
-         for (j=0; j < z->img_mcu_y; ++j) {
-            for (i=0; i < z->img_mcu_x; ++i) {
-               // scan an interleaved mcu... process scan_n components in order
-               for (k=0; k < z->scan_n; ++k) {
-                  int n = z->order[k];
-                  // scan out an mcu's worth of this component; that's just determined
-                  // by the basic H and V specified for the component
-                  for (y=0; y < z->img_comp[n].v; ++y) {
-                     for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
-                        int ha = z->img_comp[n].ha;
-                        if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
-                     }
+      }
+      return 1;
+   } else { // interleaved
+      int i,j,k,x,y,m,in;
+      int bs = 8 >> z->scale_shift;
+      STBI_SIMD_ALIGN(short, data[64]);
+      for (m=m0; m < m1; ++m) {
+         i = m % z->img_mcu_x;
+         j = m / z->img_mcu_x;
+         if (j >= z->roi[3]) return stbi__jpeg_leave_scan(z);
+         if (z->todo == z->restart_interval && !stbi__jpeg_interval_needed(z, m, z->img_mcu_x, z->roi)) {
+            // no MCU of this interval is needed, seek to the next one
+            if (!stbi__jpeg_skip_interval(z)) return 1;
+            stbi__jpeg_reset(z);
+            m += z->restart_interval - 1;
+            continue;
+         }
+         in = i >= z->roi[0] && i < z->roi[2] && j >= z->roi[1];
+         {
+            // scan an interleaved mcu... process scan_n components in order
+            for (k=0; k < z->scan_n; ++k) {
+               int n = z->order[k];
+               // scan out an mcu's worth of this component; that's just determined
+               // by the basic H and V specified for the component
+               for (y=0; y < z->img_comp[n].v; ++y) {
+                  for (x=0; x < z->img_comp[n].h; ++x) {
+                     int x2 = (i*z->img_comp[n].h + x)*bs;
+                     int y2 = (j*z->img_comp[n].v + y)*bs;
+                     int ha = z->img_comp[n].ha;
+                     if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                     if (in)
+                        stbi__jpeg_idct(z, z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
                   }
                }
-               // after all interleaved components, that's an interleaved MCU,
-               // so now count down the restart interval
-               if (--z->todo <= 0) {
-                  if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  if (!STBI__RESTART(z->marker)) return 1;
-                  stbi__jpeg_reset(z);
-               }
+            }
+            // after all interleaved components, that's an interleaved MCU,
+            // so now count down the restart interval
+            if (--z->todo <= 0) {
+               if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+               if (!STBI__RESTART(z->marker)) return 1;
+               stbi__jpeg_reset(z);
             }
          }
-         return 1;
       }
+      return 1;
+   }
+}
+
+// number of MCUs in the current scan
+static int stbi__jpeg_scan_mcus(stbi__jpeg *z)
+{
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      return ((z->img_comp[n].x+7) >> 3) * ((z->img_comp[n].y+7) >> 3);
+   }
+   return z->img_mcu_x * z->img_mcu_y;
+}
+
+#define STBI__JPEG_PARALLEL_CHUNKS 64
+
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi_uc *data;       // entropy coded data of the scan, RST markers included
+   int *start;          // offset of every restart interval, then the data length
+   int intervals, chunk, n;
+   volatile int failed;
+} stbi__jpeg_parallel;
+
+// reads the entropy coded data of a scan up to the marker ending it, noting
+// where each restart interval starts
+static int stbi__jpeg_read_scan(stbi__jpeg *z, stbi__jpeg_parallel *p)
+{
+   int len = 0, cap = 1 << 16, n = 0, ncap = 64;
+   p->data = (stbi_uc *) stbi__malloc(cap);
+   p->start = (int *) stbi__malloc(ncap * sizeof(int));
+   if (!p->data || !p->start) return stbi__err("outofmem", "Out of memory");
+   p->start[n++] = 0;
+   while (!stbi__at_eof(z->s)) {
+      stbi__context *s = z->s;
+      stbi_uc *ff;
+      int k, y;
+      // copy everything up to the next 0xff in one go
+      if (s->img_buffer >= s->img_buffer_end && s->read_from_callbacks)
+         stbi__refill_buffer(s);
+      k = (int) (s->img_buffer_end - s->img_buffer);
+      ff = (stbi_uc *) memchr(s->img_buffer, 0xff, k);
+      if (ff) k = (int) (ff - s->img_buffer);
+      while (len + k + 2 > cap || n + 1 >= ncap) {
+         stbi_uc *d = (stbi_uc *) STBI_REALLOC_SIZED(p->data, cap, cap * 2);
+         int *st = (int *) STBI_REALLOC_SIZED(p->start, ncap * sizeof(int), ncap * 2 * sizeof(int));
+         if (d) { p->data = d; cap *= 2; }
+         if (st) { p->start = st; ncap *= 2; }
+         if (!d || !st) return stbi__err("outofmem", "Out of memory");
+      }
+      memcpy(p->data + len, s->img_buffer, k);
+      len += k;
+      s->img_buffer += k;
+      if (!ff) continue;
+      stbi__get8(s);
+      do y = stbi__get8(s); while (y == 0xff);
+      if (y != 0 && !STBI__RESTART(y)) {
+         z->marker = (unsigned char) y;
+         break;
+      }
+      p->data[len++] = 0xff;
+      p->data[len++] = (stbi_uc) y;
+      if (y != 0) p->start[n++] = len;
+   }
+   p->start[n] = len;
+   p->intervals = n;
+   return 1;
+}
+
+static void stbi__jpeg_decode_chunk(void *arg, int i)
+{
+   stbi__jpeg_parallel *p = (stbi__jpeg_parallel *) arg;
+   int a = i * p->chunk, b = a + p->chunk, m0, m1;
+   stbi__context s = *p->z->s;
+   stbi__jpeg *z = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   if (!z) { p->failed = 1; return; }
+   if (b > p->intervals) b = p->intervals;
+   // same tables and output planes, but a bit reader of its own
+   memcpy(z, p->z, sizeof(*z));
+   stbi__start_mem(&s, p->data + p->start[a], p->start[b] - p->start[a]);
+   z->s = &s;
+   stbi__jpeg_reset(z);
+   m0 = a * z->restart_interval;
+   m1 = b * z->restart_interval;
+   if (m1 > p->n) m1 = p->n;
+   if (m0 < m1 && !stbi__jpeg_decode_mcus(z, m0, m1)) p->failed = 1;
+   stbi__jpeg_idct_flush(z);
+   STBI_FREE(z);
+}
+
+// restart markers reset all decoder state, so the intervals between them
+// decode independently of each other
+static int stbi__jpeg_decode_parallel(stbi__jpeg *z, int n)
+{
+   stbi__jpeg_parallel p;
+   int ok;
+   p.z = z;
+   p.n = n;
+   p.failed = 0;
+   p.data = NULL;
+   p.start = NULL;
+   ok = stbi__jpeg_read_scan(z, &p);
+   if (ok) {
+      p.chunk = (p.intervals + STBI__JPEG_PARALLEL_CHUNKS - 1) / STBI__JPEG_PARALLEL_CHUNKS;
+      stbi__parallel_for_fn(stbi__jpeg_decode_chunk, &p, (p.intervals + p.chunk - 1) / p.chunk, stbi__parallel_for_user);
+      if (p.failed) ok = stbi__err("bad huffman code","Corrupt JPEG");
+   }
+   STBI_FREE(p.data);
+   STBI_FREE(p.start);
+   return ok;
+}
+
+static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
+{
+   stbi__jpeg_reset(z);
+   if (!z->progressive) {
+      int n = stbi__jpeg_scan_mcus(z);
+      int ok;
+      if (stbi__parallel_for_fn && z->restart_interval && n > z->restart_interval)
+         return stbi__jpeg_decode_parallel(z, n);
+      ok = stbi__jpeg_decode_mcus(z, 0, n);
+      stbi__jpeg_idct_flush(z);
+      return ok;
    } else {
       if (z->scan_n == 1) {
          int i,j;
@@ -3008,17 +3644,24 @@ static void stbi__jpeg_finish(stbi__jpeg *z)
    if (z->progressive) {
       // dequantize and idct the data
       int i,j,n;
+      int bs = 8 >> z->scale_shift;
       for (n=0; n < z->s->img_n; ++n) {
          int w = (z->img_comp[n].x+7) >> 3;
          int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
-            for (i=0; i < w; ++i) {
+         // only the blocks of the region
+         int i0 = z->roi[0] * z->img_comp[n].h, i1 = z->roi[2] * z->img_comp[n].h;
+         int j0 = z->roi[1] * z->img_comp[n].v, j1 = z->roi[3] * z->img_comp[n].v;
+         if (i1 > w) i1 = w;
+         if (j1 > h) j1 = h;
+         for (j=j0; j < j1; ++j) {
+            for (i=i0; i < i1; ++i) {
                short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
                stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               stbi__jpeg_idct(z, z->img_comp[n].data+z->img_comp[n].w2*j*bs+i*bs, z->img_comp[n].w2, data);
             }
          }
       }
+      stbi__jpeg_idct_flush(z);
    }
 }
 
@@ -3186,6 +3829,11 @@ static int stbi__free_jpeg_components(stbi__jpeg *z, int ncomp, int why)
    return why;
 }
 
+static int stbi__jpeg_clamp_mcu(int v, int lo, int hi)
+{
+   return v < lo ? lo : v > hi ? hi : v;
+}
+
 static int stbi__process_frame_header(stbi__jpeg *z, int scan)
 {
    stbi__context *s = z->s;
@@ -3236,6 +3884,20 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
    z->img_mcu_x = (s->img_x + z->img_mcu_w-1) / z->img_mcu_w;
    z->img_mcu_y = (s->img_y + z->img_mcu_h-1) / z->img_mcu_h;
 
+   // MCUs covering the region, padded by a pixel so that upsampling at its
+   // edges still sees the neighbouring samples
+   z->roi[0] = z->roi[1] = 0;
+   z->roi[2] = z->img_mcu_x;
+   z->roi[3] = z->img_mcu_y;
+   z->roi_done = 0;
+   if (z->region) {
+      int *r = z->region;
+      if (r[0] > 0) z->roi[0] = stbi__jpeg_clamp_mcu((r[0] - 1) / z->img_mcu_w, 0, z->img_mcu_x - 1);
+      if (r[1] > 0) z->roi[1] = stbi__jpeg_clamp_mcu((r[1] - 1) / z->img_mcu_h, 0, z->img_mcu_y - 1);
+      z->roi[2] = stbi__jpeg_clamp_mcu(r[2] / z->img_mcu_w + 1, z->roi[0] + 1, z->img_mcu_x);
+      z->roi[3] = stbi__jpeg_clamp_mcu(r[3] / z->img_mcu_h + 1, z->roi[1] + 1, z->img_mcu_y);
+   }
+
    for (i=0; i < s->img_n; ++i) {
       // number of effective pixels (e.g. for non-interleaved MCU)
       z->img_comp[i].x = (s->img_x * z->img_comp[i].h + h_max-1) / h_max;
@@ -3247,8 +3909,9 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       //
       // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
       // so these muls can't overflow with 32-bit ints (which we require)
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      // reduced-size decodes only store (8>>scale_shift)^2 pixels per block
+      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * (8 >> z->scale_shift);
+      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * (8 >> z->scale_shift);
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
       z->img_comp[i].linebuf = NULL;
@@ -3258,10 +3921,10 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       // align blocks for idct using mmx/sse
       z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
       if (z->progressive) {
-         // w2, h2 are multiples of 8 (see above)
-         z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-         z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
+         // coefficients are kept for every 8x8 block regardless of scale
+         z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+         z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].coeff_w * 8, z->img_comp[i].coeff_h * 8, sizeof(short), 15);
          if (z->img_comp[i].raw_coeff == NULL)
             return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
          z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
@@ -3319,6 +3982,7 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
       if (stbi__SOS(m)) {
          if (!stbi__process_scan_header(j)) return 0;
          if (!stbi__parse_entropy_coded_data(j)) return 0;
+         if (j->roi_done) return 1; // nothing of the region left to decode
          if (j->marker == STBI__MARKER_none ) {
             // handle 0s at the end of image data from IP Kamera 9060
             while (!stbi__at_eof(j->s)) {
@@ -3582,7 +4246,9 @@ static void stbi__YCbCr_to_RGB_row(stbi_uc *out, const stbi_uc *y, const stbi_uc
 }
 
 #if defined(STBI_SSE2) || defined(STBI_NEON)
-static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+// bgr swaps the red and blue channels of the output, which is the pixel
+// order of most framebuffers
+static void stbi__YCbCr_simd(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step, int bgr)
 {
    int i = 0;
 
@@ -3630,7 +4296,7 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
          __m128i gw = _mm_srai_epi16(gws, 4);
 
          // back to byte, set up for transpose
-         __m128i brb = _mm_packus_epi16(rw, bw);
+         __m128i brb = bgr ? _mm_packus_epi16(bw, rw) : _mm_packus_epi16(rw, bw);
          __m128i gxb = _mm_packus_epi16(gw, xw);
 
          // transpose to interleave channels
@@ -3681,9 +4347,9 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 
          // undo scaling, round, convert to byte
          uint8x8x4_t o;
-         o.val[0] = vqrshrun_n_s16(rws, 4);
+         o.val[bgr ? 2 : 0] = vqrshrun_n_s16(rws, 4);
          o.val[1] = vqrshrun_n_s16(gws, 4);
-         o.val[2] = vqrshrun_n_s16(bws, 4);
+         o.val[bgr ? 0 : 2] = vqrshrun_n_s16(bws, 4);
          o.val[3] = vdup_n_u8(255);
 
          // store, interleaving r/g/b/a
@@ -3707,33 +4373,198 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
       if ((unsigned) r > 255) { if (r < 0) r = 0; else r = 255; }
       if ((unsigned) g > 255) { if (g < 0) g = 0; else g = 255; }
       if ((unsigned) b > 255) { if (b < 0) b = 0; else b = 255; }
-      out[0] = (stbi_uc)r;
+      out[bgr ? 2 : 0] = (stbi_uc)r;
       out[1] = (stbi_uc)g;
-      out[2] = (stbi_uc)b;
+      out[bgr ? 0 : 2] = (stbi_uc)b;
       out[3] = 255;
       out += step;
    }
 }
+
+static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   stbi__YCbCr_simd(out, y, pcb, pcr, count, step, 0);
+}
+
+static void stbi__YCbCr_to_BGR_simd(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   stbi__YCbCr_simd(out, y, pcb, pcr, count, step, 1);
+}
+#endif
+
+#ifdef STBI_AVX2
+// avx2 versions of the sse2 upsampler and color converter, 16 pixels at a
+// time with the same arithmetic, so the output is the same too
+static STBI__AVX2_TARGET stbi_uc *stbi__resample_row_hv_2_avx2(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   // need to generate 2x2 samples for every one in input
+   int i=0,t0,t1;
+
+   if (w == 1) {
+      out[0] = out[1] = stbi__div4(3*in_near[0] + in_far[0] + 2);
+      return out;
+   }
+
+   t1 = 3*in_near[0] + in_far[0];
+   for (; i < ((w-1) & ~15); i += 16) {
+      // vertical pass, 3*x + y = 4*x + (y - x)
+      __m256i farw  = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_far + i)));
+      __m256i nearw = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_near + i)));
+      __m256i diff  = _mm256_sub_epi16(farw, nearw);
+      __m256i nears = _mm256_slli_epi16(nearw, 2);
+      __m256i curr  = _mm256_add_epi16(nears, diff);
+
+      // "prev" and "next" are curr shifted by a pixel, which has to cross
+      // the lanes: alignr against curr with a lane moved in
+      __m256i prv0 = _mm256_alignr_epi8(curr, _mm256_permute2x128_si256(curr, curr, 0x08), 14);
+      __m256i nxt0 = _mm256_alignr_epi8(_mm256_permute2x128_si256(curr, curr, 0x81), curr, 2);
+      __m256i prev = _mm256_insert_epi16(prv0, t1, 0);
+      __m256i next = _mm256_insert_epi16(nxt0, 3*in_near[i+16] + in_far[i+16], 15);
+
+      // horizontal pass, polyphase as in the sse2 version
+      __m256i bias = _mm256_set1_epi16(8);
+      __m256i curs = _mm256_slli_epi16(curr, 2);
+      __m256i prvd = _mm256_sub_epi16(prev, curr);
+      __m256i nxtd = _mm256_sub_epi16(next, curr);
+      __m256i curb = _mm256_add_epi16(curs, bias);
+      __m256i even = _mm256_add_epi16(prvd, curb);
+      __m256i odd  = _mm256_add_epi16(nxtd, curb);
+
+      // interleave, undo scaling and pack; all in-lane, so the low lane
+      // holds output pixels 0-15 and the high lane 16-31
+      __m256i int0 = _mm256_unpacklo_epi16(even, odd);
+      __m256i int1 = _mm256_unpackhi_epi16(even, odd);
+      __m256i de0  = _mm256_srli_epi16(int0, 4);
+      __m256i de1  = _mm256_srli_epi16(int1, 4);
+      __m256i outv = _mm256_packus_epi16(de0, de1);
+      _mm256_storeu_si256((__m256i *) (out + i*2), outv);
+
+      t1 = 3*in_near[i+15] + in_far[i+15];
+   }
+
+   t0 = t1;
+   t1 = 3*in_near[i] + in_far[i];
+   out[i*2] = stbi__div16(3*t1 + t0 + 8);
+
+   for (++i; i < w; ++i) {
+      t0 = t1;
+      t1 = 3*in_near[i]+in_far[i];
+      out[i*2-1] = stbi__div16(3*t0 + t1 + 8);
+      out[i*2  ] = stbi__div16(3*t1 + t0 + 8);
+   }
+   out[w*2-1] = stbi__div4(t1+2);
+
+   STBI_NOTUSED(hs);
+
+   return out;
+}
+
+static STBI__AVX2_TARGET void stbi__YCbCr_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step, int bgr)
+{
+   int i = 0;
+
+   if (step == 4) {
+      __m128i signflip  = _mm_set1_epi8(-0x80);
+      __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+      __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+      __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+      __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+      __m256i y_bias = _mm256_set1_epi16(128);
+      __m256i xw = _mm256_set1_epi16(255); // alpha channel
+
+      for (; i+15 < count; i += 16) {
+         // load
+         __m128i y_bytes = _mm_loadu_si128((__m128i *) (y+i));
+         __m128i cr_biased = _mm_xor_si128(_mm_loadu_si128((__m128i *) (pcr+i)), signflip); // -128
+         __m128i cb_biased = _mm_xor_si128(_mm_loadu_si128((__m128i *) (pcb+i)), signflip); // -128
+
+         // widen to short, same values as the sse2 unpacks
+         __m256i yw  = _mm256_or_si256(_mm256_slli_epi16(_mm256_cvtepu8_epi16(y_bytes), 8), y_bias);
+         __m256i crw = _mm256_slli_epi16(_mm256_cvtepi8_epi16(cr_biased), 8);
+         __m256i cbw = _mm256_slli_epi16(_mm256_cvtepi8_epi16(cb_biased), 8);
+
+         // color transform
+         __m256i yws = _mm256_srli_epi16(yw, 4);
+         __m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw);
+         __m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw);
+         __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1);
+         __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1);
+         __m256i rws = _mm256_add_epi16(cr0, yws);
+         __m256i gwt = _mm256_add_epi16(cb0, yws);
+         __m256i bws = _mm256_add_epi16(yws, cb1);
+         __m256i gws = _mm256_add_epi16(gwt, cr1);
+
+         // descale
+         __m256i rw = _mm256_srai_epi16(rws, 4);
+         __m256i bw = _mm256_srai_epi16(bws, 4);
+         __m256i gw = _mm256_srai_epi16(gws, 4);
+
+         // back to byte and interleave channels; each lane ends up with
+         // pixels 0-3 and 4-7 of its half in o0 and o1
+         __m256i brb = bgr ? _mm256_packus_epi16(bw, rw) : _mm256_packus_epi16(rw, bw);
+         __m256i gxb = _mm256_packus_epi16(gw, xw);
+         __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+         __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+         __m256i o0 = _mm256_unpacklo_epi16(t0, t1);
+         __m256i o1 = _mm256_unpackhi_epi16(t0, t1);
+
+         // store
+         _mm256_storeu_si256((__m256i *) (out + 0), _mm256_permute2x128_si256(o0, o1, 0x20));
+         _mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(o0, o1, 0x31));
+         out += 64;
+      }
+   }
+
+   stbi__YCbCr_simd(out, y+i, pcb+i, pcr+i, count-i, step, bgr);
+}
+
+static STBI__AVX2_TARGET void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   stbi__YCbCr_avx2(out, y, pcb, pcr, count, step, 0);
+}
+
+static STBI__AVX2_TARGET void stbi__YCbCr_to_BGR_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   stbi__YCbCr_avx2(out, y, pcb, pcr, count, step, 1);
+}
 #endif
 
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
+   j->scale_shift = 0;
+   j->region = NULL;
+   j->roi_done = 0;
+   j->bgr = 0;
+   j->idct_pending = NULL;
    j->idct_block_kernel = stbi__idct_block;
+   j->idct_pair_kernel = NULL;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
+   j->YCbCr_to_BGR_kernel = NULL; // load_jpeg_image swaps the channels instead
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
 
 #ifdef STBI_SSE2
    if (stbi__sse2_available()) {
       j->idct_block_kernel = stbi__idct_simd;
       j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
+      j->YCbCr_to_BGR_kernel = stbi__YCbCr_to_BGR_simd;
       j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
    }
 #endif
 
+#ifdef STBI_AVX2
+   if (stbi__avx2_available()) {
+      j->idct_pair_kernel = stbi__idct_avx2_pair;
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx2;
+      j->YCbCr_to_BGR_kernel = stbi__YCbCr_to_BGR_avx2;
+      j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_avx2;
+   }
+#endif
+
 #ifdef STBI_NEON
    j->idct_block_kernel = stbi__idct_simd;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
+   j->YCbCr_to_BGR_kernel = stbi__YCbCr_to_BGR_simd;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
 #endif
 }
@@ -3772,8 +4603,35 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    // load a jpeg image from whichever source, but leave in YCbCr format
    if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
 
+   // region and reduced-size decodes: everything from here on works on the
+   // cropped, smaller planes
+   {
+      int k, sh = z->scale_shift, r = (1 << sh) - 1;
+      int x0 = z->roi[0] * z->img_mcu_w, y0 = z->roi[1] * z->img_mcu_h;
+      int x1 = z->roi[2] * z->img_mcu_w, y1 = z->roi[3] * z->img_mcu_h;
+      if (x1 > (int) z->s->img_x) x1 = z->s->img_x;
+      if (y1 > (int) z->s->img_y) y1 = z->s->img_y;
+      for (k=0; k < z->s->img_n; ++k) {
+         int h = z->img_comp[k].h, v = z->img_comp[k].v;
+         // MCU aligned, so the offsets are whole blocks in every component
+         z->img_comp[k].data += ((y0 * v / z->img_v_max) >> sh) * z->img_comp[k].w2 + ((x0 * h / z->img_h_max) >> sh);
+         z->img_comp[k].x = (((x1 - x0) * h + z->img_h_max - 1) / z->img_h_max + r) >> sh;
+         z->img_comp[k].y = (((y1 - y0) * v + z->img_v_max - 1) / z->img_v_max + r) >> sh;
+      }
+      z->s->img_x = (x1 - x0 + r) >> sh;
+      z->s->img_y = (y1 - y0 + r) >> sh;
+      if (z->region) {
+         z->region[0] = x0;
+         z->region[1] = y0;
+         z->region[2] = x1;
+         z->region[3] = y1;
+         z->s->jpeg_region = NULL;
+      }
+   }
+
    // determine actual number of components to generate
    n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
+   if (n < 3) z->bgr = 0;
 
    is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
 
@@ -3788,6 +4646,13 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
       unsigned int i,j;
       stbi_uc *output;
       stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+      // the YCbCr kernels can write BGR themselves, everything else gets
+      // red and blue swapped afterwards
+      int ycc = (z->s->img_n == 3 && !is_rgb) || (z->s->img_n == 4 && z->app14_color_transform != 0);
+      int ycc_bgr = z->bgr && ycc && z->YCbCr_to_BGR_kernel;
+      int swap_rows = z->bgr && z->s->img_n >= 3 && !ycc_bgr;
+      void (*YCbCr_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step) =
+         ycc_bgr ? z->YCbCr_to_BGR_kernel : z->YCbCr_to_RGB_kernel;
 
       stbi__resample res_comp[4];
 
@@ -3846,7 +4711,7 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
                      out += n;
                   }
                } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+                  YCbCr_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
                }
             } else if (z->s->img_n == 4) {
                if (z->app14_color_transform == 0) { // CMYK
@@ -3859,7 +4724,7 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
                      out += n;
                   }
                } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+                  YCbCr_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
                   for (i=0; i < z->s->img_x; ++i) {
                      stbi_uc m = coutput[3][i];
                      out[0] = stbi__blinn_8x8(255 - out[0], m);
@@ -3868,7 +4733,7 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
                      out += n;
                   }
                } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+                  YCbCr_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
                }
             } else
                for (i=0; i < z->s->img_x; ++i) {
@@ -3876,6 +4741,8 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
                   out[3] = 255; // not used if n==3
                   out += n;
                }
+            if (swap_rows)
+               stbi__swap_rb(output + n * z->s->img_x * j, z->s->img_x, n);
          } else {
             if (is_rgb) {
                if (n == 1)
@@ -3924,10 +4791,13 @@ static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int re
 {
    unsigned char* result;
    stbi__jpeg* j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg));
-   STBI_NOTUSED(ri);
    j->s = s;
    stbi__setup_jpeg(j);
+   j->scale_shift = s->jpeg_scale_shift;
+   j->region = s->jpeg_region;
+   j->bgr = stbi__bgr_on_load;
    result = load_jpeg_image(j, x,y,comp,req_comp);
+   if (j->bgr) ri->channel_order = STBI_ORDER_BGR;
    STBI_FREE(j);
    return result;
 }
@@ -3969,15 +4839,20 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 
 // public domain zlib decode    v0.2  Sean Barrett 2006-11-18
 //    simple implementation
-//      - all input must be provided in an upfront buffer
-//      - all output is written to a single output buffer (can malloc/realloc)
+//      - all input must be provided in an upfront buffer, or refilled
+//        piecewise as it runs out (zrefill)
+//      - all output is written to a single output buffer (can malloc/realloc),
+//        or to a sliding window that is handed off as it fills (zflush)
 //    performance
 //      - fast huffman
+//      - the bulk of every huffman block goes through a loop with a 64-bit
+//        bit buffer, one table lookup per literal pair or resolved length,
+//        and match copies in 8 or 16 byte steps (stbi__zinflate_fast)
 
 #ifndef STBI_NO_ZLIB
 
 // fast-way is faster to check than jpeg huffman, but slow way is slower
-#define STBI__ZFAST_BITS  9 // accelerate all cases in default tables
+#define STBI__ZFAST_BITS  11 // accelerate all cases in default tables, most in dynamic ones
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 
 // zlib-style huffman encoding
@@ -4059,13 +4934,14 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
 // zlib-from-memory implementation for PNG reading
 //    because PNG allows splitting the zlib stream arbitrarily,
 //    and it's annoying structurally to have PNG call ZLIB call PNG,
-//    we require PNG read all the IDATs and combine them into a single
-//    memory buffer
+//    interlaced PNGs read all the IDATs and combine them into a single
+//    memory buffer, others hand them over piece by piece (zrefill)
 
-typedef struct
+typedef struct stbi__zbuf
 {
    stbi_uc *zbuffer, *zbuffer_end;
    int num_bits;
+   int hit_zeof_once;
    stbi__uint32 code_buffer;
 
    char *zout;
@@ -4073,12 +4949,23 @@ typedef struct
    char *zout_end;
    int   z_expandable;
 
+   // windowed output: called instead of growing the buffer, to hand off
+   // what was inflated so far and make room for n more bytes, keeping the
+   // 32k that can still be referred to
+   int (*zflush)(struct stbi__zbuf *z, int n);
+   // windowed input: called when zbuffer runs out, to point it at more
+   // data. the 8 bytes before the new zbuffer must repeat the last ones
+   // consumed, since stbi__zinflate_fast may hand back that many
+   int (*zrefill)(struct stbi__zbuf *z);
+   void *zuser;
+
    stbi__zhuffman z_length, z_distance;
+   stbi__uint32 z_litlen[1 << STBI__ZFAST_BITS]; // z_length resolved further, see stbi__zbuild_litlen
 } stbi__zbuf;
 
 stbi_inline static int stbi__zeof(stbi__zbuf *z)
 {
-   return (z->zbuffer >= z->zbuffer_end);
+   return (z->zbuffer >= z->zbuffer_end) && (!z->zrefill || !z->zrefill(z));
 }
 
 stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
@@ -4091,6 +4978,7 @@ static void stbi__fill_bits(stbi__zbuf *z)
    do {
       if (z->code_buffer >= (1U << z->num_bits)) {
         z->zbuffer = z->zbuffer_end;  /* treat this as EOF so we fail. */
+        z->zrefill = NULL;
         return;
       }
       z->code_buffer |= (unsigned int) stbi__zget8(z) << z->num_bits;
@@ -4108,12 +4996,12 @@ stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
    return k;
 }
 
-static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
+// decodes a code not resolved by the fast table from the low bits of *bits
+static int stbi__zdecode_long(stbi__zhuffman *z, stbi__uint64 *bits, int *num_bits)
 {
    int b,s,k;
-   // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = stbi__bit_reverse(a->code_buffer, 16);
+   k = stbi__bit_reverse((int) (*bits & 0xffff), 16);
    for (s=STBI__ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -4122,19 +5010,36 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
    b = (k >> (16-s)) - z->firstcode[s] + z->firstsymbol[s];
    if (b >= sizeof (z->size)) return -1; // some data was corrupt somewhere!
    if (z->size[b] != s) return -1;  // was originally an assert, but report failure instead.
-   a->code_buffer >>= s;
-   a->num_bits -= s;
+   *bits >>= s;
+   *num_bits -= s;
    return z->value[b];
 }
 
+static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
+{
+   stbi__uint64 bits = a->code_buffer;
+   int v = stbi__zdecode_long(z, &bits, &a->num_bits);
+   a->code_buffer = (stbi__uint32) bits;
+   return v;
+}
+
 stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
 {
    int b,s;
    if (a->num_bits < 16) {
       if (stbi__zeof(a)) {
-         return -1;   /* report error for unexpected end of data. */
+         if (!a->hit_zeof_once) {
+            // first time out of data: pad with 16 zero bits so the last
+            // codes of a raw deflate stream can still be looked up. actually
+            // consuming any of them is caught at the end of the block
+            a->hit_zeof_once = 1;
+            a->num_bits += 16;
+         } else {
+            return -1;   /* report error for unexpected end of data. */
+         }
+      } else {
+         stbi__fill_bits(a);
       }
-      stbi__fill_bits(a);
    }
    b = z->fast[a->code_buffer & STBI__ZFAST_MASK];
    if (b) {
@@ -4151,6 +5056,7 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
    char *q;
    unsigned int cur, limit, old_limit;
    z->zout = zout;
+   if (z->zflush) return z->zflush(z, n);
    if (!z->z_expandable) return stbi__err("output buffer limit","Corrupt PNG");
    cur   = (unsigned int) (z->zout - z->zout_start);
    limit = old_limit = (unsigned) (z->zout_end - z->zout_start);
@@ -4168,25 +5074,167 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
    return 1;
 }
 
-static const int stbi__zlength_base[31] = {
-   3,4,5,6,7,8,9,10,11,13,
-   15,17,19,23,27,31,35,43,51,59,
-   67,83,99,115,131,163,195,227,258,0,0 };
+static const int stbi__zlength_base[31] = {
+   3,4,5,6,7,8,9,10,11,13,
+   15,17,19,23,27,31,35,43,51,59,
+   67,83,99,115,131,163,195,227,258,0,0 };
+
+static const int stbi__zlength_extra[31]=
+{ 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0 };
+
+static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
+257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
+
+static const int stbi__zdist_extra[32] =
+{ 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+// entries of the literal/length table: the number of bits they consume in
+// the low byte, then what they decode to
+#define STBI__ZLIT_LITERALS  0x300 // count of literals, in bits 16-23 and 24-31
+#define STBI__ZLIT_LENGTH    0x400 // length base in bits 16-24, extra bits in 28-31
+#define STBI__ZLIT_END       0x800 // end of block
+#define STBI__ZLIT_RESOLVED  0xf00 // else the code is too long for the table
+
+static stbi__uint32 stbi__zlit_entry(int sym, int bits)
+{
+   if (sym < 256) return (stbi__uint32) sym << 16 | 0x100 | bits;
+   if (sym == 256) return STBI__ZLIT_END | bits;
+   if (sym > 285) return 0; // invalid, stbi__zinflate_fast rejects it
+   sym -= 257;
+   return (stbi__uint32) stbi__zlength_extra[sym] << 28 | (stbi__uint32) stbi__zlength_base[sym] << 16 | STBI__ZLIT_LENGTH | bits;
+}
+
+// resolves the fast table of z_length further: a literal is followed by a
+// second one when both codes fit in the table bits, and lengths come with
+// their base and extra bit count
+static void stbi__zbuild_litlen(stbi__zbuf *a)
+{
+   int i;
+   for (i=0; i < (1 << STBI__ZFAST_BITS); ++i) {
+      int b = a->z_length.fast[i], s = b >> 9, sym = b & 511;
+      stbi__uint32 e = b ? stbi__zlit_entry(sym, s) : 0;
+      if (b && sym < 256) {
+         int b2 = a->z_length.fast[i >> s], s2 = b2 >> 9, sym2 = b2 & 511;
+         if (b2 && s + s2 <= STBI__ZFAST_BITS && sym2 < 256)
+            e = (stbi__uint32) sym2 << 24 | (stbi__uint32) sym << 16 | 0x200 | (s + s2);
+      }
+      a->z_litlen[i] = e;
+   }
+}
+
+stbi_inline static stbi__uint64 stbi__zload64(const stbi_uc *p)
+{
+   return (stbi__uint64) p[0]       | (stbi__uint64) p[1] << 8  | (stbi__uint64) p[2] << 16 | (stbi__uint64) p[3] << 24 |
+          (stbi__uint64) p[4] << 32 | (stbi__uint64) p[5] << 40 | (stbi__uint64) p[6] << 48 | (stbi__uint64) p[7] << 56;
+}
 
-static const int stbi__zlength_extra[31]=
-{ 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0 };
+// room a single iteration of stbi__zinflate_fast may write to: a longest
+// match rounded up to whole copy steps
+#define STBI__ZFAST_MARGIN (258 + 16)
 
-static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
-257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
+// decodes a huffman block for as long as there are 8 input bytes to refill
+// the bit buffer from and room for the longest match plus copy overshoot.
+// returns 1 at the end of the block, 0 when close to the end of either
+// buffer (the caller goes on carefully) and -1 on corrupt data.
+static int stbi__zinflate_fast(stbi__zbuf *a, char **pzout)
+{
+   const stbi_uc *in = a->zbuffer, *in_last = a->zbuffer_end - 8;
+   stbi_uc *out = (stbi_uc *) *pzout, *out_start = (stbi_uc *) a->zout_start;
+   stbi_uc *out_last = (stbi_uc *) a->zout_end - STBI__ZFAST_MARGIN;
+   stbi__uint64 bits = a->code_buffer;
+   int num_bits = a->num_bits, r = 0;
 
-static const int stbi__zdist_extra[32] =
-{ 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+   while (in <= in_last && out <= out_last) {
+      stbi__uint32 e;
+      int z, len, dist, n;
+      // refill to at least 56 bits, the most one iteration uses is 48. bits
+      // above num_bits may hold the next byte already, ORing it in again
+      // is harmless
+      if (num_bits < 48) {
+         bits |= stbi__zload64(in) << num_bits;
+         in += (63 - num_bits) >> 3;
+         num_bits |= 56;
+      }
+
+      e = a->z_litlen[bits & STBI__ZFAST_MASK];
+      if (!(e & STBI__ZLIT_RESOLVED)) {
+         z = stbi__zdecode_long(&a->z_length, &bits, &num_bits);
+         e = z < 0 ? 0 : stbi__zlit_entry(z, 0);
+         if (!e) { r = stbi__err("bad huffman code","Corrupt PNG") - 1; break; }
+      }
+      bits >>= e & 0xff;
+      num_bits -= e & 0xff;
+      if (e & STBI__ZLIT_LITERALS) {
+         out[0] = (stbi_uc) (e >> 16);
+         out[1] = (stbi_uc) (e >> 24); // in the margin when a single literal
+         out += (e >> 8) & 3;
+         continue;
+      }
+      if (e & STBI__ZLIT_END) { r = 1; break; }
+
+      n = e >> 28;
+      len = ((e >> 16) & 0x1ff) + (int) (bits & ((1u << n) - 1));
+      bits >>= n;
+      num_bits -= n;
+
+      z = a->z_distance.fast[bits & STBI__ZFAST_MASK];
+      if (z) {
+         n = z >> 9;
+         bits >>= n;
+         num_bits -= n;
+         z &= 511;
+      } else
+         z = stbi__zdecode_long(&a->z_distance, &bits, &num_bits);
+      if (z < 0 || z >= 30) { r = stbi__err("bad huffman code","Corrupt PNG") - 1; break; }
+      n = stbi__zdist_extra[z];
+      dist = stbi__zdist_base[z] + (int) (bits & ((1u << n) - 1));
+      bits >>= n;
+      num_bits -= n;
+      if (out - out_start < dist) { r = stbi__err("bad dist","Corrupt PNG") - 1; break; }
+
+      {
+         stbi_uc *src = out - dist, *end = out + len;
+         if (dist >= 16) {
+            do { memcpy(out, src, 16); out += 16; src += 16; } while (out < end);
+         } else if (dist >= 8) {
+            do { memcpy(out, src, 8); out += 8; src += 8; } while (out < end);
+         } else {
+            // short periods, common in images: 8 bytes of the repeating
+            // pattern are stored at steps that are a multiple of the period
+            stbi_uc pat[8];
+            int i, step = 8 - 8 % dist;
+            for (i=0; i < 8; ++i)
+               pat[i] = src[i % dist];
+            do { memcpy(out, pat, 8); out += step; } while (out < end);
+         }
+         out = end;
+      }
+   }
+
+   // give back the whole bytes still in the bit buffer
+   in -= num_bits >> 3;
+   num_bits &= 7;
+   a->zbuffer = (stbi_uc *) in;
+   a->code_buffer = (stbi__uint32) (bits & ((1u << num_bits) - 1));
+   a->num_bits = num_bits;
+   *pzout = (char *) out;
+   return r;
+}
 
 static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
    char *zout = a->zout;
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
+      int z;
+      if (a->zbuffer_end - a->zbuffer >= 8 && a->zout_end - zout >= STBI__ZFAST_MARGIN) {
+         int r = stbi__zinflate_fast(a, &zout);
+         if (r < 0) return 0;
+         if (r) {
+            a->zout = zout;
+            return 1;
+         }
+      }
+      z = stbi__zhuffman_decode(a, &a->z_length);
       if (z < 256) {
          if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
          if (zout >= a->zout_end) {
@@ -4199,13 +5247,16 @@ static int stbi__parse_huffman_block(stbi__zbuf *a)
          int len,dist;
          if (z == 256) {
             a->zout = zout;
+            if (a->hit_zeof_once && a->num_bits < 16)
+               return stbi__err("unexpected end","Corrupt PNG");
             return 1;
          }
          z -= 257;
+         if (z >= 29) return stbi__err("bad huffman code","Corrupt PNG");
          len = stbi__zlength_base[z];
          if (stbi__zlength_extra[z]) len += stbi__zreceive(a, stbi__zlength_extra[z]);
          z = stbi__zhuffman_decode(a, &a->z_distance);
-         if (z < 0) return stbi__err("bad huffman code","Corrupt PNG");
+         if (z < 0 || z >= 30) return stbi__err("bad huffman code","Corrupt PNG");
          dist = stbi__zdist_base[z];
          if (stbi__zdist_extra[z]) dist += stbi__zreceive(a, stbi__zdist_extra[z]);
          if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
@@ -4294,9 +5345,17 @@ static int stbi__parse_uncompressed_block(stbi__zbuf *a)
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt","Corrupt PNG");
-   if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
    if (a->zout + len > a->zout_end)
       if (!stbi__zexpand(a, a->zout, len)) return 0;
+   while (a->zbuffer + len > a->zbuffer_end) {
+      int n = (int) (a->zbuffer_end - a->zbuffer);
+      if (!a->zrefill) return stbi__err("read past buffer","Corrupt PNG");
+      memcpy(a->zout, a->zbuffer, n);
+      a->zbuffer += n;
+      a->zout += n;
+      len -= n;
+      if (!a->zrefill(a)) return stbi__err("read past buffer","Corrupt PNG");
+   }
    memcpy(a->zout, a->zbuffer, len);
    a->zbuffer += len;
    a->zout += len;
@@ -4352,6 +5411,7 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
    if (parse_header)
       if (!stbi__parse_zlib_header(a)) return 0;
    a->num_bits = 0;
+   a->hit_zeof_once = 0;
    a->code_buffer = 0;
    do {
       final = stbi__zreceive(a,1);
@@ -4368,6 +5428,7 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
          } else {
             if (!stbi__compute_huffman_codes(a)) return 0;
          }
+         stbi__zbuild_litlen(a);
          if (!stbi__parse_huffman_block(a)) return 0;
       }
    } while (!final);
@@ -4380,6 +5441,8 @@ static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->zflush = NULL;
+   a->zrefill = NULL;
 
    return stbi__parse_zlib(a, parse_header);
 }
@@ -4499,6 +5562,11 @@ typedef struct
    stbi__context *s;
    stbi_uc *idata, *expanded, *out;
    int depth;
+   int bgr; // swap red and blue while decoding, cleared if that didn't happen
+   stbi_row_callback *row_fn; // rows are handed to this instead of stored in out
+   void *row_user;
+   int row_bits;
+   int *row_x, *row_y, *row_comp; // set before the first row
 } stbi__png;
 
 
@@ -4535,215 +5603,250 @@ static int stbi__paeth(int a, int b, int c)
 
 static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
-// create the png data from post-deflated data
-static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+// per-image state for unfiltering scanlines one at a time
+typedef struct
 {
-   int bytes = (depth == 16? 2 : 1);
-   stbi__context *s = a->s;
-   stbi__uint32 i,j,stride = x*out_n*bytes;
-   stbi__uint32 img_len, img_width_bytes;
-   int k;
-   int img_n = s->img_n; // copy it into a local for later
+   stbi__uint32 x, y;
+   stbi__uint32 stride;       // bytes in an unfiltered row
+   stbi__uint32 width_bytes;  // bytes in a filtered row, without its filter byte
+   stbi__uint32 row_len;      // bytes in a filtered row, with its filter byte
+   int img_n, out_n, depth, color;
+} stbi__png_rows;
+
+static int stbi__png_rows_init(stbi__png_rows *r, stbi__png *a, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+{
+   r->x = x;
+   r->y = y;
+   r->img_n = a->s->img_n;
+   r->out_n = out_n;
+   r->depth = depth;
+   r->color = color;
+   r->stride = x*out_n*(depth == 16 ? 2 : 1);
+
+   STBI_ASSERT(out_n == r->img_n || out_n == r->img_n+1);
+   if (!stbi__mad3sizes_valid(r->img_n, x, depth, 7)) return stbi__err("too large", "Corrupt PNG");
+   r->width_bytes = (((r->img_n * x * depth) + 7) >> 3);
+   r->row_len = r->width_bytes + 1;
+   if (depth < 8 && r->width_bytes > x) return stbi__err("invalid width","Corrupt PNG");
+   return 1;
+}
 
+// unfilters the scanline at raw, which starts with its filter byte, into
+// cur; prior holds the previous scanline and is unused for the first one.
+// returns 0 on an invalid filter type
+static int stbi__png_unfilter_row(stbi__png_rows *r, stbi_uc *cur, stbi_uc *prior, stbi_uc *raw, int first)
+{
+   int bytes = (r->depth == 16? 2 : 1);
+   stbi__uint32 i, x = r->x;
+   stbi_uc *row = cur;
+   int k;
+   int img_n = r->img_n, out_n = r->out_n, depth = r->depth;
    int output_bytes = out_n*bytes;
    int filter_bytes = img_n*bytes;
    int width = x;
+   int filter = *raw++;
 
-   STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
-   a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
-   if (!a->out) return stbi__err("outofmem", "Out of memory");
-
-   if (!stbi__mad3sizes_valid(img_n, x, depth, 7)) return stbi__err("too large", "Corrupt PNG");
-   img_width_bytes = (((img_n * x * depth) + 7) >> 3);
-   img_len = (img_width_bytes + 1) * y;
-
-   // we used to check for exact match between raw_len and img_len on non-interlaced PNGs,
-   // but issue #276 reported a PNG in the wild that had extra data at the end (all zeros),
-   // so just check for raw_len < img_len always.
-   if (raw_len < img_len) return stbi__err("not enough pixels","Corrupt PNG");
-
-   for (j=0; j < y; ++j) {
-      stbi_uc *cur = a->out + stride*j;
-      stbi_uc *prior;
-      int filter = *raw++;
+   if (filter > 4)
+      return 0;
 
-      if (filter > 4)
-         return stbi__err("invalid filter","Corrupt PNG");
+   if (depth < 8) {
+      int skip = x*out_n - r->width_bytes;
+      cur += skip; // store output to the rightmost img_len bytes, so we can decode in place
+      prior += skip;
+      filter_bytes = 1;
+      width = r->width_bytes;
+   }
+
+   // if first row, use special filter that doesn't sample previous row
+   if (first) filter = first_row_filter[filter];
+
+   // handle first byte explicitly
+   for (k=0; k < filter_bytes; ++k) {
+      switch (filter) {
+         case STBI__F_none       : cur[k] = raw[k]; break;
+         case STBI__F_sub        : cur[k] = raw[k]; break;
+         case STBI__F_up         : cur[k] = STBI__BYTECAST(raw[k] + prior[k]); break;
+         case STBI__F_avg        : cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1)); break;
+         case STBI__F_paeth      : cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(0,prior[k],0)); break;
+         case STBI__F_avg_first  : cur[k] = raw[k]; break;
+         case STBI__F_paeth_first: cur[k] = raw[k]; break;
+      }
+   }
 
-      if (depth < 8) {
-         if (img_width_bytes > x) return stbi__err("invalid width","Corrupt PNG");
-         cur += x*out_n - img_width_bytes; // store output to the rightmost img_len bytes, so we can decode in place
-         filter_bytes = 1;
-         width = img_width_bytes;
+   if (depth == 8) {
+      if (img_n != out_n)
+         cur[img_n] = 255; // first pixel
+      raw += img_n;
+      cur += out_n;
+      prior += out_n;
+   } else if (depth == 16) {
+      if (img_n != out_n) {
+         cur[filter_bytes]   = 255; // first pixel top byte
+         cur[filter_bytes+1] = 255; // first pixel bottom byte
       }
-      prior = cur - stride; // bugfix: need to compute this after 'cur +=' computation above
-
-      // if first row, use special filter that doesn't sample previous row
-      if (j == 0) filter = first_row_filter[filter];
-
-      // handle first byte explicitly
-      for (k=0; k < filter_bytes; ++k) {
-         switch (filter) {
-            case STBI__F_none       : cur[k] = raw[k]; break;
-            case STBI__F_sub        : cur[k] = raw[k]; break;
-            case STBI__F_up         : cur[k] = STBI__BYTECAST(raw[k] + prior[k]); break;
-            case STBI__F_avg        : cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1)); break;
-            case STBI__F_paeth      : cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(0,prior[k],0)); break;
-            case STBI__F_avg_first  : cur[k] = raw[k]; break;
-            case STBI__F_paeth_first: cur[k] = raw[k]; break;
-         }
+      raw += filter_bytes;
+      cur += output_bytes;
+      prior += output_bytes;
+   } else {
+      raw += 1;
+      cur += 1;
+      prior += 1;
+   }
+
+   // this is a little gross, so that we don't switch per-pixel or per-component
+   if (depth < 8 || img_n == out_n) {
+      int nk = (width - 1)*filter_bytes;
+      #define STBI__CASE(f) \
+          case f:     \
+             for (k=0; k < nk; ++k)
+      switch (filter) {
+         // "none" filter turns into a memcpy here; make that explicit.
+         case STBI__F_none:         memcpy(cur, raw, nk); break;
+         STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]); } break;
+         STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
+         STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1)); } break;
+         STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],prior[k],prior[k-filter_bytes])); } break;
+         STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k-filter_bytes] >> 1)); } break;
+         STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],0,0)); } break;
+      }
+      #undef STBI__CASE
+   } else {
+      STBI_ASSERT(img_n+1 == out_n);
+      #define STBI__CASE(f) \
+          case f:     \
+             for (i=x-1; i >= 1; --i, cur[filter_bytes]=255,raw+=filter_bytes,cur+=output_bytes,prior+=output_bytes) \
+                for (k=0; k < filter_bytes; ++k)
+      switch (filter) {
+         STBI__CASE(STBI__F_none)         { cur[k] = raw[k]; } break;
+         STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k- output_bytes]); } break;
+         STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
+         STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k- output_bytes])>>1)); } break;
+         STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],prior[k],prior[k- output_bytes])); } break;
+         STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k- output_bytes] >> 1)); } break;
+         STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],0,0)); } break;
       }
+      #undef STBI__CASE
 
-      if (depth == 8) {
-         if (img_n != out_n)
-            cur[img_n] = 255; // first pixel
-         raw += img_n;
-         cur += out_n;
-         prior += out_n;
-      } else if (depth == 16) {
-         if (img_n != out_n) {
-            cur[filter_bytes]   = 255; // first pixel top byte
-            cur[filter_bytes+1] = 255; // first pixel bottom byte
+      // the loop above sets the high byte of the pixels' alpha, but for
+      // 16 bit png files we also need the low byte set. we'll do that here.
+      if (depth == 16) {
+         cur = row; // start at the beginning of the row again
+         for (i=0; i < x; ++i,cur+=output_bytes) {
+            cur[filter_bytes+1] = 255;
          }
-         raw += filter_bytes;
-         cur += output_bytes;
-         prior += output_bytes;
-      } else {
-         raw += 1;
-         cur += 1;
-         prior += 1;
       }
+   }
+   return 1;
+}
+
+// expands 1/2/4-bit samples to bytes and forces 16-bit samples from
+// big-endian to platform-native. this destroys what the next scanline's
+// filter reads, so it has to run a scanline behind the unfiltering
+static void stbi__png_finish_row(stbi__png_rows *r, stbi_uc *row)
+{
+   stbi__uint32 i, x = r->x;
+   int k;
+   int img_n = r->img_n, out_n = r->out_n, depth = r->depth;
 
-      // this is a little gross, so that we don't switch per-pixel or per-component
-      if (depth < 8 || img_n == out_n) {
-         int nk = (width - 1)*filter_bytes;
-         #define STBI__CASE(f) \
-             case f:     \
-                for (k=0; k < nk; ++k)
-         switch (filter) {
-            // "none" filter turns into a memcpy here; make that explicit.
-            case STBI__F_none:         memcpy(cur, raw, nk); break;
-            STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]); } break;
-            STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
-            STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1)); } break;
-            STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],prior[k],prior[k-filter_bytes])); } break;
-            STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k-filter_bytes] >> 1)); } break;
-            STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],0,0)); } break;
+   if (depth < 8) {
+      stbi_uc *cur = row;
+      stbi_uc *in  = row + x*out_n - r->width_bytes;
+      // unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
+      // png guarante byte alignment, if width is not multiple of 8/4/2 we'll decode dummy trailing data that will be skipped in the later loop
+      stbi_uc scale = (r->color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
+
+      // note that the final byte might overshoot and write more data than desired.
+      // we can allocate enough data that this never writes out of memory, but it
+      // could also overwrite the next scanline. can it overwrite non-empty data
+      // on the next scanline? yes, consider 1-pixel-wide scanlines with 1-bit-per-pixel.
+      // so we need to explicitly clamp the final ones
+
+      if (depth == 4) {
+         for (k=x*img_n; k >= 2; k-=2, ++in) {
+            *cur++ = scale * ((*in >> 4)       );
+            *cur++ = scale * ((*in     ) & 0x0f);
          }
-         #undef STBI__CASE
-         raw += nk;
-      } else {
-         STBI_ASSERT(img_n+1 == out_n);
-         #define STBI__CASE(f) \
-             case f:     \
-                for (i=x-1; i >= 1; --i, cur[filter_bytes]=255,raw+=filter_bytes,cur+=output_bytes,prior+=output_bytes) \
-                   for (k=0; k < filter_bytes; ++k)
-         switch (filter) {
-            STBI__CASE(STBI__F_none)         { cur[k] = raw[k]; } break;
-            STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k- output_bytes]); } break;
-            STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
-            STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k- output_bytes])>>1)); } break;
-            STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],prior[k],prior[k- output_bytes])); } break;
-            STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k- output_bytes] >> 1)); } break;
-            STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],0,0)); } break;
+         if (k > 0) *cur++ = scale * ((*in >> 4)       );
+      } else if (depth == 2) {
+         for (k=x*img_n; k >= 4; k-=4, ++in) {
+            *cur++ = scale * ((*in >> 6)       );
+            *cur++ = scale * ((*in >> 4) & 0x03);
+            *cur++ = scale * ((*in >> 2) & 0x03);
+            *cur++ = scale * ((*in     ) & 0x03);
          }
-         #undef STBI__CASE
-
-         // the loop above sets the high byte of the pixels' alpha, but for
-         // 16 bit png files we also need the low byte set. we'll do that here.
-         if (depth == 16) {
-            cur = a->out + stride*j; // start at the beginning of the row again
-            for (i=0; i < x; ++i,cur+=output_bytes) {
-               cur[filter_bytes+1] = 255;
-            }
+         if (k > 0) *cur++ = scale * ((*in >> 6)       );
+         if (k > 1) *cur++ = scale * ((*in >> 4) & 0x03);
+         if (k > 2) *cur++ = scale * ((*in >> 2) & 0x03);
+      } else if (depth == 1) {
+         for (k=x*img_n; k >= 8; k-=8, ++in) {
+            *cur++ = scale * ((*in >> 7)       );
+            *cur++ = scale * ((*in >> 6) & 0x01);
+            *cur++ = scale * ((*in >> 5) & 0x01);
+            *cur++ = scale * ((*in >> 4) & 0x01);
+            *cur++ = scale * ((*in >> 3) & 0x01);
+            *cur++ = scale * ((*in >> 2) & 0x01);
+            *cur++ = scale * ((*in >> 1) & 0x01);
+            *cur++ = scale * ((*in     ) & 0x01);
          }
+         if (k > 0) *cur++ = scale * ((*in >> 7)       );
+         if (k > 1) *cur++ = scale * ((*in >> 6) & 0x01);
+         if (k > 2) *cur++ = scale * ((*in >> 5) & 0x01);
+         if (k > 3) *cur++ = scale * ((*in >> 4) & 0x01);
+         if (k > 4) *cur++ = scale * ((*in >> 3) & 0x01);
+         if (k > 5) *cur++ = scale * ((*in >> 2) & 0x01);
+         if (k > 6) *cur++ = scale * ((*in >> 1) & 0x01);
       }
-   }
-
-   // we make a separate pass to expand bits to pixels; for performance,
-   // this could run two scanlines behind the above code, so it won't
-   // intefere with filtering but will still be in the cache.
-   if (depth < 8) {
-      for (j=0; j < y; ++j) {
-         stbi_uc *cur = a->out + stride*j;
-         stbi_uc *in  = a->out + stride*j + x*out_n - img_width_bytes;
-         // unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
-         // png guarante byte alignment, if width is not multiple of 8/4/2 we'll decode dummy trailing data that will be skipped in the later loop
-         stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
-
-         // note that the final byte might overshoot and write more data than desired.
-         // we can allocate enough data that this never writes out of memory, but it
-         // could also overwrite the next scanline. can it overwrite non-empty data
-         // on the next scanline? yes, consider 1-pixel-wide scanlines with 1-bit-per-pixel.
-         // so we need to explicitly clamp the final ones
-
-         if (depth == 4) {
-            for (k=x*img_n; k >= 2; k-=2, ++in) {
-               *cur++ = scale * ((*in >> 4)       );
-               *cur++ = scale * ((*in     ) & 0x0f);
+      if (img_n != out_n) {
+         int q;
+         // insert alpha = 255
+         cur = row;
+         if (img_n == 1) {
+            for (q=x-1; q >= 0; --q) {
+               cur[q*2+1] = 255;
+               cur[q*2+0] = cur[q];
             }
-            if (k > 0) *cur++ = scale * ((*in >> 4)       );
-         } else if (depth == 2) {
-            for (k=x*img_n; k >= 4; k-=4, ++in) {
-               *cur++ = scale * ((*in >> 6)       );
-               *cur++ = scale * ((*in >> 4) & 0x03);
-               *cur++ = scale * ((*in >> 2) & 0x03);
-               *cur++ = scale * ((*in     ) & 0x03);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 6)       );
-            if (k > 1) *cur++ = scale * ((*in >> 4) & 0x03);
-            if (k > 2) *cur++ = scale * ((*in >> 2) & 0x03);
-         } else if (depth == 1) {
-            for (k=x*img_n; k >= 8; k-=8, ++in) {
-               *cur++ = scale * ((*in >> 7)       );
-               *cur++ = scale * ((*in >> 6) & 0x01);
-               *cur++ = scale * ((*in >> 5) & 0x01);
-               *cur++ = scale * ((*in >> 4) & 0x01);
-               *cur++ = scale * ((*in >> 3) & 0x01);
-               *cur++ = scale * ((*in >> 2) & 0x01);
-               *cur++ = scale * ((*in >> 1) & 0x01);
-               *cur++ = scale * ((*in     ) & 0x01);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 7)       );
-            if (k > 1) *cur++ = scale * ((*in >> 6) & 0x01);
-            if (k > 2) *cur++ = scale * ((*in >> 5) & 0x01);
-            if (k > 3) *cur++ = scale * ((*in >> 4) & 0x01);
-            if (k > 4) *cur++ = scale * ((*in >> 3) & 0x01);
-            if (k > 5) *cur++ = scale * ((*in >> 2) & 0x01);
-            if (k > 6) *cur++ = scale * ((*in >> 1) & 0x01);
-         }
-         if (img_n != out_n) {
-            int q;
-            // insert alpha = 255
-            cur = a->out + stride*j;
-            if (img_n == 1) {
-               for (q=x-1; q >= 0; --q) {
-                  cur[q*2+1] = 255;
-                  cur[q*2+0] = cur[q];
-               }
-            } else {
-               STBI_ASSERT(img_n == 3);
-               for (q=x-1; q >= 0; --q) {
-                  cur[q*4+3] = 255;
-                  cur[q*4+2] = cur[q*3+2];
-                  cur[q*4+1] = cur[q*3+1];
-                  cur[q*4+0] = cur[q*3+0];
-               }
+         } else {
+            STBI_ASSERT(img_n == 3);
+            for (q=x-1; q >= 0; --q) {
+               cur[q*4+3] = 255;
+               cur[q*4+2] = cur[q*3+2];
+               cur[q*4+1] = cur[q*3+1];
+               cur[q*4+0] = cur[q*3+0];
             }
          }
       }
    } else if (depth == 16) {
-      // force the image data from big-endian to platform-native.
-      // this is done in a separate pass due to the decoding relying
-      // on the data being untouched, but could probably be done
-      // per-line during decode if care is taken.
-      stbi_uc *cur = a->out;
+      stbi_uc *cur = row;
       stbi__uint16 *cur16 = (stbi__uint16*)cur;
 
-      for(i=0; i < x*y*out_n; ++i,cur16++,cur+=2) {
+      for(i=0; i < x*out_n; ++i,cur16++,cur+=2) {
          *cur16 = (cur[0] << 8) | cur[1];
       }
    }
+}
+
+// create the png data from post-deflated data
+static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+{
+   stbi__png_rows r;
+   stbi__uint32 j;
+
+   if (!stbi__png_rows_init(&r, a, out_n, x, y, depth, color)) return 0;
+   a->out = (stbi_uc *) stbi__malloc_mad3(x, y, out_n*(depth == 16 ? 2 : 1), 0);
+   if (!a->out) return stbi__err("outofmem", "Out of memory");
+
+   // we used to check for exact match between raw_len and img_len on non-interlaced PNGs,
+   // but issue #276 reported a PNG in the wild that had extra data at the end (all zeros),
+   // so just check for raw_len < img_len always.
+   if (raw_len < r.row_len * y) return stbi__err("not enough pixels","Corrupt PNG");
+
+   for (j=0; j < y; ++j) {
+      stbi_uc *cur = a->out + r.stride*j;
+      if (!stbi__png_unfilter_row(&r, cur, j ? cur - r.stride : cur, raw + r.row_len*j, j == 0))
+         return stbi__err("invalid filter","Corrupt PNG");
+      if (j) stbi__png_finish_row(&r, cur - r.stride);
+   }
+   stbi__png_finish_row(&r, a->out + r.stride*(y-1));
 
    return 1;
 }
@@ -4792,11 +5895,9 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
    return 1;
 }
 
-static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
+static int stbi__compute_transparency(stbi_uc *p, stbi__uint32 pixel_count, stbi_uc tc[3], int out_n)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi_uc *p = z->out;
+   stbi__uint32 i;
 
    // compute color-based transparency, assuming we've
    // already got 255 as the alpha value in the output
@@ -4817,11 +5918,9 @@ static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
    return 1;
 }
 
-static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int out_n)
+static int stbi__compute_transparency16(stbi__uint16 *p, stbi__uint32 pixel_count, stbi__uint16 tc[3], int out_n)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi__uint16 *p = (stbi__uint16*) z->out;
+   stbi__uint32 i;
 
    // compute color-based transparency, assuming we've
    // already got 65535 as the alpha value in the output
@@ -4842,17 +5941,9 @@ static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int ou
    return 1;
 }
 
-static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
+static void stbi__expand_palette_row(stbi_uc *p, stbi_uc *orig, stbi__uint32 pixel_count, stbi_uc *palette, int pal_img_n)
 {
-   stbi__uint32 i, pixel_count = a->s->img_x * a->s->img_y;
-   stbi_uc *p, *temp_out, *orig = a->out;
-
-   p = (stbi_uc *) stbi__malloc_mad2(pixel_count, pal_img_n, 0);
-   if (p == NULL) return stbi__err("outofmem", "Out of memory");
-
-   // between here and free(out) below, exitting would leak
-   temp_out = p;
-
+   stbi__uint32 i;
    if (pal_img_n == 3) {
       for (i=0; i < pixel_count; ++i) {
          int n = orig[i]*4;
@@ -4871,6 +5962,17 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
          p += 4;
       }
    }
+}
+
+static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
+{
+   stbi__uint32 pixel_count = a->s->img_x * a->s->img_y;
+   stbi_uc *temp_out;
+
+   temp_out = (stbi_uc *) stbi__malloc_mad2(pixel_count, pal_img_n, 0);
+   if (temp_out == NULL) return stbi__err("outofmem", "Out of memory");
+
+   stbi__expand_palette_row(temp_out, a->out, pixel_count, palette, pal_img_n);
    STBI_FREE(a->out);
    a->out = temp_out;
 
@@ -4892,13 +5994,11 @@ STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert)
    stbi__de_iphone_flag = flag_true_if_should_convert;
 }
 
-static void stbi__de_iphone(stbi__png *z)
+static void stbi__de_iphone(stbi_uc *p, stbi__uint32 pixel_count, int out_n)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi_uc *p = z->out;
+   stbi__uint32 i;
 
-   if (s->img_out_n == 3) {  // convert bgr to rgb
+   if (out_n == 3) {  // convert bgr to rgb
       for (i=0; i < pixel_count; ++i) {
          stbi_uc t = p[0];
          p[0] = p[2];
@@ -4906,7 +6006,7 @@ static void stbi__de_iphone(stbi__png *z)
          p += 3;
       }
    } else {
-      STBI_ASSERT(s->img_out_n == 4);
+      STBI_ASSERT(out_n == 4);
       if (stbi__unpremultiply_on_load) {
          // convert bgr to rgb and unpremultiply
          for (i=0; i < pixel_count; ++i) {
@@ -4935,8 +6035,352 @@ static void stbi__de_iphone(stbi__png *z)
    }
 }
 
+// non-interlaced images are decoded as a stream: IDAT is inflated into a
+// small sliding window and every scanline is unfiltered and converted to
+// the output format as soon as it is complete, so the image is never held
+// in its filtered form. IDAT is read from the file a piece at a time as the
+// inflater needs it. with a parallel_for, a second task unfilters while the
+// first one inflates
 #define STBI__PNG_TYPE(a,b,c,d)  (((unsigned) (a) << 24) + ((unsigned) (b) << 16) + ((unsigned) (c) << 8) + (unsigned) (d))
 
+#define STBI__PNG_WINDOW         32768     // deflate history kept when sliding
+#define STBI__PNG_STEP           32768     // bytes inflated between hand-offs
+#define STBI__PNG_PIPELINE_MIN   (1 << 20) // filtered bytes worth two tasks
+#define STBI__PNG_INPUT          65536     // IDAT bytes read at a time
+
+#if defined(__GNUC__) && (defined(__unix__) || defined(__APPLE__)) && !defined(STBI_NO_PNG_PIPELINE)
+#define STBI__PNG_PIPELINE
+#include <sched.h>
+#define stbi__png_acquire(p)    __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define stbi__png_release(p,v)  __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#else
+#define stbi__png_acquire(p)    (*(p))
+#define stbi__png_release(p,v)  (*(p) = (v))
+#endif
+
+enum
+{
+   STBI__PNG_UNOWNED,   // nobody unfilters yet
+   STBI__PNG_CONSUMER,  // the second task unfilters, the inflater waits for it
+   STBI__PNG_PRODUCER   // the inflater unfilters as it goes
+};
+
+typedef struct
+{
+   stbi__png *a;
+   stbi__png_rows r;
+   stbi__zbuf z;
+   int parse_header;
+
+   stbi_uc *buf;               // sliding window the inflater writes to
+   stbi__uint32 cap;           // window size
+   stbi__uint32 base;          // stream offset of buf[0]
+   stbi__uint32 produced;      // stream bytes inflated so far
+   stbi__uint32 row;           // next scanline to unfilter
+
+   stbi_uc *rowbuf, *tmp;      // two scanlines and a palette row, when not unfiltering in place
+   stbi__uint32 out_stride;    // bytes in an output row
+   int direct;                 // unfilter straight into the output
+   stbi_uc *palette;
+   int pal_n;                  // palette entries expand to this many channels
+   int conv_n;                 // converted to this many channels, or 0
+   int has_trans, iphone, bgr;
+   stbi_uc *tc;
+   stbi__uint16 *tc16;
+
+   stbi_row_callback *row_fn;  // rows go here instead of to the output
+   void *row_user;
+   int row_bytes;              // bytes per channel the callback wants
+   stbi_uc *line;              // a row in the callback's format
+
+   stbi_uc *in;                // input window, see stbi__png_zrefill
+   stbi__uint32 in_left;       // bytes left in the current IDAT chunk
+   int in_done;                // no IDAT chunks left
+   int in_short;               // the file ended inside them
+
+   int owner, started, done;   // pipeline hand-off, see stbi__png_stream_task
+   int failed, bad_filter;
+   const char *reason;
+} stbi__png_stream;
+
+// turns an unfiltered scanline into output row j, or hands it to the row
+// callback
+static void stbi__png_stream_emit(stbi__png_stream *st, stbi_uc *row, stbi__uint32 j)
+{
+   stbi__png_rows *r = &st->r;
+   stbi_uc *dest = st->row_fn ? st->line : st->a->out + (size_t) st->out_stride * j;
+   int n = r->out_n;
+   stbi__png_finish_row(r, row);
+   if (st->has_trans) {
+      if (r->depth == 16)
+         stbi__compute_transparency16((stbi__uint16 *) row, r->x, st->tc16, n);
+      else
+         stbi__compute_transparency(row, r->x, st->tc, n);
+   }
+   if (st->iphone)
+      stbi__de_iphone(row, r->x, n);
+   if (st->pal_n) {
+      stbi_uc *p = st->conv_n ? st->tmp : dest;
+      stbi__expand_palette_row(p, row, r->x, st->palette, st->pal_n);
+      row = p;
+      n = st->pal_n;
+   }
+   if (st->conv_n) {
+      if (r->depth == 16)
+         stbi__convert_row16((stbi__uint16 *) row, (stbi__uint16 *) dest, n, st->conv_n, r->x);
+      else
+         stbi__convert_row(row, dest, n, st->conv_n, r->x);
+      row = dest;
+      n = st->conv_n;
+   }
+   if (st->row_fn && st->row_bytes != (r->depth == 16 ? 2 : 1)) {
+      stbi__uint32 i, count = r->x * n;
+      if (st->row_bytes == 1) {
+         stbi__uint16 *p16 = (stbi__uint16 *) row;
+         for (i=0; i < count; ++i)
+            dest[i] = (stbi_uc) (p16[i] >> 8);
+      } else {
+         // backwards, so that it also works in place
+         stbi__uint16 *d16 = (stbi__uint16 *) dest;
+         for (i=count; i-- > 0; )
+            d16[i] = (stbi__uint16) (row[i] * 257);
+      }
+      row = dest;
+   }
+   if (st->bgr)
+      stbi__swap_rb(row, r->x, n);
+   if (st->row_fn)
+      st->row_fn(st->row_user, (int) j, row);
+}
+
+// unfilters the next scanline, which must be in the window
+static int stbi__png_stream_row(stbi__png_stream *st)
+{
+   stbi__png_rows *r = &st->r;
+   stbi__uint32 j = st->row;
+   stbi_uc *raw = st->buf + (j * r->row_len - st->base);
+   stbi_uc *cur, *prior;
+   if (st->direct) {
+      cur = st->a->out + (size_t) r->stride * j;
+      prior = j ? cur - r->stride : cur;
+   } else {
+      cur = st->rowbuf + (size_t) r->stride * (j & 1);
+      prior = st->rowbuf + (size_t) r->stride * (~j & 1);
+   }
+   if (!stbi__png_unfilter_row(r, cur, prior, raw, j == 0)) return 0;
+   // the previous scanline is done being read as prior
+   if (j) stbi__png_stream_emit(st, prior, j - 1);
+   if (j + 1 == r->y) stbi__png_stream_emit(st, cur, j);
+   return 1;
+}
+
+// scanlines complete in the first `produced` bytes of the stream
+static stbi__uint32 stbi__png_stream_avail(stbi__png_stream *st, stbi__uint32 produced)
+{
+   stbi__uint32 n = produced / st->r.row_len;
+   return n < st->r.y ? n : st->r.y;
+}
+
+// unfilters every complete scanline, on this thread or by waiting for the
+// second task to get through them
+static int stbi__png_stream_drain(stbi__png_stream *st)
+{
+   stbi__uint32 avail = stbi__png_stream_avail(st, st->produced);
+   #ifdef STBI__PNG_PIPELINE
+   int owner = STBI__PNG_UNOWNED;
+   if (!__atomic_compare_exchange_n(&st->owner, &owner, STBI__PNG_PRODUCER, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) && owner == STBI__PNG_CONSUMER) {
+      while (stbi__png_acquire(&st->row) < avail && !stbi__png_acquire(&st->bad_filter))
+         sched_yield();
+      return !stbi__png_acquire(&st->bad_filter);
+   }
+   #endif
+   while (st->row < avail) {
+      if (!stbi__png_stream_row(st)) {
+         st->bad_filter = 1;
+         return 0;
+      }
+      ++st->row;
+   }
+   return 1;
+}
+
+static int stbi__png_zflush(stbi__zbuf *z, int n)
+{
+   stbi__png_stream *st = (stbi__png_stream *) z->zuser;
+   stbi__uint32 used = (stbi__uint32) (z->zout - (char *) st->buf);
+   stbi__uint32 need = n > STBI__PNG_STEP ? n : STBI__PNG_STEP;
+
+   if (stbi__png_acquire(&st->bad_filter)) return 0;
+   stbi__png_release(&st->produced, st->base + used);
+   // unfilter while the data is still in cache, unless the second task
+   // may take it over; then only catch up before the window slides
+   if (stbi__png_acquire(&st->owner) == STBI__PNG_PRODUCER || st->cap - used < need)
+      if (!stbi__png_stream_drain(st)) return 0;
+   if (st->cap - used < need) {
+      // keep the deflate window and the scanline that is still incomplete
+      stbi__uint32 from = used > STBI__PNG_WINDOW ? used - STBI__PNG_WINDOW : 0;
+      stbi__uint32 row = stbi__png_acquire(&st->row);
+      if (row < st->r.y && row * st->r.row_len - st->base < from)
+         from = row * st->r.row_len - st->base;
+      memmove(st->buf, st->buf + from, used - from);
+      st->base += from;
+      used -= from;
+      if (st->cap - used < need) {
+         stbi_uc *p = (stbi_uc *) STBI_REALLOC_SIZED(st->buf, st->cap, used + need);
+         if (p == NULL) return stbi__err("outofmem", "Out of memory");
+         st->buf = p;
+         st->cap = used + need;
+      }
+      z->zout_start = (char *) st->buf;
+      z->zout = (char *) st->buf + used;
+   }
+   z->zout_end = z->zout + need;
+   return 1;
+}
+
+// reads the next piece of IDAT into the input window, behind the last 8
+// bytes consumed. chunks after the IDATs are left unread, except for the
+// header of the first one
+static int stbi__png_zrefill(stbi__zbuf *z)
+{
+   stbi__png_stream *st = (stbi__png_stream *) z->zuser;
+   stbi__context *s = st->a->s;
+   stbi__uint32 keep = (stbi__uint32) (z->zbuffer - st->in), n = 0;
+   if (keep > 8) keep = 8;
+   memmove(st->in, z->zbuffer - keep, keep);
+   while (!n && !st->in_done) {
+      if (st->in_left == 0) {
+         stbi__pngchunk c;
+         stbi__get32be(s); // CRC of the previous chunk
+         c = stbi__get_chunk_header(s);
+         if (c.type != STBI__PNG_TYPE('I','D','A','T')) st->in_done = 1;
+         st->in_left = st->in_done ? 0 : c.length;
+         continue;
+      }
+      n = st->in_left < STBI__PNG_INPUT ? st->in_left : STBI__PNG_INPUT;
+      if (!stbi__getn(s, st->in + keep, n)) {
+         st->in_done = st->in_short = 1;
+         return 0;
+      }
+      st->in_left -= n;
+   }
+   z->zbuffer = st->in + keep;
+   z->zbuffer_end = z->zbuffer + n;
+   return n != 0;
+}
+
+static int stbi__png_stream_inflate(stbi__png_stream *st)
+{
+   if (!stbi__parse_zlib(&st->z, st->parse_header)) return 0;
+   stbi__png_release(&st->produced, st->base + (stbi__uint32) (st->z.zout - (char *) st->buf));
+   return stbi__png_stream_drain(st);
+}
+
+#ifdef STBI__PNG_PIPELINE
+// task 0 inflates, task 1 unfilters behind it. the unfiltering is claimed
+// by whichever side gets to it first, and task 1 only takes it while task 0
+// is running: both may run one after the other on the same thread
+static void stbi__png_stream_task(void *arg, int i)
+{
+   stbi__png_stream *st = (stbi__png_stream *) arg;
+   int owner = STBI__PNG_UNOWNED;
+   if (i == 0) {
+      stbi__png_release(&st->started, 1);
+      if (!stbi__png_stream_inflate(st)) {
+         st->failed = 1;
+         st->reason = stbi__g_failure_reason;
+      }
+      stbi__png_release(&st->done, 1);
+      return;
+   }
+   if (!stbi__png_acquire(&st->started)) {
+      __atomic_compare_exchange_n(&st->owner, &owner, STBI__PNG_PRODUCER, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+      return;
+   }
+   if (!__atomic_compare_exchange_n(&st->owner, &owner, STBI__PNG_CONSUMER, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      return;
+   while (st->row < st->r.y) {
+      int done = stbi__png_acquire(&st->done);
+      if (st->row < stbi__png_stream_avail(st, stbi__png_acquire(&st->produced))) {
+         if (!stbi__png_stream_row(st)) {
+            stbi__png_release(&st->bad_filter, 1);
+            return;
+         }
+         stbi__png_release(&st->row, st->row + 1);
+      } else if (done) {
+         return;
+      } else {
+         sched_yield();
+      }
+   }
+}
+#endif
+
+// decodes the image data, starting with an IDAT chunk of idat_len bytes
+// whose header was just read
+static int stbi__png_stream_decode(stbi__png_stream *st, stbi__uint32 idat_len)
+{
+   stbi__png *a = st->a;
+   stbi__png_rows *r = &st->r;
+   stbi__uint32 total = r->row_len * r->y;
+   int ok;
+
+   if (!st->row_fn) {
+      a->out = (stbi_uc *) stbi__malloc_mad2(r->y, st->out_stride, 0);
+      if (!a->out) return stbi__err("outofmem", "Out of memory");
+   }
+   // room for the window, a scanline and a stored block, unless the whole
+   // image is smaller than that
+   st->cap = (r->row_len > STBI__PNG_WINDOW ? r->row_len : STBI__PNG_WINDOW) + 65536 + 4 * STBI__PNG_STEP;
+   if (st->cap > total + STBI__PNG_STEP) st->cap = total + STBI__PNG_STEP;
+   st->buf = (stbi_uc *) stbi__malloc(st->cap);
+   st->in = (stbi_uc *) stbi__malloc(8 + STBI__PNG_INPUT);
+   // two scanlines, a palette row and a row for the callback
+   st->rowbuf = st->direct ? NULL : (stbi_uc *) stbi__malloc_mad3(2, r->stride, 1, r->x * (st->row_fn ? 12 : 4));
+   if (!st->buf || !st->in || (!st->direct && !st->rowbuf)) {
+      STBI_FREE(st->buf);
+      STBI_FREE(st->in);
+      STBI_FREE(st->rowbuf);
+      return stbi__err("outofmem", "Out of memory");
+   }
+   st->tmp = st->direct ? NULL : st->rowbuf + 2 * r->stride;
+   st->line = st->row_fn ? st->tmp + r->x * 4 : NULL;
+
+   st->z.zbuffer = st->z.zbuffer_end = st->in;
+   st->z.zrefill = stbi__png_zrefill;
+   st->in_left = idat_len;
+   st->in_done = st->in_short = 0;
+   st->z.zout_start = (char *) st->buf;
+   st->z.zout = (char *) st->buf;
+   st->z.zout_end = (char *) st->buf + STBI__PNG_STEP;
+   st->z.z_expandable = 0;
+   st->z.zflush = stbi__png_zflush;
+   st->z.zuser = st;
+   st->base = st->produced = st->row = 0;
+   st->owner = STBI__PNG_PRODUCER;
+   st->started = st->done = st->failed = st->bad_filter = 0;
+   st->reason = NULL;
+
+   #ifdef STBI__PNG_PIPELINE
+   if (stbi__parallel_for_fn && total >= STBI__PNG_PIPELINE_MIN) {
+      st->owner = STBI__PNG_UNOWNED;
+      stbi__parallel_for_fn(stbi__png_stream_task, st, 2, stbi__parallel_for_user);
+      ok = !st->failed;
+      if (!ok) stbi__g_failure_reason = st->reason;
+   } else
+   #endif
+   ok = stbi__png_stream_inflate(st);
+
+   STBI_FREE(st->buf);
+   STBI_FREE(st->in);
+   STBI_FREE(st->rowbuf);
+   if (st->bad_filter) return stbi__err("invalid filter","Corrupt PNG");
+   if (st->in_short) return stbi__err("outofdata","Corrupt PNG");
+   if (!ok) return 0;
+   if (st->row < r->y) return stbi__err("not enough pixels","Corrupt PNG");
+   return 1;
+}
+
 static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 {
    stbi_uc palette[1024], pal_img_n=0;
@@ -5033,6 +6477,51 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (pal_img_n && !pal_len) return stbi__err("no PLTE","Corrupt PNG");
             if (scan == STBI__SCAN_header) { s->img_n = pal_img_n; return 1; }
+            if (z->row_fn && interlace) return stbi__err("interlaced","PNG not supported: no rows from interlaced images");
+            if (!interlace) {
+               // every scanline goes all the way to the output format in one
+               // go, straight from the IDAT chunks
+               stbi__png_stream st;
+               int bytes = (z->depth == 16 ? 2 : 1), n;
+               if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
+                  s->img_out_n = s->img_n+1;
+               else
+                  s->img_out_n = s->img_n;
+               n = s->img_out_n;
+               if (!stbi__png_rows_init(&st.r, z, s->img_out_n, s->img_x, s->img_y, z->depth, color)) return 0;
+               st.a = z;
+               st.parse_header = !is_iphone;
+               st.has_trans = has_trans;
+               st.tc = tc;
+               st.tc16 = tc16;
+               st.iphone = is_iphone && stbi__de_iphone_flag && s->img_out_n > 2;
+               st.palette = palette;
+               st.pal_n = 0;
+               if (pal_img_n) n = st.pal_n = (req_comp >= 3 ? req_comp : pal_img_n);
+               st.conv_n = (req_comp && req_comp != n) ? req_comp : 0;
+               if (st.conv_n) n = st.conv_n;
+               st.row_fn = z->row_fn;
+               st.row_user = z->row_user;
+               st.row_bytes = z->row_bits / 8;
+               if (st.row_fn) bytes = st.row_bytes;
+               st.bgr = z->bgr && bytes == 1 && n >= 3;
+               st.direct = !st.pal_n && !st.conv_n && !st.row_fn;
+               st.out_stride = s->img_x * n * bytes;
+               if (pal_img_n)
+                  s->img_n = pal_img_n;
+               else if (has_trans)
+                  ++s->img_n;
+               if (st.row_fn) {
+                  *z->row_x = s->img_x;
+                  *z->row_y = s->img_y;
+                  if (z->row_comp) *z->row_comp = s->img_n;
+               }
+               if (!stbi__png_stream_decode(&st, c.length)) return 0;
+               z->bgr = st.bgr;
+               s->img_out_n = n;
+               // the chunks after the image data aren't needed
+               return 1;
+            }
             if ((int)(ioff + c.length) < (int)ioff) return 0;
             if (ioff + c.length > idata_limit) {
                stbi__uint32 idata_limit_old = idata_limit;
@@ -5054,26 +6543,27 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (scan != STBI__SCAN_load) return 1;
             if (z->idata == NULL) return stbi__err("no IDAT","Corrupt PNG");
+            if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
+               s->img_out_n = s->img_n+1;
+            else
+               s->img_out_n = s->img_n;
+            z->bgr = 0; // interlaced images are swapped in postprocessing
             // initial guess for decoded data size to avoid unnecessary reallocs
             bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
             raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
             z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
             if (z->expanded == NULL) return 0; // zlib should set error
             STBI_FREE(z->idata); z->idata = NULL;
-            if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
-               s->img_out_n = s->img_n+1;
-            else
-               s->img_out_n = s->img_n;
             if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
             if (has_trans) {
                if (z->depth == 16) {
-                  if (!stbi__compute_transparency16(z, tc16, s->img_out_n)) return 0;
+                  if (!stbi__compute_transparency16((stbi__uint16 *) z->out, s->img_x * s->img_y, tc16, s->img_out_n)) return 0;
                } else {
-                  if (!stbi__compute_transparency(z, tc, s->img_out_n)) return 0;
+                  if (!stbi__compute_transparency(z->out, s->img_x * s->img_y, tc, s->img_out_n)) return 0;
                }
             }
             if (is_iphone && stbi__de_iphone_flag && s->img_out_n > 2)
-               stbi__de_iphone(z);
+               stbi__de_iphone(z->out, s->img_x * s->img_y, s->img_out_n);
             if (pal_img_n) {
                // pal_img_n == 3 or 4
                s->img_n = pal_img_n; // record the actual colors we had
@@ -5126,6 +6616,7 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
          return stbi__errpuc("bad bits_per_channel", "PNG not supported: unsupported color depth");
       result = p->out;
       p->out = NULL;
+      if (p->bgr) ri->channel_order = STBI_ORDER_BGR;
       if (req_comp && req_comp != p->s->img_out_n) {
          if (ri->bits_per_channel == 8)
             result = stbi__convert_format((unsigned char *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
@@ -5145,13 +6636,34 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
    return result;
 }
 
-static void *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
+static void *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
 {
    stbi__png p;
    p.s = s;
+   p.bgr = stbi__bgr_on_load && bpc == 8; // only 8-bit results are swapped afterwards
+   p.row_fn = NULL;
    return stbi__do_png(&p, x,y,comp,req_comp, ri);
 }
 
+static int stbi__png_load_rows(stbi__context *s, int *x, int *y, int *comp, int req_comp, int bits, stbi_row_callback *row, void *row_user)
+{
+   stbi__png p;
+   int ok;
+   p.s = s;
+   p.bgr = stbi__bgr_on_load && bits == 8;
+   p.row_fn = row;
+   p.row_user = row_user;
+   p.row_bits = bits;
+   p.row_x = x;
+   p.row_y = y;
+   p.row_comp = comp;
+   ok = stbi__parse_png_file(&p, STBI__SCAN_load, req_comp);
+   STBI_FREE(p.out);
+   STBI_FREE(p.expanded);
+   STBI_FREE(p.idata);
+   return ok;
+}
+
 static int stbi__png_test(stbi__context *s)
 {
    int r;
@@ -7406,6 +8918,219 @@ static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp)
 }
 #endif
 
+// *************************************************************************************************
+// QOI loader
+//
+// "Quite OK Image" format, see https://qoiformat.org/qoi-specification.pdf
+// Pixels are decoded straight into the output channel order (RGB or BGR, with
+// or without alpha) so nothing needs to be swizzled afterwards.
+
+#ifndef STBI_NO_QOI
+
+#define STBI__QOI_MAGIC  0x716f6966  // "qoif"
+
+static int stbi__qoi_test(stbi__context *s)
+{
+   int r = stbi__get32be(s) == STBI__QOI_MAGIC;
+   stbi__rewind(s);
+   return r;
+}
+
+static int stbi__qoi_info(stbi__context *s, int *x, int *y, int *comp)
+{
+   stbi__uint32 w, h;
+   int n;
+   if (stbi__get32be(s) != STBI__QOI_MAGIC) {
+      stbi__rewind(s);
+      return 0;
+   }
+   w = stbi__get32be(s);
+   h = stbi__get32be(s);
+   n = stbi__get8(s);
+   stbi__get8(s); // colorspace, sRGB or linear; shown as is either way
+   if (w == 0 || h == 0 || w > INT_MAX || h > INT_MAX || (n != 3 && n != 4)) {
+      stbi__rewind(s);
+      return 0;
+   }
+   if (x) *x = (int) w;
+   if (y) *y = (int) h;
+   if (comp) *comp = n;
+   return 1;
+}
+
+typedef struct
+{
+   stbi_row_callback *fn;
+   void *user;
+   int out_n;             // channels handed to fn
+   stbi_uc *conv;         // row converted to out_n channels
+   stbi__uint16 *wide;    // row widened to 16 bits
+} stbi__qoi_rows;
+
+#define STBI__QOI_INPUT  65536   // bytes read from callbacks at a time
+
+// makes s->img_buffer to s->img_buffer_end the next input: the rest of the
+// context buffer first, then STBI__QOI_INPUT bytes at a time read straight
+// into buf. returns 0 once out of data
+static int stbi__qoi_refill(stbi__context *s, stbi_uc *buf)
+{
+   int n;
+   if (s->img_buffer < s->img_buffer_end) return 1;
+   n = buf && s->read_from_callbacks ? (s->io.read)(s->io_user_data, (char *) buf, STBI__QOI_INPUT) : 0;
+   if (n <= 0) return 0;
+   s->img_buffer = buf;
+   s->img_buffer_end = buf + n;
+   return 1;
+}
+
+// decodes the pixel data following the header into out, with out_n (3 or 4)
+// channels. with rows set, out holds a single row and each row is handed
+// over once decoded instead
+static int stbi__qoi_decode(stbi__context *s, stbi_uc *out, int out_n, int bgr, stbi__qoi_rows *rows)
+{
+   // the pixel lives in registers rather than a byte array, as writing
+   // single channels and reading the whole pixel back stalls the CPU
+   stbi__uint32 index[64];
+   stbi_uc *buf = NULL, *in = NULL, *end = NULL;
+   int r = 0, g = 0, b = 0, a = 255;
+   int ri = bgr ? 2 : 0, bi = 2 - ri;
+   int w = s->img_x, h = s->img_y, x, y, run = 0, more = 1;
+   size_t stride = rows ? 0 : (size_t) w * out_n;
+   // the input pointers stay local so that they can be kept in registers
+   #define STBI__QOI_GET()  (in < end ? *in++ : !stbi__qoi_refill(s, buf) ? (more = 0) : \
+                             (in = s->img_buffer, end = s->img_buffer = s->img_buffer_end, *in++))
+   if (s->io.read) {
+      buf = (stbi_uc *) stbi__malloc(STBI__QOI_INPUT);
+      if (!buf) return stbi__err("outofmem", "Out of memory");
+   }
+   memset(index, 0, sizeof(index));
+   for (y=0; y < h; ++y) {
+      stbi_uc *o = out + stride * y;
+      for (x=0; x < w; ++x, o += out_n) {
+         if (run) {
+            --run;
+         } else {
+            int op = STBI__QOI_GET();
+            if (op < 0x40) { // index
+               stbi__uint32 v = index[op];
+               r = v & 255;
+               g = (v >> 8) & 255;
+               b = (v >> 16) & 255;
+               a = v >> 24;
+            } else {
+               if (op < 0x80) { // small difference
+                  r = (r + ((op >> 4) & 3) - 2) & 255;
+                  g = (g + ((op >> 2) & 3) - 2) & 255;
+                  b = (b + ( op       & 3) - 2) & 255;
+               } else if (op < 0xc0) { // luma difference
+                  int op2 = STBI__QOI_GET();
+                  int dg = op - 0x80 - 32;
+                  r = (r + dg - 8 + (op2 >> 4)) & 255;
+                  g = (g + dg) & 255;
+                  b = (b + dg - 8 + (op2 & 15)) & 255;
+               } else if (op < 0xfe) { // run of the previous pixel
+                  run = op & 0x3f;
+               } else {
+                  r = STBI__QOI_GET();
+                  g = STBI__QOI_GET();
+                  b = STBI__QOI_GET();
+                  if (op == 0xff) a = STBI__QOI_GET();
+               }
+               index[(r*3 + g*5 + b*7 + a*11) & 63] = (stbi__uint32) r | g << 8 | b << 16 | (stbi__uint32) a << 24;
+            }
+         }
+         o[ri] = (stbi_uc) r;
+         o[1]  = (stbi_uc) g;
+         o[bi] = (stbi_uc) b;
+         if (out_n == 4) o[3] = (stbi_uc) a;
+      }
+      if (!more) break;
+      if (rows) {
+         const void *row = out;
+         if (rows->conv) {
+            stbi__convert_row(out, rows->conv, out_n, rows->out_n, w);
+            row = rows->conv;
+         }
+         if (rows->wide) {
+            const stbi_uc *src = (const stbi_uc *) row;
+            for (x=0; x < w * rows->out_n; ++x)
+               rows->wide[x] = (stbi__uint16) (src[x] * 257);
+            row = rows->wide;
+         }
+         rows->fn(rows->user, y, row);
+      }
+   }
+   #undef STBI__QOI_GET
+   STBI_FREE(buf);
+   // the 8 byte end marker follows the last pixel, so running out before
+   // means the data was cut short
+   if (!more) return stbi__err("outofdata", "Corrupt QOI");
+   return 1;
+}
+
+static void *stbi__qoi_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
+{
+   stbi_uc *out;
+   int n, out_n, bgr;
+   if (!stbi__qoi_info(s, (int *) &s->img_x, (int *) &s->img_y, &n))
+      return stbi__errpuc("bad header", "Corrupt QOI");
+   if (s->img_y > STBI_MAX_DIMENSIONS) return stbi__errpuc("too large","Very large image (corrupt?)");
+   if (s->img_x > STBI_MAX_DIMENSIONS) return stbi__errpuc("too large","Very large image (corrupt?)");
+   s->img_n = n;
+   out_n = req_comp >= 3 ? req_comp : n;
+   bgr = stbi__bgr_on_load && bpc == 8 && req_comp != 1 && req_comp != 2; // only 8-bit results are swapped afterwards
+
+   if (!stbi__mad3sizes_valid(out_n, s->img_x, s->img_y, 0))
+      return stbi__errpuc("too large", "QOI too large");
+   out = (stbi_uc *) stbi__malloc_mad3(out_n, s->img_x, s->img_y, 0);
+   if (!out) return stbi__errpuc("outofmem", "Out of memory");
+   if (!stbi__qoi_decode(s, out, out_n, bgr, NULL)) {
+      STBI_FREE(out);
+      return NULL;
+   }
+   if (bgr) ri->channel_order = STBI_ORDER_BGR;
+   if (req_comp && req_comp != out_n) {
+      out = stbi__convert_format(out, out_n, req_comp, s->img_x, s->img_y);
+      if (out == NULL) return out; // stbi__convert_format frees input on failure
+   }
+   *x = s->img_x;
+   *y = s->img_y;
+   if (comp) *comp = n;
+   return out;
+}
+
+static int stbi__qoi_load_rows(stbi__context *s, int *x, int *y, int *comp, int req_comp, int bits, stbi_row_callback *row, void *row_user)
+{
+   stbi__qoi_rows rows;
+   stbi_uc *line;
+   int n, ok;
+   if (!stbi__qoi_info(s, x, y, &n)) return stbi__err("bad header", "Corrupt QOI");
+   if (comp) *comp = n;
+   if (*x > STBI_MAX_DIMENSIONS || *y > STBI_MAX_DIMENSIONS) return stbi__err("too large","Very large image (corrupt?)");
+   s->img_x = *x;
+   s->img_y = *y;
+   s->img_n = n;
+   rows.fn = row;
+   rows.user = row_user;
+   rows.out_n = req_comp ? req_comp : n;
+   // the row is decoded with as many color channels as are wanted, or the
+   // file's when converting down to gray
+   n = rows.out_n >= 3 ? rows.out_n : n;
+   line = (stbi_uc *) stbi__malloc_mad2(*x, n, 0);
+   rows.conv = rows.out_n != n ? (stbi_uc *) stbi__malloc_mad2(*x, rows.out_n, 0) : NULL;
+   rows.wide = bits == 16 ? (stbi__uint16 *) stbi__malloc_mad3(*x, rows.out_n, 2, 0) : NULL;
+   if (!line || (rows.out_n != n && !rows.conv) || (bits == 16 && !rows.wide))
+      ok = stbi__err("outofmem", "Out of memory");
+   else
+      ok = stbi__qoi_decode(s, line, n, stbi__bgr_on_load && bits == 8 && rows.out_n >= 3, &rows);
+   STBI_FREE(line);
+   STBI_FREE(rows.conv);
+   STBI_FREE(rows.wide);
+   return ok;
+}
+
+#endif // STBI_NO_QOI
+
 static int stbi__info_main(stbi__context *s, int *x, int *y, int *comp)
 {
    #ifndef STBI_NO_JPEG
@@ -7436,6 +9161,10 @@ static int stbi__info_main(stbi__context *s, int *x, int *y, int *comp)
    if (stbi__pnm_info(s, x, y, comp))  return 1;
    #endif
 
+   #ifndef STBI_NO_QOI
+   if (stbi__qoi_info(s, x, y, comp))  return 1;
+   #endif
+
    #ifndef STBI_NO_HDR
    if (stbi__hdr_info(s, x, y, comp))  return 1;
    #endif
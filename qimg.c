@@ -133,6 +133,88 @@
  **
  **     qimg -loop
  **
+ ** Slides are prepared ahead of time while the current one is shown and a few
+ ** already shown slides are kept in memory, so stepping back is instant.
+ ** Both can be tuned:
+ **
+ **     qimg -history 4 -prefetch 3 input1.jpg input2.jpg input3.jpg
+ **
+ ** **Thumbnail cache:**
+ **
+ **     qimg -thumbs -scale fit photo1.jpg photo2.jpg
+ **
+ ** Uses the shared thumbnail cache (`$XDG_CACHE_HOME/thumbnails`, laid out
+ ** as in the freedesktop thumbnail specification) whenever the scaled image
+ ** fits in one of the thumbnail sizes (up to 1024 pixels). Valid thumbnails
+ ** are shown without decoding the full input and missing ones are written
+ ** by the background loaders while they have nothing else to do.
+ **
+ ** **Previews:**
+ **
+ **     qimg -preview -delay 5 camera/IMG_*.jpg
+ **
+ ** Camera JPEGs embed a small EXIF thumbnail. With `-preview` (and always in
+ ** interactive mode) it is scaled up and shown while the full image decodes,
+ ** then replaced in place.
+ **
+ ** **Interactive mode:**
+ **
+ **     qimg -i -scale fit -pos c input1.jpg input2.jpg input3.jpg
+ **
+ ** Puts the terminal into raw mode and reads single keypresses: space pauses
+ ** the slideshow, arrow keys navigate, `+` and `-` zoom, `r` rotates and `q`
+ ** quits. See #qimg_run_slideshow for the full key map. Upcoming slides are
+ ** loaded in the background (`-threads`), so moving to a cached slide repaints
+ ** within a frame. `-stats` prints the measured keypress to paint latency on
+ ** exit.
+ **
+ ** **Ken Burns effect:**
+ **
+ **     qimg -c -loop -kenburns -delay 8 photos/DSC_*.jpg
+ **
+ ** Each slide slowly pans and zooms while it is shown. Frames are resampled
+ ** bilinearly from a mip pyramid built when the slide is loaded, at about
+ ** 30 frames per second.
+ **
+ ** **Remote control:**
+ **
+ **     qimg -c -loop -control /run/qimg.sock -scale fit signage/ad-*.jpg
+ **     echo next | socat - UNIX-SENDTO:/run/qimg.sock
+ **
+ ** Commands such as `next`, `prev`, `goto 3`, `pause` and `quit` are taken
+ ** from a unix datagram socket. `SIGUSR1` and `SIGUSR2` step forward and back
+ ** and `SIGHUP` reloads the current image. Input files changed on disk are
+ ** reloaded automatically. All of this runs on one epoll loop that sleeps
+ ** until something happens.
+ **
+ ** **Archives:**
+ **
+ **     qimg -delay 3 -scale fit holiday.zip scans.tar 'album.zip#cover.jpg'
+ **
+ ** The images in zip and tar archives are shown in archive order, read from
+ ** the mapped archive without extracting anything to disk. Stored zip and
+ ** tar members are decoded in place, deflated zip members are inflated in
+ ** memory first.
+ **
+ ** **QOI conversion:**
+ **
+ **     qimg -convert-qoi slides/slide-*.png
+ **
+ ** Writes a QOI copy of every input next to it (`slides/slide-1.qoi` and so
+ ** on), decoding and encoding on all threads. Existing files are kept. QOI
+ ** decodes several times faster than PNG, straight into the framebuffer's
+ ** pixel order, so slides prepared this way show up sooner.
+ **
+ ** **Slide bundles:**
+ **
+ **     qimg -scale fit -bg black -pack show.qpk slides/1.jpg slides/2.jpg
+ **     qimg -loop -delay 10 show.qpk
+ **
+ ** Renders the slides for the current framebuffer once, on all threads, into
+ ** a single file with every slide on its own pages. Playing the bundle maps
+ ** it and copies each slide to the screen as is, which suits read-only kiosk
+ ** images. Repack when the display mode changes.
+ **
  **
  **/
 
@@ -141,13 +223,26 @@
 #include <stb_image.h>
 #include <stb_image_resize.h>
 
+#include <errno.h>
 #include <fcntl.h>
 #include <glob.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <signal.h>
+#include <strings.h>
+#include <termios.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <time.h>
 #include <linux/fb.h>
 
@@ -162,9 +257,71 @@
 /** Standard terminal control sequence for hiding cursor */
 #define CUR_HIDE "\e[?25l"
 
-/** Maximum number of images to load in the buffer at once */
-#define MAX_BUFFER_SIZE 5
+/** Default number of already shown frames kept cached behind the cursor */
+#define DEFAULT_CACHE_HISTORY 2
+/** Default number of frames loaded ahead of the cursor */
+#define DEFAULT_CACHE_PREFETCH 2
+/** Maximum number of frames held in the frame cache at once */
+#define MAX_CACHE_SIZE 64
 #define MAX_IMAGES 256
+/** Maximum number of background worker threads */
+#define MAX_THREADS 16
+
+/** Thumbnail cache directory under $XDG_CACHE_HOME */
+#define THUMB_DIR "thumbnails"
+/** Maximum length of thumbnail and input paths */
+#define THUMB_PATH_MAX 4096
+/** Bytes read from the start of a JPEG when looking for EXIF data */
+#define EXIF_SCAN_SIZE (128 * 1024)
+/** Separates an archive path from a member name in input paths */
+#define ARCHIVE_SEP '#'
+/** Largest archive member inflated into memory */
+#define ARCHIVE_MEMBER_MAX ((size_t) 1 << 30)
+/** Highest compression ratio deflate can reach, larger claimed sizes are
+ * corrupt */
+#define DEFLATE_MAX_RATIO 1032
+/** First bytes of a packed slide bundle */
+#define BUNDLE_MAGIC "QIMGPACK"
+#define BUNDLE_VERSION 1
+/** Marks a repeat packet in run-length coded bundle frames */
+#define BUNDLE_RUN 0x80000000u
+
+/** Largest accepted LUT_3D_SIZE of .cube files */
+#define LUT3D_MAX_SIZE 256
+
+/** Segments of the interpolated adjustment tables used for 16-bit pixels */
+#define ADJUST_LUT16_SIZE 4096
+
+/** Entries in the linear to sRGB lookup table used for HDR inputs */
+#define SRGB_LUT_SIZE 4096
+
+/** Display time of one frame at 60 Hz, target for interactive latency */
+#define FRAME_BUDGET_US 16667
+/** Repaint interval used when continuous repainting is enabled */
+#define REPAINT_INTERVAL_MS 16
+/** Events of the input files that get them reloaded */
+#define INPUT_WATCH_MASK (IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF)
+/** Commands handled per event loop wakeup */
+#define MAX_COMMANDS 64
+/** Events taken per event loop wakeup */
+#define MAX_EVENTS 8
+/** Wait for the rest of an escape sequence before taking it as a lone escape */
+#define ESCAPE_TIMEOUT_MS 50
+/** Zoom factor applied per zoom keypress */
+#define ZOOM_STEP 1.25f
+#define ZOOM_MIN 0.1f
+#define ZOOM_MAX 16.0f
+/** Window width factor applied per window/level keypress */
+#define WINDOW_STEP 1.25f
+/** Narrowest window, in 16-bit sample values */
+#define WINDOW_MIN 16
+/** Ken Burns zoom at the tight end of the motion, relative to covering the
+ * screen */
+#define KENBURNS_ZOOM 1.25f
+/** Ken Burns frame interval, about 30 fps */
+#define KENBURNS_FRAME_MS 33
+/** Ken Burns motion length when slides have no delay */
+#define KENBURNS_DEFAULT_MS 10000
 
 /** Prints a formatted message to stderr */
 #define log_msg(fmt_, ...)\
@@ -195,6 +352,14 @@ typedef struct qimg_point {
     int y;
 } qimg_point;
 
+/** A rectangle of pixels, end coordinates exclusive */
+typedef struct qimg_rect {
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+} qimg_rect;
+
 /** Represents an RGBA color */
 typedef struct qimg_color {
     uint8_t r;
@@ -203,41 +368,277 @@ typedef struct qimg_color {
     uint8_t a;
 } qimg_color;
 
+/** Framebuffer regions overwritten so far with their original contents */
+typedef struct qimg_damage {
+    qimg_rect* rects;               /**< saved regions, never overlapping */
+    uint32_t* pixels;               /**< original pixels, region by region */
+    int n;                          /**< number of regions */
+    int cap;                        /**< allocated regions */
+    size_t n_pixels;                /**< saved pixels */
+    size_t cap_pixels;              /**< allocated pixels */
+} qimg_damage;
+
 /** Represents an opened frambuffer instance */
 typedef struct qimg_fb {
     qimg_point res;                 /**< framebuffer resolution */
     unsigned int size;              /**< framebuffer size */
     int fbfd;                       /**< framebuffer file descriptor */
     char* fbdata;                   /**< framebuffer data pointer */
+    int depth;                      /**< bits per color channel, 8 or 10 */
+    int alpha_bits;                 /**< bits of the alpha channel */
+    int shift[4];                   /**< red, green, blue and alpha offsets */
+    bool native;                    /**< BGRA 8:8:8:8, written directly */
+    bool dither;                    /**< dither when dropping precision */
+    qimg_damage damage;             /**< what drawing has overwritten */
 } qimg_fb;
 
 /** Represents a loaded image */
 typedef struct qimg_image {
     qimg_point res;                 /**< resolution */
     int c;                          /**< channels */
-    char _padding[4];               /**< guess what */
+    int depth;                      /**< bytes per channel, 1 or 2 */
     uint8_t* pixels;                /**< image data pointer */
+    bool bgr;                       /**< BGRA, as the framebuffer, not RGBA */
+    struct qimg_image* half;        /**< next mip level, NULL if none */
 } qimg_image;
 
-/** Represents a collection of loaded images */
-typedef struct qimg_collection {
-    int idx;
-    int size;                           /**< number of images */
-    char _padding[8];                   /**< yeah */
-    qimg_image* images[MAX_BUFFER_SIZE];/**< image array */
-} qimg_collection;
+/** Job states of the worker pool */
+typedef enum qimg_job_state {
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE
+} qimg_job_state;
+
+/** Represents a unit of background work. Embedded as the first member of
+ * job specific structs. */
+typedef struct qimg_job {
+    void (*run)(struct qimg_job* job);      /**< work function */
+    void (*discard)(struct qimg_job* job);  /**< frees an unwanted job */
+    struct qimg_job* next;                  /**< next job in the queue */
+    volatile int cancelled;                 /**< result no longer needed */
+    qimg_job_state state;                   /**< guarded by the pool lock */
+    bool detached;                          /**< discarded once finished */
+    char _padding[4];                       /**< alignment */
+} qimg_job;
+
+/** A pool of worker threads running #qimg_job s in FIFO order. Idle jobs
+ * only run while no regular jobs are queued. */
+typedef struct qimg_pool {
+    pthread_t threads[MAX_THREADS]; /**< worker threads */
+    int n_threads;                  /**< number of workers */
+    int notify_fd;                  /**< eventfd bumped per finished job */
+    bool stop;                      /**< workers should exit */
+    char _padding[4];               /**< as usual */
+    pthread_mutex_t lock;           /**< guards the queue and job states */
+    pthread_cond_t work;            /**< signaled when jobs are queued */
+    pthread_cond_t done;            /**< broadcast when a job finishes */
+    qimg_job* head;                 /**< first queued job */
+    qimg_job* tail;                 /**< last queued job */
+    qimg_job* idle_head;            /**< first queued idle job */
+    qimg_job* idle_tail;            /**< last queued idle job */
+    qimg_job* running;              /**< jobs currently being run */
+} qimg_pool;
+
+/** A loop whose iterations are handed out to the caller and helper jobs */
+typedef struct qimg_parallel {
+    void (*task)(void* arg, int i); /**< loop body */
+    void* arg;                      /**< passed to the body */
+    int n;                          /**< number of iterations */
+    int next;                       /**< next iteration to hand out */
+    int pending;                    /**< iterations not finished yet */
+    int refs;                       /**< caller and helper jobs holding it */
+    pthread_mutex_t lock;           /**< guards the counters */
+    pthread_cond_t done;            /**< broadcast once nothing is pending */
+} qimg_parallel;
+
+/** Worker pool job helping out with a #qimg_parallel loop */
+typedef struct qimg_parallel_job {
+    qimg_job job;                   /**< base job */
+    qimg_parallel* par;             /**< shared loop */
+} qimg_parallel_job;
+
+/** View transformation applied when rendering an image */
+typedef struct qimg_view {
+    float zoom;                     /**< zoom factor on top of scaling */
+    int rotation;                   /**< clockwise rotation in quarter turns */
+    const uint16_t* window;         /**< window/level table, NULL for none */
+    float focus[2];                 /**< point of the rotated image drawn at
+                                    the screen center when `focused` */
+    bool focused;                   /**< position by `focus`, not `pos` */
+    bool smooth;                    /**< bilinear filtering from the mip
+                                    pyramid, unrotated images only */
+    char _padding[6];               /**< keeps the compiler quiet */
+} qimg_view;
+
+/** Keypress to paint latency statistics of the interactive mode */
+typedef struct qimg_latency {
+    int n;                          /**< number of measured keypresses */
+    int n_cached;                   /**< of which hit cached frames */
+    int n_over;                     /**< cached hits exceeding a frame */
+    char _padding[4];               /**< again */
+    uint64_t total_us;              /**< sum of all latencies */
+    uint64_t max_us;                /**< worst latency */
+    uint64_t cached_total_us;       /**< sum of cached latencies */
+    uint64_t cached_max_us;         /**< worst cached latency */
+} qimg_latency;
+
+/** Slideshow commands given by keys, signals and the control socket */
+typedef enum qimg_command {
+    CMD_NONE,
+    CMD_QUIT,
+    CMD_PAUSE,
+    CMD_RESUME,
+    CMD_TOGGLE,         /**< pause or resume */
+    CMD_NEXT,
+    CMD_PREV,
+    CMD_GOTO,           /**< jump to a slide given along */
+    CMD_RELOAD,         /**< load the current slide again from disk */
+    CMD_ZOOM_IN,
+    CMD_ZOOM_OUT,
+    CMD_ROTATE,
+    CMD_RESET_VIEW,     /**< reset zoom and rotation */
+    CMD_WINDOW_NARROW,
+    CMD_WINDOW_WIDEN,
+    CMD_LEVEL_DOWN,
+    CMD_LEVEL_UP,
+    CMD_WINDOW_FIT,     /**< fit the window to the current slide */
+    CMD_WINDOW_RESET
+} qimg_command;
+
+/** Image scale types */
+typedef enum qimg_scale {
+    SCALE_DISABLED, /**< no scaling applied */
+    SCALE_FIT,      /**< image scaled to fit the screen,
+                    aspect ratio maintained */
+    SCALE_STRETCH,  /**< image stretched to fill the whole screen */
+    SCALE_FILL      /**< image scaled to fill the whole screen,
+                    aspect ratio maintained */
+} qimg_scale;
+
+/** A 3D color lookup table */
+typedef struct qimg_lut3d {
+    int size;               /**< lattice points per axis */
+    char _padding[4];       /**< nothing to see here */
+    uint16_t* table;        /**< RGB entries, red changing fastest */
+} qimg_lut3d;
+
+/** Tone mapping operators for HDR inputs */
+typedef enum qimg_tonemap {
+    TONEMAP_ACES,       /**< filmic ACES fit, keeps contrast in highlights */
+    TONEMAP_REINHARD    /**< x / (1 + x), never clips */
+} qimg_tonemap;
+
+/** Color filter array layouts, named after the top left 2x2 cell */
+typedef enum qimg_bayer {
+    BAYER_RGGB,
+    BAYER_BGGR,
+    BAYER_GRBG,
+    BAYER_GBRG
+} qimg_bayer;
+
+/** Geometry and sample format of raw Bayer sensor dumps */
+typedef struct qimg_raw_format {
+    qimg_point res;         /**< sensor resolution, 0x0 to disable */
+    qimg_bayer pattern;     /**< color filter layout */
+    int bits;               /**< significant bits per sample, 8 to 16 */
+    float wb[3];            /**< red, green and blue white balance gains */
+} qimg_raw_format;
+
+/** False color palettes for single channel images */
+typedef enum qimg_colormap {
+    COLORMAP_NONE,      /**< plain grayscale */
+    COLORMAP_INFERNO,   /**< black - purple - orange - yellow */
+    COLORMAP_VIRIDIS,   /**< purple - teal - yellow */
+    COLORMAP_MAGMA,     /**< black - purple - pink - cream */
+    COLORMAP_PLASMA,    /**< blue - magenta - yellow */
+    COLORMAP_JET,       /**< classic blue - cyan - yellow - red rainbow */
+    COLORMAP_HOT        /**< black - red - yellow - white */
+} qimg_colormap;
+
+/** Nine evenly spaced sRGB stops of the perceptually uniform palettes, in
+ * the order of #qimg_colormap starting from COLORMAP_INFERNO */
+const static uint8_t qimg_colormap_stops[4][9][3] = {
+    {{0x00, 0x00, 0x04}, {0x1f, 0x0c, 0x48}, {0x55, 0x0f, 0x6d},
+     {0x88, 0x22, 0x6a}, {0xba, 0x36, 0x55}, {0xe3, 0x59, 0x33},
+     {0xf9, 0x8e, 0x09}, {0xf9, 0xcb, 0x35}, {0xfc, 0xff, 0xa4}},
+    {{0x44, 0x01, 0x54}, {0x47, 0x2d, 0x7b}, {0x3b, 0x52, 0x8b},
+     {0x2c, 0x72, 0x8e}, {0x21, 0x91, 0x8c}, {0x28, 0xae, 0x80},
+     {0x5e, 0xc9, 0x62}, {0xad, 0xdc, 0x30}, {0xfd, 0xe7, 0x25}},
+    {{0x00, 0x00, 0x04}, {0x1c, 0x10, 0x44}, {0x4f, 0x12, 0x7b},
+     {0x81, 0x25, 0x81}, {0xb5, 0x36, 0x7a}, {0xe5, 0x50, 0x64},
+     {0xfb, 0x87, 0x61}, {0xfe, 0xc2, 0x87}, {0xfc, 0xfd, 0xbf}},
+    {{0x0d, 0x08, 0x87}, {0x4c, 0x02, 0xa1}, {0x7e, 0x03, 0xa8},
+     {0xa9, 0x23, 0x95}, {0xcc, 0x47, 0x78}, {0xe5, 0x6b, 0x5d},
+     {0xf8, 0x94, 0x41}, {0xfd, 0xc3, 0x28}, {0xf0, 0xf9, 0x21}}
+};
+
+/** Thumbnail flavors of the freedesktop thumbnail specification */
+const static struct {
+    int size;               /**< maximum thumbnail dimension */
+    const char* dir;        /**< subdirectory */
+} qimg_thumb_flavors [] = {
+    {128, "normal"},
+    {256, "large"},
+    {512, "x-large"},
+    {1024, "xx-large"}
+};
+
+/** Background job writing a thumbnail for one input */
+typedef struct qimg_thumb_job {
+    qimg_job job;           /**< pool job, keep first */
+    char* path;             /**< input path */
+    qimg_point vp;          /**< viewport size */
+    qimg_scale scale;       /**< scale style */
+    char _padding[4];       /**< for the compiler */
+} qimg_thumb_job;
+
+/** Background job preparing one frame of a #qimg_dyn_collection */
+typedef struct qimg_load_job {
+    qimg_job job;           /**< pool job, keep first */
+    char* path;             /**< input path */
+    qimg_point vp;          /**< viewport size */
+    qimg_scale scale;       /**< scale style */
+    char _padding[4];       /**< you guessed it */
+    qimg_image* im;         /**< result, NULL if loading failed */
+} qimg_load_job;
+
+/** Represents a cached frame of a #qimg_dyn_collection */
+typedef struct qimg_cache_slot {
+    int idx;                /**< asset of the frame (see #qimg_dyn_collection),
+                            -1 if empty */
+    char _padding[4];       /**< still padding */
+    qimg_image* im;         /**< prepared image */
+    qimg_load_job* job;     /**< pending background load, NULL if none */
+} qimg_cache_slot;
 
 /** A dynamic collection of images used to load unlimited amount of inputs.
- * Loads one #qimg_collection of #MAX_BUFFER_SIZE images per time and updates
- * it whenever all current images have been read (`n_consumed == col.size`).
+ *
+ * Frames are cached in a window around the cursor (`idx`). Up to `history`
+ * already shown frames are kept behind the cursor and up to `prefetch` frames
+ * are loaded ahead of it, so moving the cursor within the window never
+ * reloads anything. Frames falling out of the window are evicted.
+ *
+ * Cached frames are stored already scaled for the viewport `vp`. With a
+ * worker pool, frames ahead of the cursor are loaded in the background and
+ * loads that fall out of the window are cancelled.
+ *
+ * Frames are cached per asset: `assets` maps every input to the first input
+ * referring to the same file, so an asset listed several times is decoded
+ * and held once (see #qimg_dedup_inputs).
  */
 typedef struct qimg_dyn_collection {
     char** input_paths;     /**< input path vector */
     int size;               /**< number of inputs */
-    int idx;                /**< current element index */
-    int n_consumed;         /**< number of elements condumed since last load */
-    char _padding[4];       /**< magic */
-    qimg_collection* col;   /**< current collection */
+    int idx;                /**< cursor, -1 before the first frame is fetched */
+    int history;            /**< frames retained behind the cursor */
+    int prefetch;           /**< frames loaded ahead of the cursor */
+    int n_slots;            /**< number of usable cache slots */
+    bool loop;              /**< indices wrap around at both ends */
+    qimg_point vp;          /**< viewport size frames are scaled for */
+    qimg_scale scale;       /**< scale style frames are prepared with */
+    qimg_pool* pool;        /**< workers for prefetching, NULL to load inline */
+    int* assets;            /**< asset of each input */
+    qimg_cache_slot slots[MAX_CACHE_SIZE]; /**< frame cache */
 } qimg_dyn_collection;
 
 /** Image position */
@@ -259,15 +660,96 @@ typedef enum qimg_bg {
     BG_DISABLED
 } qimg_bg;
 
-/** Image scale types */
-typedef enum qimg_scale {
-    SCALE_DISABLED, /**< no scaling applied */
-    SCALE_FIT,      /**< image scaled to fit the screen,
-                    aspect ratio maintained */
-    SCALE_STRETCH,  /**< image stretched to fill the whole screen */
-    SCALE_FILL      /**< image scaled to fill the whole screen,
-                    aspect ratio maintained */
-} qimg_scale;
+/** A zip or tar archive whose members are inputs */
+typedef struct qimg_archive {
+    uint8_t* map;           /**< whole archive, mapped read-only */
+    size_t size;            /**< archive size */
+} qimg_archive;
+
+/** An image inside an archive, read straight from the mapping */
+typedef struct qimg_archive_member {
+    char* path;             /**< input path, "<archive>#<member name>" */
+    const uint8_t* data;    /**< member data in the mapping */
+    size_t size;            /**< stored size */
+    size_t usize;           /**< uncompressed size */
+    bool deflated;          /**< zip deflate, stored as is otherwise */
+} qimg_archive_member;
+
+/** Coding of a bundle frame */
+typedef enum qimg_bundle_codec {
+    BUNDLE_RAW,             /**< framebuffer pixels as is */
+    BUNDLE_RLE              /**< run-length coded pixels, see #qimg_pack */
+} qimg_bundle_codec;
+
+/**
+ * Start of a packed slide bundle, followed by one #qimg_bundle_frame per
+ * slide. Everything is in native byte order, like the framebuffer pixels.
+ */
+typedef struct qimg_bundle_header {
+    char magic[8];          /**< #BUNDLE_MAGIC */
+    uint32_t version;       /**< #BUNDLE_VERSION */
+    uint32_t n_frames;      /**< number of slides */
+    uint32_t res[2];        /**< framebuffer size the slides were packed for */
+    uint32_t depth;         /**< framebuffer bits per channel */
+    uint32_t shift[4];      /**< red, green, blue and alpha offsets */
+    uint32_t page_size;     /**< alignment of frame data in the file */
+} qimg_bundle_header;
+
+/** Index entry of one slide in a packed bundle */
+typedef struct qimg_bundle_frame {
+    uint64_t offset;        /**< frame data offset, page aligned */
+    uint32_t size;          /**< frame data size */
+    uint32_t codec;         /**< a #qimg_bundle_codec */
+    qimg_rect rect;         /**< screen region the frame covers */
+} qimg_bundle_frame;
+
+/** A packed slide bundle mapped for playback */
+typedef struct qimg_bundle {
+    uint8_t* map;                       /**< whole bundle, mapped read-only */
+    size_t size;                        /**< bundle size */
+    const qimg_bundle_header* header;   /**< header at the start of map */
+    const qimg_bundle_frame* frames;    /**< index following the header */
+} qimg_bundle;
+
+/** Options collected from the command line */
+typedef struct qimg_opts {
+    char* input_paths[MAX_IMAGES];  /**< input path vector */
+    int n_inputs;                   /**< number of inputs */
+    int fb_idx;                     /**< framebuffer index, -1 for default */
+    char* fb_path;                  /**< framebuffer path, overrides fb_idx */
+    int slide_delay_s;              /**< slideshow interval */
+    int history;                    /**< frames kept cached behind the cursor */
+    int prefetch;                   /**< frames loaded ahead of the cursor */
+    int n_threads;                  /**< background loader threads */
+    bool thumbs;                    /**< use the thumbnail cache */
+    bool preview;                   /**< show previews while loading */
+    bool dedup_content;             /**< also merge inputs by content */
+    bool convert_qoi;               /**< transcode the inputs and exit */
+    char* pack_path;                /**< bundle to pack the inputs into */
+    bool pack_rle;                  /**< run-length code packed frames */
+    bool dither;                    /**< dither deep images on output */
+    bool lut_bake;                  /**< apply the 3D LUT when loading */
+    char* lut_path;                 /**< .cube file to grade with, or NULL */
+    qimg_colormap colormap;         /**< palette for single channel images */
+    qimg_raw_format raw;            /**< format of raw Bayer inputs */
+    int window_center;              /**< initial window level */
+    int window_width;               /**< initial window width, 0 for none */
+    float gamma[3];                 /**< red, green and blue gamma */
+    float brightness[3];            /**< red, green and blue offsets */
+    float contrast[3];              /**< red, green and blue contrast */
+    bool interactive;               /**< keyboard control */
+    bool kenburns;                  /**< pan and zoom animation */
+    bool stats;                     /**< print timing statistics on exit */
+    char* control_path;             /**< control socket path, or NULL */
+    bool repaint;                   /**< keep repainting the image */
+    bool hide_cursor;               /**< hide terminal cursor */
+    bool loop;                      /**< loop the slideshow indefinitely */
+    qimg_position pos;              /**< image positioning */
+    qimg_bg bg;                     /**< background style */
+    qimg_scale scale;               /**< scale style */
+    qimg_tonemap tonemap;           /**< tone mapping of HDR inputs */
+    float exposure;                 /**< HDR exposure in stops */
+} qimg_opts;
 
 /* Lookup tables to find enums with string arguments */
 const static struct {
@@ -303,13 +785,95 @@ const static struct {
     {SCALE_FILL, "fill"}
 };
 
+const static struct {
+    qimg_tonemap en;
+    const char *str;
+} qimg_tonemap_conversion [] = {
+    {TONEMAP_ACES, "aces"},
+    {TONEMAP_REINHARD, "reinhard"}
+};
+
+const static struct {
+    qimg_colormap en;
+    const char *str;
+} qimg_colormap_conversion [] = {
+    {COLORMAP_NONE, "none"},
+    {COLORMAP_INFERNO, "inferno"},
+    {COLORMAP_VIRIDIS, "viridis"},
+    {COLORMAP_MAGMA, "magma"},
+    {COLORMAP_PLASMA, "plasma"},
+    {COLORMAP_JET, "jet"},
+    {COLORMAP_HOT, "hot"}
+};
+
 STRING_TO_ENUM_(qimg_position)
 STRING_TO_ENUM_(qimg_bg)
 STRING_TO_ENUM_(qimg_scale)
+STRING_TO_ENUM_(qimg_tonemap)
+STRING_TO_ENUM_(qimg_colormap)
+
+const static struct {
+    qimg_bayer en;
+    const char *str;
+} qimg_bayer_conversion [] = {
+    {BAYER_RGGB, "rggb"},
+    {BAYER_BGGR, "bggr"},
+    {BAYER_GRBG, "grbg"},
+    {BAYER_GBRG, "gbrg"}
+};
+
+STRING_TO_ENUM_(qimg_bayer)
 
-static volatile bool run = true; /* used to go through cleanup on exit */
-static qimg_scale scale = SCALE_DISABLED;
-static clock_t begin_clk;
+/* Control socket commands, goto takes an argument and is parsed separately */
+const static struct {
+    qimg_command en;
+    const char *str;
+} qimg_command_conversion [] = {
+    {CMD_QUIT, "quit"},
+    {CMD_PAUSE, "pause"},
+    {CMD_RESUME, "resume"},
+    {CMD_TOGGLE, "toggle"},
+    {CMD_NEXT, "next"},
+    {CMD_PREV, "prev"},
+    {CMD_RELOAD, "reload"},
+    {CMD_ZOOM_IN, "zoom-in"},
+    {CMD_ZOOM_OUT, "zoom-out"},
+    {CMD_ROTATE, "rotate"},
+    {CMD_RESET_VIEW, "reset"},
+    {CMD_WINDOW_NARROW, "window-narrow"},
+    {CMD_WINDOW_WIDEN, "window-widen"},
+    {CMD_LEVEL_DOWN, "level-down"},
+    {CMD_LEVEL_UP, "level-up"},
+    {CMD_WINDOW_FIT, "window-fit"},
+    {CMD_WINDOW_RESET, "window-reset"}
+};
+
+static qimg_fb* restore_fb = NULL; /* framebuffer put back on exit, or NULL */
+static bool restore_cursor = false; /* cursor shown again on exit */
+static char* thumb_root = NULL; /* thumbnail cache root, NULL if disabled */
+static struct timespec begin_ts;
+static qimg_tonemap tonemap = TONEMAP_ACES; /* HDR tone mapping operator */
+static float exposure = 1.0f;   /* linear HDR exposure multiplier */
+static qimg_lut3d* lut3d = NULL; /* color grading LUT, NULL if disabled */
+static bool lut_bake = false;   /* grade frames when loading, not per paint */
+static bool adjust = false;     /* apply the display adjustment tables */
+static uint8_t adjust_lut[3][256];      /* 8-bit adjustment per channel */
+static uint16_t adjust_lut16[3][ADJUST_LUT16_SIZE + 1]; /* for deep images */
+static qimg_raw_format raw_format; /* inputs stb_image can't read are raw */
+static bool colormap = false;   /* false color single channel images */
+static bool kenburns = false;   /* cached frames carry a mip pyramid */
+static bool crop = false;       /* frames only keep what shows at crop_pos */
+static qimg_position crop_pos = POS_TOP_LEFT;
+static bool bgra_frames = false; /* color frames decode in framebuffer order */
+static uint32_t colormap_px[256];       /* BGRA palette, adjustments applied */
+static uint16_t colormap_lut16[257][3]; /* RGB palette for deep images */
+static qimg_archive archives[MAX_IMAGES];       /* archives given as inputs */
+static int n_archives = 0;
+static qimg_archive_member archive_members[MAX_IMAGES]; /* their images */
+static int n_archive_members = 0;
+static char key_seq[2];         /* escape sequence start left by a key read */
+static int key_seq_len = 0;
+static uint32_t key_seq_ms = 0; /* when the escape sequence start was read */
 
 
 /*----------------------------------------------------------------------------*/
@@ -343,496 +907,5782 @@ qimg_color qimg_get_bg_color(qimg_bg bg);
 qimg_image* qimg_load_image(char* input_path);
 
 /**
- * @brief Loads multiple images to a collection
- * @param input_paths   input path vector
- * @param n_inputs      number of inputs
- * @param offset        offset in input_paths vector, in case some paths
- * should be omitted.
- * @return collection of images
+ * @brief Decodes image at given path, giving up as soon as `cancel` is set
+ * @param input_path    input path
+ * @param cancel        cancellation flag, may be NULL
+ * @return loaded image or NULL if decoding failed or was cancelled
+ */
+qimg_image* qimg_decode_image(const char* input_path, volatile int* cancel);
+
+/**
+ * @brief Adds the images in a zip or tar archive as inputs. Members are
+ * listed in archive order as "<archive>#<member name>", and are read from
+ * the mapped archive without extracting anything. A path that is not a file
+ * but names an archive member that way adds just that member.
+ * @param path  archive path, optionally followed by #<member name>
+ * @param out   receives the member input paths
+ * @param max   room in out
+ * @return number of images, which may exceed max, or -1 if path is not an
+ * archive
+ */
+int qimg_expand_archive(const char* path, char** out, int max);
+
+/**
+ * @brief Opens an input for reading, a file or an archive member. Stored
+ * members are read from the archive mapping, deflated ones are inflated into
+ * memory first. Deflated members claiming more than #DEFLATE_MAX_RATIO times
+ * their stored size or more than #ARCHIVE_MEMBER_MAX bytes are unreadable.
+ * @param input_path    input path
+ * @param buf           receives memory to free after closing, or NULL
+ * @return stream or NULL on failure
+ */
+FILE* qimg_open_input(const char* input_path, void** buf);
+
+/**
+ * @brief Unmaps the archives added by #qimg_expand_archive
  */
-qimg_collection* qimg_load_collection(char** input_paths, int n_inputs,
-                                     int offset);
+void qimg_free_archives(void);
 
 /**
- * @brief Initializes a dynamic collection and loads first images to it.
+ * @brief Loads image at given path and scales it for the given viewport
  *
- * A dynamic collection loads up to #MAX_BUFFER_SIZE images per time when
- * needed. #qimg_get_next should be used to fetch images from a dynamic
- * collection.
+ * With the thumbnail cache enabled, a valid thumbnail that is at least as
+ * large as the scaled image is used instead of decoding the full input.
  *
- * @param input_paths   input path vector
- * @param n_inputs      number of inputs
- * @return
+ * @param input_path    input path
+ * @param vp            viewport size
+ * @param scale         scale style
+ * @param cancel        cancellation flag, may be NULL
+ * @return loaded image or NULL if loading failed or was cancelled
  */
-qimg_dyn_collection* qimg_init_dyn_collection(char** input_paths, int n_inputs);
+qimg_image* qimg_prepare_image(const char* input_path, qimg_point vp,
+                               qimg_scale scale, volatile int* cancel);
 
 /**
- * @brief Get next image from a dynamic collection
- * @param col   dynamic collection
- * @return image pointer
+ * @brief Tone maps a linear HDR image into a displayable RGB image.
+ *
+ * The float image is resampled to the target size first, so that filtering
+ * happens in linear light and only the output pixels go through exposure,
+ * the tone curve (see #qimg_tonemap) and sRGB encoding.
+ *
+ * @param hdr   linear RGB pixels
+ * @param res   resolution of hdr
+ * @param dims  output resolution
+ * @return 8-bit RGB image or NULL on failure
  */
-qimg_image* qimg_get_next(qimg_dyn_collection* col);
+qimg_image* qimg_tonemap_image(const float* hdr, qimg_point res,
+                               qimg_point dims);
 
 /**
- * @brief Resizes an image
- * @param im        image to resize
- * @param dest_res  target resolution
- * @return true if resizing succeeded, false if not
+ * @brief Demosaics a raw Bayer frame into a 16-bit RGB image of given size.
+ *
+ * Samples are one byte up to 8 bits and little endian 16-bit words above
+ * that. When the output is at most half the sensor size, demosaicing and
+ * downscaling are fused: every output pixel averages the red, green and blue
+ * sites of the 2x2 cells it covers, so no full resolution RGB image is ever
+ * built. Larger outputs are demosaiced bilinearly at full resolution first.
+ *
+ * @param raw   samples
+ * @param fmt   frame format
+ * @param dims  output resolution
+ * @return image or NULL on failure
  */
-bool qimg_resize_image(qimg_image* im, qimg_point dest_res);
+qimg_image* qimg_demosaic(const uint8_t* raw, const qimg_raw_format* fmt,
+                          qimg_point dims);
 
 /**
- * @brief Calculates target dimensions for image when viewed on a viewport of
- * specified size on given scale style.
+ * @brief Extracts the thumbnail embedded in the EXIF data of a JPEG.
  *
- * See #qimg_scale for different scale type definitions.
+ * Camera JPEGs usually carry a small JPEG preview in IFD1 of their APP1
+ * segment, pointed to by the JPEGInterchangeFormat tags.
  *
- * @param src       source image
- * @param vp        viewport
- * @param scale     scale style
- * @return target dimensions
+ * @param jpg   start of the JPEG file
+ * @param len   number of bytes available
+ * @param out   receives the embedded JPEG
+ * @param n     receives its length
+ * @return true if a thumbnail was found
  */
-qimg_point qimg_get_scaled_dims(qimg_point src, qimg_point vp,
-                                     qimg_scale scale);
+bool qimg_exif_thumbnail(const uint8_t* jpg, size_t len, const uint8_t** out,
+                         size_t* n);
 
 /**
- * @brief Opens framebuffer with given index
- * @param idx   framebuffer index (/dev/fb<idx>)
- * @return framebuffer instance
+ * @brief Loads a quick low resolution stand-in for an input.
+ *
+ * The embedded EXIF thumbnail is used if there is one, otherwise any cached
+ * thumbnail. The preview keeps the size it was decoded at; painting it with
+ * `zoom` makes it as large as the full image will be shown, so replacing it
+ * does not move anything on the screen and only the visible pixels are ever
+ * scaled. Archive members get no preview.
+ *
+ * @param input_path    input path
+ * @param vp            viewport size
+ * @param scale         scale style
+ * @param zoom          receives the zoom to paint the preview with
+ * @return preview image or NULL if none is available
  */
-qimg_fb* qimg_open_fb(int idx);
+qimg_image* qimg_load_preview(const char* input_path, qimg_point vp,
+                              qimg_scale scale, float* zoom);
 
 /**
- * @brief Opens framebuffer from given path
- * @param path  framebuffer path
- * @return framebuffer instance
+ * @brief Picks the smallest thumbnail flavor covering given dimensions
+ * @param dims  displayed image dimensions
+ * @return thumbnail size or 0 if no flavor is large enough
  */
-qimg_fb* qimg_open_fb_from_path(const char* path);
-
+int qimg_thumb_size(qimg_point dims);
 
 /**
- * @brief Gets milliseconds since program start
- * @return milliseconds from start
+ * @brief Builds the thumbnail cache path of an input.
+ *
+ * Thumbnails are named after the MD5 hash of the canonical `file://` URI of
+ * the input as defined by the freedesktop thumbnail specification.
+ *
+ * @param input_path    input path
+ * @param size          thumbnail size, see #qimg_thumb_size
+ * @param uri           receives the URI, at least #THUMB_PATH_MAX bytes
+ * @param out           receives the thumbnail path, at least #THUMB_PATH_MAX
+ * bytes
+ * @return true if the path could be built
  */
-uint32_t qimg_get_millis(void);
+bool qimg_thumb_path(const char* input_path, int size, char* uri, char* out);
 
 /**
- * @brief Checks if given milliseoncds have elapsed since timestamps
- * @param start     beginning timestamp
- * @param millis    interval to check
- * @return true if the given interval has elapsed since beginnind
+ * @brief Loads a cached thumbnail of an input.
+ *
+ * Thumbnails whose `Thumb::URI` or `Thumb::MTime` do not match the input
+ * are considered stale and ignored.
+ *
+ * @param input_path    input path
+ * @param size          thumbnail size
+ * @return thumbnail image or NULL if there is no valid thumbnail
  */
-bool qimg_have_millis_elapsed(uint32_t start, uint32_t millis);
+qimg_image* qimg_load_thumbnail(const char* input_path, int size);
 
 /**
- * @brief Sleeps for given amount of time
- * @param ms    sleep time in milliseconds
+ * @brief Downscales an image and writes it to the thumbnail cache
+ * @param input_path    input path the image was loaded from
+ * @param im            full image
+ * @param size          thumbnail size
+ * @return true if the thumbnail was written
  */
-void qimg_sleep_ms(uint32_t ms);
+bool qimg_save_thumbnail(const char* input_path, qimg_image* im, int size);
 
 /**
- * @brief Fills the framebuffer with black
- * @param fb    target framebuffer
+ * @brief Writes an image as PNG
+ * @param path      output path
+ * @param im        image
+ * @param text      tEXt chunk keyword / value pairs
+ * @param n_text    number of pairs
+ * @return true on success
  */
-void qimg_clear_framebuffer(qimg_fb* fb);
+bool qimg_write_png(const char* path, qimg_image* im, const char** text,
+                    int n_text);
 
 /**
- * @brief Frees and unmaps the framebuffer instance
- * @param fb    target framebuffer
+ * @brief Writes an image as QOI. Gray images are stored as RGB and 16-bit
+ * samples are cut to 8 bits.
+ * @param path      output path
+ * @param im        image
+ * @return true on success
  */
-void qimg_free_framebuffer(qimg_fb* fb);
+bool qimg_write_qoi(const char* path, const qimg_image* im);
 
 /**
- * @brief Frees all images in a collection
- * @param col   target collection
+ * @brief Transcodes inputs to QOI on a worker pool, each written next to its
+ * input with a .qoi extension (archive members to the working directory).
+ * Existing files are kept, and of inputs that would share an output name
+ * only the first one is converted.
+ * @param input_paths   input paths
+ * @param n             number of inputs
+ * @param n_threads     worker threads besides the calling one
+ * @return number of inputs that failed
  */
-void qimg_free_collection(qimg_collection* col);
+int qimg_convert_qoi(char** input_paths, int n, int n_threads);
 
 /**
- * @brief Frees a dynamic collection
- * @param dcol  target collection
+ * @brief Pre-renders the inputs into a slide bundle for the given
+ * framebuffer, see #qimg_play_bundle.
+ *
+ * Slides are loaded and rendered on a worker pool with the position,
+ * background, scale and color options of `o`, exactly as the slideshow
+ * would paint them. Only the screen region a slide covers is stored, each
+ * frame starting on a page boundary. With `o->pack_rle` frames are
+ * run-length coded in 32-bit pixels, packets never crossing a row: a word
+ * with #BUNDLE_RUN set repeats the next pixel, otherwise that many pixels
+ * follow. Frames that would not get smaller are stored as is.
+ *
+ * The bundle is written under a temporary name and renamed into place, so
+ * a player mapping the previous bundle keeps running. Inputs that fail to
+ * load are left out.
+ *
+ * @param path      bundle path
+ * @param fb        framebuffer the slides are rendered for
+ * @param o         options, with the inputs
+ * @return number of inputs that failed, -1 if no bundle was written
  */
-void qimg_free_dyn_collection(qimg_dyn_collection* dcol);
+int qimg_pack(const char* path, qimg_fb* fb, const qimg_opts* o);
 
 /**
- * @brief Frees an image from memory
- * @param im    target image
+ * @brief Queues idle time thumbnail generation for every input of a
+ * collection that has no valid thumbnail yet.
+ * @param dcol  dynamic collection
  */
-void qimg_free_image(qimg_image* im);
+void qimg_queue_thumbnails(qimg_dyn_collection* dcol);
 
 /**
- * @brief Draws a dynamic collection of images on the framebuffer
+ * @brief Initializes a dynamic collection.
  *
- * Images are loaded in batches and resized right before drawing if needed.
+ * A dynamic collection caches up to `history` already shown frames behind
+ * its cursor and `prefetch` frames ahead of it. #qimg_get_at and
+ * #qimg_try_get_at should be used to fetch images from a dynamic collection.
+ * Nothing is loaded before the first fetch.
  *
- * @param col       image collection
- * @param fb        target framebuffer
- * @param pos       image positioning
- * @param bg        background style
- * @param repaint   keep repainting the image
- * @param delay_s   delay between images
- * @param loop      loop the slideshow images indefinitely
+ * @param input_paths   input path vector
+ * @param n_inputs      number of inputs
+ * @param vp            viewport size frames are prepared for
+ * @param scale         scale style frames are prepared with
+ * @param history       number of shown frames to retain
+ * @param prefetch      number of frames to load ahead
+ * @param loop          wrap around at both ends of the collection
+ * @param pool          worker pool used for prefetching, NULL to prefetch
+ * synchronously
+ * @return dynamic collection
  */
-void qimg_draw_images(qimg_dyn_collection* col, qimg_fb* fb, qimg_position pos,
-                      qimg_bg bg, bool repaint, int delay_s, bool loop);
+qimg_dyn_collection* qimg_init_dyn_collection(char** input_paths, int n_inputs,
+                                              qimg_point vp, qimg_scale scale,
+                                              int history, int prefetch,
+                                              bool loop, qimg_pool* pool);
 
 /**
- * @brief Draws an image on the framebuffer
+ * @brief Merges inputs referring to the same asset so that it is decoded and
+ * cached only once.
  *
- * If delay_s <= 0, it is not applied. In this case the image is drawn
- * indefinitely if repaint is set to true.
+ * Inputs are the same asset if they resolve to the same file, i.e. have the
+ * same device, inode, modification time and size, which also catches
+ * symlinks and hard links. Optionally files of equal size are compared by
+ * an MD5 of their contents as well, which catches copies.
  *
- * @param im        image
- * @param fb        target framebuffer
- * @param pos       image positioning
- * @param bg        background style
- * @param repaint   keep repainting the image
- * @param delay_s   time to keep the image on the framebuffer.
+ * @param dcol          dynamic collection
+ * @param by_content    also compare file contents
+ * @return number of distinct assets
  */
-void qimg_draw_image(qimg_image* im, qimg_fb* fb, qimg_position pos, qimg_bg bg,
-                     bool repaint, int delay_s);
+int qimg_dedup_inputs(qimg_dyn_collection* dcol, bool by_content);
 
 /**
- * @brief Translates framebuffer coordinates to image coordinates based on given
- * image positioning.
- * @param pos   image position
- * @param im    image pointer
- * @param fb    framebuffer pointer
- * @param x     framebuffer coordinate x
- * @param y     framebuffer coordinate y
- * @return translated coordinates
+ * @brief Moves the cursor of a dynamic collection to given index and gets
+ * the image there.
+ *
+ * Cached frames are returned as-is, others are loaded on demand. Frames
+ * falling out of the cache window are freed, so the returned image stays
+ * valid only until the cursor is moved again.
+ *
+ * @param dcol  dynamic collection
+ * @param idx   input index, wrapped around if the collection loops and
+ * clamped otherwise
+ * @return image pointer or NULL if the input failed to load
  */
-qimg_point qimg_translate_coords(qimg_position pos, qimg_image* im, qimg_fb* fb,
-                                 int x, int y);
+qimg_image* qimg_get_at(qimg_dyn_collection* dcol, int idx);
 
 /**
- * @brief Draws a data buffer to the framebuffer with optional repainting and
- * delays.
+ * @brief Moves the cursor like #qimg_get_at but does not wait for the image.
+ *
+ * If the frame is not ready yet, its load is started in the background
+ * ahead of any prefetching. Collections without a worker pool load it
+ * right away.
  *
- * Note that data buffer must be at least the same size as the framebuffer.
+ * @param dcol  dynamic collection
+ * @param idx   input index
+ * @return image pointer or NULL if the frame is still loading or failed to
+ * load, which #qimg_is_cached tells apart
+ */
+qimg_image* qimg_try_get_at(qimg_dyn_collection* dcol, int idx);
+
+/**
+ * @brief Loads frames ahead of the cursor that are not cached yet.
  *
- * If delay_s <= 0, it is not applied. In this case the image is drawn
- * indefinitely if repaint is set to true. If delay_s > 0 and repaint is set to
- * false, the function will simply wait delay_s seconds before returning.
+ * With a worker pool the frames are queued for background loading and the
+ * function returns immediately.
  *
- * @param fb        framebuffer
- * @param buf       data buffer
- * @param delay_s   time to keep the image on the framebuffer
- * @param repaint   keep repainting the image
+ * @param dcol  dynamic collection
  */
-void qimg_draw_buffer(qimg_fb* fb, char* buf, int delay_s, bool repaint);
+void qimg_prefetch(qimg_dyn_collection* dcol);
 
 /**
- * @brief Searches for default framebuffer index.
- * Exits if no framebuffers found.
- * @return lowest index found on the system
+ * @brief Checks whether fetching given index would return without loading
+ * @param dcol  dynamic collection
+ * @param idx   input index, wrapped or clamped as in #qimg_get_at
+ * @return true if the frame is cached and ready
  */
-int get_default_framebuffer_idx(void);
+bool qimg_is_cached(qimg_dyn_collection* dcol, int idx);
 
 /**
- * @brief Sets terminal cursor visibility
- * @param visible   cursor visibility
+ * @brief Drops the frame of given index from the cache so that it is loaded
+ * again from disk the next time it is needed. Images returned for it earlier
+ * are freed.
+ * @param dcol  dynamic collection
+ * @param idx   input index
  */
-void set_cursor_visibility(bool visible);
+void qimg_invalidate(qimg_dyn_collection* dcol, int idx);
 
 /**
- * @brief Handles exit signals and stops processing to go through cleanups
+ * @brief Starts a pool of worker threads
+ * @param n_threads number of workers
+ * @param notify_fd eventfd incremented whenever a job finishes, -1 to disable
+ * notifications
+ * @return worker pool
  */
-void interrupt_handler(int);
+qimg_pool* qimg_pool_create(int n_threads, int notify_fd);
 
 /**
- * @brief Prints usage help
+ * @brief Queues a job for the workers. The pool owns the job until
+ * #qimg_pool_wait returns for it or it is released with #qimg_pool_release.
+ * @param pool  worker pool
+ * @param job   job to run
  */
-void print_help(void);
+void qimg_pool_submit(qimg_pool* pool, qimg_job* job);
 
+/**
+ * @brief Queues a job ahead of all other queued jobs. Ownership is the same
+ * as with #qimg_pool_submit.
+ * @param pool  worker pool
+ * @param job   job to run
+ */
+void qimg_pool_submit_urgent(qimg_pool* pool, qimg_job* job);
 
-/*----------------------------------------------------------------------------*/
+/**
+ * @brief Queues a detached low priority job. It runs only when no regular
+ * jobs are waiting and is discarded by the pool once finished.
+ * @param pool  worker pool
+ * @param job   job to run
+ */
+void qimg_pool_submit_idle(qimg_pool* pool, qimg_job* job);
 
+/**
+ * @brief Blocks until a job has finished. Ownership of the job returns to
+ * the caller.
+ * @param pool  worker pool
+ * @param job   submitted job
+ */
+void qimg_pool_wait(qimg_pool* pool, qimg_job* job);
 
-int get_default_framebuffer_idx() {
-    /* Glob search for framebuffer devices */
-    glob_t globbuf;
-    glob(FB_GLOB, 0, NULL, &globbuf);
+/**
+ * @brief Checks whether a job has finished without blocking
+ * @param pool  worker pool
+ * @param job   submitted job
+ * @return true if the job is done
+ */
+bool qimg_pool_is_done(qimg_pool* pool, qimg_job* job);
 
-    /* At least one result matched */
-    assertf(globbuf.gl_pathc > 0, "No framebuffers found");
+/**
+ * @brief Gives up a job whose result is no longer needed.
+ *
+ * Queued and finished jobs are discarded right away, running jobs are
+ * flagged as cancelled and discarded by the worker once they return.
+ *
+ * @param pool  worker pool
+ * @param job   submitted job
+ */
+void qimg_pool_release(qimg_pool* pool, qimg_job* job);
 
-    /* Get framebuffer index */
-    strsep(&globbuf.gl_pathv[0], "fb"); /* Discard the first split */
-    return atoi(strsep(&globbuf.gl_pathv[0], "fb"));
-}
+/**
+ * @brief Stops the workers and frees the pool. Running jobs are flagged as
+ * cancelled and jobs still queued are discarded.
+ * @param pool  worker pool
+ */
+void qimg_pool_destroy(qimg_pool* pool);
 
-uint32_t qimg_get_millis(void) {
-    return (uint32_t)((double)(clock() - begin_clk) / CLOCKS_PER_SEC) * 1000;
-}
+/**
+ * @brief Runs `task(arg, i)` for every `i` below `n`, spreading the calls
+ * over the worker pool. The caller works through the calls as well, so this
+ * is safe to use from within pool jobs. Matches stbi_parallel_for.
+ * @param task  function to call
+ * @param arg   passed to every call
+ * @param n     number of calls
+ * @param user  worker pool
+ */
+void qimg_parallel_for(void (*task)(void* arg, int i), void* arg, int n,
+                       void* user);
 
-bool qimg_have_millis_elapsed(uint32_t start, uint32_t millis) {
-    return (qimg_get_millis() - start) > millis;
-}
+/**
+ * @brief Builds the palette tables single channel images are expanded
+ * through. Must be called after #qimg_build_adjust_luts, the 8-bit palette
+ * has the display adjustments applied so that false color costs a single
+ * lookup per pixel.
+ * @param cmap  palette, COLORMAP_NONE to show grayscale
+ */
+void qimg_build_colormap(qimg_colormap cmap);
 
-void qimg_sleep_ms(uint32_t ms) {
-    struct timespec ts;
-    ts.tv_sec = ms / 1000;
-    ts.tv_nsec = (ms % 1000) * 1000000;
-    nanosleep(&ts, NULL);
-}
+/**
+ * @brief Fills a window/level table mapping 16-bit samples linearly from
+ * [center - width / 2, center + width / 2] to the full range
+ * @param lut       table of 65536 entries
+ * @param center    window level
+ * @param width     window width
+ */
+void qimg_build_window_lut(uint16_t* lut, int center, int width);
 
-qimg_fb* qimg_open_fb(int idx) {
-    /* Append device index to the framebuffer device path */
-    char idx_buf[FB_IDX_MAX_SIZE];
-    assertf(snprintf(idx_buf, FB_IDX_MAX_SIZE, "%d", idx) <
+/**
+ * @brief Finds the range of color sample values of an image, scaled to 16
+ * bits
+ * @param im    image
+ * @param lo    receives the smallest value
+ * @param hi    receives the largest value
+ */
+void qimg_get_sample_range(const qimg_image* im, int* lo, int* hi);
+
+/**
+ * @brief Compiles display adjustments into per-channel lookup tables used by
+ * the conversion kernels.
+ *
+ * Each channel maps as (v^(1/gamma) - 0.5) * contrast + 0.5 + brightness on
+ * the 0 to 1 range. Neutral settings (1, 0, 1) disable the adjustment.
+ *
+ * @param gamma         red, green and blue gamma
+ * @param brightness    red, green and blue brightness offset
+ * @param contrast      red, green and blue contrast
+ */
+void qimg_build_adjust_luts(const float gamma[3], const float brightness[3],
+                            const float contrast[3]);
+
+/**
+ * @brief Loads a 3D LUT from an Adobe/Resolve .cube file
+ *
+ * Only 3D tables on the default 0 to 1 domain are supported.
+ *
+ * @param path  .cube file path
+ * @return lookup table or NULL if the file could not be parsed
+ */
+qimg_lut3d* qimg_load_cube(const char* path);
+
+/**
+ * @brief Frees a 3D LUT
+ * @param lut   lookup table, may be NULL
+ */
+void qimg_free_lut3d(qimg_lut3d* lut);
+
+/**
+ * @brief Grades an image through a 3D LUT in place. Grayscale images become
+ * RGB, the bit depth is kept.
+ * @param im    image
+ * @param lut   lookup table
+ */
+void qimg_bake_lut3d(qimg_image* im, const qimg_lut3d* lut);
+
+/**
+ * @brief Converts a 16-bit image to 8 bits per channel in place
+ * @param im    image
+ */
+void qimg_reduce_depth(qimg_image* im);
+
+/**
+ * @brief Resizes an image
+ * @param im        image to resize
+ * @param dest_res  target resolution
+ * @return true if resizing succeeded, false if not
+ */
+bool qimg_resize_image(qimg_image* im, qimg_point dest_res);
+
+/**
+ * @brief Crops an image in place
+ * @param im    image to crop
+ * @param r     rectangle to keep, inside the image
+ */
+void qimg_crop_image(qimg_image* im, qimg_rect r);
+
+/**
+ * @brief Builds the mip pyramid of an image, halving it with a 2x2 box
+ * filter for as long as the level still covers the viewport twice over.
+ * Levels are chained through `half` and freed with the image.
+ * @param im    image
+ * @param vp    viewport size
+ */
+void qimg_build_mips(qimg_image* im, qimg_point vp);
+
+/**
+ * @brief Calculates target dimensions for image when viewed on a viewport of
+ * specified size on given scale style.
+ *
+ * See #qimg_scale for different scale type definitions.
+ *
+ * @param src       source image
+ * @param vp        viewport
+ * @param scale     scale style
+ * @return target dimensions
+ */
+qimg_point qimg_get_scaled_dims(qimg_point src, qimg_point vp,
+                                     qimg_scale scale);
+
+/**
+ * @brief Opens framebuffer with given index
+ * @param idx   framebuffer index (/dev/fb<idx>)
+ * @return framebuffer instance
+ */
+qimg_fb* qimg_open_fb(int idx);
+
+/**
+ * @brief Opens framebuffer from given path
+ *
+ * 32 bits per pixel framebuffers with 8 or 10 bits per color channel (e.g.
+ * 8:8:8:8 and 2:10:10:10) are supported in any channel order.
+ *
+ * @param path  framebuffer path
+ * @return framebuffer instance
+ */
+qimg_fb* qimg_open_fb_from_path(const char* path);
+
+
+/**
+ * @brief Gets milliseconds since program start
+ * @return milliseconds from start
+ */
+uint32_t qimg_get_millis(void);
+
+/**
+ * @brief Gets microseconds since program start
+ * @return microseconds from start
+ */
+uint64_t qimg_get_micros(void);
+
+/**
+ * @brief Checks if given milliseoncds have elapsed since timestamps
+ * @param start     beginning timestamp
+ * @param millis    interval to check
+ * @return true if the given interval has elapsed since beginnind
+ */
+bool qimg_have_millis_elapsed(uint32_t start, uint32_t millis);
+
+/**
+ * @brief Sleeps for given amount of time
+ * @param ms    sleep time in milliseconds
+ */
+void qimg_sleep_ms(uint32_t ms);
+
+/**
+ * @brief Fills the framebuffer with black
+ * @param fb    target framebuffer
+ */
+void qimg_clear_framebuffer(qimg_fb* fb);
+
+/**
+ * @brief Saves the original contents of a framebuffer region about to be
+ * drawn over.
+ *
+ * Only the parts of `r` that are not saved yet are read, so the snapshot
+ * never grows beyond the area actually drawn on. Must be called before the
+ * region is written.
+ *
+ * @param fb    target framebuffer
+ * @param r     region about to be written, clipped to the framebuffer
+ */
+void qimg_track_damage(qimg_fb* fb, qimg_rect r);
+
+/**
+ * @brief Puts back the original contents of every region saved with
+ * #qimg_track_damage, leaving the rest of the screen untouched
+ * @param fb    target framebuffer
+ */
+void qimg_restore_framebuffer(qimg_fb* fb);
+
+/**
+ * @brief Frees and unmaps the framebuffer instance
+ * @param fb    target framebuffer
+ */
+void qimg_free_framebuffer(qimg_fb* fb);
+
+/**
+ * @brief Frees a dynamic collection
+ * @param dcol  target collection
+ */
+void qimg_free_dyn_collection(qimg_dyn_collection* dcol);
+
+/**
+ * @brief Frees an image from memory
+ * @param im    target image
+ */
+void qimg_free_image(qimg_image* im);
+
+/**
+ * @brief Renders an image into a framebuffer sized data buffer
+ *
+ * The image is converted one framebuffer row at a time. Without zoom or
+ * rotation visible image rows are converted straight from the pixel data.
+ * 8-bit images on BGRA framebuffers are written directly, everything else
+ * goes through 16 bits per channel, is graded through the 3D LUT unless it
+ * is baked into the frames and is packed to the framebuffer layout with
+ * optional ordered dithering. Display adjustments (#qimg_build_adjust_luts)
+ * are looked up within the conversion on either path, as is the false
+ * color palette of single channel images (#qimg_build_colormap). A
+ * window/level table in the view remaps color samples right after they are
+ * widened, straight from the full precision cached frame.
+ *
+ * Smooth views (Ken Burns frames) are placed with sub-pixel precision and
+ * sampled bilinearly from the mip level closest above the displayed size,
+ * so zoomed out frames never touch more than four times their own pixels.
+ *
+ * @param im        image
+ * @param fb        target framebuffer
+ * @param pos       image positioning
+ * @param bg        background style
+ * @param view      zoom, rotation and window/level, NULL for none
+ * @param buf       data buffer, at least the size of the framebuffer
+ * @return region of `buf` written, the whole framebuffer unless the
+ * background is disabled
+ */
+qimg_rect qimg_render_image(qimg_image* im, qimg_fb* fb, qimg_position pos,
+                            qimg_bg bg, const qimg_view* view, char* buf);
+
+/**
+ * @brief Renders the frame shown in place of an image that failed to load,
+ * the background color over the whole framebuffer. A disabled background is
+ * black so that the previous image does not stay up.
+ * @param fb        target framebuffer
+ * @param bg        background style
+ * @param buf       data buffer, at least the size of the framebuffer
+ * @return region of `buf` written, the whole framebuffer
+ */
+qimg_rect qimg_render_error(qimg_fb* fb, qimg_bg bg, char* buf);
+
+/**
+ * @brief Shows a dynamic collection of images as a slideshow.
+ *
+ * Everything the slideshow reacts to is multiplexed on a single epoll
+ * instance, so waiting for the next event costs no CPU at all:
+ *
+ * - a timerfd expiring when the current slide has been shown for the
+ *   slideshow delay, and another one repainting the screen with `-r`
+ * - a signalfd: `SIGINT` and `SIGTERM` quit, `SIGUSR1` and `SIGUSR2` step to
+ *   the next and previous slide and `SIGHUP` reloads the current one
+ * - the eventfd the worker pool bumps for every finished load, so that a
+ *   preview is replaced as soon as its full image is ready
+ * - inotify watches on the input files, changed files are dropped from the
+ *   cache and the current slide is repainted from the new contents
+ * - the control socket (`-control`), a unix datagram socket taking one
+ *   command per line, see #qimg_command_conversion; `goto <n>` jumps to the
+ *   n:th input
+ * - keyboard input in interactive mode, read from a terminal switched to
+ *   raw mode:
+ *
+ * Key              | Action
+ * ---              | ------
+ * space            | pause / resume the slideshow
+ * right, down, n   | next image
+ * left, up, p      | previous image
+ * `+`, `-`         | zoom in / out
+ * r                | rotate clockwise
+ * 0                | reset zoom and rotation
+ * `[`, `]`         | narrower / wider window
+ * `,`, `.`         | lower / raise window level
+ * a                | fit the window to the current image
+ * w                | reset the window to the full range
+ * l                | reload the current image
+ * q                | quit
+ *
+ * The window/level table is rebuilt on each window command and applied
+ * while painting, the cached frames are never touched.
+ *
+ * Prefetches that fall out of the cache window while navigating are
+ * cancelled. In interactive mode and with `o->preview`, slides that are not
+ * loaded yet are shown as a preview (see #qimg_load_preview) until the full
+ * image is ready. Slides that fail to load are logged and shown as an
+ * empty frame (see #qimg_render_error) for the usual delay. Command to paint
+ * latency is recorded into `lat`.
+ *
+ * Without keyboard control the slideshow ends after the last slide unless
+ * it loops. A single image without delay is painted once, or kept up until
+ * quit when repainting or hiding the cursor.
+ *
+ * @param dcol      image collection
+ * @param fb        target framebuffer
+ * @param o         options
+ * @param notify_fd worker pool eventfd, -1 if none
+ * @param lat       latency statistics
+ */
+void qimg_run_slideshow(qimg_dyn_collection* dcol, qimg_fb* fb,
+                        const qimg_opts* o, int notify_fd, qimg_latency* lat);
+
+/**
+ * @brief Maps a slide bundle written by #qimg_pack and checks its index
+ * @param path  bundle path
+ * @return bundle, NULL if the file is not a valid bundle
+ */
+qimg_bundle* qimg_open_bundle(const char* path);
+
+/**
+ * @brief Plays a slide bundle packed for this framebuffer.
+ *
+ * Slides are copied from the mapping to the screen, or run-length decoded
+ * straight into it, with nothing decoded or scaled on the way. Timing,
+ * looping, signals, the control socket and the slide keys of interactive
+ * mode work as in #qimg_run_slideshow, view commands are ignored. The next
+ * slide is read ahead while the current one is up.
+ *
+ * @param bundle    bundle matching fb
+ * @param fb        target framebuffer
+ * @param o         options
+ */
+void qimg_play_bundle(const qimg_bundle* bundle, qimg_fb* fb,
+                      const qimg_opts* o);
+
+/**
+ * @brief Unmaps and frees a bundle
+ * @param bundle    bundle, may be NULL
+ */
+void qimg_free_bundle(qimg_bundle* bundle);
+
+/**
+ * @brief Prints latency statistics of an interactive session
+ * @param lat   latency statistics
+ */
+void qimg_print_latency(const qimg_latency* lat);
+
+/**
+ * @brief Translates framebuffer coordinates to image coordinates based on given
+ * image positioning.
+ * @param pos   image position
+ * @param dims  displayed image dimensions
+ * @param vp    framebuffer resolution
+ * @param x     framebuffer coordinate x
+ * @param y     framebuffer coordinate y
+ * @return translated coordinates
+ */
+qimg_point qimg_translate_coords(qimg_position pos, qimg_point dims,
+                                 qimg_point vp, int x, int y);
+
+/**
+ * @brief Searches for default framebuffer index.
+ * Exits if no framebuffers found.
+ * @return lowest index found on the system
+ */
+int get_default_framebuffer_idx(void);
+
+/**
+ * @brief Sets terminal cursor visibility
+ * @param visible   cursor visibility
+ */
+void set_cursor_visibility(bool visible);
+
+/**
+ * @brief Switches the terminal on stdin to raw mode and back
+ *
+ * Raw mode disables line buffering and echo so that single keypresses can be
+ * read as they come. Signal keys keep working.
+ *
+ * @param raw   true to enter raw mode, false to restore the saved mode
+ */
+void set_tty_raw(bool raw);
+
+/**
+ * @brief Puts back the terminal mode, the cursor and the framebuffer regions
+ * saved with #qimg_track_damage. Registered with atexit() so that
+ * exits through assertf() leave a usable console too.
+ */
+void qimg_restore_screen(void);
+
+/**
+ * @brief Prints usage help
+ */
+void print_help(void);
+
+/**
+ * @brief Parses a per-channel option argument, either a single value for
+ * all channels or three comma separated values. Exits on malformed input.
+ * @param arg   argument string
+ * @param v     red, green and blue values
+ */
+void parse_channels(const char* arg, float v[3]);
+
+
+/*----------------------------------------------------------------------------*/
+
+
+int get_default_framebuffer_idx() {
+    /* Glob search for framebuffer devices */
+    glob_t globbuf;
+    glob(FB_GLOB, 0, NULL, &globbuf);
+
+    /* At least one result matched */
+    assertf(globbuf.gl_pathc > 0, "No framebuffers found");
+
+    /* Get framebuffer index */
+    strsep(&globbuf.gl_pathv[0], "fb"); /* Discard the first split */
+    return atoi(strsep(&globbuf.gl_pathv[0], "fb"));
+}
+
+uint32_t qimg_get_millis(void) {
+    /* Wall clock, clock() would stop advancing while we sleep */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((ts.tv_sec - begin_ts.tv_sec) * 1000 +
+                      (ts.tv_nsec - begin_ts.tv_nsec) / 1000000);
+}
+
+uint64_t qimg_get_micros(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec - begin_ts.tv_sec) * 1000000 +
+           (ts.tv_nsec - begin_ts.tv_nsec) / 1000;
+}
+
+bool qimg_have_millis_elapsed(uint32_t start, uint32_t millis) {
+    return (qimg_get_millis() - start) > millis;
+}
+
+void qimg_sleep_ms(uint32_t ms) {
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000;
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * @brief Appends a job to a singly linked job queue
+ * @param head  queue head
+ * @param tail  queue tail
+ * @param job   job to append
+ */
+static void qimg_queue_push(qimg_job** head, qimg_job** tail, qimg_job* job) {
+    job->next = NULL;
+    if (*tail)
+        (*tail)->next = job;
+    else
+        *head = job;
+    *tail = job;
+}
+
+/**
+ * @brief Removes a job from a singly linked job queue
+ * @param head  queue head
+ * @param tail  queue tail, NULL for lists without one
+ * @param job   job to remove
+ * @return true if the job was found
+ */
+static bool qimg_queue_unlink(qimg_job** head, qimg_job** tail,
+                              qimg_job* job) {
+    qimg_job* prev = NULL;
+    for (qimg_job* j = *head; j; prev = j, j = j->next) {
+        if (j != job)
+            continue;
+        if (prev)
+            prev->next = j->next;
+        else
+            *head = j->next;
+        if (tail && *tail == j)
+            *tail = prev;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Worker thread main loop, runs queued jobs until the pool stops
+ * @param arg   worker pool
+ * @return NULL
+ */
+static void* qimg_pool_worker(void* arg) {
+    qimg_pool* pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stop) {
+        qimg_job* job = pool->head ? pool->head : pool->idle_head;
+        if (!job) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+            continue;
+        }
+        if (job == pool->head)
+            qimg_queue_unlink(&pool->head, &pool->tail, job);
+        else
+            qimg_queue_unlink(&pool->idle_head, &pool->idle_tail, job);
+        job->state = JOB_RUNNING;
+        job->next = pool->running;
+        pool->running = job;
+        pthread_mutex_unlock(&pool->lock);
+
+        job->run(job);
+
+        pthread_mutex_lock(&pool->lock);
+        qimg_queue_unlink(&pool->running, NULL, job);
+        if (job->cancelled || job->detached) {
+            job->discard(job);
+        } else {
+            job->state = JOB_DONE;
+            pthread_cond_broadcast(&pool->done);
+        }
+        if (pool->notify_fd >= 0) {
+            uint64_t one = 1;
+            if (write(pool->notify_fd, &one, sizeof(one)) < 0) {
+                /* Only fails once the counter saturates, still readable */
+            }
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+qimg_pool* qimg_pool_create(int n_threads, int notify_fd) {
+    qimg_pool* pool = malloc(sizeof(qimg_pool));
+    pool->n_threads = n_threads < MAX_THREADS ? n_threads : MAX_THREADS;
+    pool->notify_fd = notify_fd;
+    pool->stop = false;
+    pool->head = NULL;
+    pool->tail = NULL;
+    pool->idle_head = NULL;
+    pool->idle_tail = NULL;
+    pool->running = NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    /* Workers inherit a fully blocked signal mask so that exit signals are
+     * always delivered to the main thread */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (int i = 0; i < pool->n_threads; ++i) {
+        assertf(!pthread_create(&pool->threads[i], NULL, qimg_pool_worker,
+                                pool), "Starting worker thread failed");
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return pool;
+}
+
+void qimg_pool_submit(qimg_pool* pool, qimg_job* job) {
+    job->cancelled = 0;
+    job->detached = false;
+    job->state = JOB_QUEUED;
+    pthread_mutex_lock(&pool->lock);
+    qimg_queue_push(&pool->head, &pool->tail, job);
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void qimg_pool_submit_urgent(qimg_pool* pool, qimg_job* job) {
+    job->cancelled = 0;
+    job->detached = false;
+    job->state = JOB_QUEUED;
+    pthread_mutex_lock(&pool->lock);
+    job->next = pool->head;
+    pool->head = job;
+    if (!pool->tail)
+        pool->tail = job;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void qimg_pool_submit_idle(qimg_pool* pool, qimg_job* job) {
+    job->cancelled = 0;
+    job->detached = true;
+    job->state = JOB_QUEUED;
+    pthread_mutex_lock(&pool->lock);
+    qimg_queue_push(&pool->idle_head, &pool->idle_tail, job);
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void qimg_pool_wait(qimg_pool* pool, qimg_job* job) {
+    pthread_mutex_lock(&pool->lock);
+    while (job->state != JOB_DONE)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+bool qimg_pool_is_done(qimg_pool* pool, qimg_job* job) {
+    pthread_mutex_lock(&pool->lock);
+    bool done = job->state == JOB_DONE;
+    pthread_mutex_unlock(&pool->lock);
+    return done;
+}
+
+void qimg_pool_release(qimg_pool* pool, qimg_job* job) {
+    pthread_mutex_lock(&pool->lock);
+    if (job->state == JOB_QUEUED) {
+        /* Unlink from the queue, nobody has touched it yet */
+        if (!qimg_queue_unlink(&pool->head, &pool->tail, job))
+            qimg_queue_unlink(&pool->idle_head, &pool->idle_tail, job);
+        job->discard(job);
+    } else if (job->state == JOB_RUNNING) {
+        job->cancelled = 1; /* Worker discards it once done */
+    } else {
+        job->discard(job);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * @brief Runs iterations of a parallel loop until none are left
+ * @param par   parallel loop
+ */
+static void qimg_parallel_drain(qimg_parallel* par) {
+    pthread_mutex_lock(&par->lock);
+    while (par->next < par->n) {
+        int i = par->next++;
+        pthread_mutex_unlock(&par->lock);
+        par->task(par->arg, i);
+        pthread_mutex_lock(&par->lock);
+        if (--par->pending == 0)
+            pthread_cond_broadcast(&par->done);
+    }
+    pthread_mutex_unlock(&par->lock);
+}
+
+/**
+ * @brief Drops a reference to a parallel loop, freeing it with the last one
+ * @param par   parallel loop
+ */
+static void qimg_parallel_unref(qimg_parallel* par) {
+    pthread_mutex_lock(&par->lock);
+    int refs = --par->refs;
+    pthread_mutex_unlock(&par->lock);
+    if (refs)
+        return;
+    pthread_mutex_destroy(&par->lock);
+    pthread_cond_destroy(&par->done);
+    free(par);
+}
+
+static void qimg_parallel_job_run(qimg_job* job) {
+    qimg_parallel_drain(((qimg_parallel_job*) job)->par);
+}
+
+static void qimg_parallel_job_discard(qimg_job* job) {
+    qimg_parallel_unref(((qimg_parallel_job*) job)->par);
+    free(job);
+}
+
+void qimg_parallel_for(void (*task)(void* arg, int i), void* arg, int n,
+                       void* user) {
+    qimg_pool* pool = user;
+    int n_helpers = n - 1 < pool->n_threads ? n - 1 : pool->n_threads;
+    if (n_helpers <= 0) {
+        for (int i = 0; i < n; ++i)
+            task(arg, i);
+        return;
+    }
+    qimg_parallel* par = malloc(sizeof(qimg_parallel));
+    par->task = task;
+    par->arg = arg;
+    par->n = n;
+    par->next = 0;
+    par->pending = n;
+    par->refs = 1 + n_helpers;
+    pthread_mutex_init(&par->lock, NULL);
+    pthread_cond_init(&par->done, NULL);
+
+    /* Helpers go ahead of queued loads, the image being decoded is needed
+     * first */
+    qimg_parallel_job* helpers[MAX_THREADS];
+    for (int i = 0; i < n_helpers; ++i) {
+        helpers[i] = malloc(sizeof(qimg_parallel_job));
+        helpers[i]->job.run = qimg_parallel_job_run;
+        helpers[i]->job.discard = qimg_parallel_job_discard;
+        helpers[i]->par = par;
+        qimg_pool_submit_urgent(pool, &helpers[i]->job);
+    }
+    qimg_parallel_drain(par);
+
+    /* Only wait for iterations already started, helpers that never got a
+     * worker are dropped unrun */
+    pthread_mutex_lock(&par->lock);
+    while (par->pending)
+        pthread_cond_wait(&par->done, &par->lock);
+    pthread_mutex_unlock(&par->lock);
+    for (int i = 0; i < n_helpers; ++i)
+        qimg_pool_release(pool, &helpers[i]->job);
+    qimg_parallel_unref(par);
+}
+
+void qimg_pool_destroy(qimg_pool* pool) {
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    for (qimg_job* job = pool->running; job; job = job->next)
+        job->cancelled = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->n_threads; ++i)
+        pthread_join(pool->threads[i], NULL);
+
+    qimg_job* queues[2] = {pool->head, pool->idle_head};
+    for (int i = 0; i < 2; ++i) {
+        while (queues[i]) {
+            qimg_job* job = queues[i];
+            queues[i] = job->next;
+            job->discard(job);
+        }
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool);
+}
+
+qimg_fb* qimg_open_fb(int idx) {
+    /* Append device index to the framebuffer device path */
+    char idx_buf[FB_IDX_MAX_SIZE];
+    assertf(snprintf(idx_buf, FB_IDX_MAX_SIZE, "%d", idx) <
             FB_IDX_MAX_SIZE, "Framebuffer index overflow");
     char dev_path[FB_IDX_MAX_SIZE + sizeof(FB_DEV_BASE)] = FB_DEV_BASE;
     strncat(dev_path, idx_buf, FB_IDX_MAX_SIZE);
 
-    return qimg_open_fb_from_path(dev_path);
+    return qimg_open_fb_from_path(dev_path);
+}
+
+qimg_fb* qimg_open_fb_from_path(const char* path) {
+    qimg_fb* fb = malloc(sizeof(qimg_fb));
+    fb->fbfd = open(path, O_RDWR);
+    assertf(fb->fbfd >= 0, "Framebuffer device fopen() failed");
+
+    /* Get framebuffer information */
+    struct fb_var_screeninfo vinfo;
+    ioctl(fb->fbfd, FBIOGET_VSCREENINFO, &vinfo);
+
+    fb->res.x = (int) vinfo.xres;
+    fb->res.y = (int) vinfo.yres;
+    unsigned int fb_bpp = vinfo.bits_per_pixel;
+    unsigned int fb_bytes = fb_bpp / 8;
+    assertf(fb_bpp == 32, "Unsupported framebuffer depth %u bpp", fb_bpp);
+
+    /* Channel layout, alpha takes the spare bits if the driver names none */
+    fb->depth = (int) vinfo.red.length;
+    assertf((fb->depth == 8 || fb->depth == 10) &&
+            vinfo.green.length == vinfo.red.length &&
+            vinfo.blue.length == vinfo.red.length,
+            "Unsupported framebuffer format %u:%u:%u", vinfo.red.length,
+            vinfo.green.length, vinfo.blue.length);
+    fb->shift[0] = (int) vinfo.red.offset;
+    fb->shift[1] = (int) vinfo.green.offset;
+    fb->shift[2] = (int) vinfo.blue.offset;
+    fb->shift[3] = vinfo.transp.length ? (int) vinfo.transp.offset :
+                                         3 * fb->depth;
+    fb->alpha_bits = vinfo.transp.length ? (int) vinfo.transp.length :
+                                           32 - 3 * fb->depth;
+    fb->native = fb->depth == 8 && fb->shift[0] == 16 && fb->shift[1] == 8 &&
+                 fb->shift[2] == 0 && fb->shift[3] == 24;
+    fb->dither = false;
+    memset(&fb->damage, 0, sizeof(fb->damage));
+
+    /* Calculate data size and map framebuffer to memory */
+    fb->size = fb->res.x * fb->res.y * fb_bytes;
+    fb->fbdata = mmap(0, fb->size,
+                        PROT_READ | PROT_WRITE, MAP_SHARED, fb->fbfd, (off_t) 0);
+
+    return fb;
+}
+
+void qimg_clear_framebuffer(qimg_fb* fb) {
+    memset(fb->fbdata, 0, fb->size);
+}
+
+/**
+ * @brief Cuts the parts of `r` outside of `cut` into `out`
+ * @param r     rectangle
+ * @param cut   rectangle to remove
+ * @param out   receives up to four non-overlapping pieces
+ * @return number of pieces
+ */
+static int qimg_rect_subtract(qimg_rect r, qimg_rect cut, qimg_rect* out) {
+    if (cut.x0 >= r.x1 || cut.x1 <= r.x0 || cut.y0 >= r.y1 || cut.y1 <= r.y0) {
+        out[0] = r;
+        return 1;
+    }
+    int n = 0;
+    int y0 = cut.y0 > r.y0 ? cut.y0 : r.y0;
+    int y1 = cut.y1 < r.y1 ? cut.y1 : r.y1;
+    if (r.y0 < y0)
+        out[n++] = (qimg_rect) {r.x0, r.y0, r.x1, y0};
+    if (y1 < r.y1)
+        out[n++] = (qimg_rect) {r.x0, y1, r.x1, r.y1};
+    if (r.x0 < cut.x0)
+        out[n++] = (qimg_rect) {r.x0, y0, cut.x0, y1};
+    if (cut.x1 < r.x1)
+        out[n++] = (qimg_rect) {cut.x1, y0, r.x1, y1};
+    return n;
+}
+
+void qimg_track_damage(qimg_fb* fb, qimg_rect r) {
+    qimg_damage* d = &fb->damage;
+    r.x0 = r.x0 < 0 ? 0 : r.x0;
+    r.y0 = r.y0 < 0 ? 0 : r.y0;
+    r.x1 = r.x1 > fb->res.x ? fb->res.x : r.x1;
+    r.y1 = r.y1 > fb->res.y ? fb->res.y : r.y1;
+    if (r.x1 <= r.x0 || r.y1 <= r.y0)
+        return;
+
+    /* Carve out everything saved already, each cut splits a piece into at
+     * most four */
+    int n = 1, cap = 16;
+    qimg_rect* pieces = malloc(cap * sizeof(qimg_rect));
+    pieces[0] = r;
+    for (int i = 0; i < d->n && n; ++i) {
+        qimg_rect* next = malloc(4 * n * sizeof(qimg_rect));
+        int m = 0;
+        for (int j = 0; j < n; ++j)
+            m += qimg_rect_subtract(pieces[j], d->rects[i], next + m);
+        free(pieces);
+        pieces = next;
+        n = m;
+    }
+
+    for (int j = 0; j < n; ++j) {
+        qimg_rect p = pieces[j];
+        size_t w = (size_t) (p.x1 - p.x0);
+        size_t area = w * (size_t) (p.y1 - p.y0);
+        if (d->n == d->cap) {
+            d->cap = d->cap ? 2 * d->cap : 16;
+            d->rects = realloc(d->rects, d->cap * sizeof(qimg_rect));
+        }
+        if (d->n_pixels + area > d->cap_pixels) {
+            d->cap_pixels = 2 * (d->n_pixels + area);
+            d->pixels = realloc(d->pixels, d->cap_pixels * sizeof(uint32_t));
+        }
+        uint32_t* dst = d->pixels + d->n_pixels;
+        for (int y = p.y0; y < p.y1; ++y, dst += w)
+            memcpy(dst, (uint32_t*) fb->fbdata + (size_t) y * fb->res.x + p.x0,
+                   w * sizeof(uint32_t));
+        d->rects[d->n++] = p;
+        d->n_pixels += area;
+    }
+    free(pieces);
+}
+
+void qimg_restore_framebuffer(qimg_fb* fb) {
+    qimg_damage* d = &fb->damage;
+    const uint32_t* src = d->pixels;
+    for (int i = 0; i < d->n; ++i) {
+        qimg_rect p = d->rects[i];
+        size_t w = (size_t) (p.x1 - p.x0);
+        for (int y = p.y0; y < p.y1; ++y, src += w)
+            memcpy((uint32_t*) fb->fbdata + (size_t) y * fb->res.x + p.x0, src,
+                   w * sizeof(uint32_t));
+    }
+    d->n = 0;
+    d->n_pixels = 0;
+}
+
+/**
+ * @brief Records one command to paint latency sample
+ * @param lat       latency statistics
+ * @param us        latency in microseconds
+ * @param cached    the command hit a cached frame
+ */
+static void qimg_record_latency(qimg_latency* lat, uint64_t us, bool cached) {
+    ++lat->n;
+    lat->total_us += us;
+    if (us > lat->max_us)
+        lat->max_us = us;
+    if (cached) {
+        ++lat->n_cached;
+        lat->cached_total_us += us;
+        if (us > lat->cached_max_us)
+            lat->cached_max_us = us;
+        if (us > FRAME_BUDGET_US)
+            ++lat->n_over;
+    }
+}
+
+void qimg_print_latency(const qimg_latency* lat) {
+    if (!lat->n)
+        return;
+    log_msg("Keypress to paint latency: %d keypresses, avg %.2f ms, "
+            "max %.2f ms", lat->n, lat->total_us / 1000.0 / lat->n,
+            lat->max_us / 1000.0);
+    if (lat->n_cached)
+        log_msg("  cached frames: %d keypresses, avg %.2f ms, max %.2f ms, "
+                "%d over one frame (%.2f ms)", lat->n_cached,
+                lat->cached_total_us / 1000.0 / lat->n_cached,
+                lat->cached_max_us / 1000.0, lat->n_over,
+                FRAME_BUDGET_US / 1000.0);
+}
+
+/**
+ * @brief Arms a timerfd
+ * @param fd        timer descriptor
+ * @param ms        time until expiry, 0 to disarm
+ * @param periodic  keep expiring every `ms` milliseconds
+ */
+static void qimg_set_timer(int fd, uint32_t ms, bool periodic) {
+    struct itimerspec ts = {{0, 0}, {0, 0}};
+    ts.it_value.tv_sec = ms / 1000;
+    ts.it_value.tv_nsec = (long) (ms % 1000) * 1000000;
+    if (periodic)
+        ts.it_interval = ts.it_value;
+    timerfd_settime(fd, 0, &ts, NULL);
+}
+
+/**
+ * @brief Opens the control socket. A stale socket left at `path` by an
+ * earlier run is replaced. Exits on failure.
+ * @param path  socket path
+ * @return socket descriptor
+ */
+static int qimg_open_control(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    assertf(strlen(path) < sizeof(addr.sun_path),
+            "Control socket path %s is too long", path);
+    strcpy(addr.sun_path, path);
+
+    struct stat st;
+    if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+        unlink(path);
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    assertf(fd >= 0, "Creating control socket failed");
+    assertf(!bind(fd, (struct sockaddr*) &addr, sizeof(addr)),
+            "Binding control socket %s failed", path);
+    return fd;
+}
+
+/**
+ * @brief Reads pending control socket commands
+ * @param fd        control socket
+ * @param cmds      receives the commands
+ * @param size      room in `cmds`
+ * @param target    receives the slide of a goto command
+ * @return number of commands read
+ */
+static int qimg_read_control(int fd, qimg_command* cmds, int size,
+                             int* target) {
+    char msg[256];
+    ssize_t len;
+    int n = 0;
+    while (n < size && (len = recv(fd, msg, sizeof(msg) - 1, 0)) >= 0) {
+        msg[len] = '\0';
+        char* save = NULL;
+        for (char* line = strtok_r(msg, "\r\n", &save); line && n < size;
+             line = strtok_r(NULL, "\r\n", &save)) {
+            int slide;
+            if (sscanf(line, "goto %d", &slide) == 1) {
+                *target = slide - 1;
+                cmds[n++] = CMD_GOTO;
+                continue;
+            }
+            size_t j, count = sizeof(qimg_command_conversion) /
+                              sizeof(qimg_command_conversion[0]);
+            for (j = 0; j < count; ++j)
+                if (!strcmp(line, qimg_command_conversion[j].str))
+                    break;
+            if (j < count)
+                cmds[n++] = qimg_command_conversion[j].en;
+            else
+                log_msg("Unknown control command %s", line);
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief Reads pending signals
+ * @param fd        signalfd
+ * @param cmds      receives the commands the signals stand for
+ * @param size      room in `cmds`
+ * @return number of commands read
+ */
+static int qimg_read_signals(int fd, qimg_command* cmds, int size) {
+    struct signalfd_siginfo si;
+    int n = 0;
+    while (n < size && read(fd, &si, sizeof(si)) == sizeof(si)) {
+        switch (si.ssi_signo) {
+        case SIGUSR1:
+            cmds[n++] = CMD_NEXT;
+            break;
+        case SIGUSR2:
+            cmds[n++] = CMD_PREV;
+            break;
+        case SIGHUP:
+            cmds[n++] = CMD_RELOAD;
+            break;
+        default:
+            cmds[n++] = CMD_QUIT;
+            break;
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief Turns keys into commands. Arrow keys come as `\e[` or `\eO`
+ * sequences; up and left go back, down and right forward.
+ * @param keys      keys read from the terminal
+ * @param len       number of keys
+ * @param flush     an escape sequence cut off at the end is a lone escape,
+ *                  otherwise it is kept for the next read
+ * @param cmds      receives the commands of known keys
+ * @param size      room in `cmds`
+ * @return number of commands
+ */
+static int qimg_parse_keys(const char* keys, int len, bool flush,
+                           qimg_command* cmds, int size) {
+    int n = 0;
+    key_seq_len = 0;
+    for (int i = 0; i < len && n < size; ++i) {
+        char key = keys[i];
+        if (key == '\e') {
+            bool csi = i + 1 < len && (keys[i + 1] == '[' || keys[i + 1] == 'O');
+            if (!flush && (i + 1 == len || (csi && i + 2 == len))) {
+                key_seq_len = len - i;
+                memcpy(key_seq, keys + i, key_seq_len);
+                key_seq_ms = qimg_get_millis();
+                break;
+            }
+            if (!csi || i + 2 == len)
+                continue; /* Lone escape, the keys after it count alone */
+            char code = keys[i + 2];
+            i += 2;
+            if (code == 'A' || code == 'D')
+                key = 'p';
+            else if (code == 'B' || code == 'C')
+                key = 'n';
+            else
+                continue;
+        }
+
+        qimg_command cmd = CMD_NONE;
+        switch (key) {
+        case 'q': cmd = CMD_QUIT; break;
+        case ' ': cmd = CMD_TOGGLE; break;
+        case 'n': cmd = CMD_NEXT; break;
+        case 'p': cmd = CMD_PREV; break;
+        case 'l': cmd = CMD_RELOAD; break;
+        case '+':
+        case '=': cmd = CMD_ZOOM_IN; break;
+        case '-': cmd = CMD_ZOOM_OUT; break;
+        case 'r': cmd = CMD_ROTATE; break;
+        case '0': cmd = CMD_RESET_VIEW; break;
+        case '[': cmd = CMD_WINDOW_NARROW; break;
+        case ']': cmd = CMD_WINDOW_WIDEN; break;
+        case ',': cmd = CMD_LEVEL_DOWN; break;
+        case '.': cmd = CMD_LEVEL_UP; break;
+        case 'a': cmd = CMD_WINDOW_FIT; break;
+        case 'w': cmd = CMD_WINDOW_RESET; break;
+        }
+        if (cmd != CMD_NONE)
+            cmds[n++] = cmd;
+    }
+    return n;
+}
+
+/**
+ * @brief Tells how long a kept escape sequence start may still wait for the
+ * rest of it
+ * @return milliseconds left, 0 once it is a lone escape, -1 if none is kept
+ */
+static int qimg_keys_timeout(void) {
+    if (!key_seq_len)
+        return -1;
+    uint32_t elapsed = qimg_get_millis() - key_seq_ms;
+    return elapsed < ESCAPE_TIMEOUT_MS ? (int) (ESCAPE_TIMEOUT_MS - elapsed) : 0;
+}
+
+/**
+ * @brief Takes a kept escape sequence start that timed out as a lone escape
+ * @param cmds      receives the commands of the keys after the escape
+ * @param size      room in `cmds`
+ * @return number of commands
+ */
+static int qimg_flush_keys(qimg_command* cmds, int size) {
+    if (qimg_keys_timeout())
+        return 0;
+    char keys[sizeof(key_seq)];
+    int len = key_seq_len;
+    memcpy(keys, key_seq, len);
+    return qimg_parse_keys(keys, len, true, cmds, size);
+}
+
+/**
+ * @brief Reads pending keypresses. An escape sequence split across reads is
+ * put back together, one left incomplete for #ESCAPE_TIMEOUT_MS is taken
+ * as a lone escape.
+ * @param cmds      receives the commands of known keys
+ * @param size      room in `cmds`
+ * @return number of commands read, -1 if the terminal is gone
+ */
+static int qimg_read_keys(qimg_command* cmds, int size) {
+    int n = qimg_flush_keys(cmds, size);
+    char keys[sizeof(key_seq) + 32];
+    int kept = key_seq_len;
+    memcpy(keys, key_seq, kept);
+    ssize_t len = read(STDIN_FILENO, keys + kept, sizeof(keys) - kept);
+    if (len <= 0)
+        return -1;
+    return n + qimg_parse_keys(keys, kept + len, false, cmds + n, size - n);
+}
+
+/**
+ * @brief Handles pending change events of the input files
+ *
+ * Changed inputs are dropped from the frame cache. Files replaced by a
+ * rename lose their watch, which is then set up again on the new file.
+ * Inputs that no longer exist keep their cached frame.
+ *
+ * @param fd    inotify descriptor
+ * @param dcol  dynamic collection
+ * @param wds   watch of each input, -1 if none
+ * @return true if the asset under the cursor changed
+ */
+static bool qimg_read_inotify(int fd, qimg_dyn_collection* dcol, int* wds) {
+    char ev_buf[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool current = false;
+    ssize_t len;
+    while ((len = read(fd, ev_buf, sizeof(ev_buf))) > 0) {
+        const char* p = ev_buf;
+        while (p < ev_buf + len) {
+            const struct inotify_event* ev = (const struct inotify_event*) p;
+            p += sizeof(struct inotify_event) + ev->len;
+            for (int i = 0; i < dcol->size; ++i) {
+                if (wds[i] != ev->wd)
+                    continue;
+                if (ev->mask & IN_MOVE_SELF) {
+                    /* Moved away, watch the path again once IN_IGNORED
+                     * confirms the removal */
+                    inotify_rm_watch(fd, ev->wd);
+                    continue;
+                }
+                if (ev->mask & IN_IGNORED)
+                    wds[i] = inotify_add_watch(fd, dcol->input_paths[i],
+                                               INPUT_WATCH_MASK);
+                if (!(ev->mask & (IN_CLOSE_WRITE | IN_IGNORED)) ||
+                        access(dcol->input_paths[i], R_OK))
+                    continue;
+                if (dcol->idx >= 0 &&
+                        dcol->assets[i] == dcol->assets[dcol->idx])
+                    current = true;
+                qimg_invalidate(dcol, i);
+            }
+        }
+    }
+    return current;
+}
+
+/**
+ * @brief Computes the Ken Burns view of a slide.
+ *
+ * Slides alternate between zooming in and out between covering the screen
+ * and #KENBURNS_ZOOM times that, while panning across the image between two
+ * opposite points picked from the slide index. Zoom changes geometrically
+ * so that the motion looks steady.
+ *
+ * @param slide slide index
+ * @param t     progress of the motion, 0 to 1
+ * @param res   rotated image size
+ * @param vp    viewport size
+ * @param view  view to animate, its zoom is applied on top
+ */
+static void qimg_kenburns_view(int slide, float t, qimg_point res,
+                               qimg_point vp, qimg_view* view) {
+    float cover = fmaxf((float) vp.x / res.x, (float) vp.y / res.y);
+    float k = (slide & 1) ? powf(KENBURNS_ZOOM, 1.0f - t) :
+                            powf(KENBURNS_ZOOM, t);
+    float z = cover * k * view->zoom;
+
+    /* Pan within the range that keeps the screen covered */
+    uint32_t hash = (uint32_t) slide * 2654435761u;
+    float px = (hash & 0x100) ? 0.15f : 0.85f;
+    float py = (hash & 0x200) ? 0.15f : 0.85f;
+    px += (1.0f - 2.0f * px) * t;
+    py += (1.0f - 2.0f * py) * t;
+    float hw = vp.x / (2.0f * z);
+    float hh = vp.y / (2.0f * z);
+    view->focus[0] = res.x > 2.0f * hw ? hw + px * (res.x - 2.0f * hw) :
+                                         res.x * 0.5f;
+    view->focus[1] = res.y > 2.0f * hh ? hh + py * (res.y - 2.0f * hh) :
+                                         res.y * 0.5f;
+    view->zoom = z;
+    view->focused = true;
+    view->smooth = true;
+}
+
+/** Event sources shared by the slide loops */
+typedef struct qimg_events {
+    int ep;                 /**< epoll instance all sources are on */
+    int sig_fd;             /**< signalfd */
+    int slide_fd;           /**< slide delay timer */
+    int repaint_fd;         /**< repaint timer, -1 without repainting */
+    int ctl_fd;             /**< control socket, -1 if none */
+    int key_fd;             /**< terminal in interactive mode, -1 otherwise */
+    sigset_t old_sigs;      /**< signal mask to put back when done */
+} qimg_events;
+
+/** What a slide loop was woken up for */
+typedef struct qimg_wakeup {
+    qimg_command cmds[MAX_COMMANDS];    /**< commands read */
+    int n_cmds;                         /**< number of commands */
+    int target;                         /**< slide of a goto command */
+    int ready[MAX_EVENTS];              /**< loop specific sources with
+                                        events, see #qimg_add_event */
+    int n_ready;                        /**< number of ready sources */
+    bool expired;                       /**< slide delay is over */
+    bool repaint;                       /**< screen is due a repaint */
+} qimg_wakeup;
+
+/**
+ * @brief Adds a source to the event loop of a slide loop
+ * @param ev    event sources
+ * @param fd    descriptor to wait on, ignored if negative
+ */
+static void qimg_add_event(qimg_events* ev, int fd) {
+    if (fd < 0)
+        return;
+    struct epoll_event e = {EPOLLIN, {.fd = fd}};
+    assertf(!epoll_ctl(ev->ep, EPOLL_CTL_ADD, fd, &e),
+            "Adding event source failed");
+}
+
+/**
+ * @brief Opens the event sources shared by the slide loops, see
+ * #qimg_run_slideshow. Signals are only taken through the signalfd and the
+ * terminal is in raw mode in interactive mode until #qimg_close_events.
+ * @param ev    receives the sources
+ * @param o     options
+ */
+static void qimg_open_events(qimg_events* ev, const qimg_opts* o) {
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGHUP);
+    sigaddset(&sigs, SIGUSR1);
+    sigaddset(&sigs, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &sigs, &ev->old_sigs);
+
+    ev->ep = epoll_create1(EPOLL_CLOEXEC);
+    assertf(ev->ep >= 0, "Creating event loop failed");
+    ev->sig_fd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+    ev->slide_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    ev->repaint_fd = o->repaint ?
+        timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC) : -1;
+    ev->ctl_fd = o->control_path ? qimg_open_control(o->control_path) : -1;
+    ev->key_fd = o->interactive ? STDIN_FILENO : -1;
+    assertf(ev->sig_fd >= 0 && ev->slide_fd >= 0 &&
+            (!o->repaint || ev->repaint_fd >= 0),
+            "Creating event sources failed");
+    qimg_add_event(ev, ev->sig_fd);
+    qimg_add_event(ev, ev->slide_fd);
+    qimg_add_event(ev, ev->repaint_fd);
+    qimg_add_event(ev, ev->ctl_fd);
+    qimg_add_event(ev, ev->key_fd);
+
+    if (o->repaint)
+        qimg_set_timer(ev->repaint_fd, REPAINT_INTERVAL_MS, true);
+    if (o->interactive)
+        set_tty_raw(true);
+}
+
+/**
+ * @brief Closes the sources opened by #qimg_open_events, sources added with
+ * #qimg_add_event are left to the caller
+ * @param ev    event sources
+ * @param o     options the sources were opened with
+ */
+static void qimg_close_events(qimg_events* ev, const qimg_opts* o) {
+    if (o->interactive)
+        set_tty_raw(false);
+    int fds[] = {ev->sig_fd, ev->slide_fd, ev->repaint_fd, ev->ctl_fd};
+    for (size_t k = 0; k < sizeof(fds) / sizeof(fds[0]); ++k)
+        if (fds[k] >= 0)
+            close(fds[k]);
+    close(ev->ep);
+    if (o->control_path)
+        unlink(o->control_path);
+    sigprocmask(SIG_SETMASK, &ev->old_sigs, NULL);
+}
+
+/**
+ * @brief Waits for events and reads the shared sources. Signals, control
+ * socket messages and keys become commands; the terminal going away or the
+ * event loop failing is a quit command.
+ * @param ev        event sources
+ * @param target    slide to show next, kept as the goto target if no goto
+ *                  command comes
+ * @param w         receives what happened
+ */
+static void qimg_wait_events(qimg_events* ev, int target, qimg_wakeup* w) {
+    w->n_cmds = 0;
+    w->target = target;
+    w->n_ready = 0;
+    w->expired = false;
+    w->repaint = false;
+
+    /* A kept escape sequence start is waited on only for a short while */
+    struct epoll_event evs[MAX_EVENTS];
+    int n = epoll_wait(ev->ep, evs, MAX_EVENTS, qimg_keys_timeout());
+    if (n < 0 && errno != EINTR)
+        w->cmds[w->n_cmds++] = CMD_QUIT;
+    w->n_cmds += qimg_flush_keys(w->cmds + w->n_cmds,
+                                 MAX_COMMANDS - w->n_cmds);
+    for (int e = 0; e < n; ++e) {
+        int fd = evs[e].data.fd;
+        int room = MAX_COMMANDS - w->n_cmds;
+        uint64_t count;
+        if (fd == ev->slide_fd) {
+            if (read(fd, &count, sizeof(count)) == sizeof(count))
+                w->expired = true;
+        } else if (fd == ev->repaint_fd) {
+            if (read(fd, &count, sizeof(count)) == sizeof(count))
+                w->repaint = true;
+        } else if (fd == ev->sig_fd) {
+            w->n_cmds += qimg_read_signals(fd, w->cmds + w->n_cmds, room);
+        } else if (fd == ev->ctl_fd) {
+            w->n_cmds += qimg_read_control(fd, w->cmds + w->n_cmds, room,
+                                           &w->target);
+        } else if (fd == ev->key_fd) {
+            int k = qimg_read_keys(w->cmds + w->n_cmds, room);
+            if (k < 0 && room > 0)
+                w->cmds[w->n_cmds++] = CMD_QUIT;
+            else if (k > 0)
+                w->n_cmds += k;
+        } else {
+            w->ready[w->n_ready++] = fd;
+        }
+    }
+}
+
+/**
+ * @brief Sets the slide timer to what is left of the delay of the current
+ * slide, at least a millisecond
+ * @param ev        event sources
+ * @param o         options
+ * @param start     when the slide was shown
+ * @param paused    slideshow is paused, the timer is stopped
+ */
+static void qimg_arm_slide_timer(qimg_events* ev, const qimg_opts* o,
+                                 uint32_t start, bool paused) {
+    uint32_t delay_ms = o->slide_delay_s * 1000;
+    uint32_t elapsed = qimg_get_millis() - start;
+    uint32_t left = elapsed < delay_ms ? delay_ms - elapsed : 1;
+    qimg_set_timer(ev->slide_fd, paused || !delay_ms ? 0 : left, false);
+}
+
+/**
+ * @brief Tells whether the last slide stays up instead of ending the
+ * slideshow, as with keyboard control or a repainted single image
+ * @param o     options
+ * @return true to hold the last slide
+ */
+static bool qimg_holds_last_slide(const qimg_opts* o) {
+    return o->interactive ||
+           (!o->slide_delay_s && (o->repaint || o->hide_cursor));
+}
+
+/**
+ * @brief Picks the slide to move to once the current one has been shown
+ * @param o     options
+ * @param idx   current slide
+ * @param n     number of slides
+ * @return next slide, idx to stay, -1 to end the slideshow
+ */
+static int qimg_next_slide(const qimg_opts* o, int idx, int n) {
+    if ((o->loop && n > 1) || idx < n - 1)
+        return idx + 1;
+    return qimg_holds_last_slide(o) ? idx : -1;
+}
+
+/**
+ * @brief Brings a slide index into range, wrapping around when looping
+ * @param idx   slide index
+ * @param n     number of slides
+ * @param loop  wrap instead of stopping at the ends
+ * @return valid slide index
+ */
+static int qimg_wrap_slide(int idx, int n, bool loop) {
+    if (loop)
+        return ((idx % n) + n) % n;
+    return idx < 0 ? 0 : (idx >= n ? n - 1 : idx);
+}
+
+/**
+ * @brief Copies a region of a back buffer to the screen, leaving everything
+ * else on it alone
+ * @param fb    target framebuffer
+ * @param buf   back buffer of the framebuffer's size
+ * @param r     region, within the framebuffer
+ */
+static void qimg_copy_rect(qimg_fb* fb, const char* buf, qimg_rect r) {
+    size_t stride = (size_t) fb->res.x * 4;
+    size_t offset = (size_t) r.y0 * stride + (size_t) r.x0 * 4;
+    size_t len = (size_t) (r.x1 - r.x0) * 4;
+    if (r.x1 <= r.x0)
+        return;
+    if (len == stride) {
+        memcpy(fb->fbdata + offset, buf + offset, len * (r.y1 - r.y0));
+        return;
+    }
+    for (int y = r.y0; y < r.y1; ++y, offset += stride)
+        memcpy(fb->fbdata + offset, buf + offset, len);
+}
+
+void qimg_run_slideshow(qimg_dyn_collection* dcol, qimg_fb* fb,
+                        const qimg_opts* o, int notify_fd, qimg_latency* lat) {
+    /* Back buffer starts from the current framebuffer contents so that
+     * disabled background keeps whatever was on the screen */
+    char* buf = malloc(fb->size);
+    memcpy(buf, fb->fbdata, fb->size);
+
+    qimg_view view = {1.0f, 0, NULL, {0.0f, 0.0f}, false, false, {0}};
+    qimg_image* im = NULL;      /* current slide, NULL while it loads */
+    qimg_image* pv = NULL;      /* preview shown while the slide loads */
+    float pv_zoom = 1.0f;       /* zoom bringing the preview to full size */
+    bool failed = false;        /* current slide failed to load */
+    uint32_t delay_ms = o->slide_delay_s * 1000;
+    uint32_t start = 0;         /* when the current slide was shown */
+    uint64_t key_us = 0;        /* pending command to measure, 0 if none */
+    bool key_cached = false;    /* pending command hit a cached frame */
+    bool run = true;            /* cleared to leave the event loop */
+    bool paused = false;
+    bool dirty = true;
+    bool reload = true;         /* current slide has to be fetched again */
+    bool expired = false;       /* current slide has been shown long enough */
+    bool rearm = false;         /* slide timer has to be set again */
+    bool previews = o->interactive || o->preview;
+    uint32_t motion_ms = delay_ms ? delay_ms : KENBURNS_DEFAULT_MS;
+    float motion = 0.0f;        /* Ken Burns progress when last resumed */
+    uint32_t motion_start = 0;  /* when the motion was last resumed */
+    bool animate = false;       /* frame timer is running */
+    /* Keep the last slide up instead of exiting after it */
+    bool hold = qimg_holds_last_slide(o);
+    int target = 0;             /* slide to show next */
+    int center = o->window_width ? o->window_center : 32768;
+    int width = o->window_width ? o->window_width : 65536;
+    uint16_t* window = malloc(65536 * sizeof(uint16_t));
+    if (o->window_width) {
+        qimg_build_window_lut(window, center, width);
+        view.window = window;
+    }
+
+    /* Signals are only taken through the signalfd from here on */
+    qimg_events ev;
+    qimg_open_events(&ev, o);
+    int frame_fd = o->kenburns ?
+        timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC) : -1;
+    int watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    assertf(!o->kenburns || frame_fd >= 0, "Creating event sources failed");
+    qimg_add_event(&ev, frame_fd);
+    qimg_add_event(&ev, watch_fd);
+    qimg_add_event(&ev, notify_fd);
+
+    int* wds = malloc(dcol->size * sizeof(int));
+    for (int i = 0; i < dcol->size; ++i)
+        wds[i] = watch_fd < 0 ? -1 : inotify_add_watch(
+                    watch_fd, dcol->input_paths[i], INPUT_WATCH_MASK);
+
+    while (run) {
+        if (reload || target != dcol->idx) {
+            bool moved = target != dcol->idx;
+            qimg_free_image(pv);
+            pv = NULL;
+            im = qimg_try_get_at(dcol, target);
+            target = dcol->idx;
+            failed = !im && qimg_is_cached(dcol, target);
+            if (!im && !failed && previews)
+                pv = qimg_load_preview(dcol->input_paths[target], dcol->vp,
+                                       dcol->scale, &pv_zoom);
+            if (!im && !failed && !pv) { /* Nothing to show meanwhile */
+                im = qimg_get_at(dcol, target);
+                failed = !im;
+            }
+            if (moved) {
+                start = qimg_get_millis();
+                motion = 0.0f;
+                motion_start = start;
+                expired = false;
+                rearm = true;
+            }
+            reload = false;
+            dirty = true;
+        }
+        if (!im && !failed && qimg_is_cached(dcol, target)) {
+            /* Full image is ready, replace the preview */
+            im = qimg_get_at(dcol, target);
+            failed = !im;
+            qimg_free_image(pv);
+            pv = NULL;
+            dirty = true;
+        }
+        if (dirty) {
+            qimg_image* shown = im ? im : pv;
+            qimg_view v = view;
+            if (!im && pv && !o->kenburns) { /* Ken Burns covers anyway */
+                v.zoom *= pv_zoom;
+                v.smooth = true;
+            }
+            if (o->kenburns) {
+                float t = motion;
+                if (!paused)
+                    t += (float) (qimg_get_millis() - motion_start) / motion_ms;
+                t = t > 1.0f ? 1.0f : t;
+                if (shown) {
+                    qimg_point res = shown->res;
+                    if (view.rotation & 1)
+                        res = (qimg_point) {shown->res.y, shown->res.x};
+                    qimg_kenburns_view(dcol->idx, t, res, fb->res, &v);
+                }
+
+                /* Frames keep coming until the motion is over */
+                bool run_frames = shown && !paused && t < 1.0f;
+                if (run_frames != animate)
+                    qimg_set_timer(frame_fd, run_frames ? KENBURNS_FRAME_MS : 0,
+                                   true);
+                animate = run_frames;
+            }
+            qimg_rect r = shown ?
+                qimg_render_image(shown, fb, o->pos, o->bg, &v, buf) :
+                qimg_render_error(fb, o->bg, buf);
+            qimg_track_damage(fb, r);
+            qimg_copy_rect(fb, buf, r);
+            if (key_us)
+                qimg_record_latency(lat, qimg_get_micros() - key_us,
+                                    key_cached);
+            dirty = false;
+            qimg_prefetch(dcol);
+            if ((im || failed) && !delay_ms && !hold)
+                expired = true;
+        }
+        /* A command that painted nothing has nothing to measure */
+        key_us = 0;
+
+        /* Slides are only left once their full image, or the error frame in
+         * its place, has been shown */
+        if (expired && (im || failed) && !paused) {
+            expired = false;
+            int next = qimg_next_slide(o, dcol->idx, dcol->size);
+            if (next < 0)
+                run = false;
+            else
+                target = next;
+            continue;
+        }
+        if (rearm) {
+            qimg_arm_slide_timer(&ev, o, start, paused);
+            rearm = false;
+        }
+
+        qimg_wakeup w;
+        qimg_wait_events(&ev, target, &w);
+        uint64_t now = qimg_get_micros();
+        if (w.expired)
+            expired = true;
+        if (w.repaint)
+            for (int i = 0; i < fb->damage.n; ++i)
+                qimg_copy_rect(fb, buf, fb->damage.rects[i]);
+        for (int e = 0; e < w.n_ready; ++e) {
+            int fd = w.ready[e];
+            uint64_t count;
+            if (fd == frame_fd) {
+                if (read(fd, &count, sizeof(count)) == sizeof(count))
+                    dirty = true;
+            } else if (fd == notify_fd) {
+                /* Background loads finished, a pending preview is swapped
+                 * for the full image on the next iteration */
+                if (read(fd, &count, sizeof(count)) < 0)
+                    continue;
+            } else if (fd == watch_fd) {
+                if (qimg_read_inotify(fd, dcol, wds)) {
+                    im = NULL;
+                    reload = true;
+                }
+                qimg_prefetch(dcol);
+            }
+        }
+
+        for (int k = 0; k < w.n_cmds; ++k) {
+            qimg_command cmd = w.cmds[k];
+            /* Only commands that change something are measured, so state
+             * left by earlier events is set aside while this one runs */
+            int was_target = target;
+            bool was_dirty = dirty, was_reload = reload;
+            dirty = false;
+            reload = false;
+            switch (cmd) {
+            case CMD_NONE:
+                break;
+            case CMD_QUIT:
+                run = false;
+                break;
+            case CMD_PAUSE:
+            case CMD_RESUME:
+            case CMD_TOGGLE:
+                if (!paused)
+                    motion += (float) (qimg_get_millis() - motion_start) /
+                              motion_ms;
+                paused = cmd == CMD_TOGGLE ? !paused : cmd == CMD_PAUSE;
+                start = qimg_get_millis(); /* Resume with a full delay */
+                motion_start = start;
+                rearm = true;
+                dirty = dirty || o->kenburns;
+                break;
+            case CMD_NEXT:
+                target = target + 1;
+                break;
+            case CMD_PREV:
+                target = target - 1;
+                break;
+            case CMD_GOTO:
+                target = w.target;
+                break;
+            case CMD_RELOAD:
+                qimg_invalidate(dcol, dcol->idx);
+                im = NULL;
+                reload = true;
+                break;
+            case CMD_ZOOM_IN:
+                view.zoom = view.zoom * ZOOM_STEP > ZOOM_MAX ?
+                            ZOOM_MAX : view.zoom * ZOOM_STEP;
+                dirty = true;
+                break;
+            case CMD_ZOOM_OUT:
+                view.zoom = view.zoom / ZOOM_STEP < ZOOM_MIN ?
+                            ZOOM_MIN : view.zoom / ZOOM_STEP;
+                dirty = true;
+                break;
+            case CMD_ROTATE:
+                view.rotation = (view.rotation + 1) % 4;
+                dirty = true;
+                break;
+            case CMD_RESET_VIEW:
+                view.zoom = 1.0f;
+                view.rotation = 0;
+                dirty = true;
+                break;
+            case CMD_WINDOW_NARROW:
+            case CMD_WINDOW_WIDEN:
+            case CMD_LEVEL_DOWN:
+            case CMD_LEVEL_UP:
+            case CMD_WINDOW_FIT:
+            case CMD_WINDOW_RESET:
+                if (cmd == CMD_WINDOW_NARROW)
+                    width = (int) (width / WINDOW_STEP);
+                else if (cmd == CMD_WINDOW_WIDEN)
+                    width = (int) (width * WINDOW_STEP);
+                else if (cmd == CMD_LEVEL_DOWN)
+                    center -= width / 10 + 1;
+                else if (cmd == CMD_LEVEL_UP)
+                    center += width / 10 + 1;
+                else if (cmd == CMD_WINDOW_FIT && (im || pv)) {
+                    int lo, hi;
+                    qimg_get_sample_range(im ? im : pv, &lo, &hi);
+                    center = (lo + hi + 1) / 2;
+                    width = hi - lo + 1;
+                }
+                width = width < WINDOW_MIN ? WINDOW_MIN :
+                        (width > 4 * 65536 ? 4 * 65536 : width);
+                center = center < 0 ? 0 : (center > 65535 ? 65535 : center);
+                if (cmd == CMD_WINDOW_RESET) {
+                    center = 32768;
+                    width = 65536;
+                    view.window = NULL;
+                } else {
+                    qimg_build_window_lut(window, center, width);
+                    view.window = window;
+                }
+                dirty = true;
+                break;
+            }
+            target = qimg_wrap_slide(target, dcol->size, dcol->loop);
+            if (!key_us && (dirty || reload || target != was_target)) {
+                key_us = now;
+                key_cached = true;
+            }
+            dirty = dirty || was_dirty;
+            reload = reload || was_reload;
+        }
+        if (key_us && target != dcol->idx)
+            key_cached = qimg_is_cached(dcol, target);
+    }
+    qimg_close_events(&ev, o);
+    if (frame_fd >= 0)
+        close(frame_fd);
+    if (watch_fd >= 0)
+        close(watch_fd);
+    qimg_free_image(pv);
+    free(wds);
+    free(window);
+    free(buf);
+}
+
+qimg_point qimg_translate_coords(qimg_position pos, qimg_point dims,
+                                 qimg_point vp, int x, int y) {
+    qimg_point out;
+    switch (pos) {
+    case POS_TOP_LEFT:
+        out.x = x;
+        out.y = y;
+        break;
+    case POS_TOP_RIGHT:
+        out.x = x - (vp.x - dims.x);
+        out.y = y;
+        break;
+    case POS_BOTTOM_RIGHT:
+        out.x = x - (vp.x - dims.x);
+        out.y = y - (vp.y - dims.y);
+        break;
+    case POS_BOTTOM_LEFT:
+        out.x = x;
+        out.y = y - (vp.y - dims.y);
+        break;
+    case POS_CENTERED:
+        out.x = x - ((vp.x / 2) - (dims.x / 2));
+        out.y = y - ((vp.y / 2) - (dims.y / 2));
+        break;
+    }
+
+    return out;
+}
+
+/** Converts a row of `n` image pixels to framebuffer pixels */
+typedef void (*qimg_convert_fn)(const uint8_t* src, uint8_t* dst, int n);
+
+static void qimg_convert_gray(const uint8_t* src, uint8_t* dst, int n) {
+    for (int i = 0; i < n; ++i) {
+        dst[4 * i + 0] = src[i];
+        dst[4 * i + 1] = src[i];
+        dst[4 * i + 2] = src[i];
+        dst[4 * i + 3] = 0xff;
+    }
+}
+
+static void qimg_convert_gray_alpha(const uint8_t* src, uint8_t* dst, int n) {
+    for (int i = 0; i < n; ++i) {
+        dst[4 * i + 0] = src[2 * i];
+        dst[4 * i + 1] = src[2 * i];
+        dst[4 * i + 2] = src[2 * i];
+        dst[4 * i + 3] = src[2 * i + 1];
+    }
+}
+
+static void qimg_convert_rgb(const uint8_t* src, uint8_t* dst, int n) {
+    for (int i = 0; i < n; ++i) {
+        dst[4 * i + 0] = src[3 * i + 2];
+        dst[4 * i + 1] = src[3 * i + 1];
+        dst[4 * i + 2] = src[3 * i + 0];
+        dst[4 * i + 3] = 0xff;
+    }
+}
+
+static void qimg_convert_rgba(const uint8_t* src, uint8_t* dst, int n) {
+    for (int i = 0; i < n; ++i) {
+        dst[4 * i + 0] = src[4 * i + 2];
+        dst[4 * i + 1] = src[4 * i + 1];
+        dst[4 * i + 2] = src[4 * i + 0];
+        dst[4 * i + 3] = src[4 * i + 3];
+    }
+}
+
+static void qimg_convert_bgra(const uint8_t* src, uint8_t* dst, int n) {
+    memcpy(dst, src, (size_t) n * 4);
+}
+
+/* Variants of the kernels above looking colors up in the adjustment tables */
+
+static void qimg_convert_gray_adjusted(const uint8_t* src, uint8_t* dst,
+                                       int n) {
+    const uint8_t *lr = adjust_lut[0], *lg = adjust_lut[1], *lb = adjust_lut[2];
+    for (int i = 0; i < n; ++i) {
+        dst[4 * i + 0] = lb[src[i]];
+        dst[4 * i + 1] = lg[src[i]];
+        dst[4 * i + 2] = lr[src[i]];
+        dst[4 * i + 3] = 0xff;
+    }
+}
+
+static void qimg_convert_gray_alpha_adjusted(const uint8_t* src, uint8_t* dst,
+                                             int n) {
+    const uint8_t *lr = adjust_lut[0], *lg = adjust_lut[1], *lb = adjust_lut[2];
+    for (int i = 0; i < n; ++i) {
+        dst[4 * i + 0] = lb[src[2 * i]];
+        dst[4 * i + 1] = lg[src[2 * i]];
+        dst[4 * i + 2] = lr[src[2 * i]];
+        dst[4 * i + 3] = src[2 * i + 1];
+    }
+}
+
+static void qimg_convert_rgb_adjusted(const uint8_t* src, uint8_t* dst, int n) {
+    const uint8_t *lr = adjust_lut[0], *lg = adjust_lut[1], *lb = adjust_lut[2];
+    for (int i = 0; i < n; ++i) {
+        dst[4 * i + 0] = lb[src[3 * i + 2]];
+        dst[4 * i + 1] = lg[src[3 * i + 1]];
+        dst[4 * i + 2] = lr[src[3 * i + 0]];
+        dst[4 * i + 3] = 0xff;
+    }
+}
+
+static void qimg_convert_rgba_adjusted(const uint8_t* src, uint8_t* dst,
+                                       int n) {
+    const uint8_t *lr = adjust_lut[0], *lg = adjust_lut[1], *lb = adjust_lut[2];
+    for (int i = 0; i < n; ++i) {
+        dst[4 * i + 0] = lb[src[4 * i + 2]];
+        dst[4 * i + 1] = lg[src[4 * i + 1]];
+        dst[4 * i + 2] = lr[src[4 * i + 0]];
+        dst[4 * i + 3] = src[4 * i + 3];
+    }
+}
+
+static void qimg_convert_bgra_adjusted(const uint8_t* src, uint8_t* dst,
+                                       int n) {
+    const uint8_t *lr = adjust_lut[0], *lg = adjust_lut[1], *lb = adjust_lut[2];
+    for (int i = 0; i < n; ++i) {
+        dst[4 * i + 0] = lb[src[4 * i + 0]];
+        dst[4 * i + 1] = lg[src[4 * i + 1]];
+        dst[4 * i + 2] = lr[src[4 * i + 2]];
+        dst[4 * i + 3] = src[4 * i + 3];
+    }
+}
+
+/* Single channel kernels expanding through the false color palette */
+
+static void qimg_convert_gray_colormap(const uint8_t* src, uint8_t* dst,
+                                       int n) {
+    uint32_t* out = (uint32_t*) dst;
+    for (int i = 0; i < n; ++i)
+        out[i] = colormap_px[src[i]];
+}
+
+static void qimg_convert_gray_alpha_colormap(const uint8_t* src, uint8_t* dst,
+                                             int n) {
+    uint32_t* out = (uint32_t*) dst;
+    for (int i = 0; i < n; ++i)
+        out[i] = (colormap_px[src[2 * i]] & 0x00ffffff) |
+                 (uint32_t) src[2 * i + 1] << 24;
+}
+
+/**
+ * @brief Picks the row conversion kernel for given channel count
+ * @param c         image channels
+ * @param bgr       4 channel pixels are BGRA rather than RGBA
+ * @param adjusted  apply the display adjustment tables
+ * @return conversion function
+ */
+static qimg_convert_fn qimg_get_converter(int c, bool bgr, bool adjusted) {
+    switch (c) {
+    case 1:
+        if (colormap)
+            return qimg_convert_gray_colormap;
+        return adjusted ? qimg_convert_gray_adjusted : qimg_convert_gray;
+    case 2:
+        if (colormap)
+            return qimg_convert_gray_alpha_colormap;
+        return adjusted ? qimg_convert_gray_alpha_adjusted :
+                          qimg_convert_gray_alpha;
+    case 3:
+        return adjusted ? qimg_convert_rgb_adjusted : qimg_convert_rgb;
+    default:
+        if (bgr)
+            return adjusted ? qimg_convert_bgra_adjusted : qimg_convert_bgra;
+        return adjusted ? qimg_convert_rgba_adjusted : qimg_convert_rgba;
+    }
+}
+
+/**
+ * @brief Applies the display adjustment tables to a row of 16-bit RGBA
+ * pixels in place, interpolating between table entries
+ * @param px    RGBA pixels
+ * @param n     number of pixels
+ */
+static void qimg_adjust_row(uint16_t* px, int n) {
+    for (int i = 0; i < n; ++i) {
+        for (int k = 0; k < 3; ++k) {
+            const uint16_t* lut = adjust_lut16[k];
+            uint32_t v = px[4 * i + k];
+            uint32_t j = v >> 4, f = v & 0xf;
+            px[4 * i + k] = (uint16_t) ((lut[j] * (16 - f) + lut[j + 1] * f +
+                                         8) >> 4);
+        }
+    }
+}
+
+/**
+ * @brief Widens a row of samples to 16 bits, 8-bit samples are scaled to
+ * the full range
+ * @param src   samples
+ * @param depth bytes per sample
+ * @param dst   16-bit output
+ * @param n     number of samples
+ */
+static void qimg_widen_row(const uint8_t* src, int depth, uint16_t* dst,
+                           int n) {
+    if (depth == 2) {
+        memcpy(dst, src, n * sizeof(uint16_t));
+        return;
+    }
+    for (int i = 0; i < n; ++i)
+        dst[i] = src[i] * 257;
+}
+
+/**
+ * @brief Remaps the color samples of a row of 16-bit pixels through a
+ * window/level table, leaving alpha alone
+ * @param lut   table of 65536 entries
+ * @param s     samples
+ * @param n     number of pixels
+ * @param c     channels
+ */
+static void qimg_window_row(const uint16_t* lut, uint16_t* s, int n, int c) {
+    if (c == 1 || c == 3) {
+        for (int i = 0; i < n * c; ++i)
+            s[i] = lut[s[i]];
+        return;
+    }
+    for (int i = 0; i < n; ++i)
+        for (int k = 0; k < c - 1; ++k)
+            s[i * c + k] = lut[s[i * c + k]];
+}
+
+/**
+ * @brief Expands a row of 16-bit pixels with given channel count to RGBA.
+ * Single channel pixels go through the false color palette if one is set.
+ * @param src   pixels
+ * @param c     channels
+ * @param dst   RGBA output
+ * @param n     number of pixels
+ */
+static void qimg_expand_row(const uint16_t* src, int c, uint16_t* dst,
+                            int n) {
+    if (colormap && c <= 2) {
+        for (int i = 0; i < n; ++i) {
+            uint32_t v = src[i * c];
+            uint32_t j = v >> 8, f = v & 0xff;
+            for (int k = 0; k < 3; ++k)
+                dst[4 * i + k] = (uint16_t) ((colormap_lut16[j][k] * (256 - f) +
+                                              colormap_lut16[j + 1][k] * f +
+                                              128) >> 8);
+            dst[4 * i + 3] = c == 2 ? src[2 * i + 1] : 0xffff;
+        }
+        return;
+    }
+    switch (c) {
+    case 1:
+        for (int i = 0; i < n; ++i) {
+            dst[4 * i + 0] = dst[4 * i + 1] = dst[4 * i + 2] = src[i];
+            dst[4 * i + 3] = 0xffff;
+        }
+        break;
+    case 2:
+        for (int i = 0; i < n; ++i) {
+            dst[4 * i + 0] = dst[4 * i + 1] = dst[4 * i + 2] = src[2 * i];
+            dst[4 * i + 3] = src[2 * i + 1];
+        }
+        break;
+    case 3:
+        for (int i = 0; i < n; ++i) {
+            dst[4 * i + 0] = src[3 * i + 0];
+            dst[4 * i + 1] = src[3 * i + 1];
+            dst[4 * i + 2] = src[3 * i + 2];
+            dst[4 * i + 3] = 0xffff;
+        }
+        break;
+    default:
+        memcpy(dst, src, 4 * n * sizeof(uint16_t));
+        break;
+    }
+}
+
+/**
+ * @brief Swaps red and blue of a row of 16-bit pixels in place, turning
+ * BGRA into RGBA
+ * @param px    pixels
+ * @param n     number of pixels
+ */
+static void qimg_swap_rb_row(uint16_t* px, int n) {
+    for (int i = 0; i < n; ++i) {
+        uint16_t t = px[4 * i + 0];
+        px[4 * i + 0] = px[4 * i + 2];
+        px[4 * i + 2] = t;
+    }
+}
+
+/**
+ * @brief Grades a row of 16-bit RGBA pixels in place with tetrahedral
+ * interpolation. Alpha is left as is.
+ *
+ * The lattice cell is split into six tetrahedra by the ordering of the
+ * fractional coordinates, so each output blends only four entries.
+ *
+ * @param lut   lookup table
+ * @param px    RGBA pixels
+ * @param n     number of pixels
+ */
+static void qimg_lut3d_row(const qimg_lut3d* lut, uint16_t* px, int n) {
+    const int s = lut->size;
+    const uint32_t scale = (uint32_t) (s - 1);
+    /* Entry strides along red, green and blue */
+    const int dr = 3, dg = 3 * s, db = 3 * s * s;
+
+    for (int i = 0; i < n; ++i) {
+        uint16_t* p = px + 4 * i;
+        /* Lattice position in 16.16 fixed point */
+        uint32_t pr = p[0] * scale + (p[0] * scale >> 16);
+        uint32_t pg = p[1] * scale + (p[1] * scale >> 16);
+        uint32_t pb = p[2] * scale + (p[2] * scale >> 16);
+        uint32_t ir = pr >> 16, ig = pg >> 16, ib = pb >> 16;
+        if (ir >= scale) { ir = scale - 1; pr = (ir << 16) + 0x10000; }
+        if (ig >= scale) { ig = scale - 1; pg = (ig << 16) + 0x10000; }
+        if (ib >= scale) { ib = scale - 1; pb = (ib << 16) + 0x10000; }
+        int64_t fr = pr - (ir << 16), fg = pg - (ig << 16),
+                fb = pb - (ib << 16);
+
+        const uint16_t* c000 = lut->table + ir * dr + ig * dg + ib * db;
+        const uint16_t *c1, *c2;
+        int64_t f1, f2, f3;
+        if (fr > fg) {
+            if (fg > fb) {          /* r > g > b */
+                c1 = c000 + dr; c2 = c1 + dg; f1 = fr; f2 = fg; f3 = fb;
+            } else if (fr > fb) {   /* r > b >= g */
+                c1 = c000 + dr; c2 = c1 + db; f1 = fr; f2 = fb; f3 = fg;
+            } else {                /* b >= r > g */
+                c1 = c000 + db; c2 = c1 + dr; f1 = fb; f2 = fr; f3 = fg;
+            }
+        } else {
+            if (fb > fg) {          /* b > g >= r */
+                c1 = c000 + db; c2 = c1 + dg; f1 = fb; f2 = fg; f3 = fr;
+            } else if (fb > fr) {   /* g >= b > r */
+                c1 = c000 + dg; c2 = c1 + db; f1 = fg; f2 = fb; f3 = fr;
+            } else {                /* g >= r >= b */
+                c1 = c000 + dg; c2 = c1 + dr; f1 = fg; f2 = fr; f3 = fb;
+            }
+        }
+        const uint16_t* c111 = c000 + dr + dg + db;
+        for (int k = 0; k < 3; ++k) {
+            int64_t v = ((int64_t) c000[k] << 16) +
+                        (c1[k] - c000[k]) * f1 +
+                        (c2[k] - c1[k]) * f2 +
+                        (c111[k] - c2[k]) * f3;
+            p[k] = (uint16_t) ((v + 0x8000) >> 16);
+        }
+    }
+}
+
+/** 4x4 ordered dither thresholds */
+static const uint8_t qimg_bayer4[4][4] = {
+    {0, 8, 2, 10},
+    {12, 4, 14, 6},
+    {3, 11, 1, 9},
+    {15, 7, 13, 5}
+};
+
+/**
+ * @brief Packs a row of 16-bit RGBA pixels to the framebuffer layout.
+ *
+ * Samples are requantized as (v * max + t) >> 16, where t rounds to nearest
+ * or, with dithering, follows the ordered dither matrix. 8-bit samples
+ * widened by #qimg_widen_row come out unchanged either way.
+ *
+ * @param fb    target framebuffer
+ * @param src   RGBA pixels
+ * @param dst   destination, 4 bytes per pixel
+ * @param n     number of pixels
+ * @param x     framebuffer column of the first pixel
+ * @param y     framebuffer row
+ */
+static void qimg_pack_row(const qimg_fb* fb, const uint16_t* src,
+                          uint8_t* dst, int n, int x, int y) {
+    const uint32_t max = (1u << fb->depth) - 1;
+    const uint32_t amax = (1u << fb->alpha_bits) - 1;
+    const int sr = fb->shift[0], sg = fb->shift[1], sb = fb->shift[2];
+    const int sa = fb->shift[3];
+    uint32_t t[4];
+    for (int i = 0; i < 4; ++i)
+        t[i] = fb->dither ? qimg_bayer4[y & 3][(x + i) & 3] * 4096u + 2048u :
+                            32767u;
+
+    uint32_t* out = (uint32_t*) dst;
+    for (int i = 0; i < n; ++i) {
+        const uint16_t* p = src + 4 * i;
+        uint32_t d = t[i & 3];
+        out[i] = ((p[0] * max + d) >> 16) << sr |
+                 ((p[1] * max + d) >> 16) << sg |
+                 ((p[2] * max + d) >> 16) << sb |
+                 ((p[3] * amax + 32767u) >> 16) << sa;
+    }
+}
+
+/**
+ * @brief Packs a color to a framebuffer pixel
+ * @param fb    target framebuffer
+ * @param c     color
+ * @return pixel value
+ */
+static uint32_t qimg_pack_color(const qimg_fb* fb, qimg_color c) {
+    uint16_t rgba[4] = {c.r * 257, c.g * 257, c.b * 257, c.a * 257};
+    uint32_t px;
+    qimg_pack_row(fb, rgba, (uint8_t*) &px, 1, 0, 0);
+    return px;
+}
+
+/**
+ * @brief Fills a row of framebuffer pixels with a single color
+ * @param dst   destination row
+ * @param px    packed pixel value
+ * @param n     number of pixels
+ */
+static void qimg_fill_row(uint8_t* dst, uint32_t px, int n) {
+    uint32_t* out = (uint32_t*) dst;
+    for (int i = 0; i < n; ++i)
+        out[i] = px;
+}
+
+/**
+ * @brief Gathers a row of a zoomed and rotated image with nearest neighbour
+ * sampling.
+ *
+ * Displayed coordinates (u, v) are mapped back to the source image with
+ * 16.16 fixed point stepping along the row.
+ *
+ * @param im    source image
+ * @param rot   clockwise rotation in quarter turns, 0-3
+ * @param step  source pixels per displayed pixel in 16.16 fixed point
+ * @param u0    first displayed column
+ * @param v     displayed row
+ * @param n     number of pixels to gather
+ * @param dst   destination, n * im->c bytes
+ */
+static void qimg_sample_row(qimg_image* im, int rot, int64_t step, int u0,
+                            int v, int n, uint8_t* dst) {
+    int w = im->res.x;
+    int h = im->res.y;
+    int c = im->c * im->depth;
+    int64_t ru = u0 * step;
+    int64_t rv = (v * step) >> 16;
+    int64_t sx, sy, dx, dy;
+
+    switch (rot) {
+    case 1:
+        sx = rv << 16;
+        sy = ((int64_t) h << 16) - 1 - ru;
+        dx = 0;
+        dy = -step;
+        break;
+    case 2:
+        sx = ((int64_t) w << 16) - 1 - ru;
+        sy = (h - 1 - rv) << 16;
+        dx = -step;
+        dy = 0;
+        break;
+    case 3:
+        sx = (w - 1 - rv) << 16;
+        sy = ru;
+        dx = 0;
+        dy = step;
+        break;
+    default:
+        sx = ru;
+        sy = rv << 16;
+        dx = step;
+        dy = 0;
+        break;
+    }
+
+    for (int i = 0; i < n; ++i, sx += dx, sy += dy) {
+        int x = (int)(sx >> 16);
+        int y = (int)(sy >> 16);
+        x = x < 0 ? 0 : (x >= w ? w - 1 : x);
+        y = y < 0 ? 0 : (y >= h ? h - 1 : y);
+        memcpy(dst + i * c, im->pixels + ((size_t) y * w + x) * c, c);
+    }
+}
+
+/**
+ * @brief Gathers a row of a scaled image with bilinear filtering.
+ *
+ * The two source rows are blended vertically over the span the row covers
+ * first, a plain loop over contiguous samples that the compiler vectorizes,
+ * and the blended span is then resampled horizontally. Positions are source
+ * pixel centers in 16.16 fixed point with 8-bit weights, edges are clamped.
+ *
+ * @param im    source image
+ * @param sx    source column of the first pixel
+ * @param step  source pixels per displayed pixel
+ * @param sy    source row
+ * @param n     number of pixels to gather
+ * @param dst   destination, n * im->c samples in the format of `im`
+ * @param tmp   scratch space, im->res.x * im->c entries
+ */
+static void qimg_sample_row_bilinear(const qimg_image* im, int64_t sx,
+                                     int64_t step, int64_t sy, int n,
+                                     uint8_t* restrict dst,
+                                     uint32_t* restrict tmp) {
+    int w = im->res.x;
+    int h = im->res.y;
+    int c = im->c;
+    int y0 = (int) (sy >> 16);
+    uint32_t fy = (uint32_t) (sy >> 8) & 0xff;
+    if (y0 < 0 || h == 1) {
+        y0 = 0;
+        fy = 0;
+    } else if (y0 >= h - 1) {
+        y0 = h - 1;
+        fy = 0;
+    }
+    int y1 = y0 + (y0 < h - 1);
+
+    /* Columns touched by the row */
+    int64_t xa = sx >> 16;
+    int64_t xb = ((sx + step * (n - 1)) >> 16) + 1;
+    xa = xa < 0 ? 0 : (xa > w - 1 ? w - 1 : xa);
+    xb = xb < 0 ? 0 : (xb > w - 1 ? w - 1 : xb);
+    size_t a = (size_t) xa * c;
+    size_t b = (size_t) (xb + 1) * c;
+    size_t row = (size_t) w * c;
+    if (im->depth == 2) {
+        const uint16_t* r0 = (const uint16_t*) im->pixels + y0 * row;
+        const uint16_t* r1 = (const uint16_t*) im->pixels + y1 * row;
+        for (size_t i = a; i < b; ++i)
+            tmp[i] = r0[i] * (256 - fy) + r1[i] * fy;
+    } else {
+        const uint8_t* r0 = im->pixels + y0 * row;
+        const uint8_t* r1 = im->pixels + y1 * row;
+        for (size_t i = a; i < b; ++i)
+            tmp[i] = r0[i] * (256 - fy) + r1[i] * fy;
+    }
+
+    uint16_t* dst16 = (uint16_t*) dst;
+    for (int i = 0; i < n; ++i, sx += step) {
+        int x0 = (int) (sx >> 16);
+        uint32_t fx = (uint32_t) (sx >> 8) & 0xff;
+        if (x0 < 0) {
+            x0 = 0;
+            fx = 0;
+        } else if (x0 >= w - 1) {
+            x0 = w - 1;
+            fx = 0;
+        }
+        const uint32_t* p0 = tmp + (size_t) x0 * c;
+        const uint32_t* p1 = p0 + (x0 < w - 1 ? c : 0);
+        for (int k = 0; k < c; ++k) {
+            uint64_t v = ((uint64_t) p0[k] * (256 - fx) +
+                          (uint64_t) p1[k] * fx + 0x8000) >> 16;
+            if (im->depth == 2)
+                dst16[i * c + k] = (uint16_t) v;
+            else
+                dst[i * c + k] = (uint8_t) v;
+        }
+    }
+}
+
+qimg_rect qimg_render_image(qimg_image* im, qimg_fb* fb, qimg_position pos,
+                            qimg_bg bg, const qimg_view* view, char* buf) {
+    static const qimg_view identity = {1.0f, 0, NULL, {0.0f, 0.0f}, false,
+                                       false, {0}};
+    if (!view)
+        view = &identity;
+    int rot = ((view->rotation % 4) + 4) % 4;
+    bool transposed = rot & 1;
+    bool smooth = view->smooth && rot == 0;
+    bool direct = rot == 0 && view->zoom == 1.0f && !view->focused;
+
+    /* Displayed image size after rotation and zoom */
+    qimg_point dims;
+    dims.x = (int)((transposed ? im->res.y : im->res.x) * view->zoom);
+    dims.y = (int)((transposed ? im->res.x : im->res.y) * view->zoom);
+    if (dims.x < 1) dims.x = 1;
+    if (dims.y < 1) dims.y = 1;
+
+    /* Framebuffer coordinates of the displayed image origin and the visible
+     * column span */
+    qimg_point org = qimg_translate_coords(pos, dims, fb->res, 0, 0);
+    org.x = -org.x;
+    org.y = -org.y;
+    float ox = (float) org.x;
+    float oy = (float) org.y;
+    if (view->focused) {
+        ox = fb->res.x * 0.5f - view->focus[0] * view->zoom;
+        oy = fb->res.y * 0.5f - view->focus[1] * view->zoom;
+        org.x = (int) floorf(ox);
+        org.y = (int) floorf(oy);
+    }
+    int x0 = org.x > 0 ? org.x : 0;
+    int x1 = org.x + dims.x < fb->res.x ? org.x + dims.x : fb->res.x;
+
+    uint32_t c = qimg_pack_color(fb, qimg_get_bg_color(bg));
+    qimg_convert_fn convert = qimg_get_converter(im->c, im->bgr, adjust);
+    int64_t step = (int64_t)(65536.0f / view->zoom);
+    size_t stride = (size_t) im->c * im->depth;
+    bool grade = lut3d && !lut_bake;
+    bool packed = !fb->native || im->depth != 1 || grade || view->window;
+    uint8_t* scratch = NULL;
+    uint16_t* wide = NULL;
+    if (!direct && x1 > x0)
+        scratch = malloc((size_t)(x1 - x0) * stride);
+    if (packed && x1 > x0)
+        wide = malloc((size_t)(x1 - x0) * 8 * sizeof(uint16_t));
+
+    /* Smooth views sample the smallest mip level that still has at least
+     * one pixel per displayed pixel */
+    const qimg_image* level = im;
+    float level_zoom = view->zoom;
+    uint32_t* blend = NULL;
+    int64_t sx0 = 0;
+    if (smooth) {
+        while (level->half && level_zoom < 0.5f) {
+            level = level->half;
+            level_zoom *= 2.0f;
+        }
+        step = (int64_t) (65536.0f / level_zoom);
+        sx0 = (int64_t) (((x0 + 0.5f - ox) / level_zoom - 0.5f) * 65536.0f);
+        blend = malloc((size_t) level->res.x * level->c * sizeof(uint32_t));
+    }
+
+    for (int y = 0; y < fb->res.y; ++y) {
+        uint8_t* row = (uint8_t*) buf + (size_t) y * fb->res.x * 4;
+        int v = y - org.y;
+        if (v < 0 || v >= dims.y || x1 <= x0) {
+            if (bg != BG_DISABLED) /* Else keep the framebuffer as-is */
+                qimg_fill_row(row, c, fb->res.x);
+            continue;
+        }
+        if (bg != BG_DISABLED) {
+            qimg_fill_row(row, c, x0);
+            qimg_fill_row(row + x1 * 4, c, fb->res.x - x1);
+        }
+
+        int u0 = x0 - org.x;
+        int n = x1 - x0;
+        const uint8_t* src = scratch;
+        if (direct)
+            src = im->pixels + ((size_t) v * im->res.x + u0) * stride;
+        else if (smooth)
+            qimg_sample_row_bilinear(level, sx0, step, (int64_t)
+                                     (((y + 0.5f - oy) / level_zoom - 0.5f) *
+                                      65536.0f), n, scratch, blend);
+        else
+            qimg_sample_row(im, rot, step, u0, v, n, scratch);
+        if (packed) {
+            qimg_widen_row(src, im->depth, wide + 4 * n, n * im->c);
+            if (view->window)
+                qimg_window_row(view->window, wide + 4 * n, n, im->c);
+            qimg_expand_row(wide + 4 * n, im->c, wide, n);
+            if (im->bgr)
+                qimg_swap_rb_row(wide, n);
+            if (grade)
+                qimg_lut3d_row(lut3d, wide, n);
+            if (adjust)
+                qimg_adjust_row(wide, n);
+            qimg_pack_row(fb, wide, row + x0 * 4, n, x0, y);
+        } else {
+            convert(src, row + x0 * 4, n);
+        }
+    }
+    free(scratch);
+    free(wide);
+    free(blend);
+
+    if (bg != BG_DISABLED)
+        return (qimg_rect) {0, 0, fb->res.x, fb->res.y};
+    int y0 = org.y > 0 ? org.y : 0;
+    int y1 = org.y + dims.y < fb->res.y ? org.y + dims.y : fb->res.y;
+    if (x1 <= x0 || y1 <= y0)
+        return (qimg_rect) {0, 0, 0, 0};
+    return (qimg_rect) {x0, y0, x1, y1};
+}
+
+qimg_rect qimg_render_error(qimg_fb* fb, qimg_bg bg, char* buf) {
+    uint32_t c = qimg_pack_color(fb, qimg_get_bg_color(bg));
+    for (int y = 0; y < fb->res.y; ++y)
+        qimg_fill_row((uint8_t*) buf + (size_t) y * fb->res.x * 4, c,
+                      fb->res.x);
+    return (qimg_rect) {0, 0, fb->res.x, fb->res.y};
+}
+
+qimg_bundle* qimg_open_bundle(const char* path) {
+    qimg_bundle* bundle = NULL;
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) &&
+            (size_t) st.st_size >= sizeof(qimg_bundle_header)) {
+        size_t size = (size_t) st.st_size;
+        uint8_t* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED && !memcmp(map, BUNDLE_MAGIC, 8)) {
+            bundle = malloc(sizeof(qimg_bundle));
+            bundle->map = map;
+            bundle->size = size;
+            bundle->header = (const qimg_bundle_header*) map;
+            bundle->frames = (const qimg_bundle_frame*) (bundle->header + 1);
+        } else if (map != MAP_FAILED) {
+            munmap(map, size);
+        }
+    }
+    close(fd);
+    if (!bundle)
+        return NULL;
+
+    /* Every frame has to lie within the file and the screen it was packed
+     * for, so that playback needs no checks beyond the run lengths */
+    const qimg_bundle_header* h = bundle->header;
+    bool ok = h->version == BUNDLE_VERSION && h->page_size &&
+              !(h->page_size % sizeof(uint32_t)) &&
+              h->n_frames <= (bundle->size - sizeof(qimg_bundle_header)) /
+                             sizeof(qimg_bundle_frame);
+    for (uint32_t i = 0; ok && i < h->n_frames; ++i) {
+        const qimg_bundle_frame* frame = &bundle->frames[i];
+        qimg_rect r = frame->rect;
+        ok = !(frame->offset % h->page_size) &&
+             frame->offset <= bundle->size &&
+             frame->size <= bundle->size - frame->offset &&
+             r.x0 >= 0 && r.x0 <= r.x1 && r.x1 <= (int64_t) h->res[0] &&
+             r.y0 >= 0 && r.y0 <= r.y1 && r.y1 <= (int64_t) h->res[1];
+        if (frame->codec == BUNDLE_RAW)
+            ok = ok && frame->size ==
+                 (uint64_t) (r.x1 - r.x0) * (r.y1 - r.y0) * sizeof(uint32_t);
+        else
+            ok = ok && frame->codec == BUNDLE_RLE;
+    }
+    if (!ok) {
+        log_msg("[ERROR]: Bundle %s is damaged", path);
+        qimg_free_bundle(bundle);
+        return NULL;
+    }
+    return bundle;
+}
+
+void qimg_free_bundle(qimg_bundle* bundle) {
+    if (!bundle)
+        return;
+    munmap(bundle->map, bundle->size);
+    free(bundle);
+}
+
+/**
+ * @brief Paints one slide of a bundle, see #qimg_pack for the coding
+ * @param bundle    bundle
+ * @param idx       slide index
+ * @param fb        target framebuffer
+ * @return false if the slide is damaged
+ */
+static bool qimg_blit_frame(const qimg_bundle* bundle, int idx, qimg_fb* fb) {
+    const qimg_bundle_frame* frame = &bundle->frames[idx];
+    qimg_rect r = frame->rect;
+    int w = r.x1 - r.x0;
+    int h = r.y1 - r.y0;
+    const uint32_t* src = (const uint32_t*) (bundle->map + frame->offset);
+    uint32_t* dst = (uint32_t*) fb->fbdata + (size_t) r.y0 * fb->res.x + r.x0;
+    qimg_track_damage(fb, r);
+    if (frame->codec == BUNDLE_RAW) {
+        if (w == fb->res.x)
+            memcpy(dst, src, frame->size);
+        else
+            for (int y = 0; y < h; ++y)
+                memcpy(dst + (size_t) y * fb->res.x, src + (size_t) y * w,
+                       (size_t) w * sizeof(uint32_t));
+        return true;
+    }
+
+    size_t n = frame->size / sizeof(uint32_t);
+    for (int y = 0; y < h; ++y, dst += fb->res.x) {
+        for (int x = 0; x < w;) {
+            if (!n--)
+                return false;
+            uint32_t c = *src++;
+            uint32_t len = c & ~BUNDLE_RUN;
+            if (!len || len > (uint32_t) (w - x) ||
+                    n < ((c & BUNDLE_RUN) ? 1 : len))
+                return false;
+            if (c & BUNDLE_RUN) {
+                qimg_fill_row((uint8_t*) (dst + x), *src++, (int) len);
+                --n;
+            } else {
+                memcpy(dst + x, src, len * sizeof(uint32_t));
+                src += len;
+                n -= len;
+            }
+            x += (int) len;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Starts reading a slide of a bundle in so that showing it does not
+ * wait for the disk
+ * @param bundle    bundle
+ * @param idx       slide index
+ */
+static void qimg_read_ahead_frame(const qimg_bundle* bundle, int idx) {
+    const qimg_bundle_frame* frame = &bundle->frames[idx];
+    uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) (bundle->map + frame->offset);
+    uintptr_t aligned = start / page * page;
+    if (frame->size)
+        madvise((void*) aligned, frame->size + (start - aligned),
+                MADV_WILLNEED);
+}
+
+void qimg_play_bundle(const qimg_bundle* bundle, qimg_fb* fb,
+                      const qimg_opts* o) {
+    int n = (int) bundle->header->n_frames;
+    uint32_t start = 0;         /* when the current slide was shown */
+    bool playing = n > 0;       /* cleared to leave the event loop */
+    bool paused = false;
+    bool expired = false;       /* current slide has been shown long enough */
+    bool rearm = false;         /* slide timer has to be set again */
+    bool hold = qimg_holds_last_slide(o);
+    int idx = -1;               /* slide on the screen */
+    int target = 0;             /* slide to show next */
+
+    qimg_events ev;
+    qimg_open_events(&ev, o);
+    while (playing) {
+        target = qimg_wrap_slide(target, n, o->loop);
+        if (target != idx) {
+            idx = target;
+            if (!qimg_blit_frame(bundle, idx, fb))
+                log_msg("[ERROR]: Slide %d of the bundle is damaged", idx + 1);
+            qimg_read_ahead_frame(bundle, (idx + 1) % n);
+            start = qimg_get_millis();
+            expired = !o->slide_delay_s && !hold;
+            rearm = true;
+        }
+
+        if (expired && !paused) {
+            expired = false;
+            int next = qimg_next_slide(o, idx, n);
+            if (next < 0)
+                playing = false;
+            else
+                target = next;
+            continue;
+        }
+        if (rearm) {
+            qimg_arm_slide_timer(&ev, o, start, paused);
+            rearm = false;
+        }
+
+        qimg_wakeup w;
+        qimg_wait_events(&ev, target, &w);
+        if (w.expired)
+            expired = true;
+        if (w.repaint)
+            qimg_blit_frame(bundle, idx, fb);
+
+        /* Slides are final, view commands have nothing to act on */
+        for (int k = 0; k < w.n_cmds; ++k) {
+            qimg_command cmd = w.cmds[k];
+            if (cmd == CMD_QUIT) {
+                playing = false;
+            } else if (cmd == CMD_PAUSE || cmd == CMD_RESUME ||
+                       cmd == CMD_TOGGLE) {
+                paused = cmd == CMD_TOGGLE ? !paused : cmd == CMD_PAUSE;
+                start = qimg_get_millis(); /* Resume with a full delay */
+                rearm = true;
+            } else if (cmd == CMD_NEXT) {
+                target = target + 1;
+            } else if (cmd == CMD_PREV) {
+                target = target - 1;
+            } else if (cmd == CMD_GOTO) {
+                target = w.target;
+            } else if (cmd == CMD_RELOAD) {
+                qimg_blit_frame(bundle, idx, fb);
+            }
+        }
+    }
+    qimg_close_events(&ev, o);
+}
+
+qimg_color qimg_get_pixel(qimg_image* im, int x, int y) {
+    assertf(x < im->res.x && y < im->res.y, "Image coordinates out of bounds");
+    int d = im->depth;
+    /* Most significant byte of each sample */
+    uint8_t* offset = im->pixels + (y * im->res.x + x) * im->c * d + d - 1;
+    qimg_color color;
+
+    if (im->c < 3) {
+        color.r = offset[0];
+        color.g = offset[0];
+        color.b = offset[0];
+        color.a = im->c >= 2 ? offset[d] : 0xff;
+    } else {
+        color.r = offset[0];
+        color.g = offset[d];
+        color.b = offset[2 * d];
+        color.a = im->c >= 4 ? offset[3 * d] : 0xff;
+        if (im->bgr) {
+            color.r = offset[2 * d];
+            color.b = offset[0];
+        }
+    }
+    return color;
+}
+
+qimg_color qimg_get_bg_color(qimg_bg bg) {
+    qimg_color bg_color;
+    switch (bg) {
+    case BG_BLACK:
+        bg_color = (qimg_color){0, 0, 0, 0xff};
+        break;
+    case BG_WHITE:
+        bg_color = (qimg_color){0xff, 0xff, 0xff, 0xff};
+        break;
+    case BG_RED:
+        bg_color = (qimg_color){0xff, 0, 0, 0xff};
+        break;
+    case BG_GREEN:
+        bg_color = (qimg_color){0, 0xff, 0, 0xff};
+        break;
+    case BG_BLUE:
+        bg_color = (qimg_color){0, 0, 0xff, 0xff};
+        break;
+    default:
+        bg_color = (qimg_color){0, 0, 0, 0xff};
+        break;
+    }
+    return bg_color;
+}
+
+/**
+ * @brief Reads a little endian value
+ * @param p     data
+ * @param n     size in bytes, up to 8
+ * @return value
+ */
+static uint64_t qimg_le(const uint8_t* p, int n) {
+    uint64_t v = 0;
+    while (n--)
+        v = v << 8 | p[n];
+    return v;
+}
+
+/**
+ * @brief Tells whether an archive member name looks like a decodable image.
+ * Directories and resource fork files ("._name") are left out.
+ * @param name  member name
+ * @param len   name length, not NUL terminated
+ * @return true for images
+ */
+static bool qimg_is_image_name(const char* name, size_t len) {
+    static const char* exts[] = {
+        "jpg", "jpeg", "png", "bmp", "gif", "psd", "tga", "hdr", "pic", "pnm",
+        "ppm", "pgm", "qoi"
+    };
+    size_t base = len, dot = len;
+    while (base > 0 && name[base - 1] != '/')
+        --base;
+    for (size_t i = base; i < len; ++i)
+        if (name[i] == '.')
+            dot = i;
+    if (dot == len || len - base < 2 || !memcmp(name + base, "._", 2))
+        return false;
+    size_t ext_len = len - dot - 1;
+    for (size_t i = 0; i < sizeof(exts) / sizeof(exts[0]); ++i)
+        if (strlen(exts[i]) == ext_len &&
+                !strncasecmp(name + dot + 1, exts[i], ext_len))
+            return true;
+    return false;
+}
+
+/**
+ * @brief Adds an image member of an archive unless a single member was asked
+ * for and this is not it
+ * @param path      archive path
+ * @param name      member name, not NUL terminated
+ * @param len       name length
+ * @param only      wanted member name or NULL for all
+ * @param member    member, its path is filled in here
+ * @param out       receives the member input paths
+ * @param max       room in out
+ * @param n         images so far, incremented
+ */
+static void qimg_add_member(const char* path, const char* name, size_t len,
+                            const char* only, qimg_archive_member member,
+                            char** out, int max, int* n) {
+    if (!qimg_is_image_name(name, len) ||
+            (only && (strlen(only) != len || memcmp(only, name, len))))
+        return;
+    if (*n < max && n_archive_members < MAX_IMAGES) {
+        size_t path_len = strlen(path);
+        member.path = malloc(path_len + len + 2);
+        memcpy(member.path, path, path_len);
+        member.path[path_len] = ARCHIVE_SEP;
+        memcpy(member.path + path_len + 1, name, len);
+        member.path[path_len + len + 1] = '\0';
+        archive_members[n_archive_members++] = member;
+        out[*n] = member.path;
+    }
+    ++*n;
+}
+
+/**
+ * @brief Lists the images in a mapped zip archive from its central
+ * directory. Encrypted members and compression methods other than store and
+ * deflate are skipped.
+ * @param path  archive path
+ * @param map   archive contents
+ * @param size  archive size
+ * @param only  wanted member name or NULL for all
+ * @param out   receives the member input paths
+ * @param max   room in out
+ * @return number of images or -1 if this is no zip archive
+ */
+static int qimg_list_zip(const char* path, const uint8_t* map, size_t size,
+                         const char* only, char** out, int max) {
+    /* End of central directory record, followed by a comment of up to 64k */
+    if (size < 22)
+        return -1;
+    size_t eocd = size - 22;
+    size_t lowest = eocd > 0xffff ? eocd - 0xffff : 0;
+    while (eocd > lowest && qimg_le(map + eocd, 4) != 0x06054b50)
+        --eocd;
+    if (qimg_le(map + eocd, 4) != 0x06054b50)
+        return -1;
+    uint64_t entries = qimg_le(map + eocd + 10, 2);
+    uint64_t cd = qimg_le(map + eocd + 16, 4);
+    uint64_t cd_size = qimg_le(map + eocd + 12, 4);
+    if ((entries == 0xffff || cd == 0xffffffff || cd_size == 0xffffffff) &&
+            eocd >= 20 && qimg_le(map + eocd - 20, 4) == 0x07064b50) {
+        uint64_t rec = qimg_le(map + eocd - 12, 8);
+        if (size >= 56 && rec <= size - 56 && qimg_le(map + rec, 4) == 0x06064b50) {
+            entries = qimg_le(map + rec + 32, 8);
+            cd_size = qimg_le(map + rec + 40, 8);
+            cd = qimg_le(map + rec + 48, 8);
+        }
+    }
+    if (cd > size || cd_size > size - cd)
+        return -1;
+
+    int n = 0;
+    const uint8_t* p = map + cd;
+    const uint8_t* end = p + cd_size;
+    for (uint64_t i = 0; i < entries && end - p >= 46 &&
+            qimg_le(p, 4) == 0x02014b50; ++i) {
+        size_t name_len = qimg_le(p + 28, 2);
+        size_t extra_len = qimg_le(p + 30, 2);
+        size_t entry_len = 46 + name_len + extra_len + qimg_le(p + 32, 2);
+        if ((size_t) (end - p) < entry_len)
+            break;
+        int method = (int) qimg_le(p + 10, 2);
+        uint64_t csize = qimg_le(p + 20, 4);
+        uint64_t usize = qimg_le(p + 24, 4);
+        uint64_t off = qimg_le(p + 42, 4);
+        /* ZIP64 extra field holds whichever of these overflowed */
+        const uint8_t* x = p + 46 + name_len;
+        const uint8_t* x_end = x + extra_len;
+        for (; x_end - x >= 4; x += 4 + qimg_le(x + 2, 2)) {
+            if (qimg_le(x, 2) != 0x0001)
+                continue;
+            const uint8_t* v = x + 4;
+            const uint8_t* v_end = v + qimg_le(x + 2, 2);
+            uint64_t* fields[3] = {&usize, &csize, &off};
+            if (v_end > x_end)
+                break;
+            for (int k = 0; k < 3; ++k)
+                if (*fields[k] == 0xffffffff && v_end - v >= 8) {
+                    *fields[k] = qimg_le(v, 8);
+                    v += 8;
+                }
+            break;
+        }
+        bool encrypted = qimg_le(p + 8, 2) & 1;
+        if (!encrypted && (method == 0 || method == 8) &&
+                off <= size - 30 && qimg_le(map + off, 4) == 0x04034b50) {
+            uint64_t data = off + 30 + qimg_le(map + off + 26, 2) +
+                            qimg_le(map + off + 28, 2);
+            if (data <= size && csize <= size - data &&
+                    (method == 0 ? csize == usize : usize <= INT_MAX)) {
+                qimg_archive_member m = {
+                    NULL, map + data, csize, usize, method == 8
+                };
+                qimg_add_member(path, (const char*) p + 46, name_len, only,
+                                m, out, max, &n);
+            }
+        }
+        p += entry_len;
+    }
+    return n;
+}
+
+/**
+ * @brief Reads a numeric tar header field, octal or GNU base-256
+ * @param p     field
+ * @param len   field size
+ * @return value
+ */
+static uint64_t qimg_tar_number(const uint8_t* p, size_t len) {
+    uint64_t v = 0;
+    if (p[0] & 0x80) {
+        for (size_t i = 1; i < len; ++i)
+            v = v << 8 | p[i];
+        return v;
+    }
+    while (len && *p == ' ')
+        ++p, --len;
+    for (size_t i = 0; i < len && p[i] >= '0' && p[i] <= '7'; ++i)
+        v = v << 3 | (p[i] - '0');
+    return v;
+}
+
+/**
+ * @brief Checks a tar header block checksum
+ * @param h     header block
+ * @return true if valid
+ */
+static bool qimg_tar_header_ok(const uint8_t* h) {
+    uint64_t sum = 0;
+    for (int i = 0; i < 512; ++i)
+        sum += i >= 148 && i < 156 ? ' ' : h[i];
+    return h[0] && sum == qimg_tar_number(h + 148, 8);
+}
+
+/**
+ * @brief Lists the regular file images in a mapped tar archive. GNU long
+ * names and pax path records are honored.
+ * @param path  archive path
+ * @param map   archive contents
+ * @param size  archive size
+ * @param only  wanted member name or NULL for all
+ * @param out   receives the member input paths
+ * @param max   room in out
+ * @return number of images or -1 if this is no tar archive
+ */
+static int qimg_list_tar(const char* path, const uint8_t* map, size_t size,
+                         const char* only, char** out, int max) {
+    if (size < 512 || !qimg_tar_header_ok(map))
+        return -1;
+
+    int n = 0;
+    char name[256 + 1 + 100 + 1];
+    const char* long_name = NULL;
+    size_t long_len = 0;
+    for (size_t off = 0; size - off >= 512 && qimg_tar_header_ok(map + off);) {
+        const uint8_t* h = map + off;
+        uint64_t len = qimg_tar_number(h + 124, 12);
+        size_t data = off + 512;
+        if (len > size - data)
+            break;
+        off = data + (size_t) ((len + 511) & ~(uint64_t) 511);
+        if (off > size)
+            off = size;
+
+        char type = (char) h[156];
+        if (type == 'L') {
+            long_name = (const char*) map + data;
+            long_len = strnlen(long_name, len);
+            continue;
+        } else if (type == 'x') {
+            /* Records of the form "<length> <key>=<value>\n" */
+            const char* rec = (const char*) map + data;
+            const char* rec_end = rec + len;
+            while (rec < rec_end) {
+                char* key;
+                unsigned long rec_len = strtoul(rec, &key, 10);
+                if (!rec_len || rec_len > (size_t) (rec_end - rec) ||
+                        *key != ' ')
+                    break;
+                if (rec + rec_len - key > 6 && !memcmp(key, " path=", 6)) {
+                    long_name = key + 6;
+                    long_len = rec + rec_len - 1 - long_name;
+                }
+                rec += rec_len;
+            }
+            continue;
+        } else if (type != '0' && type != '\0' && type != '7') {
+            long_name = NULL;
+            continue;
+        }
+
+        const char* member = long_name;
+        size_t member_len = long_len;
+        if (!member) {
+            size_t prefix = 0;
+            if (!memcmp(h + 257, "ustar", 5) && h[345]) {
+                prefix = strnlen((const char*) h + 345, 155);
+                memcpy(name, h + 345, prefix);
+                name[prefix++] = '/';
+            }
+            size_t base = strnlen((const char*) h, 100);
+            memcpy(name + prefix, h, base);
+            member = name;
+            member_len = prefix + base;
+        }
+        qimg_archive_member m = {NULL, map + data, len, len, false};
+        qimg_add_member(path, member, member_len, only, m, out, max, &n);
+        long_name = NULL;
+    }
+    return n;
+}
+
+int qimg_expand_archive(const char* path, char** out, int max) {
+    /* "<archive>#<member>" names a single member when no such file exists */
+    char* archive_path = NULL;
+    const char* only = NULL;
+    struct stat st;
+    if (stat(path, &st)) {
+        for (const char* sep = strchr(path, ARCHIVE_SEP); sep && !only;
+                sep = strchr(sep + 1, ARCHIVE_SEP)) {
+            free(archive_path);
+            archive_path = strndup(path, sep - path);
+            if (!stat(archive_path, &st) && S_ISREG(st.st_mode))
+                only = sep + 1;
+        }
+        if (!only) {
+            free(archive_path);
+            return -1;
+        }
+        path = archive_path;
+    }
+
+    int n = -1;
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0 && !fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0 &&
+            n_archives < MAX_IMAGES) {
+        size_t size = (size_t) st.st_size;
+        uint8_t* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            if (size >= 4 && !memcmp(map, "PK", 2))
+                n = qimg_list_zip(path, map, size, only, out, max);
+            else
+                n = qimg_list_tar(path, map, size, only, out, max);
+            if (n > 0)
+                archives[n_archives++] = (qimg_archive){map, size};
+            else
+                munmap(map, size);
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    free(archive_path);
+    return n;
+}
+
+/**
+ * @brief Finds the archive member an input path refers to
+ * @param input_path    input path
+ * @return member or NULL for plain files
+ */
+static const qimg_archive_member* qimg_find_member(const char* input_path) {
+    for (int i = 0; i < n_archive_members; ++i)
+        if (!strcmp(archive_members[i].path, input_path))
+            return &archive_members[i];
+    return NULL;
+}
+
+FILE* qimg_open_input(const char* input_path, void** buf) {
+    *buf = NULL;
+    const qimg_archive_member* m = qimg_find_member(input_path);
+    if (!m)
+        return fopen(input_path, "rb");
+    if (!m->size && !m->usize)
+        return NULL;
+    if (!m->deflated)
+        return fmemopen((void*) m->data, m->size, "rb");
+
+    /* The uncompressed size comes from the archive headers, don't trust it
+     * beyond what deflate could produce */
+    if (m->usize > ARCHIVE_MEMBER_MAX ||
+            m->usize / DEFLATE_MAX_RATIO > m->size ||
+            !(*buf = malloc(m->usize ? m->usize : 1))) {
+        log_msg("Archive member %s is unreadable", input_path);
+        return NULL;
+    }
+    int len = stbi_zlib_decode_noheader_buffer(
+                  *buf, (int) m->usize, (const char*) m->data,
+                  m->size > INT_MAX ? INT_MAX : (int) m->size);
+    FILE* file = len > 0 ? fmemopen(*buf, (size_t) len, "rb") : NULL;
+    if (!file) {
+        free(*buf);
+        *buf = NULL;
+    }
+    return file;
+}
+
+void qimg_free_archives(void) {
+    for (int i = 0; i < n_archive_members; ++i)
+        free(archive_members[i].path);
+    for (int i = 0; i < n_archives; ++i)
+        munmap(archives[i].map, archives[i].size);
+    n_archive_members = n_archives = 0;
+}
+
+/** File reader for stb_image that stops feeding data once cancelled */
+typedef struct qimg_reader {
+    FILE* f;                /**< input file */
+    volatile int* cancel;   /**< cancellation flag, may be NULL */
+} qimg_reader;
+
+static int qimg_reader_read(void* user, char* data, int size) {
+    qimg_reader* r = user;
+    if (r->cancel && *r->cancel)
+        return 0;
+    return (int) fread(data, 1, size, r->f);
+}
+
+static void qimg_reader_skip(void* user, int n) {
+    qimg_reader* r = user;
+    fseek(r->f, n, SEEK_CUR);
+}
+
+static int qimg_reader_eof(void* user) {
+    qimg_reader* r = user;
+    return (r->cancel && *r->cancel) || feof(r->f);
+}
+
+/**
+ * @brief Maps a raw Bayer frame and demosaics it for given viewport
+ * @param input_path    input path
+ * @param vp            viewport size
+ * @param scale         scale style
+ * @return image or NULL if the file is too short for the frame format
+ */
+static qimg_image* qimg_load_raw(const char* input_path, qimg_point vp,
+                                 qimg_scale scale) {
+    const qimg_raw_format* fmt = &raw_format;
+    size_t len = (size_t) fmt->res.x * fmt->res.y * (fmt->bits > 8 ? 2 : 1);
+    int fd = open(input_path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    qimg_image* im = NULL;
+    if (!fstat(fd, &st) && (size_t) st.st_size >= len) {
+        uint8_t* raw = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (raw != MAP_FAILED) {
+            madvise(raw, len, MADV_SEQUENTIAL);
+            im = qimg_demosaic(raw, fmt,
+                               qimg_get_scaled_dims(fmt->res, vp, scale));
+            munmap(raw, len);
+        }
+    }
+    close(fd);
+    return im;
+}
+
+/**
+ * @brief Finds the part of an image scaled to `dims` that is visible when
+ * placed at the crop position
+ * @param dims  scaled image size
+ * @param vp    viewport size
+ * @return visible rectangle in scaled image coordinates
+ */
+static qimg_rect qimg_visible_rect(qimg_point dims, qimg_point vp) {
+    /* Image coordinates of the top left screen corner */
+    qimg_point org = qimg_translate_coords(crop_pos, dims, vp, 0, 0);
+    qimg_rect r;
+    r.x0 = org.x > 0 ? org.x : 0;
+    r.y0 = org.y > 0 ? org.y : 0;
+    r.x1 = org.x + vp.x < dims.x ? org.x + vp.x : dims.x;
+    r.y1 = org.y + vp.y < dims.y ? org.y + vp.y : dims.y;
+    return r;
+}
+
+/**
+ * @brief Plans a decode: picks the largest JPEG reduction that keeps an input
+ * at least as large as it is shown and, when cropping, the source region that
+ * stays visible. Rewinds the reader afterwards.
+ * @param callbacks     reader callbacks
+ * @param r             reader
+ * @param vp            viewport size
+ * @param scale         scale style
+ * @param cut           decode only the visible region
+ * @param src           set to the full source size, zero if unknown
+ * @param region        set to the source region to decode
+ * @return reduction denominator: 1, 2, 4 or 8
+ */
+static int qimg_decode_plan(const stbi_io_callbacks* callbacks,
+                            qimg_reader* r, qimg_point vp, qimg_scale scale,
+                            bool cut, qimg_point* src, int region[4]) {
+    int denom = 1;
+    src->x = src->y = 0;
+    region[0] = region[1] = 0;
+    region[2] = region[3] = INT_MAX;
+    if (stbi_info_from_callbacks(callbacks, r, &src->x, &src->y, NULL)) {
+        qimg_point dims = qimg_get_scaled_dims(*src, vp, scale);
+        while (denom < 8 &&
+                (src->x + 2 * denom - 1) / (2 * denom) >= dims.x &&
+                (src->y + 2 * denom - 1) / (2 * denom) >= dims.y)
+            denom *= 2;
+        if (cut) {
+            qimg_rect vis = qimg_visible_rect(dims, vp);
+            region[0] = (int) ((int64_t) vis.x0 * src->x / dims.x);
+            region[1] = (int) ((int64_t) vis.y0 * src->y / dims.y);
+            region[2] = (int) (((int64_t) vis.x1 * src->x + dims.x - 1) /
+                               dims.x);
+            region[3] = (int) (((int64_t) vis.y1 * src->y + dims.y - 1) /
+                               dims.y);
+        }
+    }
+    rewind(r->f);
+    return denom;
+}
+
+/**
+ * @brief Scales a decoded region of an image the way the whole image is
+ * scaled and cuts it down to what is visible at the crop position
+ * @param im        decoded region
+ * @param src       full source size
+ * @param region    source region `im` covers
+ * @param vp        viewport size
+ * @param scale     scale style
+ */
+static void qimg_crop_visible(qimg_image* im, qimg_point src,
+                              const int region[4], qimg_point vp,
+                              qimg_scale scale) {
+    qimg_point dims = qimg_get_scaled_dims(src, vp, scale);
+    qimg_rect vis = qimg_visible_rect(dims, vp);
+    if (vis.x1 - vis.x0 == dims.x && vis.y1 - vis.y0 == dims.y &&
+            im->res.x == src.x && im->res.y == src.y)
+        return; /* Whole image shown and decoded, leave it to the caller */
+
+    /* Where the region ends up in the scaled image */
+    float kx = (float) dims.x / (float) src.x;
+    float ky = (float) dims.y / (float) src.y;
+    qimg_rect at = {(int) lroundf(region[0] * kx), (int) lroundf(region[1] * ky),
+                    (int) lroundf(region[2] * kx), (int) lroundf(region[3] * ky)};
+    qimg_point size = {at.x1 - at.x0, at.y1 - at.y0};
+    if ((size.x != im->res.x || size.y != im->res.y) &&
+            !qimg_resize_image(im, size))
+        return;
+    qimg_rect keep = {vis.x0 - at.x0, vis.y0 - at.y0,
+                      vis.x1 - at.x0, vis.y1 - at.y0};
+    if (keep.x0 < 0) keep.x0 = 0;
+    if (keep.y0 < 0) keep.y0 = 0;
+    if (keep.x1 > size.x) keep.x1 = size.x;
+    if (keep.y1 > size.y) keep.y1 = size.y;
+    qimg_crop_image(im, keep);
+}
+
+/** Area averaging downscaler fed one source row at a time. Source pixels
+ * are weighted by how much of each output pixel they cover, in units of
+ * 1/src.x of an output column and 1/src.y of an output row, so the weights
+ * of an output pixel always add up to src.x * src.y. */
+typedef struct qimg_row_scaler {
+    qimg_point src;         /**< source size */
+    qimg_point dims;        /**< scaled size */
+    qimg_rect vis;          /**< part of the scaled image kept */
+    int* comp;              /**< channels in the file, set before row 0 */
+    int req;                /**< channels requested, 0 for the file's */
+    int c;                  /**< channels in a row */
+    int depth;              /**< bytes per channel, 1 or 2 */
+    int sx0;                /**< first source column reaching vis */
+    int sx1;                /**< end of the source columns reaching vis */
+    int width;              /**< accumulated columns, vis plus one each side */
+    int* ox;                /**< accumulator column of each source column */
+    uint32_t* wx;           /**< its weight there, the rest goes to the next */
+    uint64_t* sums;         /**< weighted sums of the current source row */
+    uint64_t* acc;          /**< two output rows being accumulated */
+    uint8_t* pixels;        /**< output, vis sized */
+} qimg_row_scaler;
+
+/**
+ * @brief Writes a finished output row if it is visible and clears its
+ * accumulator
+ * @param s     scaler
+ * @param oy    output row
+ * @param acc   its accumulator
+ */
+static void qimg_scaler_flush(qimg_row_scaler* s, int oy, uint64_t* acc) {
+    size_t n = (size_t) s->width * s->c;
+    if (oy >= s->vis.y0 && oy < s->vis.y1) {
+        uint64_t total = (uint64_t) s->src.x * s->src.y;
+        size_t w = (size_t) (s->vis.x1 - s->vis.x0) * s->c;
+        const uint64_t* a = acc + s->c;     /* skip the column left of vis */
+        size_t at = (size_t) (oy - s->vis.y0) * w;
+        for (size_t i = 0; i < w; ++i) {
+            uint64_t v = (a[i] + total / 2) / total;
+            if (s->depth == 2)
+                ((uint16_t*) s->pixels)[at + i] = (uint16_t) v;
+            else
+                s->pixels[at + i] = (uint8_t) v;
+        }
+    }
+    memset(acc, 0, n * sizeof(uint64_t));
+}
+
+/**
+ * @brief Row callback of stbi_load_rows_from_callbacks, adds a source row to
+ * the one or two output rows it covers
+ * @param user      scaler
+ * @param y         source row
+ * @param pixels    its samples
+ */
+static void qimg_scale_row(void* user, int y, const void* pixels) {
+    qimg_row_scaler* s = user;
+    if (y == 0)
+        s->c = s->req ? s->req : *s->comp;
+    int c = s->c;
+    uint64_t y0 = (uint64_t) y * s->dims.y;
+    int oy = (int) (y0 / s->src.y);
+    uint64_t split = (uint64_t) (oy + 1) * s->src.y;
+    if (oy + 1 < s->vis.y0 || oy >= s->vis.y1)
+        return;
+    uint64_t y1 = y0 + s->dims.y < split ? y0 + s->dims.y : split;
+    uint64_t wy = y1 - y0, wy_next = s->dims.y - wy;
+
+    size_t n = (size_t) s->width * c;
+    uint64_t* sums = s->sums;
+    memset(sums, 0, n * sizeof(uint64_t));
+    for (int sx = s->sx0; sx < s->sx1; ++sx) {
+        int i = sx - s->sx0;
+        uint64_t* d = sums + (size_t) s->ox[i] * c;
+        uint64_t w = s->wx[i], w_next = s->dims.x - w;
+        size_t at = (size_t) sx * c;
+        for (int k = 0; k < c; ++k) {
+            uint64_t v = s->depth == 2 ? ((const uint16_t*) pixels)[at + k] :
+                                         ((const uint8_t*) pixels)[at + k];
+            d[k] += v * w;
+            d[c + k] += v * w_next;
+        }
+    }
+
+    uint64_t* acc = s->acc + (size_t) (oy & 1) * n;
+    uint64_t* acc_next = s->acc + (size_t) (~oy & 1) * n;
+    for (size_t i = 0; i < n; ++i) {
+        acc[i] += sums[i] * wy;
+        acc_next[i] += sums[i] * wy_next;
+    }
+    if (y0 + s->dims.y >= split)
+        qimg_scaler_flush(s, oy, acc);
+}
+
+/**
+ * @brief Decodes a PNG straight to the size it is shown at, averaging the
+ * source pixels each output pixel covers as the rows come in, so that only
+ * the output and a few rows of sums are held however large the PNG is. Only
+ * used for 2x or larger reductions, other inputs are left to the caller.
+ * @param callbacks     reader callbacks
+ * @param r             reader, rewound unless decoded
+ * @param vp            viewport size
+ * @param scale         scale style
+ * @param cut           keep only the visible part
+ * @param req           channels to request, 0 for the file's
+ * @param im            receives the resolution, channels and pixels of
+ *                      depth im->depth
+ * @return true if decoded
+ */
+static bool qimg_decode_rows(const stbi_io_callbacks* callbacks,
+                             qimg_reader* r, qimg_point vp, qimg_scale scale,
+                             bool cut, int req, qimg_image* im) {
+    qimg_row_scaler s;
+    int comp = 0;
+    if (scale == SCALE_DISABLED)
+        return false;
+    bool ok = stbi_info_from_callbacks(callbacks, r, &s.src.x, &s.src.y,
+                                       &comp);
+    rewind(r->f);
+    if (!ok)
+        return false;
+    s.dims = qimg_get_scaled_dims(s.src, vp, scale);
+    if (s.dims.x <= 0 || s.dims.y <= 0 ||
+            2 * s.dims.x > s.src.x || 2 * s.dims.y > s.src.y)
+        return false;
+    qimg_rect all = {0, 0, s.dims.x, s.dims.y};
+    s.vis = cut ? qimg_visible_rect(s.dims, vp) : all;
+    s.comp = &comp;
+    s.req = req;
+    s.depth = im->depth;
+    s.sx0 = (int) ((int64_t) s.vis.x0 * s.src.x / s.dims.x);
+    s.sx1 = (int) (((int64_t) s.vis.x1 * s.src.x + s.dims.x - 1) / s.dims.x);
+    s.width = s.vis.x1 - s.vis.x0 + 2;
+    /* Sized for up to 4 channels, the count is only known at row 0 */
+    size_t n = (size_t) s.width * 4;
+    size_t vis_n = (size_t) (s.vis.x1 - s.vis.x0) * (s.vis.y1 - s.vis.y0) * 4;
+    s.ox = malloc((s.sx1 - s.sx0) * sizeof(int));
+    s.wx = malloc((s.sx1 - s.sx0) * sizeof(uint32_t));
+    s.sums = malloc(n * sizeof(uint64_t));
+    s.acc = calloc(2 * n, sizeof(uint64_t));
+    s.pixels = malloc(vis_n * s.depth);
+    ok = s.ox && s.wx && s.sums && s.acc && s.pixels;
+    if (ok) {
+        for (int sx = s.sx0; sx < s.sx1; ++sx) {
+            uint64_t x0 = (uint64_t) sx * s.dims.x;
+            int ox = (int) (x0 / s.src.x);
+            uint64_t split = (uint64_t) (ox + 1) * s.src.x;
+            uint64_t x1 = x0 + s.dims.x < split ? x0 + s.dims.x : split;
+            s.ox[sx - s.sx0] = ox - (s.vis.x0 - 1);
+            s.wx[sx - s.sx0] = (uint32_t) (x1 - x0);
+        }
+        qimg_point res;
+        ok = stbi_load_rows_from_callbacks(callbacks, r, &res.x, &res.y,
+                                           &comp, req, 8 * s.depth,
+                                           qimg_scale_row, &s);
+    }
+    free(s.ox);
+    free(s.wx);
+    free(s.sums);
+    free(s.acc);
+    if (!ok) {
+        free(s.pixels);
+        rewind(r->f);
+        return false;
+    }
+    im->res.x = s.vis.x1 - s.vis.x0;
+    im->res.y = s.vis.y1 - s.vis.y0;
+    im->c = s.c;
+    im->pixels = s.pixels;
+    if (s.c < 4) {
+        uint8_t* shrunk = realloc(s.pixels, vis_n / 4 * s.c * s.depth);
+        if (shrunk)
+            im->pixels = shrunk;
+    }
+    return true;
+}
+
+/**
+ * @brief Decodes an input. HDR inputs are tone mapped straight to the size
+ * they are shown at, large PNGs are averaged down to it while they decode,
+ * JPEGs are decoded at the smallest 1/2, 1/4 or 1/8 reduction still at least
+ * that size, other images are returned at their own resolution. Frames get
+ * the display treatment: with `crop` set, 8-bit images are returned scaled
+ * and cut down to their visible part, as are large PNGs, and JPEGs only
+ * decode that part; with `bgra_frames` set, 8-bit color images come out as
+ * BGRA.
+ * @param input_path    input path
+ * @param vp            viewport size, zero to always decode whole images
+ * @param scale         scale style, SCALE_DISABLED for full resolution
+ * @param frame         decode a frame for display rather than plain pixels
+ * @param cancel        cancellation flag, may be NULL
+ * @return image or NULL on failure or cancellation
+ */
+static qimg_image* qimg_decode(const char* input_path, qimg_point vp,
+                               qimg_scale scale, bool frame,
+                               volatile int* cancel) {
+    static const stbi_io_callbacks callbacks = {
+        qimg_reader_read, qimg_reader_skip, qimg_reader_eof
+    };
+    if (raw_format.res.x && !qimg_find_member(input_path) &&
+            !stbi_info(input_path, NULL, NULL, NULL))
+        return qimg_load_raw(input_path, vp, scale);
+
+    void* buf;
+    qimg_reader r = {qimg_open_input(input_path, &buf), cancel};
+    if (!r.f)
+        return NULL;
+
+    qimg_image* im = NULL;
+    bool hdr = stbi_is_hdr_from_callbacks(&callbacks, &r);
+    rewind(r.f);
+    if (hdr) {
+        qimg_point res;
+        float* data = stbi_loadf_from_callbacks(&callbacks, &r, &res.x,
+                                                &res.y, NULL, 3);
+        if (data && !(cancel && *cancel))
+            im = qimg_tonemap_image(data, res,
+                                    qimg_get_scaled_dims(res, vp, scale));
+        stbi_image_free(data);
+    } else {
+        /* Keep the precision of 16-bit PNGs for deep framebuffers and
+         * dithering */
+        bool deep = stbi_is_16_bit_from_callbacks(&callbacks, &r);
+        bool cut = frame && crop && vp.x > 0 && vp.y > 0;
+        rewind(r.f);
+        /* Color frames for the framebuffer skip the swizzle when shown */
+        int comp = 0;
+        if (!deep && frame && bgra_frames) {
+            stbi_info_from_callbacks(&callbacks, &r, NULL, NULL, &comp);
+            rewind(r.f);
+        }
+        int req = comp >= 3 ? 4 : 0;
+        im = malloc(sizeof(qimg_image));
+        im->depth = deep ? 2 : 1;
+        im->bgr = req != 0;
+        im->half = NULL;
+        qimg_point src = {0, 0};
+        int region[4];
+        stbi_set_bgr_on_load_thread(im->bgr);
+        if (qimg_decode_rows(&callbacks, &r, vp, scale, cut, req, im))
+            cut = false; /* Already scaled and cut down */
+        else if (deep)
+            im->pixels = (uint8_t*) stbi_load_16_from_callbacks(
+                             &callbacks, &r, &im->res.x, &im->res.y, &im->c, 0);
+        else if (scale == SCALE_DISABLED && !cut)
+            im->pixels = stbi_load_from_callbacks(&callbacks, &r, &im->res.x,
+                                                  &im->res.y, &im->c, req);
+        else {
+            int denom = qimg_decode_plan(&callbacks, &r, vp, scale, cut,
+                                         &src, region);
+            im->pixels = stbi_load_from_callbacks_region(
+                             &callbacks, &r, &im->res.x, &im->res.y, &im->c,
+                             req, denom, region);
+        }
+        stbi_set_bgr_on_load_thread(0);
+        if (req)
+            im->c = req;
+        if (im->pixels && cut && src.x && !(cancel && *cancel))
+            qimg_crop_visible(im, src, region, vp, scale);
+        if (!im->pixels) {
+            free(im);
+            im = NULL;
+        }
+    }
+    fclose(r.f);
+    free(buf);
+    if (im && cancel && *cancel) {
+        qimg_free_image(im);
+        return NULL;
+    }
+    return im;
+}
+
+qimg_image* qimg_decode_image(const char* input_path, volatile int* cancel) {
+    qimg_point none = {0, 0};
+    return qimg_decode(input_path, none, SCALE_DISABLED, false, cancel);
+}
+
+qimg_image* qimg_load_image(char* input_path) {
+    qimg_image* im = qimg_decode_image(input_path, NULL);
+    assertf(im, "Loading image %s failed", input_path);
+    return im;
+}
+
+qimg_image* qimg_prepare_image(const char* input_path, qimg_point vp,
+                               qimg_scale scale, volatile int* cancel) {
+    qimg_image* im = NULL;
+    /* Fit and stretch never show more than the viewport, fill may show more
+     * than the thumbnail has, which its own aspect ratio tells */
+    int size = scale != SCALE_DISABLED ? qimg_thumb_size(vp) : 0;
+    if (size)
+        im = qimg_load_thumbnail(input_path, size);
+    if (im && qimg_thumb_size(qimg_get_scaled_dims(im->res, vp, scale)) >
+            size) {
+        qimg_free_image(im);
+        im = NULL;
+    }
+    if (!im)
+        im = qimg_decode(input_path, vp, scale, true, cancel);
+    if (im && scale == SCALE_DISABLED && lut3d && lut_bake)
+        qimg_bake_lut3d(im, lut3d);
+    if (!im || scale == SCALE_DISABLED) {
+        if (im && kenburns)
+            qimg_build_mips(im, vp);
+        return im;
+    }
+    if (cancel && *cancel) {
+        qimg_free_image(im);
+        return NULL;
+    }
+    qimg_point dims = qimg_get_scaled_dims(im->res, vp, scale);
+    if (dims.x != im->res.x || dims.y != im->res.y)
+        qimg_resize_image(im, dims);
+    if (lut3d && lut_bake)
+        qimg_bake_lut3d(im, lut3d);
+    if (kenburns)
+        qimg_build_mips(im, vp);
+    return im;
+}
+
+qimg_dyn_collection* qimg_init_dyn_collection(char** input_paths, int n_inputs,
+                                              qimg_point vp, qimg_scale scale,
+                                              int history, int prefetch,
+                                              bool loop, qimg_pool* pool) {
+    qimg_dyn_collection* dcol = malloc(sizeof(qimg_dyn_collection));
+    dcol->input_paths = input_paths;
+    dcol->size = n_inputs;
+    dcol->idx = -1;
+    dcol->history = history;
+    dcol->prefetch = prefetch;
+    dcol->loop = loop;
+    dcol->vp = vp;
+    dcol->scale = scale;
+    dcol->pool = pool;
+    dcol->assets = malloc(n_inputs * sizeof(int));
+    for (int i = 0; i < n_inputs; ++i)
+        dcol->assets[i] = i;
+
+    /* The cache window never holds more than history + current + prefetch
+     * distinct frames */
+    int n = history + 1 + prefetch;
+    if (n > n_inputs)
+        n = n_inputs;
+    assertf(n <= MAX_CACHE_SIZE, "Frame cache too large (max %d frames)",
+            MAX_CACHE_SIZE);
+    dcol->n_slots = n;
+    for (int i = 0; i < MAX_CACHE_SIZE; ++i) {
+        dcol->slots[i].idx = -1;
+        dcol->slots[i].im = NULL;
+        dcol->slots[i].job = NULL;
+    }
+    return dcol;
+}
+
+/**
+ * @brief Gets the distance of an index from the cursor in given direction
+ * @param dcol  dynamic collection
+ * @param idx   input index
+ * @param dir   1 for ahead, -1 for behind
+ * @return steps needed to reach idx from the cursor, negative if unreachable
+ */
+static int qimg_cursor_distance(qimg_dyn_collection* dcol, int idx, int dir) {
+    int d = (idx - dcol->idx) * dir;
+    if (dcol->loop)
+        d = ((d % dcol->size) + dcol->size) % dcol->size;
+    return d;
+}
+
+/**
+ * @brief Checks whether an index lies in the cache window of the cursor
+ * @param dcol  dynamic collection
+ * @param idx   input index
+ * @return true if the frame should stay cached
+ */
+static bool qimg_in_window(qimg_dyn_collection* dcol, int idx) {
+    int ahead = qimg_cursor_distance(dcol, idx, 1);
+    int behind = qimg_cursor_distance(dcol, idx, -1);
+    return (ahead >= 0 && ahead <= dcol->prefetch) ||
+           (behind >= 0 && behind <= dcol->history);
+}
+
+/**
+ * @brief Checks whether any input showing an asset lies in the cache window
+ * @param dcol  dynamic collection
+ * @param asset asset index
+ * @return true if the frame should stay cached
+ */
+static bool qimg_asset_in_window(qimg_dyn_collection* dcol, int asset) {
+    for (int i = asset; i < dcol->size; ++i)
+        if (dcol->assets[i] == asset && qimg_in_window(dcol, i))
+            return true;
+    return false;
+}
+
+/**
+ * @brief Finds the cache slot holding an asset
+ * @param dcol  dynamic collection
+ * @param asset asset index, -1 for a free slot
+ * @return slot pointer or NULL if not found
+ */
+static qimg_cache_slot* qimg_find_asset_slot(qimg_dyn_collection* dcol,
+                                             int asset) {
+    for (int i = 0; i < dcol->n_slots; ++i)
+        if (dcol->slots[i].idx == asset)
+            return &dcol->slots[i];
+    return NULL;
+}
+
+/**
+ * @brief Finds the cache slot holding the asset of given index
+ * @param dcol  dynamic collection
+ * @param idx   input index
+ * @return slot pointer or NULL if not found or out of range
+ */
+static qimg_cache_slot* qimg_find_slot(qimg_dyn_collection* dcol, int idx) {
+    if (idx < 0 || idx >= dcol->size)
+        return NULL;
+    return qimg_find_asset_slot(dcol, dcol->assets[idx]);
+}
+
+/**
+ * @brief Finds an unused cache slot
+ * @param dcol  dynamic collection
+ * @return slot pointer or NULL if all are taken
+ */
+static qimg_cache_slot* qimg_find_free_slot(qimg_dyn_collection* dcol) {
+    return qimg_find_asset_slot(dcol, -1);
+}
+
+/**
+ * @brief Reads a 16 or 32 bit TIFF value
+ * @param p     data
+ * @param n     value size in bytes, 2 or 4
+ * @param le    little endian byte order
+ * @return value
+ */
+static uint32_t qimg_tiff_get(const uint8_t* p, int n, bool le) {
+    uint32_t v = 0;
+    for (int i = 0; i < n; ++i)
+        v |= (uint32_t) p[le ? i : n - 1 - i] << (8 * i);
+    return v;
+}
+
+bool qimg_exif_thumbnail(const uint8_t* jpg, size_t len, const uint8_t** out,
+                         size_t* n) {
+    if (len < 4 || jpg[0] != 0xff || jpg[1] != 0xd8)
+        return false;
+
+    /* Walk the marker segments preceding the image data */
+    size_t off = 2;
+    while (off + 4 <= len && jpg[off] == 0xff) {
+        uint8_t marker = jpg[off + 1];
+        size_t seg = (size_t) jpg[off + 2] << 8 | jpg[off + 3];
+        if (marker == 0xda || marker == 0xd9 || seg < 2)
+            break;
+        const uint8_t* data = jpg + off + 4;
+        size_t size = seg - 2;
+        off += 2 + seg;
+        if (marker != 0xe1 || off > len || size < 14 ||
+                memcmp(data, "Exif\0\0", 6))
+            continue;
+
+        /* TIFF header, then IFD0 whose successor IFD1 describes the
+         * thumbnail */
+        const uint8_t* tiff = data + 6;
+        size_t tlen = size - 6;
+        bool le = tiff[0] == 'I' && tiff[1] == 'I';
+        if ((!le && (tiff[0] != 'M' || tiff[1] != 'M')) ||
+                qimg_tiff_get(tiff + 2, 2, le) != 42)
+            return false;
+        size_t ifd = qimg_tiff_get(tiff + 4, 4, le);
+        if (ifd + 2 > tlen)
+            return false;
+        size_t entries = qimg_tiff_get(tiff + ifd, 2, le);
+        if (ifd + 2 + entries * 12 + 4 > tlen)
+            return false;
+        ifd = qimg_tiff_get(tiff + ifd + 2 + entries * 12, 4, le);
+        if (!ifd || ifd + 2 > tlen)
+            return false;
+        entries = qimg_tiff_get(tiff + ifd, 2, le);
+        if (ifd + 2 + entries * 12 > tlen)
+            return false;
+
+        size_t thumb_off = 0, thumb_len = 0;
+        for (size_t i = 0; i < entries; ++i) {
+            const uint8_t* e = tiff + ifd + 2 + i * 12;
+            uint32_t tag = qimg_tiff_get(e, 2, le);
+            uint32_t type = qimg_tiff_get(e + 2, 2, le);
+            uint32_t val = type == 3 ? qimg_tiff_get(e + 8, 2, le) :
+                                       qimg_tiff_get(e + 8, 4, le);
+            if (tag == 0x0201)      /* JPEGInterchangeFormat */
+                thumb_off = val;
+            else if (tag == 0x0202) /* JPEGInterchangeFormatLength */
+                thumb_len = val;
+        }
+        if (!thumb_off || !thumb_len || thumb_off + thumb_len > tlen)
+            return false;
+        *out = tiff + thumb_off;
+        *n = thumb_len;
+        return true;
+    }
+    return false;
+}
+
+qimg_image* qimg_load_preview(const char* input_path, qimg_point vp,
+                              qimg_scale scale, float* zoom) {
+    if (qimg_find_member(input_path))
+        return NULL;
+    FILE* file = fopen(input_path, "rb");
+    if (!file)
+        return NULL;
+    qimg_point src;
+    if (!stbi_info_from_file(file, &src.x, &src.y, NULL)) {
+        fclose(file);
+        return NULL;
+    }
+
+    qimg_image* im = NULL;
+    uint8_t* head = malloc(EXIF_SCAN_SIZE);
+    size_t len = fread(head, 1, EXIF_SCAN_SIZE, file);
+    const uint8_t* thumb;
+    size_t thumb_len;
+    if (qimg_exif_thumbnail(head, len, &thumb, &thumb_len)) {
+        im = malloc(sizeof(qimg_image));
+        im->depth = 1;
+        im->bgr = false;
+        im->half = NULL;
+        im->pixels = stbi_load_from_memory(thumb, (int) thumb_len,
+                                           &im->res.x, &im->res.y, &im->c, 0);
+        if (!im->pixels) {
+            free(im);
+            im = NULL;
+        }
+    }
+    free(head);
+    fclose(file);
+
+    /* Fall back to the largest cached thumbnail */
+    int n = sizeof(qimg_thumb_flavors) / sizeof(qimg_thumb_flavors[0]);
+    for (int i = n - 1; !im && thumb_root && i >= 0; --i)
+        im = qimg_load_thumbnail(input_path, qimg_thumb_flavors[i].size);
+    if (!im)
+        return NULL;
+
+    /* Fit the thumbnail, letterboxing included, within the full image */
+    qimg_point dims = qimg_get_scaled_dims(src, vp, scale);
+    float zx = (float) dims.x / im->res.x;
+    float zy = (float) dims.y / im->res.y;
+    *zoom = zx < zy ? zx : zy;
+    if (!(*zoom > 0.0f))
+        *zoom = 1.0f;
+    if (lut3d && lut_bake)
+        qimg_bake_lut3d(im, lut3d);
+    return im;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Thumbnail cache                                                            */
+
+/**
+ * @brief Computes the MD5 digest of a message
+ * @param msg   message
+ * @param len   message length
+ * @param out   16 byte digest
+ */
+static void qimg_md5(const uint8_t* msg, size_t len, uint8_t out[16]) {
+    static const uint32_t k[64] = {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+        0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+        0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+        0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+        0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+        0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+        0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+        0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+        0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+    };
+    static const uint8_t r[16] = {7, 12, 17, 22, 5, 9, 14, 20,
+                                  4, 11, 16, 23, 6, 10, 15, 21};
+    uint32_t h[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+
+    /* Pad to a multiple of 64 bytes with the bit length at the end */
+    size_t n = ((len + 8) / 64 + 1) * 64;
+    uint8_t* m = calloc(n, 1);
+    memcpy(m, msg, len);
+    m[len] = 0x80;
+    for (int i = 0; i < 8; ++i)
+        m[n - 8 + i] = (uint8_t)((uint64_t) len * 8 >> (8 * i));
+
+    for (size_t off = 0; off < n; off += 64) {
+        uint32_t w[16];
+        for (int i = 0; i < 16; ++i)
+            w[i] = (uint32_t) m[off + 4 * i] |
+                   (uint32_t) m[off + 4 * i + 1] << 8 |
+                   (uint32_t) m[off + 4 * i + 2] << 16 |
+                   (uint32_t) m[off + 4 * i + 3] << 24;
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t f;
+            int g;
+            switch (i / 16) {
+            case 0:
+                f = (b & c) | (~b & d);
+                g = i;
+                break;
+            case 1:
+                f = (d & b) | (~d & c);
+                g = (5 * i + 1) % 16;
+                break;
+            case 2:
+                f = b ^ c ^ d;
+                g = (3 * i + 5) % 16;
+                break;
+            default:
+                f = c ^ (b | ~d);
+                g = (7 * i) % 16;
+                break;
+            }
+            uint32_t t = a + f + k[i] + w[g];
+            int s = r[(i / 16) * 4 + i % 4];
+            a = d;
+            d = c;
+            c = b;
+            b = b + ((t << s) | (t >> (32 - s)));
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+    }
+    free(m);
+    for (int i = 0; i < 16; ++i)
+        out[i] = (uint8_t)(h[i / 4] >> (8 * (i % 4)));
+}
+
+int qimg_thumb_size(qimg_point dims) {
+    int n = sizeof(qimg_thumb_flavors) / sizeof(qimg_thumb_flavors[0]);
+    for (int i = 0; i < n; ++i)
+        if (dims.x <= qimg_thumb_flavors[i].size &&
+                dims.y <= qimg_thumb_flavors[i].size)
+            return qimg_thumb_flavors[i].size;
+    return 0;
+}
+
+bool qimg_thumb_path(const char* input_path, int size, char* uri, char* out) {
+    static const char hex[] = "0123456789abcdef";
+    char abs_path[PATH_MAX];
+    if (!thumb_root || !realpath(input_path, abs_path))
+        return false;
+
+    /* Escape the path the same way as GLib does for file URIs */
+    int len = snprintf(uri, THUMB_PATH_MAX, "file://");
+    for (const char* p = abs_path; *p && len < THUMB_PATH_MAX - 4; ++p) {
+        unsigned char ch = (unsigned char) *p;
+        if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+                (ch >= '0' && ch <= '9') || strchr("!$&'()*+,-./:=@_~", ch)) {
+            uri[len++] = (char) ch;
+        } else {
+            uri[len++] = '%';
+            uri[len++] = hex[ch >> 4];
+            uri[len++] = hex[ch & 0xf];
+        }
+    }
+    uri[len] = '\0';
+
+    const char* dir = NULL;
+    int n = sizeof(qimg_thumb_flavors) / sizeof(qimg_thumb_flavors[0]);
+    for (int i = 0; i < n; ++i)
+        if (qimg_thumb_flavors[i].size == size)
+            dir = qimg_thumb_flavors[i].dir;
+    if (!dir)
+        return false;
+
+    uint8_t digest[16];
+    char name[33];
+    qimg_md5((const uint8_t*) uri, (size_t) len, digest);
+    for (int i = 0; i < 16; ++i) {
+        name[2 * i] = hex[digest[i] >> 4];
+        name[2 * i + 1] = hex[digest[i] & 0xf];
+    }
+    name[32] = '\0';
+    return snprintf(out, THUMB_PATH_MAX, "%s/%s/%s.png", thumb_root, dir,
+                    name) < THUMB_PATH_MAX;
+}
+
+/**
+ * @brief Reads a whole file into memory
+ * @param path  file path
+ * @param len   receives the file length
+ * @return file contents or NULL on failure
+ */
+static uint8_t* qimg_read_file(const char* path, size_t* len) {
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+    uint8_t* data = NULL;
+    struct stat st;
+    if (!fstat(fileno(f), &st) && st.st_size > 0) {
+        data = malloc((size_t) st.st_size);
+        *len = fread(data, 1, (size_t) st.st_size, f);
+        if (*len != (size_t) st.st_size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(f);
+    return data;
 }
 
-qimg_fb* qimg_open_fb_from_path(const char* path) {
-    qimg_fb* fb = malloc(sizeof(qimg_fb));
-    fb->fbfd = open(path, O_RDWR);
-    assertf(fb->fbfd >= 0, "Framebuffer device fopen() failed");
+/**
+ * @brief Reads a big endian 32 bit value
+ * @param p     data
+ * @return value
+ */
+static uint32_t qimg_be32(const uint8_t* p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+           (uint32_t) p[2] << 8 | p[3];
+}
+
+/**
+ * @brief Looks up a tEXt or zTXt chunk value from PNG data. Only chunks
+ * preceding the image data are searched.
+ * @param png   PNG file contents
+ * @param len   data length
+ * @param key   keyword
+ * @param out   receives the value
+ * @param size  size of out
+ * @return true if found
+ */
+static bool qimg_png_text(const uint8_t* png, size_t len, const char* key,
+                          char* out, size_t size) {
+    size_t key_len = strlen(key);
+    size_t off = 8; /* Skip the signature */
+    while (off + 12 <= len) {
+        size_t chunk = qimg_be32(png + off);
+        const uint8_t* type = png + off + 4;
+        const uint8_t* data = png + off + 8;
+        if (chunk > len - off - 12 || !memcmp(type, "IDAT", 4))
+            break;
+        /* zTXt has a compression method byte (0, zlib) before the value */
+        size_t zip = !memcmp(type, "zTXt", 4);
+        if ((zip || !memcmp(type, "tEXt", 4)) && chunk > key_len + zip &&
+                !memcmp(data, key, key_len) && data[key_len] == '\0') {
+            const char* val = (const char*) data + key_len + 1 + zip;
+            size_t n = chunk - key_len - 1 - zip;
+            char* inflated = NULL;
+            if (zip) {
+                int inflated_len = 0;
+                if (val[-1] != 0 || !(inflated = stbi_zlib_decode_malloc(
+                        val, (int) n, &inflated_len)))
+                    return false;
+                val = inflated;
+                n = (size_t) inflated_len;
+            }
+            bool found = n < size;
+            if (found) {
+                memcpy(out, val, n);
+                out[n] = '\0';
+            }
+            stbi_image_free(inflated);
+            return found;
+        }
+        off += chunk + 12;
+    }
+    return false;
+}
+
+qimg_image* qimg_load_thumbnail(const char* input_path, int size) {
+    char uri[THUMB_PATH_MAX], path[THUMB_PATH_MAX], val[THUMB_PATH_MAX];
+    struct stat st;
+    if (stat(input_path, &st) || !qimg_thumb_path(input_path, size, uri, path))
+        return NULL;
+
+    size_t len = 0;
+    uint8_t* png = qimg_read_file(path, &len);
+    if (!png)
+        return NULL;
+
+    /* The thumbnail must describe this very revision of the input */
+    qimg_image* im = NULL;
+    if (qimg_png_text(png, len, "Thumb::URI", val, sizeof(val)) &&
+            !strcmp(val, uri) &&
+            qimg_png_text(png, len, "Thumb::MTime", val, sizeof(val)) &&
+            strtoll(val, NULL, 10) == (long long) st.st_mtime) {
+        im = malloc(sizeof(qimg_image));
+        im->depth = 1;
+        im->bgr = false;
+        im->half = NULL;
+        im->pixels = stbi_load_from_memory(png, (int) len, &im->res.x,
+                                           &im->res.y, &im->c, 0);
+        if (!im->pixels) {
+            free(im);
+            im = NULL;
+        }
+    }
+    free(png);
+    return im;
+}
+
+/** Growable byte buffer used for encoding */
+typedef struct qimg_bytes {
+    uint8_t* data;          /**< contents */
+    size_t len;             /**< bytes used */
+    size_t cap;             /**< bytes allocated */
+    uint32_t bits;          /**< pending bits, LSB first */
+    int n_bits;             /**< number of pending bits */
+    char _padding[4];       /**< boring */
+} qimg_bytes;
+
+static void qimg_bytes_put(qimg_bytes* b, const void* data, size_t len) {
+    if (b->len + len > b->cap) {
+        b->cap = (b->len + len) * 2;
+        b->data = realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void qimg_bytes_put32(qimg_bytes* b, uint32_t v) {
+    uint8_t be[4] = {(uint8_t)(v >> 24), (uint8_t)(v >> 16),
+                     (uint8_t)(v >> 8), (uint8_t) v};
+    qimg_bytes_put(b, be, 4);
+}
+
+/**
+ * @brief Appends bits LSB first as deflate expects
+ * @param b     buffer
+ * @param v     bits
+ * @param n     number of bits
+ */
+static void qimg_bytes_bits(qimg_bytes* b, uint32_t v, int n) {
+    b->bits |= v << b->n_bits;
+    b->n_bits += n;
+    while (b->n_bits >= 8) {
+        uint8_t byte = (uint8_t) b->bits;
+        qimg_bytes_put(b, &byte, 1);
+        b->bits >>= 8;
+        b->n_bits -= 8;
+    }
+}
+
+/**
+ * @brief Appends a Huffman code, which deflate stores MSB first
+ * @param b     buffer
+ * @param code  code
+ * @param n     code length
+ */
+static void qimg_bytes_code(qimg_bytes* b, uint32_t code, int n) {
+    uint32_t rev = 0;
+    for (int i = 0; i < n; ++i)
+        rev |= ((code >> i) & 1) << (n - 1 - i);
+    qimg_bytes_bits(b, rev, n);
+}
+
+/**
+ * @brief Appends a literal / length symbol using the fixed Huffman code
+ * @param b     buffer
+ * @param sym   symbol 0-287
+ */
+static void qimg_deflate_sym(qimg_bytes* b, int sym) {
+    if (sym < 144)
+        qimg_bytes_code(b, 0x30 + sym, 8);
+    else if (sym < 256)
+        qimg_bytes_code(b, 0x190 + sym - 144, 9);
+    else if (sym < 280)
+        qimg_bytes_code(b, sym - 256, 7);
+    else
+        qimg_bytes_code(b, 0xc0 + sym - 280, 8);
+}
+
+/**
+ * @brief Compresses data into a zlib stream using fixed Huffman codes and
+ * greedy LZ77 matching
+ * @param data  input
+ * @param len   input length
+ * @param out   output buffer, appended to
+ */
+static void qimg_zlib_compress(const uint8_t* data, size_t len,
+                               qimg_bytes* out) {
+    static const uint16_t len_base[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51,
+        59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const uint8_t len_extra[29] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4,
+        5, 5, 5, 5, 0};
+    static const uint16_t dist_base[30] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+        513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385,
+        24577};
+    static const uint8_t dist_extra[30] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10,
+        10, 11, 11, 12, 12, 13, 13};
+    const int hash_bits = 15;
+    const size_t window = 32768;
+
+    uint8_t header[2] = {0x78, 0x01};
+    qimg_bytes_put(out, header, 2);
+    qimg_bytes_bits(out, 1, 1); /* Final block */
+    qimg_bytes_bits(out, 1, 2); /* Fixed Huffman codes */
+
+    int64_t* head = malloc(sizeof(int64_t) << hash_bits);
+    for (int i = 0; i < (1 << hash_bits); ++i)
+        head[i] = -1;
+
+    size_t i = 0;
+    while (i < len) {
+        int best = 0;
+        size_t dist = 0;
+        if (i + 3 <= len) {
+            uint32_t h = ((uint32_t) data[i] << 16 | data[i + 1] << 8 |
+                          data[i + 2]) * 2654435761u >> (32 - hash_bits);
+            int64_t cand = head[h];
+            head[h] = (int64_t) i;
+            if (cand >= 0 && i - (size_t) cand <= window) {
+                size_t max = len - i < 258 ? len - i : 258;
+                size_t n = 0;
+                while (n < max && data[cand + n] == data[i + n])
+                    ++n;
+                if (n >= 3) {
+                    best = (int) n;
+                    dist = i - (size_t) cand;
+                }
+            }
+        }
+
+        if (!best) {
+            qimg_deflate_sym(out, data[i++]);
+            continue;
+        }
+        int l = 28;
+        while (len_base[l] > best)
+            --l;
+        qimg_deflate_sym(out, 257 + l);
+        qimg_bytes_bits(out, (uint32_t)(best - len_base[l]), len_extra[l]);
+        int d = 29;
+        while (dist_base[d] > dist)
+            --d;
+        qimg_bytes_code(out, (uint32_t) d, 5);
+        qimg_bytes_bits(out, (uint32_t)(dist - dist_base[d]), dist_extra[d]);
+        i += (size_t) best;
+    }
+    qimg_deflate_sym(out, 256);
+    qimg_bytes_bits(out, 0, 7); /* Flush to a byte boundary */
+    free(head);
+
+    uint32_t a = 1, b = 0;
+    for (size_t j = 0; j < len; ++j) {
+        a = (a + data[j]) % 65521;
+        b = (b + a) % 65521;
+    }
+    qimg_bytes_put32(out, b << 16 | a);
+}
+
+/**
+ * @brief Updates a CRC-32 as used by PNG and zlib
+ * @param crc   CRC of the preceding data, 0 to start
+ * @param data  data
+ * @param len   data length
+ * @return updated CRC
+ */
+static uint32_t qimg_crc32(uint32_t crc, const uint8_t* data, size_t len) {
+    static const uint32_t t[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190,
+        0x6b6b51f4, 0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344,
+        0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278,
+        0xbdbdf21c};
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i) {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ t[crc & 0xf];
+        crc = (crc >> 4) ^ t[crc & 0xf];
+    }
+    return ~crc;
+}
+
+/**
+ * @brief Appends a PNG chunk
+ * @param b     buffer
+ * @param type  chunk type
+ * @param data  chunk data
+ * @param len   data length
+ */
+static void qimg_png_chunk(qimg_bytes* b, const char* type,
+                           const uint8_t* data, size_t len) {
+    qimg_bytes_put32(b, (uint32_t) len);
+    size_t start = b->len;
+    qimg_bytes_put(b, type, 4);
+    if (len)
+        qimg_bytes_put(b, data, len);
+    qimg_bytes_put32(b, qimg_crc32(0, b->data + start, len + 4));
+}
+
+bool qimg_write_png(const char* path, qimg_image* im, const char** text,
+                    int n_text) {
+    static const uint8_t sig[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a,
+                                   '\n'};
+    static const uint8_t color_types[5] = {0, 0, 4, 2, 6};
+    qimg_bytes b = {0};
+    qimg_bytes_put(&b, sig, 8);
+
+    uint8_t ihdr[13] = {0};
+    for (int i = 0; i < 4; ++i) {
+        ihdr[i] = (uint8_t)(im->res.x >> (24 - 8 * i));
+        ihdr[4 + i] = (uint8_t)(im->res.y >> (24 - 8 * i));
+    }
+    ihdr[8] = 8;
+    ihdr[9] = color_types[im->c];
+    qimg_png_chunk(&b, "IHDR", ihdr, sizeof(ihdr));
+
+    for (int i = 0; i < n_text; ++i) {
+        qimg_bytes t = {0};
+        qimg_bytes_put(&t, text[2 * i], strlen(text[2 * i]) + 1);
+        qimg_bytes_put(&t, text[2 * i + 1], strlen(text[2 * i + 1]));
+        qimg_png_chunk(&b, "tEXt", t.data, t.len);
+        free(t.data);
+    }
+
+    /* Paeth filter every row, it suits photographic content best */
+    size_t stride = (size_t) im->res.x * im->c;
+    uint8_t* raw = malloc((stride + 1) * im->res.y);
+    for (int y = 0; y < im->res.y; ++y) {
+        const uint8_t* cur = im->pixels + y * stride;
+        const uint8_t* up = y ? cur - stride : NULL;
+        uint8_t* dst = raw + y * (stride + 1);
+        dst[0] = 4;
+        for (size_t x = 0; x < stride; ++x) {
+            int a = x >= (size_t) im->c ? cur[x - im->c] : 0;
+            int bb = up ? up[x] : 0;
+            int c = up && x >= (size_t) im->c ? up[x - im->c] : 0;
+            int p = a + bb - c;
+            int pa = abs(p - a), pb = abs(p - bb), pc = abs(p - c);
+            int pred = (pa <= pb && pa <= pc) ? a : (pb <= pc ? bb : c);
+            dst[x + 1] = (uint8_t)(cur[x] - pred);
+        }
+    }
+    qimg_bytes z = {0};
+    qimg_zlib_compress(raw, (stride + 1) * im->res.y, &z);
+    free(raw);
+    qimg_png_chunk(&b, "IDAT", z.data, z.len);
+    free(z.data);
+    qimg_png_chunk(&b, "IEND", NULL, 0);
+
+    FILE* f = fopen(path, "wb");
+    bool ok = f && fwrite(b.data, 1, b.len, f) == b.len;
+    if (f)
+        ok = !fclose(f) && ok;
+    free(b.data);
+    return ok;
+}
+
+bool qimg_write_qoi(const char* path, const qimg_image* im) {
+    /* Gray is stored as RGB, QOI only has 3 and 4 channel images */
+    int c = im->c >= 3 ? im->c : im->c + 2;
+    int r = im->bgr ? 2 : 0;
+    size_t n = (size_t) im->res.x * im->res.y;
+    uint8_t* data = malloc(14 + n * (c + 1) + 8);
+    if (!data)
+        return false;
+    uint8_t* o = data;
+    memcpy(o, "qoif", 4);
+    for (int i = 0; i < 4; ++i) {
+        o[4 + i] = (uint8_t)(im->res.x >> (24 - 8 * i));
+        o[8 + i] = (uint8_t)(im->res.y >> (24 - 8 * i));
+    }
+    o[12] = (uint8_t) c;
+    o[13] = 0; /* sRGB */
+    o += 14;
+
+    uint8_t index[64][4] = {{0}};
+    uint8_t prev[4] = {0, 0, 0, 255};
+    int reps = 0;       /* pending repeats of prev */
+    for (size_t i = 0; i < n; ++i) {
+        /* RGBA sample values, 16-bit ones cut down to their high byte */
+        int s[4] = {0};
+        for (int k = 0; k < im->c; ++k)
+            s[k] = im->depth == 2 ? ((const uint16_t*) im->pixels)[
+                       i * im->c + k] >> 8 : im->pixels[i * im->c + k];
+        uint8_t px[4];
+        if (im->c <= 2) {
+            px[0] = px[1] = px[2] = (uint8_t) s[0];
+            px[3] = im->c == 2 ? (uint8_t) s[1] : 255;
+        } else {
+            px[0] = (uint8_t) s[r];
+            px[1] = (uint8_t) s[1];
+            px[2] = (uint8_t) s[2 - r];
+            px[3] = im->c == 4 ? (uint8_t) s[3] : 255;
+        }
+
+        if (!memcmp(px, prev, 4)) {
+            if (++reps == 62 || i == n - 1) {
+                *o++ = (uint8_t)(0xc0 | (reps - 1));
+                reps = 0;
+            }
+            continue;
+        }
+        if (reps) {
+            *o++ = (uint8_t)(0xc0 | (reps - 1));
+            reps = 0;
+        }
+        int h = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) & 63;
+        if (!memcmp(index[h], px, 4)) {
+            *o++ = (uint8_t) h;
+        } else if (px[3] != prev[3]) {
+            memcpy(index[h], px, 4);
+            *o++ = 0xff;
+            memcpy(o, px, 4);
+            o += 4;
+        } else {
+            memcpy(index[h], px, 4);
+            int dr = (int8_t)(px[0] - prev[0]);
+            int dg = (int8_t)(px[1] - prev[1]);
+            int db = (int8_t)(px[2] - prev[2]);
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 &&
+                    db >= -2 && db <= 1) {
+                *o++ = (uint8_t)(0x40 | (dr + 2) << 4 | (dg + 2) << 2 |
+                                 (db + 2));
+            } else if (dg >= -32 && dg <= 31 && dr - dg >= -8 &&
+                       dr - dg <= 7 && db - dg >= -8 && db - dg <= 7) {
+                *o++ = (uint8_t)(0x80 | (dg + 32));
+                *o++ = (uint8_t)((dr - dg + 8) << 4 | (db - dg + 8));
+            } else {
+                *o++ = 0xfe;
+                memcpy(o, px, 3);
+                o += 3;
+            }
+        }
+        memcpy(prev, px, 4);
+    }
+    static const uint8_t end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    memcpy(o, end, 8);
+    o += 8;
+
+    FILE* file = fopen(path, "wb");
+    size_t len = (size_t)(o - data);
+    bool ok = file && fwrite(data, 1, len, file) == len;
+    if (file)
+        ok = !fclose(file) && ok;
+    free(data);
+    return ok;
+}
+
+/** Inputs being transcoded to QOI */
+typedef struct qimg_qoi_batch {
+    char** input_paths;     /**< input paths */
+    char** output_paths;    /**< output of each input, NULL to skip it */
+    bool* ok;               /**< per input, set when converted or skipped */
+} qimg_qoi_batch;
+
+/**
+ * @brief Names the QOI output of an input, see #qimg_convert_qoi
+ * @param input_path    input path
+ * @return output path to free
+ */
+static char* qimg_qoi_path(const char* input_path) {
+    /* Archive members are written to the working directory */
+    const char* name = strrchr(input_path, ARCHIVE_SEP);
+    if (name && qimg_find_member(input_path)) {
+        const char* base = strrchr(name, '/');
+        name = base ? base + 1 : name + 1;
+    } else {
+        name = input_path;
+    }
+    const char* slash = strrchr(name, '/');
+    const char* dot = strrchr(slash ? slash : name, '.');
+    size_t stem = dot ? (size_t)(dot - name) : strlen(name);
+    char* path = malloc(stem + 5);
+    memcpy(path, name, stem);
+    memcpy(path + stem, ".qoi", 5);
+    return path;
+}
+
+/**
+ * @brief Transcodes one input of a batch to QOI, see #qimg_convert_qoi
+ * @param arg   batch
+ * @param i     input index
+ */
+static void qimg_convert_qoi_input(void* arg, int i) {
+    qimg_qoi_batch* batch = arg;
+    const char* input_path = batch->input_paths[i];
+    const char* path = batch->output_paths[i];
+    if (!path)
+        return;
+
+    /* Write to a temporary file first so readers never see partial files */
+    char tmp[THUMB_PATH_MAX + 32];
+    snprintf(tmp, sizeof(tmp), "%s.qimg-%d-%lx", path, (int) getpid(),
+             (unsigned long) pthread_self());
+    qimg_image* im = qimg_decode_image(input_path, NULL);
+    batch->ok[i] = im && qimg_write_qoi(tmp, im) && !rename(tmp, path);
+    if (!batch->ok[i]) {
+        log_msg("[ERROR]: Converting %s to %s failed", input_path, path);
+        unlink(tmp);
+    }
+    if (im)
+        qimg_free_image(im);
+}
+
+int qimg_convert_qoi(char** input_paths, int n, int n_threads) {
+    qimg_qoi_batch batch = {input_paths, calloc(n, sizeof(char*)),
+                            calloc(n, sizeof(bool))};
+
+    /* Outputs are settled before any worker starts, so that no two inputs
+     * are written to the same file and nothing already there is replaced */
+    struct stat st;
+    for (int i = 0; i < n; ++i) {
+        char* path = qimg_qoi_path(input_paths[i]);
+        int j;
+        for (j = 0; j < i; ++j)
+            if (batch.output_paths[j] &&
+                    !strcmp(batch.output_paths[j], path))
+                break;
+        batch.ok[i] = true;
+        if (!strcmp(path, input_paths[i])) {
+            log_msg("Skipping %s, it is already QOI", input_paths[i]);
+        } else if (j < i) {
+            log_msg("[ERROR]: Skipping %s, %s is written from %s",
+                    input_paths[i], path, input_paths[j]);
+            batch.ok[i] = false;
+        } else if (!lstat(path, &st)) {
+            log_msg("Skipping %s, %s exists", input_paths[i], path);
+        } else {
+            batch.output_paths[i] = path;
+            batch.ok[i] = false;
+            continue;
+        }
+        free(path);
+    }
+
+    qimg_pool* pool = qimg_pool_create(n_threads, -1);
+    qimg_parallel_for(qimg_convert_qoi_input, &batch, n, pool);
+    qimg_pool_destroy(pool);
+    int failed = 0;
+    for (int i = 0; i < n; ++i) {
+        failed += !batch.ok[i];
+        free(batch.output_paths[i]);
+    }
+    free(batch.output_paths);
+    free(batch.ok);
+    return failed;
+}
+
+/** Inputs being rendered into a bundle */
+typedef struct qimg_pack_batch {
+    const qimg_opts* o;         /**< options, with the inputs */
+    qimg_fb* fb;                /**< framebuffer slides are rendered for */
+    const qimg_view* view;      /**< view slides are rendered with */
+    int fd;                     /**< bundle being written */
+    size_t page;                /**< frame alignment */
+    pthread_mutex_t lock;       /**< guards end */
+    uint64_t end;               /**< offset of the next frame */
+    qimg_bundle_frame* frames;  /**< index entry of each input */
+    bool* ok;                   /**< per input, set when packed */
+} qimg_pack_batch;
+
+/**
+ * @brief Run-length codes rows of pixels, see #qimg_pack
+ * @param src   pixels, rows one after another
+ * @param w     row length
+ * @param h     number of rows
+ * @param dst   receives the coded words
+ * @param cap   room in dst, in words
+ * @return number of words written, 0 if they did not fit
+ */
+static size_t qimg_rle_encode(const uint32_t* src, int w, int h,
+                              uint32_t* dst, size_t cap) {
+    size_t o = 0;
+    for (int y = 0; y < h; ++y, src += w) {
+        int i = 0;
+        int start = 0;  /* first pending literal */
+        while (i <= w) {
+            int r = 0;
+            if (i < w)
+                while (++r < w - i && src[i + r] == src[i]) {}
+            /* Short runs are cheaper as literals */
+            if (i < w && r < 3) {
+                i += r;
+                continue;
+            }
+            if (i > start) {
+                size_t n = (size_t) (i - start);
+                if (o + 1 + n > cap)
+                    return 0;
+                dst[o++] = (uint32_t) n;
+                memcpy(dst + o, src + start, n * sizeof(uint32_t));
+                o += n;
+            }
+            if (i == w)
+                break;
+            if (o + 2 > cap)
+                return 0;
+            dst[o++] = BUNDLE_RUN | (uint32_t) r;
+            dst[o++] = src[i];
+            i += r;
+            start = i;
+        }
+    }
+    return o;
+}
+
+/**
+ * @brief Writes all of a buffer at an offset
+ * @param fd        file
+ * @param data      data
+ * @param len       data length
+ * @param offset    file offset
+ * @return true on success
+ */
+static bool qimg_pwrite(int fd, const void* data, size_t len, off_t offset) {
+    const char* p = data;
+    while (len) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= (size_t) n;
+        offset += n;
+    }
+    return true;
+}
+
+/**
+ * @brief Renders one input of a batch into the bundle, see #qimg_pack
+ * @param arg   batch
+ * @param i     input index
+ */
+static void qimg_pack_input(void* arg, int i) {
+    qimg_pack_batch* batch = arg;
+    const qimg_opts* o = batch->o;
+    qimg_fb* fb = batch->fb;
+    const char* input_path = o->input_paths[i];
+    qimg_image* im = qimg_prepare_image(input_path, fb->res, o->scale, NULL);
+    if (!im) {
+        log_msg("[ERROR]: Loading %s failed", input_path);
+        return;
+    }
+    uint32_t* buf = calloc(fb->size, 1);
+    qimg_rect r = qimg_render_image(im, fb, o->pos, o->bg, batch->view,
+                                    (char*) buf);
+    qimg_free_image(im);
+
+    /* Keep the covered region only, its rows just move towards the start */
+    int w = r.x1 - r.x0;
+    int h = r.y1 - r.y0;
+    if (r.y0 || w < fb->res.x)
+        for (int y = 0; y < h; ++y)
+            memmove(buf + (size_t) y * w,
+                    buf + (size_t) (r.y0 + y) * fb->res.x + r.x0,
+                    (size_t) w * sizeof(uint32_t));
+    size_t size = (size_t) w * h * sizeof(uint32_t);
+    const void* data = buf;
+    uint32_t* coded = NULL;
+    qimg_bundle_codec codec = BUNDLE_RAW;
+    if (o->pack_rle && size) {
+        coded = malloc(size);
+        size_t n = qimg_rle_encode(buf, w, h, coded,
+                                   size / sizeof(uint32_t) - 1);
+        if (n) {
+            data = coded;
+            size = n * sizeof(uint32_t);
+            codec = BUNDLE_RLE;
+        }
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    uint64_t offset = batch->end;
+    batch->end += (size + batch->page - 1) / batch->page * batch->page;
+    pthread_mutex_unlock(&batch->lock);
+    batch->frames[i] = (qimg_bundle_frame) {offset, (uint32_t) size, codec, r};
+    batch->ok[i] = qimg_pwrite(batch->fd, data, size, (off_t) offset);
+    if (!batch->ok[i])
+        log_msg("[ERROR]: Writing %s to the bundle failed", input_path);
+    free(coded);
+    free(buf);
+}
+
+int qimg_pack(const char* path, qimg_fb* fb, const qimg_opts* o) {
+    /* Write to a temporary file first so players never see partial files */
+    char tmp[THUMB_PATH_MAX + 32];
+    snprintf(tmp, sizeof(tmp), "%s.qimg-%d", path, (int) getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_msg("[ERROR]: Creating %s failed", tmp);
+        return -1;
+    }
+
+    /* Slides look as they would in the slideshow */
+    qimg_view view = {1.0f, 0, NULL, {0.0f, 0.0f}, false, false, {0}};
+    uint16_t* window = NULL;
+    if (o->window_width) {
+        window = malloc(65536 * sizeof(uint16_t));
+        qimg_build_window_lut(window, o->window_center, o->window_width);
+        view.window = window;
+    }
+
+    /* Frames start on the first page after the index */
+    int n = o->n_inputs;
+    qimg_pack_batch batch;
+    batch.o = o;
+    batch.fb = fb;
+    batch.view = &view;
+    batch.fd = fd;
+    batch.page = (size_t) sysconf(_SC_PAGESIZE);
+    pthread_mutex_init(&batch.lock, NULL);
+    batch.end = sizeof(qimg_bundle_header) + n * sizeof(qimg_bundle_frame);
+    batch.end = (batch.end + batch.page - 1) / batch.page * batch.page;
+    batch.frames = calloc(n, sizeof(qimg_bundle_frame));
+    batch.ok = calloc(n, sizeof(bool));
+    qimg_pool* pool = qimg_pool_create(o->n_threads, -1);
+    qimg_parallel_for(qimg_pack_input, &batch, n, pool);
+    qimg_pool_destroy(pool);
+    pthread_mutex_destroy(&batch.lock);
+
+    /* Index the slides that made it in playlist order */
+    int packed = 0;
+    for (int i = 0; i < n; ++i)
+        if (batch.ok[i])
+            batch.frames[packed++] = batch.frames[i];
+    qimg_bundle_header header = {{0}, BUNDLE_VERSION,
+        (uint32_t) packed, {(uint32_t) fb->res.x, (uint32_t) fb->res.y},
+        (uint32_t) fb->depth, {(uint32_t) fb->shift[0],
+        (uint32_t) fb->shift[1], (uint32_t) fb->shift[2],
+        (uint32_t) fb->shift[3]}, (uint32_t) batch.page};
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    bool ok = packed &&
+              qimg_pwrite(fd, &header, sizeof(header), 0) &&
+              qimg_pwrite(fd, batch.frames,
+                          packed * sizeof(qimg_bundle_frame), sizeof(header));
+    ok = !close(fd) && ok && !rename(tmp, path);
+    if (!ok) {
+        log_msg("[ERROR]: Writing bundle %s failed", path);
+        unlink(tmp);
+    }
+    free(batch.frames);
+    free(batch.ok);
+    free(window);
+    return ok ? n - packed : -1;
+}
+
+bool qimg_save_thumbnail(const char* input_path, qimg_image* im, int size) {
+    char uri[THUMB_PATH_MAX], path[THUMB_PATH_MAX], tmp[THUMB_PATH_MAX + 32];
+    struct stat st;
+    if (stat(input_path, &st) || !qimg_thumb_path(input_path, size, uri, path))
+        return false;
+
+    /* Create the cache directories private to the user as the spec asks */
+    for (char* p = path + 1; *p; ++p) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        mkdir(path, 0700);
+        *p = '/';
+    }
+
+    /* Thumbnails only ever shrink the input */
+    qimg_image th = *im;
+    if (im->res.x > size || im->res.y > size) {
+        qimg_point p = {size, size};
+        th.res = qimg_get_scaled_dims(im->res, p, SCALE_FIT);
+        th.pixels = malloc((size_t) th.res.x * th.res.y * th.c);
+        if (!stbir_resize_uint8(im->pixels, im->res.x, im->res.y, 0,
+                                th.pixels, th.res.x, th.res.y, 0, th.c)) {
+            free(th.pixels);
+            return false;
+        }
+    }
+
+    char mtime[32], fsize[32];
+    snprintf(mtime, sizeof(mtime), "%lld", (long long) st.st_mtime);
+    snprintf(fsize, sizeof(fsize), "%lld", (long long) st.st_size);
+    const char* text[] = {
+        "Thumb::URI", uri,
+        "Thumb::MTime", mtime,
+        "Thumb::Size", fsize,
+        "Software", "qimg"
+    };
+
+    /* Write to a temporary file first so readers never see partial files */
+    snprintf(tmp, sizeof(tmp), "%s.qimg-%d-%lx", path, (int) getpid(),
+             (unsigned long) pthread_self());
+    bool ok = qimg_write_png(tmp, &th, text, 4);
+    if (ok) {
+        chmod(tmp, 0600);
+        ok = !rename(tmp, path);
+    }
+    if (!ok)
+        unlink(tmp);
+    if (th.pixels != im->pixels)
+        free(th.pixels);
+    return ok;
+}
+
+static void qimg_run_thumb_job(qimg_job* job) {
+    qimg_thumb_job* tj = (qimg_thumb_job*) job;
+    int size = qimg_thumb_size(tj->vp);
+    if (!size)
+        return;
+
+    /* Decode no larger than the thumbnail, JPEGs at a reduced size */
+    qimg_image* im = qimg_load_thumbnail(tj->path, size);
+    if (!im) {
+        qimg_point box = {size, size};
+        im = qimg_decode(tj->path, box, SCALE_FIT, false, &job->cancelled);
+        if (im) {
+            qimg_reduce_depth(im);
+            qimg_save_thumbnail(tj->path, im, size);
+        }
+    }
+    qimg_free_image(im);
+}
+
+static void qimg_discard_thumb_job(qimg_job* job) {
+    free(job);
+}
+
+int qimg_dedup_inputs(qimg_dyn_collection* dcol, bool by_content) {
+    int n = dcol->size;
+    struct stat* st = calloc(n, sizeof(struct stat));
+    bool* ok = calloc(n, sizeof(bool));
+    uint8_t (*digest)[16] = calloc(n, sizeof(*digest));
+    bool* hashed = calloc(n, sizeof(bool));
+    int distinct = 0;
+
+    for (int i = 0; i < n; ++i) {
+        ok[i] = !stat(dcol->input_paths[i], &st[i]);
+        dcol->assets[i] = i;
+        for (int j = 0; ok[i] && j < i; ++j) {
+            if (!ok[j] || dcol->assets[j] != j || st[i].st_size != st[j].st_size)
+                continue;
+            bool same = st[i].st_dev == st[j].st_dev &&
+                        st[i].st_ino == st[j].st_ino &&
+                        st[i].st_mtime == st[j].st_mtime;
+            /* Contents are only hashed for files whose sizes collide */
+            for (int k = 0; by_content && !same && k < 2; ++k) {
+                int h = k ? j : i;
+                if (hashed[h])
+                    continue;
+                size_t len;
+                uint8_t* data = qimg_read_file(dcol->input_paths[h], &len);
+                if (data)
+                    qimg_md5(data, len, digest[h]);
+                hashed[h] = data != NULL;
+                free(data);
+            }
+            if (by_content && !same && hashed[i] && hashed[j])
+                same = !memcmp(digest[i], digest[j], 16);
+            if (same) {
+                dcol->assets[i] = j;
+                break;
+            }
+        }
+        distinct += dcol->assets[i] == i;
+    }
+    free(hashed);
+    free(digest);
+    free(ok);
+    free(st);
+    return distinct;
+}
+
+void qimg_queue_thumbnails(qimg_dyn_collection* dcol) {
+    if (!thumb_root || !dcol->pool || dcol->scale == SCALE_DISABLED ||
+            !qimg_thumb_size(dcol->vp))
+        return;
+    for (int i = 0; i < dcol->size; ++i) {
+        if (dcol->assets[i] != i)
+            continue;
+        qimg_thumb_job* job = calloc(1, sizeof(qimg_thumb_job));
+        job->job.run = qimg_run_thumb_job;
+        job->job.discard = qimg_discard_thumb_job;
+        job->path = dcol->input_paths[i];
+        job->vp = dcol->vp;
+        job->scale = dcol->scale;
+        qimg_pool_submit_idle(dcol->pool, &job->job);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void qimg_run_load_job(qimg_job* job) {
+    qimg_load_job* lj = (qimg_load_job*) job;
+    lj->im = qimg_prepare_image(lj->path, lj->vp, lj->scale, &job->cancelled);
+}
+
+static void qimg_discard_load_job(qimg_job* job) {
+    qimg_load_job* lj = (qimg_load_job*) job;
+    qimg_free_image(lj->im);
+    free(lj);
+}
+
+/**
+ * @brief Empties a cache slot, cancelling its pending load if any
+ * @param dcol  dynamic collection
+ * @param slot  slot to empty
+ */
+static void qimg_cache_evict(qimg_dyn_collection* dcol, qimg_cache_slot* slot) {
+    if (slot->job)
+        qimg_pool_release(dcol->pool, &slot->job->job);
+    qimg_free_image(slot->im);
+    slot->job = NULL;
+    slot->im = NULL;
+    slot->idx = -1;
+}
+
+/**
+ * @brief Makes given index ready in the cache, loading it on the calling
+ * thread or waiting for its background load if needed. An input that fails
+ * to load is logged once and keeps an empty frame until it is invalidated.
+ *
+ * The cursor must be moved first so that a free slot is guaranteed to exist
+ * for any index within the window.
+ *
+ * @param dcol  dynamic collection
+ * @param idx   input index
+ * @return cache slot holding the frame
+ */
+static qimg_cache_slot* qimg_cache_load(qimg_dyn_collection* dcol, int idx) {
+    qimg_cache_slot* slot = qimg_find_slot(dcol, idx);
+    if (!slot) {
+        slot = qimg_find_free_slot(dcol);
+        assertf(slot, "Frame cache overflow");
+        slot->im = qimg_prepare_image(dcol->input_paths[idx], dcol->vp,
+                                      dcol->scale, NULL);
+        slot->idx = dcol->assets[idx];
+        if (!slot->im)
+            log_msg("Loading image %s failed", dcol->input_paths[idx]);
+    } else if (slot->job) {
+        qimg_pool_wait(dcol->pool, &slot->job->job);
+        slot->im = slot->job->im;
+        free(slot->job);
+        slot->job = NULL;
+        if (!slot->im)
+            log_msg("Loading image %s failed", dcol->input_paths[idx]);
+    }
+    return slot;
+}
+
+/**
+ * @brief Queues given index for background loading unless it is cached
+ * already. Loads it right away if the collection has no worker pool.
+ * @param dcol      dynamic collection
+ * @param idx       input index
+ * @param urgent    load ahead of everything else queued
+ */
+static void qimg_cache_request(qimg_dyn_collection* dcol, int idx,
+                               bool urgent) {
+    if (qimg_find_slot(dcol, idx))
+        return;
+    if (!dcol->pool) {
+        qimg_cache_load(dcol, idx);
+        return;
+    }
+
+    qimg_cache_slot* slot = qimg_find_free_slot(dcol);
+    assertf(slot, "Frame cache overflow");
+    qimg_load_job* job = calloc(1, sizeof(qimg_load_job));
+    job->job.run = qimg_run_load_job;
+    job->job.discard = qimg_discard_load_job;
+    job->path = dcol->input_paths[idx];
+    job->vp = dcol->vp;
+    job->scale = dcol->scale;
+    slot->job = job;
+    slot->idx = dcol->assets[idx];
+    if (urgent)
+        qimg_pool_submit_urgent(dcol->pool, &job->job);
+    else
+        qimg_pool_submit(dcol->pool, &job->job);
+}
+
+/**
+ * @brief Moves the cursor of a dynamic collection and evicts frames that
+ * fall out of the cache window
+ * @param dcol  dynamic collection
+ * @param idx   input index, wrapped or clamped as in #qimg_get_at
+ */
+static void qimg_move_cursor(qimg_dyn_collection* dcol, int idx) {
+    dcol->idx = qimg_wrap_slide(idx, dcol->size, dcol->loop);
+
+    /* Evict frames that fell out of the window */
+    for (int i = 0; i < dcol->n_slots; ++i) {
+        qimg_cache_slot* slot = &dcol->slots[i];
+        if (slot->idx != -1 && !qimg_asset_in_window(dcol, slot->idx))
+            qimg_cache_evict(dcol, slot);
+    }
+}
+
+qimg_image* qimg_get_at(qimg_dyn_collection* dcol, int idx) {
+    qimg_move_cursor(dcol, idx);
+    return qimg_cache_load(dcol, dcol->idx)->im;
+}
+
+qimg_image* qimg_try_get_at(qimg_dyn_collection* dcol, int idx) {
+    qimg_move_cursor(dcol, idx);
+    qimg_cache_request(dcol, dcol->idx, true);
+    if (!qimg_is_cached(dcol, dcol->idx))
+        return NULL;
+    return qimg_cache_load(dcol, dcol->idx)->im;
+}
+
+void qimg_prefetch(qimg_dyn_collection* dcol) {
+    for (int i = 1; i <= dcol->prefetch; ++i) {
+        int idx = dcol->idx + i;
+        if (!dcol->loop && idx >= dcol->size)
+            break;
+        qimg_cache_request(dcol, qimg_wrap_slide(idx, dcol->size, dcol->loop),
+                           false);
+    }
+}
+
+bool qimg_is_cached(qimg_dyn_collection* dcol, int idx) {
+    idx = qimg_wrap_slide(idx, dcol->size, dcol->loop);
+    qimg_cache_slot* slot = qimg_find_slot(dcol, idx);
+    if (!slot)
+        return false;
+    return !slot->job || qimg_pool_is_done(dcol->pool, &slot->job->job);
+}
+
+void qimg_invalidate(qimg_dyn_collection* dcol, int idx) {
+    qimg_cache_slot* slot = qimg_find_slot(dcol, idx);
+    if (slot)
+        qimg_cache_evict(dcol, slot);
+}
+
+/**
+ * @brief Evaluates a palette
+ * @param cmap  palette
+ * @param t     position from 0 to 1
+ * @param rgb   receives the color, 0 to 1 per channel
+ */
+static void qimg_colormap_eval(qimg_colormap cmap, float t, float rgb[3]) {
+    float v[3];
+    switch (cmap) {
+    case COLORMAP_JET:
+        v[0] = 1.5f - fabsf(4.0f * t - 3.0f);
+        v[1] = 1.5f - fabsf(4.0f * t - 2.0f);
+        v[2] = 1.5f - fabsf(4.0f * t - 1.0f);
+        break;
+    case COLORMAP_HOT:
+        v[0] = 3.0f * t;
+        v[1] = 3.0f * t - 1.0f;
+        v[2] = 3.0f * t - 2.0f;
+        break;
+    default: {
+        /* Linear interpolation between the stops */
+        const uint8_t (*stops)[3] = qimg_colormap_stops[cmap - COLORMAP_INFERNO];
+        float p = t * 8.0f;
+        int i = p >= 8.0f ? 7 : (int) p;
+        float f = p - i;
+        for (int k = 0; k < 3; ++k)
+            v[k] = (stops[i][k] * (1.0f - f) + stops[i + 1][k] * f) / 255.0f;
+        break;
+    }
+    }
+    for (int k = 0; k < 3; ++k)
+        rgb[k] = v[k] < 0.0f ? 0.0f : (v[k] > 1.0f ? 1.0f : v[k]);
+}
+
+void qimg_build_colormap(qimg_colormap cmap) {
+    colormap = cmap != COLORMAP_NONE;
+    if (!colormap)
+        return;
+
+    float rgb[3];
+    for (int i = 0; i <= 256; ++i) {
+        qimg_colormap_eval(cmap, i / 256.0f, rgb);
+        for (int k = 0; k < 3; ++k)
+            colormap_lut16[i][k] = (uint16_t) (rgb[k] * 65535.0f + 0.5f);
+    }
+    for (int i = 0; i < 256; ++i) {
+        qimg_colormap_eval(cmap, i / 255.0f, rgb);
+        uint8_t c[3];
+        for (int k = 0; k < 3; ++k) {
+            c[k] = (uint8_t) (rgb[k] * 255.0f + 0.5f);
+            if (adjust)
+                c[k] = adjust_lut[k][c[k]];
+        }
+        colormap_px[i] = (uint32_t) c[2] | (uint32_t) c[1] << 8 |
+                         (uint32_t) c[0] << 16 | 0xff000000u;
+    }
+}
+
+void qimg_build_window_lut(uint16_t* lut, int center, int width) {
+    int64_t lo = center - width / 2;
+    for (int64_t v = 0; v < 65536; ++v) {
+        int64_t out = (v - lo) * 65535 / width;
+        lut[v] = (uint16_t) (out < 0 ? 0 : (out > 65535 ? 65535 : out));
+    }
+}
+
+void qimg_get_sample_range(const qimg_image* im, int* lo, int* hi) {
+    size_t n = (size_t) im->res.x * im->res.y;
+    int colors = im->c == 2 || im->c == 4 ? im->c - 1 : im->c;
+    int min = 65535, max = 0;
+    for (size_t i = 0; i < n; ++i) {
+        for (int k = 0; k < colors; ++k) {
+            size_t j = i * im->c + k;
+            int v = im->depth == 2 ? ((const uint16_t*) im->pixels)[j] :
+                                     im->pixels[j] * 257;
+            min = v < min ? v : min;
+            max = v > max ? v : max;
+        }
+    }
+    *lo = min;
+    *hi = max < min ? min : max;
+}
+
+void qimg_build_adjust_luts(const float gamma[3], const float brightness[3],
+                            const float contrast[3]) {
+    adjust = false;
+    for (int k = 0; k < 3; ++k) {
+        adjust |= gamma[k] != 1.0f || brightness[k] != 0.0f ||
+                  contrast[k] != 1.0f;
+        /* The 16-bit table samples the curve at multiples of 16 with the
+         * last entry at the top of the range */
+        for (int i = 0; i <= ADJUST_LUT16_SIZE; ++i) {
+            float v = i < ADJUST_LUT16_SIZE ? i * 16.0f / 65535.0f : 1.0f;
+            v = (powf(v, 1.0f / gamma[k]) - 0.5f) * contrast[k] + 0.5f +
+                brightness[k];
+            v = v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+            adjust_lut16[k][i] = (uint16_t) (v * 65535.0f + 0.5f);
+        }
+        for (int i = 0; i < 256; ++i) {
+            float v = (powf(i / 255.0f, 1.0f / gamma[k]) - 0.5f) * contrast[k] +
+                      0.5f + brightness[k];
+            v = v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+            adjust_lut[k][i] = (uint8_t) (v * 255.0f + 0.5f);
+        }
+    }
+}
 
-    /* Get framebuffer information */
-    struct fb_var_screeninfo vinfo;
-    ioctl(fb->fbfd, FBIOGET_VSCREENINFO, &vinfo);
+qimg_lut3d* qimg_load_cube(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return NULL;
 
-    fb->res.x = (int) vinfo.xres;
-    fb->res.y = (int) vinfo.yres;
-    unsigned int fb_bpp = vinfo.bits_per_pixel;
-    unsigned int fb_bytes = fb_bpp / 8;
+    qimg_lut3d* lut = calloc(1, sizeof(qimg_lut3d));
+    size_t n = 0, count = 0;
+    bool ok = true;
+    char line[256];
+    while (ok && fgets(line, sizeof(line), f)) {
+        char* p = line;
+        while (*p == ' ' || *p == '\t')
+            ++p;
+        if (*p == '#' || *p == '\n' || *p == '\r' || !*p ||
+                !strncmp(p, "TITLE", 5))
+            continue;
 
-    /* Calculate data size and map framebuffer to memory */
-    fb->size = fb->res.x * fb->res.y * fb_bytes;
-    fb->fbdata = mmap(0, fb->size,
-                        PROT_READ | PROT_WRITE, MAP_SHARED, fb->fbfd, (off_t) 0);
+        float rgb[3];
+        if (!strncmp(p, "LUT_3D_SIZE", 11)) {
+            lut->size = atoi(p + 11);
+            ok = !lut->table && lut->size >= 2 && lut->size <= LUT3D_MAX_SIZE;
+            if (ok) {
+                count = (size_t) lut->size * lut->size * lut->size;
+                lut->table = malloc(count * 3 * sizeof(uint16_t));
+            }
+        } else if (!strncmp(p, "DOMAIN_MIN", 10)) {
+            ok = sscanf(p + 10, "%f %f %f", &rgb[0], &rgb[1], &rgb[2]) == 3 &&
+                 !rgb[0] && !rgb[1] && !rgb[2];
+        } else if (!strncmp(p, "DOMAIN_MAX", 10)) {
+            ok = sscanf(p + 10, "%f %f %f", &rgb[0], &rgb[1], &rgb[2]) == 3 &&
+                 rgb[0] == 1.0f && rgb[1] == 1.0f && rgb[2] == 1.0f;
+        } else if (sscanf(p, "%f %f %f", &rgb[0], &rgb[1], &rgb[2]) == 3) {
+            ok = lut->table && n < count;
+            for (int k = 0; ok && k < 3; ++k) {
+                float v = rgb[k] < 0.0f ? 0.0f : (rgb[k] > 1.0f ? 1.0f : rgb[k]);
+                lut->table[3 * n + k] = (uint16_t) (v * 65535.0f + 0.5f);
+            }
+            ++n;
+        } else {
+            ok = false; /* LUT_1D_SIZE and anything else we don't know */
+        }
+    }
+    fclose(f);
 
-    return fb;
+    if (!ok || !count || n != count) {
+        qimg_free_lut3d(lut);
+        return NULL;
+    }
+    return lut;
 }
 
-void qimg_clear_framebuffer(qimg_fb* fb) {
-    memset(fb->fbdata, 0, fb->size);
+void qimg_free_lut3d(qimg_lut3d* lut) {
+    if (!lut)
+        return;
+    free(lut->table);
+    free(lut);
 }
 
-void qimg_draw_images(qimg_dyn_collection* dcol, qimg_fb* fb, qimg_position pos,
-                      qimg_bg bg, bool repaint, int delay_s, bool loop) {
-    int i = 0;
-    while (i < dcol->size || (loop && dcol->size > 1)) {
-        qimg_image* im = qimg_get_next(dcol);
-        if (scale != SCALE_DISABLED) {
-            qimg_point dest;
-            dest = qimg_get_scaled_dims(im->res, fb->res, scale);
-            qimg_resize_image(im, dest);
+void qimg_bake_lut3d(qimg_image* im, const qimg_lut3d* lut) {
+    int c = im->c == 2 || im->c == 4 ? 4 : 3;
+    int w = im->res.x;
+    size_t in_stride = (size_t) w * im->c * im->depth;
+    uint8_t* out = malloc((size_t) w * im->res.y * c * im->depth);
+    uint16_t* wide = malloc((size_t) w * 8 * sizeof(uint16_t));
+
+    for (int y = 0; y < im->res.y; ++y) {
+        qimg_widen_row(im->pixels + y * in_stride, im->depth, wide + 4 * w,
+                       w * im->c);
+        qimg_expand_row(wide + 4 * w, im->c, wide, w);
+        qimg_lut3d_row(lut, wide, w);
+
+        /* Back to the source depth, dropping alpha if there was none */
+        size_t base = (size_t) y * w * c;
+        for (int x = 0; x < w; ++x) {
+            for (int k = 0; k < c; ++k) {
+                uint16_t v = wide[4 * x + k];
+                if (im->depth == 2)
+                    ((uint16_t*) out)[base + x * c + k] = v;
+                else
+                    out[base + x * c + k] = (uint8_t) ((v * 255u + 32767u) >> 16);
+            }
         }
-        qimg_draw_image(im, fb, pos, bg, repaint, delay_s);
-        ++i;
-        if (!run) /* Draw routine exited via interrupt signal */
-            break;
     }
+    free(wide);
+    free(im->pixels);
+    im->pixels = out;
+    im->c = c;
+}
 
+void qimg_reduce_depth(qimg_image* im) {
+    if (im->depth == 1)
+        return;
+    size_t n = (size_t) im->res.x * im->res.y * im->c;
+    const uint16_t* src = (const uint16_t*) im->pixels;
+    uint8_t* dst = malloc(n);
+    for (size_t i = 0; i < n; ++i)
+        dst[i] = (uint8_t) ((src[i] * 255u + 32767u) >> 16);
+    free(im->pixels);
+    im->pixels = dst;
+    im->depth = 1;
 }
 
-qimg_point qimg_translate_coords(qimg_position pos, qimg_image* im, qimg_fb* fb,
-                                 int x, int y) {
-    qimg_point out;
-    switch (pos) {
-    case POS_TOP_LEFT:
-        out.x = x;
-        out.y = y;
-        break;
-    case POS_TOP_RIGHT:
-        out.x = x - (fb->res.x - im->res.x);
-        out.y = y;
-        break;
-    case POS_BOTTOM_RIGHT:
-        out.x = x - (fb->res.x - im->res.x);
-        out.y = y - (fb->res.y - im->res.y);
-        break;
-    case POS_BOTTOM_LEFT:
-        out.x = x;
-        out.y = y - (fb->res.y - im->res.y);
-        break;
-    case POS_CENTERED:
-        out.x = x - ((fb->res.x / 2) - (im->res.x / 2));
-        out.y = y - ((fb->res.y / 2) - (im->res.y / 2));
-        break;
-    }
+bool qimg_resize_image(qimg_image* im, qimg_point dest_res) {
+    unsigned long s = dest_res.x * dest_res.y * im->c * im->depth;
+    uint8_t* out_buf = malloc(s);
+    int ok;
+    if (im->depth == 2)
+        ok = stbir_resize_uint16_generic(
+                 (const uint16_t*) im->pixels, im->res.x, im->res.y, 0,
+                 (uint16_t*) out_buf, dest_res.x, dest_res.y, 0, im->c,
+                 STBIR_ALPHA_CHANNEL_NONE, 0, STBIR_EDGE_CLAMP,
+                 STBIR_FILTER_DEFAULT, STBIR_COLORSPACE_LINEAR, NULL);
+    else
+        ok = stbir_resize_uint8(im->pixels, im->res.x, im->res.y, 0, out_buf,
+                                dest_res.x, dest_res.y, 0, im->c);
+    if (ok) {
+        /* Update data pointer */
+        free(im->pixels);
+        im->pixels = out_buf;
 
-    return out;
+        /* Update resolution */
+        im->res.x = dest_res.x;
+        im->res.y = dest_res.y;
+        return true;
+    }
+    return false;
 }
 
-void qimg_draw_buffer(qimg_fb* fb, char* buf, int delay_s, bool repaint) {
-    uint32_t delay_ms = delay_s * 1000;
-    bool delay_set = (delay_s > 0);
-    uint32_t start_ticks = qimg_get_millis();
-    do {
-        memcpy(fb->fbdata, buf, fb->size);
-
-        /* Delay and repaint, check timer and draw again if needed */
-        if (delay_set && repaint) {
-            if (qimg_have_millis_elapsed(start_ticks, delay_ms))
-                break;
-        }
-        /* Delay and no repaint, draw once and wait before break */
-        else if (delay_set && !repaint) {
-            uint32_t to_sleep = delay_ms - (qimg_get_millis() - start_ticks);
-            if (to_sleep > 0)
-                qimg_sleep_ms(to_sleep);
-            break;
-        }
-        /* No delay or repaint, break immediately */
-        else if (!delay_set && !repaint) {
-            break;
-        }
-    } while (run);
+void qimg_crop_image(qimg_image* im, qimg_rect r) {
+    size_t px = (size_t) im->c * im->depth;
+    size_t row = (size_t) (r.x1 - r.x0) * px;
+    for (int y = r.y0; y < r.y1; ++y)
+        memmove(im->pixels + (size_t) (y - r.y0) * row,
+                im->pixels + ((size_t) y * im->res.x + r.x0) * px, row);
+    im->res.x = r.x1 - r.x0;
+    im->res.y = r.y1 - r.y0;
+    uint8_t* shrunk = realloc(im->pixels, row * im->res.y);
+    if (shrunk)
+        im->pixels = shrunk;
 }
 
-void qimg_draw_image(qimg_image* im, qimg_fb* fb, qimg_position pos, qimg_bg bg,
-                     bool repaint, int delay_s) {
-    char* buf = malloc(fb->size);
-    memcpy(buf, fb->fbdata, fb->size);
-    qimg_color c;
-    int offs, x, y;
-
-    for (int x_ = 0; x_ < fb->res.x; ++x_) { /* This is embarassingly parallel */
-        for (int y_ = 0; y_ < fb->res.y; ++y_) {
-            /* Translate framebuffer coordinates to image coordinates */
-            qimg_point t = qimg_translate_coords(pos, im, fb, x_, y_);
-            x = t.x;
-            y = t.y;
-
-            if (x >= im->res.x || y >= im->res.y || x < 0 || y < 0) {
-                if (bg == BG_DISABLED) {
-                    continue; /* Keep the framebuffer as-is */
+void qimg_build_mips(qimg_image* im, qimg_point vp) {
+    while (!im->half && im->res.x >= 2 * vp.x && im->res.y >= 2 * vp.y) {
+        qimg_image* h = malloc(sizeof(qimg_image));
+        h->res.x = im->res.x / 2;
+        h->res.y = im->res.y / 2;
+        h->c = im->c;
+        h->depth = im->depth;
+        h->bgr = im->bgr;
+        h->half = NULL;
+        size_t n = (size_t) h->res.x * im->c;   /* samples per row */
+        size_t src_n = (size_t) im->res.x * im->c;
+        h->pixels = malloc(n * h->res.y * im->depth);
+        for (int y = 0; y < h->res.y; ++y) {
+            for (size_t i = 0; i < n; ++i) {
+                size_t s = (i / im->c) * 2 * im->c + i % im->c;
+                size_t r0 = 2 * y * src_n + s, r1 = r0 + src_n;
+                if (im->depth == 2) {
+                    const uint16_t* p = (const uint16_t*) im->pixels;
+                    ((uint16_t*) h->pixels)[y * n + i] = (uint16_t)
+                        ((p[r0] + p[r0 + im->c] + p[r1] + p[r1 + im->c] + 2) >> 2);
                 } else {
-                    c = qimg_get_bg_color(bg);
+                    const uint8_t* p = im->pixels;
+                    h->pixels[y * n + i] = (uint8_t)
+                        ((p[r0] + p[r0 + im->c] + p[r1] + p[r1 + im->c] + 2) >> 2);
                 }
-            } else {
-                c = qimg_get_pixel(im, x, y);
             }
-
-            offs = (y_ * fb->res.x + x_) * 4;
-            buf[offs + 0] = (char) c.b;
-            buf[offs + 1] = (char) c.g;
-            buf[offs + 2] = (char) c.r;
-            buf[offs + 3] = (char) c.a;
         }
+        im->half = h;
+        im = h;
     }
-
-    qimg_draw_buffer(fb, buf, delay_s, repaint);
-    free(buf);
 }
 
-qimg_color qimg_get_pixel(qimg_image* im, int x, int y) {
-    assertf(x < im->res.x && y < im->res.y, "Image coordinates out of bounds");
-    uint8_t* offset = im->pixels + (y * im->res.x + x) * im->c;
-    qimg_color color;
+static uint8_t srgb_lut[SRGB_LUT_SIZE];
+static pthread_once_t srgb_lut_once = PTHREAD_ONCE_INIT;
 
-    if (im->c < 3) {
-        color.r = offset[0];
-        color.g = offset[0];
-        color.b = offset[0];
-        color.a = im->c >= 2 ? offset[1] : 0xff;
-    } else {
-        color.r = offset[0];
-        color.g = offset[1];
-        color.b = offset[2];
-        color.a = im->c >= 4 ? offset[3] : 0xff;
+/** @brief Fills the linear to 8-bit sRGB lookup table */
+static void qimg_init_srgb_lut(void) {
+    for (int i = 0; i < SRGB_LUT_SIZE; ++i) {
+        float v = (float) i / (SRGB_LUT_SIZE - 1);
+        v = v <= 0.0031308f ? 12.92f * v : 1.055f * powf(v, 1.0f / 2.4f) - 0.055f;
+        srgb_lut[i] = (uint8_t) (v * 255.0f + 0.5f);
     }
-    return color;
 }
 
-qimg_color qimg_get_bg_color(qimg_bg bg) {
-    qimg_color bg_color;
-    switch (bg) {
-    case BG_BLACK:
-        bg_color = (qimg_color){0, 0, 0, 0xff};
-        break;
-    case BG_WHITE:
-        bg_color = (qimg_color){0xff, 0xff, 0xff, 0xff};
-        break;
-    case BG_RED:
-        bg_color = (qimg_color){0xff, 0, 0, 0xff};
-        break;
-    case BG_GREEN:
-        bg_color = (qimg_color){0, 0xff, 0, 0xff};
-        break;
-    case BG_BLUE:
-        bg_color = (qimg_color){0, 0, 0xff, 0xff};
-        break;
-    default:
-        bg_color = (qimg_color){0, 0, 0, 0xff};
-        break;
+/**
+ * @brief Tone maps a row of linear samples to sRGB.
+ *
+ * The curve is evaluated in a separate branch free pass over `tmp` so the
+ * compiler can vectorize it, only the table lookups are done per sample.
+ *
+ * @param src   linear samples
+ * @param dst   8-bit sRGB output
+ * @param tmp   scratch space for n samples
+ * @param n     number of samples
+ */
+static void qimg_tonemap_row(const float* restrict src, uint8_t* restrict dst,
+                             float* restrict tmp, int n) {
+    const float k = exposure;
+    if (tonemap == TONEMAP_REINHARD) {
+        for (int i = 0; i < n; ++i) {
+            float v = fmaxf(src[i] * k, 0.0f);
+            tmp[i] = v / (1.0f + v);
+        }
+    } else {
+        /* Narkowicz's fit of the ACES reference rendering transform */
+        for (int i = 0; i < n; ++i) {
+            float v = fmaxf(src[i] * k, 0.0f);
+            v = (v * (2.51f * v + 0.03f)) / (v * (2.43f * v + 0.59f) + 0.14f);
+            tmp[i] = fminf(v, 1.0f) * (SRGB_LUT_SIZE - 1) + 0.5f;
+        }
+        for (int i = 0; i < n; ++i)
+            dst[i] = srgb_lut[(int) tmp[i]];
+        return;
     }
-    return bg_color;
+    for (int i = 0; i < n; ++i)
+        dst[i] = srgb_lut[(int) (tmp[i] * (SRGB_LUT_SIZE - 1) + 0.5f)];
 }
 
-qimg_image* qimg_load_image(char* input_path) {
+qimg_image* qimg_tonemap_image(const float* hdr, qimg_point res,
+                               qimg_point dims) {
+    pthread_once(&srgb_lut_once, qimg_init_srgb_lut);
+
+    float* scaled = NULL;
+    if (dims.x != res.x || dims.y != res.y) {
+        scaled = malloc(sizeof(float) * dims.x * dims.y * 3);
+        if (!stbir_resize_float(hdr, res.x, res.y, 0, scaled, dims.x, dims.y,
+                                0, 3)) {
+            free(scaled);
+            return NULL;
+        }
+        hdr = scaled;
+    }
+
     qimg_image* im = malloc(sizeof(qimg_image));
-    im->pixels = stbi_load(input_path, &im->res.x, &im->res.y, &im->c, 0);
-    assertf(im->pixels, "Loading image %s failed", input_path);
+    im->res = dims;
+    im->c = 3;
+    im->depth = 1;
+    im->bgr = false;
+    im->half = NULL;
+    im->pixels = malloc(dims.x * dims.y * 3);
+    int n = dims.x * 3;
+    float* tmp = malloc(sizeof(float) * n);
+    for (int y = 0; y < dims.y; ++y)
+        qimg_tonemap_row(hdr + y * n, im->pixels + y * n, tmp, n);
+    free(tmp);
+    free(scaled);
     return im;
 }
 
-qimg_collection* qimg_load_collection(char** input_paths, int n_inputs, int offset) {
-    qimg_collection* col = malloc(sizeof(qimg_collection));
-    for (int i = 0; i < n_inputs; ++i) {
-        col->images[i] = qimg_load_image(input_paths[offset + i]);
-    }
-    col->size = n_inputs;
-    col->idx = 0;
-    return col;
+/**
+ * @brief Reads a raw Bayer sample, clamping coordinates to the frame
+ * @param raw   samples
+ * @param fmt   frame format
+ * @param x     column
+ * @param y     row
+ * @return sample value
+ */
+static inline uint32_t qimg_raw_at(const uint8_t* raw,
+                                   const qimg_raw_format* fmt, int x, int y) {
+    x = x < 0 ? -x : (x >= fmt->res.x ? 2 * fmt->res.x - 2 - x : x);
+    y = y < 0 ? -y : (y >= fmt->res.y ? 2 * fmt->res.y - 2 - y : y);
+    size_t i = (size_t) y * fmt->res.x + x;
+    if (fmt->bits <= 8)
+        return raw[i];
+    return raw[2 * i] | (uint32_t) raw[2 * i + 1] << 8;
 }
 
-qimg_dyn_collection* qimg_init_dyn_collection(char** input_paths, int n_inputs) {
-    qimg_dyn_collection* dcol = malloc(sizeof(qimg_dyn_collection));
-    dcol->input_paths = input_paths;
-    dcol->size = n_inputs;
-    dcol->n_consumed = 0;
-    dcol->idx = 0;
-
-    /* Load first batch */
-    int n = (n_inputs < MAX_BUFFER_SIZE) ? n_inputs : MAX_BUFFER_SIZE;
-    dcol->col = qimg_load_collection(input_paths, n, 0);
-    return dcol;
-}
+/**
+ * @brief Fused demosaic and box downscale, see #qimg_demosaic
+ * @param raw   samples
+ * @param fmt   frame format
+ * @param rx    column of red sites within a cell
+ * @param ry    row of red sites within a cell
+ * @param gain  per-channel gains scaling sums of one site to 16 bits
+ * @param im    output image, 16-bit RGB
+ */
+static void qimg_demosaic_binned(const uint8_t* raw, const qimg_raw_format* fmt,
+                                 int rx, int ry, const float gain[3],
+                                 qimg_image* im) {
+    int cw = fmt->res.x / 2, ch = fmt->res.y / 2;
+    int w = im->res.x, h = im->res.y;
+    bool wide = fmt->bits > 8;
+    uint16_t* out = (uint16_t*) im->pixels;
 
-qimg_image* qimg_get_next(qimg_dyn_collection* dcol) {
-    if (dcol->n_consumed == dcol->col->size) {
-        qimg_free_collection(dcol->col);
-        int left = dcol->size - dcol->idx;
-        int n = (left < MAX_BUFFER_SIZE) ? left : MAX_BUFFER_SIZE;
-        int offset = dcol->idx;
-        dcol->col = qimg_load_collection(dcol->input_paths, n, offset);
-        dcol->n_consumed = 0;
+    /* Output column of every cell */
+    int* col = malloc(cw * sizeof(int));
+    int* count = calloc(w, sizeof(int));
+    for (int cx = 0; cx < cw; ++cx) {
+        col[cx] = (int) ((int64_t) cx * w / cw);
+        ++count[col[cx]];
     }
+    uint32_t* sum = malloc((size_t) w * 3 * sizeof(uint32_t));
 
-    ++dcol->idx;
-    ++dcol->n_consumed;
-
-    if (dcol->idx == dcol->size) {
-        dcol->idx = 0;
-        dcol->n_consumed = dcol->size; /* trigger image loading */
+    for (int oy = 0; oy < h; ++oy) {
+        int cy0 = (int) ((int64_t) oy * ch / h);
+        int cy1 = (int) ((int64_t) (oy + 1) * ch / h);
+        memset(sum, 0, (size_t) w * 3 * sizeof(uint32_t));
+        for (int cy = cy0; cy < cy1; ++cy) {
+            /* Rows holding the red and blue sites of this cell row */
+            size_t r_row = (size_t) (2 * cy + ry) * fmt->res.x;
+            size_t b_row = (size_t) (2 * cy + 1 - ry) * fmt->res.x;
+            for (int cx = 0; cx < cw; ++cx) {
+                size_t ir = r_row + 2 * cx + rx, ig1 = r_row + 2 * cx + 1 - rx;
+                size_t ib = b_row + 2 * cx + 1 - rx, ig2 = b_row + 2 * cx + rx;
+                uint32_t r, g, b;
+                if (wide) {
+                    const uint16_t* s = (const uint16_t*) raw;
+                    r = s[ir]; g = s[ig1] + s[ig2]; b = s[ib];
+                } else {
+                    r = raw[ir]; g = raw[ig1] + raw[ig2]; b = raw[ib];
+                }
+                uint32_t* acc = sum + 3 * col[cx];
+                acc[0] += r;
+                acc[1] += g;
+                acc[2] += b;
+            }
+        }
+        int rows = cy1 - cy0;
+        for (int ox = 0; ox < w; ++ox) {
+            float n = (float) (count[ox] * rows);
+            for (int k = 0; k < 3; ++k) {
+                float v = sum[3 * ox + k] * gain[k] / n;
+                out[((size_t) oy * w + ox) * 3 + k] =
+                    (uint16_t) (v > 65535.0f ? 65535.0f : v + 0.5f);
+            }
+        }
     }
+    free(sum);
+    free(count);
+    free(col);
+}
 
-    return dcol->col->images[dcol->col->idx++];
+/**
+ * @brief Bilinear demosaic at full resolution, see #qimg_demosaic
+ * @param raw   samples
+ * @param fmt   frame format
+ * @param rx    column of red sites within a cell
+ * @param ry    row of red sites within a cell
+ * @param gain  per-channel gains scaling one site to 16 bits
+ * @param im    output image, 16-bit RGB at sensor resolution
+ */
+static void qimg_demosaic_bilinear(const uint8_t* raw,
+                                   const qimg_raw_format* fmt, int rx, int ry,
+                                   const float gain[3], qimg_image* im) {
+    uint16_t* out = (uint16_t*) im->pixels;
+    for (int y = 0; y < fmt->res.y; ++y) {
+        for (int x = 0; x < fmt->res.x; ++x) {
+            uint32_t c = qimg_raw_at(raw, fmt, x, y);
+            uint32_t cross = qimg_raw_at(raw, fmt, x - 1, y) +
+                             qimg_raw_at(raw, fmt, x + 1, y) +
+                             qimg_raw_at(raw, fmt, x, y - 1) +
+                             qimg_raw_at(raw, fmt, x, y + 1);
+            uint32_t diag = qimg_raw_at(raw, fmt, x - 1, y - 1) +
+                            qimg_raw_at(raw, fmt, x + 1, y - 1) +
+                            qimg_raw_at(raw, fmt, x - 1, y + 1) +
+                            qimg_raw_at(raw, fmt, x + 1, y + 1);
+            uint32_t horiz = qimg_raw_at(raw, fmt, x - 1, y) +
+                             qimg_raw_at(raw, fmt, x + 1, y);
+            uint32_t vert = qimg_raw_at(raw, fmt, x, y - 1) +
+                            qimg_raw_at(raw, fmt, x, y + 1);
+            bool red_row = (y & 1) == ry, red_col = (x & 1) == rx;
+            float rgb[3];
+            if (red_row && red_col) {
+                rgb[0] = c; rgb[1] = cross / 4.0f; rgb[2] = diag / 4.0f;
+            } else if (!red_row && !red_col) {
+                rgb[0] = diag / 4.0f; rgb[1] = cross / 4.0f; rgb[2] = c;
+            } else if (red_row) {
+                rgb[0] = horiz / 2.0f; rgb[1] = c; rgb[2] = vert / 2.0f;
+            } else {
+                rgb[0] = vert / 2.0f; rgb[1] = c; rgb[2] = horiz / 2.0f;
+            }
+            for (int k = 0; k < 3; ++k) {
+                float v = rgb[k] * gain[k];
+                out[((size_t) y * fmt->res.x + x) * 3 + k] =
+                    (uint16_t) (v > 65535.0f ? 65535.0f : v + 0.5f);
+            }
+        }
+    }
 }
 
-bool qimg_resize_image(qimg_image* im, qimg_point dest_res) {
-    unsigned long s = dest_res.x * dest_res.y * im->c;
-    uint8_t* out_buf = malloc(s);
-    if (stbir_resize_uint8(im->pixels, im->res.x, im->res.y, 0, out_buf,
-                           dest_res.x, dest_res.y, 0, im->c)) {
-        /* Update data pointer */
-        free(im->pixels);
-        im->pixels = out_buf;
+qimg_image* qimg_demosaic(const uint8_t* raw, const qimg_raw_format* fmt,
+                          qimg_point dims) {
+    if (fmt->res.x < 2 || fmt->res.y < 2 || dims.x < 1 || dims.y < 1)
+        return NULL;
+    static const int red_site[4][2] = {{0, 0}, {1, 1}, {1, 0}, {0, 1}};
+    int rx = red_site[fmt->pattern][0], ry = red_site[fmt->pattern][1];
+    float scale = 65535.0f / (float) ((1u << fmt->bits) - 1);
+    bool binned = dims.x <= fmt->res.x / 2 && dims.y <= fmt->res.y / 2;
+    /* Binned green sums two sites per cell */
+    float gain[3] = {
+        fmt->wb[0] * scale,
+        fmt->wb[1] * scale / (binned ? 2.0f : 1.0f),
+        fmt->wb[2] * scale
+    };
 
-        /* Update resolution */
-        im->res.x = dest_res.x;
-        im->res.y = dest_res.y;
-        return true;
+    qimg_image* im = malloc(sizeof(qimg_image));
+    im->c = 3;
+    im->depth = 2;
+    im->bgr = false;
+    im->half = NULL;
+    im->res = binned ? dims : fmt->res;
+    im->pixels = malloc((size_t) im->res.x * im->res.y * 3 * sizeof(uint16_t));
+    if (binned) {
+        qimg_demosaic_binned(raw, fmt, rx, ry, gain, im);
+    } else {
+        qimg_demosaic_bilinear(raw, fmt, rx, ry, gain, im);
+        if (dims.x != im->res.x || dims.y != im->res.y)
+            qimg_resize_image(im, dims);
     }
-    return false;
+    return im;
 }
 
 qimg_point qimg_get_scaled_dims(qimg_point src, qimg_point vp,
@@ -869,21 +6719,16 @@ void qimg_free_image(qimg_image* im) {
         return;
     if (im->pixels)
         free(im->pixels);
+    qimg_free_image(im->half);
     free(im);
 }
 
-void qimg_free_collection(qimg_collection* col) {
-    if (!col)
-        return;
-    for (int i = 0; i < col->size; ++i)
-        qimg_free_image(col->images[i]);
-    free(col);
-}
-
 void qimg_free_dyn_collection(qimg_dyn_collection* dcol) {
     if (!dcol)
         return;
-    qimg_free_collection(dcol->col);
+    for (int i = 0; i < dcol->n_slots; ++i)
+        qimg_cache_evict(dcol, &dcol->slots[i]);
+    free(dcol->assets);
     free(dcol);
 }
 
@@ -893,6 +6738,8 @@ void qimg_free_framebuffer(qimg_fb* fb) {
 
     munmap(fb->fbdata, fb->size);
     close(fb->fbfd);
+    free(fb->damage.rects);
+    free(fb->damage.pixels);
     free(fb);
 }
 
@@ -902,8 +6749,34 @@ void set_cursor_visibility(bool visible) {
     fflush(stdout);
 }
 
-void interrupt_handler(int dummy) {
-    run = false;
+void set_tty_raw(bool raw) {
+    static struct termios saved;
+    static bool is_raw = false;
+
+    if (raw && !is_raw) {
+        if (tcgetattr(STDIN_FILENO, &saved))
+            return;
+        struct termios t = saved;
+        t.c_lflag &= ~(tcflag_t)(ICANON | ECHO);
+        t.c_iflag &= ~(tcflag_t)(IXON | ICRNL);
+        t.c_cc[VMIN] = 1;
+        t.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &t);
+        is_raw = true;
+    } else if (!raw && is_raw) {
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved);
+        is_raw = false;
+    }
+}
+
+void qimg_restore_screen(void) {
+    set_tty_raw(false);
+    if (restore_fb)
+        qimg_restore_framebuffer(restore_fb);
+    if (restore_cursor)
+        set_cursor_visibility(true);
+    restore_fb = NULL;
+    restore_cursor = false;
 }
 
 void print_help() {
@@ -911,6 +6784,10 @@ void print_help() {
            "\n"
            "Usage: qimg [OPTION]... INPUT...\n"
            "\n"
+           "INPUT is an image, a zip or tar archive of images, or a single\n"
+           "archive member as <archive>#<member name>, or a slide bundle\n"
+           "written with -pack.\n"
+           "\n"
            "General options:\n"
            "-h,             Print this help.\n"
            "-d <path>,      Use framebuffer device at given path.\n"
@@ -920,6 +6797,29 @@ void print_help() {
            "-r,             Keep repainting the image. If hiding the cursor\n"
            "                fails, this will certainly work for keeping the\n"
            "                image on top with the cost of CPU usage.\n"
+           "-dither,        Dither 16-bit images when the framebuffer has\n"
+           "                fewer bits per channel.\n"
+           "-gamma <g>,     Display gamma, either one value or r,g,b.\n"
+           "-brightness <b>,\n"
+           "                Brightness offset (-1 to 1), one value or r,g,b.\n"
+           "-contrast <c>,  Contrast factor, one value or r,g,b.\n"
+           "-raw <w>x<h>:<pattern>:<bits>,\n"
+           "                Read inputs that are not in a known image format\n"
+           "                as raw Bayer frames of given geometry, pattern\n"
+           "                (rggb, bggr, grbg, gbrg) and bit depth. Samples\n"
+           "                above 8 bits are little endian 16-bit words.\n"
+           "-wb <r,g,b>,    White balance gains for raw frames.\n"
+           "-colormap <map>,\n"
+           "                Show single channel images in false color.\n"
+           "                Possible values: inferno, viridis, magma, plasma,\n"
+           "                jet, hot, none (default).\n"
+           "-window <l>,<w>,\n"
+           "                Window/level for deep images: map sample values\n"
+           "                l - w/2 to l + w/2 (16-bit scale) to the full\n"
+           "                display range.\n"
+           "-lut <file>,    Grade colors through a 3D LUT (.cube) on output.\n"
+           "-lut-bake,      Apply the LUT once when images are loaded instead\n"
+           "                of on every paint.\n"
            "\n"
            "Image layout:\n"
            "-pos <pos>,     Draw the image in given position. Possible values:\n"
@@ -943,11 +6843,76 @@ void print_help() {
            "                fill        -   fill the screen with the image,\n"
            "                                preserving aspect ratio.\n"
            "\n"
+           "HDR images (Radiance .hdr):\n"
+           "-exposure <ev>, Exposure adjustment in stops (default 0).\n"
+           "-tonemap <op>,  Tone mapping operator. Possible values:\n"
+           "                aces        -   filmic curve (default)\n"
+           "                reinhard    -   softer, never clips highlights\n"
+           "\n"
            "Slideshow and timing options:\n"
            "-delay <delay>, Slideshow interval in seconds (default 5s).\n"
            "                If used with a single image, the image is displayed\n"
            "                for <delay> seconds.\n"
            "-loop           Loop the slideshow indefinitely.\n"
+           "-kenburns,      Slowly pan and zoom across each image, covering\n"
+           "                the screen. The motion lasts for the slideshow\n"
+           "                interval (10s for a single image).\n"
+           "-history <n>,   Number of already shown images kept in memory so\n"
+           "                that stepping back is instant (default 2).\n"
+           "-prefetch <n>,  Number of upcoming images loaded in advance\n"
+           "                while the current one is shown (default 2).\n"
+           "-threads <n>,   Number of background loader threads, 0 loads\n"
+           "                everything on the main thread (default: CPUs).\n"
+           "-dedup-content, Also merge inputs with identical contents, not\n"
+           "                only paths and links to the same file, so each\n"
+           "                asset is decoded once.\n"
+           "-preview,       Show the embedded EXIF thumbnail (or a cached\n"
+           "                thumbnail) while an image is still loading.\n"
+           "                Always on in interactive mode.\n"
+           "-thumbs,        Use the shared thumbnail cache ($XDG_CACHE_HOME/\n"
+           "                thumbnails) for scaled images that fit in a\n"
+           "                thumbnail. Missing thumbnails are generated in\n"
+           "                the background when idle.\n"
+           "\n"
+           "Interactive mode:\n"
+           "-i,             Control the slideshow with the keyboard:\n"
+           "                space       -   pause / resume\n"
+           "                right, n    -   next image\n"
+           "                left, p     -   previous image\n"
+           "                +, -        -   zoom in / out\n"
+           "                r           -   rotate clockwise\n"
+           "                0           -   reset zoom and rotation\n"
+           "                [, ]        -   narrower / wider window\n"
+           "                ,, .        -   lower / raise window level\n"
+           "                a           -   fit window to the image\n"
+           "                w           -   reset window\n"
+           "                l           -   reload the image\n"
+           "                q           -   quit\n"
+           "-stats,         Print command to paint latency on exit.\n"
+           "\n"
+           "Remote control:\n"
+           "-control <path>,\n"
+           "                Take commands from a unix datagram socket, one\n"
+           "                per line: next, prev, goto <n>, pause, resume,\n"
+           "                toggle, reload, zoom-in, zoom-out, rotate, reset,\n"
+           "                window-narrow, window-widen, level-down, level-up,\n"
+           "                window-fit, window-reset, quit.\n"
+           "                SIGUSR1 and SIGUSR2 show the next and previous\n"
+           "                image, SIGHUP reloads the current one. Changed\n"
+           "                input files are reloaded automatically.\n"
+           "\n"
+           "Conversion:\n"
+           "-convert-qoi,   Transcode the inputs to QOI on all threads and exit,\n"
+           "                writing x.qoi next to x.png and so on. Existing\n"
+           "                files are kept. QOI decodes several times faster\n"
+           "                than PNG.\n"
+           "-pack BUNDLE,   Render the inputs for the framebuffer on all threads\n"
+           "                into BUNDLE and exit. Position, background, scale\n"
+           "                and color options apply as when showing them.\n"
+           "                Showing BUNDLE later just copies each slide to the\n"
+           "                screen, with no decoding or scaling.\n"
+           "-pack-rle,      Run-length code the packed slides, smaller for\n"
+           "                flat backgrounds and graphics.\n"
            "\n"
            "Generic framebuffer operations:\n"
            "(Use one at a time, cannot be joined with other operations)\n"
@@ -955,10 +6920,15 @@ void print_help() {
            "\n");
 }
 
-void parse_arguments(int argc, char *argv[], int* fb_idx, char** input,
-                     int* n_inputs, bool* refresh, bool* hide_cursor,
-                     qimg_position* pos, qimg_bg* bg, int* slide_delay_s,
-                     qimg_scale* scale, char** fb_path, bool* loop) {
+void parse_channels(const char* arg, float v[3]) {
+    int n = sscanf(arg, "%f,%f,%f", &v[0], &v[1], &v[2]);
+    assertf(n == 1 || n == 3, "Expected one value or three comma separated "
+            "values, got %s", arg);
+    if (n == 1)
+        v[1] = v[2] = v[0];
+}
+
+void parse_arguments(int argc, char *argv[], qimg_opts* o) {
     assertf(argc > 1, "Arguments missing");
     int opts = 0;
     for (int i = 1; i < argc; ++i) {
@@ -966,25 +6936,25 @@ void parse_arguments(int argc, char *argv[], int* fb_idx, char** input,
             ++opts;
             if (argc > (++i)) {
                 ++opts;
-                *fb_idx = atoi(argv[i]);
+                o->fb_idx = atoi(argv[i]);
             }
         } else if (strcmp(argv[i], "-r") == 0) {
             ++opts;
-            *refresh = true;
+            o->repaint = true;
         } else if (strcmp(argv[i], "-c") == 0) {
             ++opts;
-            *hide_cursor = true;
+            o->hide_cursor = true;
         } else if (strcmp(argv[i], "-pos") == 0) {
             ++opts;
             if (argc > (++i)) {
                 ++opts;
-                *pos = str2qimg_position(argv[i]);
+                o->pos = str2qimg_position(argv[i]);
             }
         } else if (strcmp(argv[i], "-bg") == 0) {
             ++opts;
             if (argc > (++i)) {
                 ++opts;
-                *bg = str2qimg_bg(argv[i]);
+                o->bg = str2qimg_bg(argv[i]);
             }
         } else if (strcmp(argv[i], "-delay") == 0) {
             ++opts;
@@ -992,23 +6962,157 @@ void parse_arguments(int argc, char *argv[], int* fb_idx, char** input,
                 ++opts;
                 int dly = atoi(argv[i]);
                 assertf(dly >= 0, "Delay must be positive");
-                *slide_delay_s = dly;
+                o->slide_delay_s = dly;
             }
         } else if (strcmp(argv[i], "-scale") == 0) {
             ++opts;
             if (argc > (++i)) {
                 ++opts;
-                *scale = str2qimg_scale(argv[i]);
+                o->scale = str2qimg_scale(argv[i]);
             }
         } else if (strcmp(argv[i], "-d") == 0) {
             ++opts;
             if (argc > (++i)) {
                 ++opts;
-                *fb_path = argv[i];
+                o->fb_path = argv[i];
             }
         } else if (strcmp(argv[i], "-loop") == 0) {
             ++opts;
-            *loop = true;
+            o->loop = true;
+        } else if (strcmp(argv[i], "-history") == 0) {
+            ++opts;
+            if (argc > (++i)) {
+                ++opts;
+                o->history = atoi(argv[i]);
+                assertf(o->history >= 0, "History must be positive");
+            }
+        } else if (strcmp(argv[i], "-threads") == 0) {
+            ++opts;
+            if (argc > (++i)) {
+                ++opts;
+                o->n_threads = atoi(argv[i]);
+                assertf(o->n_threads >= 0, "Thread count must be positive");
+            }
+        } else if (strcmp(argv[i], "-convert-qoi") == 0) {
+            ++opts;
+            o->convert_qoi = true;
+        } else if (strcmp(argv[i], "-pack") == 0) {
+            ++opts;
+            if (argc > (++i)) {
+                ++opts;
+                o->pack_path = argv[i];
+            }
+        } else if (strcmp(argv[i], "-pack-rle") == 0) {
+            ++opts;
+            o->pack_rle = true;
+        } else if (strcmp(argv[i], "-thumbs") == 0) {
+            ++opts;
+            o->thumbs = true;
+        } else if (strcmp(argv[i], "-tonemap") == 0) {
+            ++opts;
+            if (argc > (++i)) {
+                ++opts;
+                o->tonemap = str2qimg_tonemap(argv[i]);
+            }
+        } else if (strcmp(argv[i], "-exposure") == 0) {
+            ++opts;
+            if (argc > (++i)) {
+                ++opts;
+                o->exposure = atof(argv[i]);
+            }
+        } else if (strcmp(argv[i], "-gamma") == 0) {
+            ++opts;
+            if (argc > (++i)) {
+                ++opts;
+                parse_channels(argv[i], o->gamma);
+                assertf(o->gamma[0] > 0 && o->gamma[1] > 0 && o->gamma[2] > 0,
+                        "Gamma must be positive");
+            }
+        } else if (strcmp(argv[i], "-brightness") == 0) {
+            ++opts;
+            if (argc > (++i)) {
+                ++opts;
+                parse_channels(argv[i], o->brightness);
+            }
+        } else if (strcmp(argv[i], "-contrast") == 0) {
+            ++opts;
+            if (argc > (++i)) {
+                ++opts;
+                parse_channels(argv[i], o->contrast);
+            }
+        } else if (strcmp(argv[i], "-raw") == 0) {
+            ++opts;
+            if (argc > (++i)) {
+                ++opts;
+                char pattern[8];
+                qimg_raw_format* raw = &o->raw;
+                assertf(sscanf(argv[i], "%dx%d:%4[a-z]:%d", &raw->res.x,
+                               &raw->res.y, pattern, &raw->bits) == 4,
+                        "Raw format must be given as <w>x<h>:<pattern>:<bits>");
+                assertf(raw->res.x >= 2 && raw->res.y >= 2 && raw->bits >= 1 &&
+                        raw->bits <= 16, "Invalid raw format %s", argv[i]);
+                raw->pattern = str2qimg_bayer(pattern);
+            }
+        } else if (strcmp(argv[i], "-wb") == 0) {
+            ++opts;
+            if (argc > (++i)) {
+                ++opts;
+                parse_channels(argv[i], o->raw.wb);
+            }
+        } else if (strcmp(argv[i], "-colormap") == 0) {
+            ++opts;
+            if (argc > (++i)) {
+                ++opts;
+                o->colormap = str2qimg_colormap(argv[i]);
+            }
+        } else if (strcmp(argv[i], "-window") == 0) {
+            ++opts;
+            if (argc > (++i)) {
+                ++opts;
+                assertf(sscanf(argv[i], "%d,%d", &o->window_center,
+                               &o->window_width) == 2 && o->window_width > 0,
+                        "Window must be given as <level>,<width>");
+            }
+        } else if (strcmp(argv[i], "-lut") == 0) {
+            ++opts;
+            if (argc > (++i)) {
+                ++opts;
+                o->lut_path = argv[i];
+            }
+        } else if (strcmp(argv[i], "-lut-bake") == 0) {
+            ++opts;
+            o->lut_bake = true;
+        } else if (strcmp(argv[i], "-dither") == 0) {
+            ++opts;
+            o->dither = true;
+        } else if (strcmp(argv[i], "-dedup-content") == 0) {
+            ++opts;
+            o->dedup_content = true;
+        } else if (strcmp(argv[i], "-preview") == 0) {
+            ++opts;
+            o->preview = true;
+        } else if (strcmp(argv[i], "-i") == 0) {
+            ++opts;
+            o->interactive = true;
+        } else if (strcmp(argv[i], "-kenburns") == 0) {
+            ++opts;
+            o->kenburns = true;
+        } else if (strcmp(argv[i], "-stats") == 0) {
+            ++opts;
+            o->stats = true;
+        } else if (strcmp(argv[i], "-control") == 0) {
+            ++opts;
+            if (argc > (++i)) {
+                ++opts;
+                o->control_path = argv[i];
+            }
+        } else if (strcmp(argv[i], "-prefetch") == 0) {
+            ++opts;
+            if (argc > (++i)) {
+                ++opts;
+                o->prefetch = atoi(argv[i]);
+                assertf(o->prefetch >= 0, "Prefetch must be positive");
+            }
         }
 
 
@@ -1019,77 +7123,206 @@ void parse_arguments(int argc, char *argv[], int* fb_idx, char** input,
             exit(EXIT_SUCCESS);
         } else if (strcmp(argv[i], "-clear") == 0) {
             ++opts;
-            if (*fb_idx == -1)
-                *fb_idx = get_default_framebuffer_idx();
-            qimg_fb* fb = qimg_open_fb(*fb_idx);
+            if (o->fb_idx == -1)
+                o->fb_idx = get_default_framebuffer_idx();
+            qimg_fb* fb = qimg_open_fb(o->fb_idx);
             qimg_clear_framebuffer(fb);
             exit(EXIT_SUCCESS);
         }
     }
     /* We should still have some leftover arguments, these are our inputs */
     while (++opts < argc) {
-        input[*n_inputs] = argv[opts];
-        ++*n_inputs;
-        assertf(*n_inputs <= MAX_IMAGES, "Too many input images (max %d)",
+        /* Archives stand for the images they contain */
+        int n = qimg_expand_archive(argv[opts], o->input_paths + o->n_inputs,
+                                    MAX_IMAGES - o->n_inputs);
+        if (n < 0) {
+            o->input_paths[o->n_inputs] = argv[opts];
+            n = 1;
+        }
+        o->n_inputs += n;
+        assertf(o->n_inputs <= MAX_IMAGES, "Too many input images (max %d)",
                 MAX_IMAGES);
     }
 }
 
 int main(int argc, char *argv[]) {
 
-    /* Record start ticks for timekeeping */
-    begin_clk = clock();
+    /* Record start time for timekeeping */
+    clock_gettime(CLOCK_MONOTONIC, &begin_ts);
 
     /* Setup starting values for params */
-    int fb_idx = -1;
-    int n_inputs = 0;
-    int slide_dly_s = 0;
-    char* input_paths[MAX_IMAGES];
-    char* fb_path = NULL;
-    bool repaint = false;
-    bool hide_cursor = false;
-    bool loop = false;
-    qimg_position pos = POS_TOP_LEFT;
-    qimg_bg bg = BG_DISABLED;
-
-    parse_arguments(argc, argv, &fb_idx, input_paths, &n_inputs, &repaint,
-                    &hide_cursor, &pos, &bg, &slide_dly_s, &scale, &fb_path,
-                    &loop);
-
-    assertf(n_inputs, "No input file");
-    if (fb_idx == -1)
-        fb_idx = get_default_framebuffer_idx();
-    if (slide_dly_s == 0 && n_inputs > 1) /* Default interval for slideshows */
-        slide_dly_s = 5;
+    static qimg_opts o;
+    o.fb_idx = -1;
+    o.n_inputs = 0;
+    o.slide_delay_s = 0;
+    o.fb_path = NULL;
+    o.history = DEFAULT_CACHE_HISTORY;
+    o.prefetch = DEFAULT_CACHE_PREFETCH;
+    o.n_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    o.thumbs = false;
+    o.preview = false;
+    o.dedup_content = false;
+    o.convert_qoi = false;
+    o.pack_path = NULL;
+    o.pack_rle = false;
+    o.dither = false;
+    o.lut_path = NULL;
+    o.lut_bake = false;
+    o.colormap = COLORMAP_NONE;
+    o.raw.res.x = o.raw.res.y = 0;
+    o.raw.wb[0] = o.raw.wb[1] = o.raw.wb[2] = 1.0f;
+    o.window_center = 0;
+    o.window_width = 0;
+    for (int k = 0; k < 3; ++k) {
+        o.gamma[k] = 1.0f;
+        o.brightness[k] = 0.0f;
+        o.contrast[k] = 1.0f;
+    }
+    o.tonemap = TONEMAP_ACES;
+    o.exposure = 0.0f;
+    o.interactive = false;
+    o.kenburns = false;
+    o.stats = false;
+    o.control_path = NULL;
+    o.repaint = false;
+    o.hide_cursor = false;
+    o.loop = false;
+    o.pos = POS_TOP_LEFT;
+    o.bg = BG_DISABLED;
+    o.scale = SCALE_DISABLED;
+
+    parse_arguments(argc, argv, &o);
+
+    assertf(o.n_inputs, "No input file");
+    if (o.slide_delay_s == 0 && o.n_inputs > 1) /* Default slideshow interval */
+        o.slide_delay_s = 5;
+    tonemap = o.tonemap;
+    exposure = exp2f(o.exposure);
+    qimg_build_adjust_luts(o.gamma, o.brightness, o.contrast);
+    qimg_build_colormap(o.colormap);
+    raw_format = o.raw;
+    if (o.convert_qoi) {
+        int failed = qimg_convert_qoi(o.input_paths, o.n_inputs, o.n_threads);
+        qimg_free_archives();
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    /* A single packed bundle is played as it is, without any loaders */
+    qimg_bundle* bundle = NULL;
+    if (!o.pack_path && o.n_inputs == 1)
+        bundle = qimg_open_bundle(o.input_paths[0]);
+    if (bundle && o.slide_delay_s == 0 && bundle->header->n_frames > 1)
+        o.slide_delay_s = 5;
+    kenburns = o.kenburns;
+    /* Only slides that are never zoomed, rotated or panned can drop what is
+     * off screen */
+    crop = !o.interactive && !o.kenburns && !o.control_path;
+    crop_pos = o.pos;
+    if (o.lut_path) {
+        lut3d = qimg_load_cube(o.lut_path);
+        assertf(lut3d, "Loading 3D LUT %s failed", o.lut_path);
+        lut_bake = o.lut_bake;
+    }
 
     /* Open framebuffer */
     qimg_fb* fb;
-    if (fb_path)
-        fb = qimg_open_fb_from_path(fb_path);
+    if (o.fb_idx == -1 && !o.fb_path)
+        o.fb_idx = get_default_framebuffer_idx();
+    if (o.fb_path)
+        fb = qimg_open_fb_from_path(o.fb_path);
     else
-        fb = qimg_open_fb(fb_idx);
+        fb = qimg_open_fb(o.fb_idx);
+    fb->dither = o.dither;
+    /* Color frames are decoded to BGRA and copied to a native framebuffer
+     * as-is, unless the 3D LUT grades them */
+    bgra_frames = fb->native && !lut3d;
+    if (o.interactive)
+        assertf(isatty(STDIN_FILENO), "Interactive mode needs a terminal");
 
-    /* Initialize dynamic collection */
-    qimg_dyn_collection* dcol = qimg_init_dyn_collection(input_paths, n_inputs);
+    if (o.pack_path) {
+        int failed = qimg_pack(o.pack_path, fb, &o);
+        qimg_free_framebuffer(fb);
+        qimg_free_lut3d(lut3d);
+        qimg_free_archives();
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
 
-    /* Setup exit hooks on signals */
-    signal(SIGINT, interrupt_handler);
-    signal(SIGTERM, interrupt_handler);
+    /* From here on the console is put back however qimg exits */
+    if (o.repaint || o.hide_cursor || o.interactive)
+        restore_fb = fb;
+    restore_cursor = o.hide_cursor;
+    atexit(qimg_restore_screen);
+    if (bundle) {
+        const qimg_bundle_header* h = bundle->header;
+        assertf(h->res[0] == (uint32_t) fb->res.x &&
+                h->res[1] == (uint32_t) fb->res.y &&
+                h->depth == (uint32_t) fb->depth &&
+                h->shift[0] == (uint32_t) fb->shift[0] &&
+                h->shift[1] == (uint32_t) fb->shift[1] &&
+                h->shift[2] == (uint32_t) fb->shift[2] &&
+                h->shift[3] == (uint32_t) fb->shift[3],
+                "Bundle %s was packed for another framebuffer (%ux%u)",
+                o.input_paths[0], h->res[0], h->res[1]);
+        if (o.hide_cursor) set_cursor_visibility(false);
+        qimg_play_bundle(bundle, fb, &o);
+        qimg_restore_screen();
+        qimg_free_bundle(bundle);
+        qimg_free_framebuffer(fb);
+        qimg_free_lut3d(lut3d);
+        qimg_free_archives();
+        return EXIT_SUCCESS;
+    }
 
-    /* Fasten your seatbelts */
-    if (hide_cursor) set_cursor_visibility(false);
-    qimg_draw_images(dcol, fb, pos, bg, repaint, slide_dly_s, loop);
+    /* Start background loaders, the slideshow gets woken up by finished
+     * loads through an eventfd */
+    int notify_fd = -1;
+    qimg_pool* pool = NULL;
+    if (o.n_threads > 0 && o.prefetch > 0) {
+        notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        assertf(notify_fd >= 0, "Creating notification eventfd failed");
+        pool = qimg_pool_create(o.n_threads, notify_fd);
+        /* Large JPEGs with restart markers decode on all workers */
+        stbi_set_parallel_for(qimg_parallel_for, pool);
+    }
+
+    /* Thumbnails live under $XDG_CACHE_HOME, falling back to ~/.cache */
+    char thumb_dir[THUMB_PATH_MAX];
+    if (o.thumbs) {
+        const char* cache = getenv("XDG_CACHE_HOME");
+        const char* home = getenv("HOME");
+        if (cache && *cache)
+            snprintf(thumb_dir, sizeof(thumb_dir), "%s/" THUMB_DIR, cache);
+        else if (home && *home)
+            snprintf(thumb_dir, sizeof(thumb_dir), "%s/.cache/" THUMB_DIR,
+                     home);
+        else
+            assertf(false, "No cache directory for thumbnails");
+        thumb_root = thumb_dir;
+    }
+
+    /* Initialize dynamic collection */
+    qimg_dyn_collection* dcol = qimg_init_dyn_collection(
+                o.input_paths, o.n_inputs, fb->res, o.scale, o.history,
+                o.prefetch, o.loop, pool);
+    qimg_dedup_inputs(dcol, o.dedup_content);
+    qimg_queue_thumbnails(dcol);
 
-    /* if cursor is set to hidden and no repaint nor delay is set, the program
-     * shall wait indefinitely for user interrupt */
-    if (!repaint && hide_cursor && !slide_dly_s) pause();
+    /* Fasten your seatbelts */
+    qimg_latency lat = {0};
+    if (o.hide_cursor) set_cursor_visibility(false);
+    qimg_run_slideshow(dcol, fb, &o, notify_fd, &lat);
 
-    /* Cleanup */
-    if (repaint || hide_cursor)
-        qimg_clear_framebuffer(fb);
-    if (hide_cursor) set_cursor_visibility(true);
+    /* Cleanup, put back what was on the screen under the images */
+    qimg_restore_screen();
     qimg_free_dyn_collection(dcol);
+    qimg_pool_destroy(pool);
+    stbi_set_parallel_for(NULL, NULL);
+    if (notify_fd >= 0)
+        close(notify_fd);
     qimg_free_framebuffer(fb);
+    qimg_free_lut3d(lut3d);
+    qimg_free_archives();
+    if (o.stats)
+        qimg_print_latency(&lat);
 
     return EXIT_SUCCESS;
 }